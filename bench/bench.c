@@ -0,0 +1,456 @@
+/**
+ * @brief Benchmarks for the matrix kernels, training epochs, sweeps and inference latency.
+ *
+ * Every result is printed as one JSON object per line so runs can be stored and compared:
+ *
+ *   ./bench/bench [--layers 784,100,10] [--examples 10000] [--threads 1] [--filter mult] [--quick]
+ *
+ * The first line describes the run (kernels selected, thread count, layer sizes).
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/dataset.h"
+#include "../src/gemm.h"
+#include "../src/network.h"
+#include "../src/half.h"
+#include "../src/quant.h"
+
+#define MAX_LAYERS 16
+#define SAMPLES 15
+
+typedef struct Options {
+    unsigned layers[MAX_LAYERS];
+    unsigned nLayers;
+    size_t examples;
+    unsigned threads;
+    const char *filter;
+    /* Minimum duration of one timing sample in seconds */
+    double sampleTime;
+} Options;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static float randomFloat(void) {
+    return rand() / (float)RAND_MAX - 0.5f;
+}
+
+static Matrix randomMatrix(unsigned rows, unsigned cols) {
+    Matrix m = matrix(rows, cols);
+    for (unsigned i = 0; i < len(m); i++) {
+        m.data[i] = randomFloat();
+    }
+    return m;
+}
+
+static float sigmoid(float x) {
+    return 1 / (1 + expf(-x));
+}
+
+typedef void (*BenchFn)(void *arg);
+
+/* Median and minimum time of one call to fn, from SAMPLES samples of at least sampleTime seconds each */
+static void timeCalls(const Options *opt, BenchFn fn, void *arg, double *median, double *best) {
+    fn(arg);
+    size_t iters = 1;
+    for (;;) {
+        double t = now();
+        for (size_t i = 0; i < iters; i++) {
+            fn(arg);
+        }
+        if (now() - t >= opt->sampleTime || iters >= (1u << 30)) {
+            break;
+        }
+        iters *= 2;
+    }
+    double samples[SAMPLES];
+    for (unsigned s = 0; s < SAMPLES; s++) {
+        double t = now();
+        for (size_t i = 0; i < iters; i++) {
+            fn(arg);
+        }
+        samples[s] = (now() - t) / iters;
+    }
+    qsort(samples, SAMPLES, sizeof(double), compareDoubles);
+    *median = samples[SAMPLES / 2];
+    *best = samples[0];
+}
+
+static int selected(const Options *opt, const char *name) {
+    return !opt->filter || strstr(name, opt->filter);
+}
+
+/* Matrix operations */
+
+typedef struct MatrixArgs {
+    Matrix a, b, c;
+} MatrixArgs;
+
+static void benchMult(void *p) { MatrixArgs *m = p; freeMatrix(mult(m->a, m->b)); }
+static void benchMultInto(void *p) { MatrixArgs *m = p; multInto(m->c, m->a, m->b); }
+static void benchTranspose(void *p) { MatrixArgs *m = p; freeMatrix(transpose(m->a)); }
+static void benchTransposeInto(void *p) { MatrixArgs *m = p; transposeInto(m->c, m->a); }
+static void benchHadamard(void *p) { MatrixArgs *m = p; freeMatrix(hadamard(m->a, m->b)); }
+static void benchHadamardInto(void *p) { MatrixArgs *m = p; hadamardInto(m->c, m->a, m->b); }
+static void benchAdd(void *p) { MatrixArgs *m = p; freeMatrix(add(m->a, m->b)); }
+static void benchAddInto(void *p) { MatrixArgs *m = p; addInto(m->c, m->a, m->b); }
+static void benchApplyFunc(void *p) { MatrixArgs *m = p; freeMatrix(applyFunc(m->a, sigmoid)); }
+static void benchApplyFuncInto(void *p) { MatrixArgs *m = p; applyFuncInto(m->c, m->a, sigmoid); }
+static void benchAddBiasActivate(void *p) { MatrixArgs *m = p; copyInto(m->c, m->a); addBiasActivate(m->c, m->b, FN_SIGMOID); }
+
+static void reportMatrix(const char *name, unsigned m, unsigned n, unsigned k, double median, double best, double flops, double bytes) {
+    printf("{\"bench\": \"%s\", \"m\": %u, \"n\": %u, \"k\": %u, \"median_ns\": %.1f, \"min_ns\": %.1f",
+           name, m, n, k, median * 1e9, best * 1e9);
+    if (flops) {
+        printf(", \"gflops\": %.3f", flops / median * 1e-9);
+    }
+    if (bytes) {
+        printf(", \"gbytes_per_s\": %.3f", bytes / median * 1e-9);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void runMatrixBenchmarks(const Options *opt) {
+    /* GEMM shapes of training and inference on MNIST-sized networks, plus a square reference */
+    static const unsigned multShapes[][3] = {
+        {100, 1, 784}, {100, 10, 784}, {100, 64, 784}, {10, 64, 100}, {100, 64, 10},
+        {100, 784, 64}, {784, 64, 100}, {256, 256, 256}, {512, 512, 512}
+    };
+    for (unsigned s = 0; s < sizeof(multShapes) / sizeof(multShapes[0]); s++) {
+        unsigned m = multShapes[s][0], n = multShapes[s][1], k = multShapes[s][2];
+        MatrixArgs args = {randomMatrix(m, k), randomMatrix(k, n), matrix(m, n)};
+        double median, best;
+        if (selected(opt, "mult")) {
+            timeCalls(opt, benchMult, &args, &median, &best);
+            reportMatrix("mult", m, n, k, median, best, 2.0 * m * n * k, 0);
+        }
+        if (selected(opt, "multInto")) {
+            timeCalls(opt, benchMultInto, &args, &median, &best);
+            reportMatrix("multInto", m, n, k, median, best, 2.0 * m * n * k, 0);
+        }
+        freeMatrix(args.a);
+        freeMatrix(args.b);
+        freeMatrix(args.c);
+    }
+
+    static const unsigned elementShapes[][2] = {{100, 1}, {100, 64}, {784, 64}, {1000, 1000}};
+    for (unsigned s = 0; s < sizeof(elementShapes) / sizeof(elementShapes[0]); s++) {
+        unsigned m = elementShapes[s][0], n = elementShapes[s][1];
+        MatrixArgs args = {randomMatrix(m, n), randomMatrix(m, n), matrix(m, n)};
+        MatrixArgs transposed = {args.a, args.b, matrix(n, m)};
+        MatrixArgs bias = {args.a, randomMatrix(m, 1), args.c};
+        double bytes2 = 2.0 * len(args.a) * sizeof(float), bytes3 = 1.5 * bytes2;
+        struct {
+            const char *name;
+            BenchFn fn;
+            MatrixArgs *args;
+            double bytes;
+        } ops[] = {
+            {"transpose", benchTranspose, &transposed, bytes2},
+            {"transposeInto", benchTransposeInto, &transposed, bytes2},
+            {"hadamard", benchHadamard, &args, bytes3},
+            {"hadamardInto", benchHadamardInto, &args, bytes3},
+            {"add", benchAdd, &args, bytes3},
+            {"addInto", benchAddInto, &args, bytes3},
+            {"applyFunc", benchApplyFunc, &args, bytes2},
+            {"applyFuncInto", benchApplyFuncInto, &args, bytes2},
+            {"addBiasActivate", benchAddBiasActivate, &bias, 2 * bytes2}
+        };
+        for (unsigned o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+            if (selected(opt, ops[o].name)) {
+                double median, best;
+                timeCalls(opt, ops[o].fn, ops[o].args, &median, &best);
+                reportMatrix(ops[o].name, m, n, 0, median, best, 0, ops[o].bytes);
+            }
+        }
+        freeMatrix(args.a);
+        freeMatrix(args.b);
+        freeMatrix(args.c);
+        freeMatrix(transposed.c);
+        freeMatrix(bias.b);
+    }
+}
+
+/* Synthetic classification data: noisy copies of one random prototype per class */
+static TrainingSet *syntheticSet(const Options *opt, size_t n, bool labels) {
+    unsigned nIn = opt->layers[0], nOut = opt->layers[opt->nLayers - 1];
+    TrainingSet *set = initTrainingSet(n, nIn, labels ? 1 : nOut);
+    if (!set) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    srand(1);
+    float *prototypes = malloc((size_t)nOut * nIn * sizeof(float));
+    for (size_t i = 0; i < (size_t)nOut * nIn; i++) {
+        prototypes[i] = rand() % 2;
+    }
+    for (size_t e = 0; e < n; e++) {
+        unsigned c = rand() % nOut;
+        for (unsigned i = 0; i < nIn; i++) {
+            float v = prototypes[c * nIn + i] + randomFloat();
+            set->inputs[e * nIn + i] = v < 0 ? 0 : v > 1 ? 1 : v;
+        }
+        if (labels) {
+            set->outputs[e] = c;
+        } else {
+            for (unsigned j = 0; j < nOut; j++) {
+                set->outputs[e * nOut + j] = j == c;
+            }
+        }
+    }
+    free(prototypes);
+    return set;
+}
+
+/* Keeps the stats of the fastest epoch */
+static void keepFastestEpoch(const TrainingStats *stats, void *userData) {
+    TrainingStats *best = userData;
+    if (!best->seconds || stats->seconds < best->seconds) {
+        *best = *stats;
+        best->layers = NULL;
+    }
+}
+
+static void printLayers(const Options *opt) {
+    printf("[");
+    for (unsigned i = 0; i < opt->nLayers; i++) {
+        printf(i ? ", %u" : "%u", opt->layers[i]);
+    }
+    printf("]");
+}
+
+static void runTrainingBenchmarks(const Options *opt) {
+    if (!selected(opt, "epoch")) {
+        return;
+    }
+    TrainingSet *set = syntheticSet(opt, opt->examples, false);
+    static const size_t batchSizes[] = {1, 10, 64, 256};
+    for (unsigned b = 0; b < sizeof(batchSizes) / sizeof(batchSizes[0]); b++) {
+        Network *net = initNetwork(opt->layers, opt->nLayers);
+        TrainingConfig config = {
+            .epochs = 1,
+            .batchSize = batchSizes[b],
+            .learningRate = 0.5f,
+            .af = FN_SIGMOID,
+            .nThreads = opt->threads,
+            .seed = 1
+        };
+        /* Warm up once, then keep the fastest of three epochs */
+        TrainingStats best = {0};
+        config.onEpoch = keepFastestEpoch;
+        config.userData = &best;
+        trainNetworkOnSet(net, set, &config, NULL);
+        best.seconds = 0;
+        for (unsigned r = 0; r < 3; r++) {
+            trainNetworkOnSet(net, set, &config, NULL);
+        }
+        printf("{\"bench\": \"epoch\", \"layers\": ");
+        printLayers(opt);
+        printf(", \"examples\": %zu, \"batch_size\": %zu, \"threads\": %u, \"seconds\": %.4f, \"samples_per_s\": %.1f, \"allocations\": %zu",
+               opt->examples, batchSizes[b], opt->threads, best.seconds, best.samplesPerSecond, best.allocations);
+        for (unsigned p = 0; p < PHASE_COUNT; p++) {
+            printf(", \"%s_s\": %.4f", trainingPhaseName(p), best.phaseSeconds[p]);
+        }
+        printf("}\n");
+        fflush(stdout);
+        freeNetwork(net);
+    }
+    freeTrainingSet(set);
+}
+
+static void ignoreEpoch(const TrainingStats *stats, void *userData) { (void)stats; (void)userData; }
+static void ignoreSweepEpoch(const SweepStats *stats, void *userData) { (void)stats; (void)userData; }
+
+/* An epoch of SWEEP_MODELS networks differing in learning rate, one after the other and as one sweep */
+#define SWEEP_MODELS 8
+static void runSweepBenchmarks(const Options *opt) {
+    if (!selected(opt, "sweep")) {
+        return;
+    }
+    TrainingSet *set = syntheticSet(opt, opt->examples, false);
+    static const size_t batchSizes[] = {10, 64};
+    for (unsigned b = 0; b < sizeof(batchSizes) / sizeof(batchSizes[0]); b++) {
+        Network *nets[SWEEP_MODELS];
+        TrainingConfig configs[SWEEP_MODELS];
+        for (unsigned m = 0; m < SWEEP_MODELS; m++) {
+            nets[m] = initNetwork(opt->layers, opt->nLayers);
+            configs[m] = (TrainingConfig){
+                .epochs = 1,
+                .batchSize = batchSizes[b],
+                .learningRate = 0.1f * (m + 1),
+                .af = FN_SIGMOID,
+                .seed = 1
+            };
+        }
+        double separate = 0, together = 0;
+        for (unsigned r = 0; r < 2; r++) {
+            double t = now();
+            for (unsigned m = 0; m < SWEEP_MODELS; m++) {
+                TrainingConfig config = configs[m];
+                config.nThreads = opt->threads;
+                config.onEpoch = ignoreEpoch;
+                trainNetworkOnSet(nets[m], set, &config, NULL);
+            }
+            separate = r ? now() - t : 0;
+            SweepConfig sweep = {.nThreads = opt->threads, .onEpoch = ignoreSweepEpoch};
+            t = now();
+            trainNetworksOnSet(nets, configs, SWEEP_MODELS, set, NULL, &sweep, NULL);
+            together = r ? now() - t : 0;
+        }
+        printf("{\"bench\": \"sweep\", \"layers\": ");
+        printLayers(opt);
+        printf(", \"models\": %u, \"examples\": %zu, \"batch_size\": %zu, \"threads\": %u, \"separate_s\": %.4f, "
+               "\"sweep_s\": %.4f, \"speedup\": %.2f}\n", SWEEP_MODELS, opt->examples, batchSizes[b], opt->threads,
+               separate, together, separate / together);
+        fflush(stdout);
+        for (unsigned m = 0; m < SWEEP_MODELS; m++) {
+            freeNetwork(nets[m]);
+        }
+    }
+    freeTrainingSet(set);
+}
+
+static void reportLatency(const char *name, const Options *opt, double *latencies, size_t n) {
+    qsort(latencies, n, sizeof(double), compareDoubles);
+    printf("{\"bench\": \"%s\", \"layers\": ", name);
+    printLayers(opt);
+    printf(", \"samples\": %zu, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}\n",
+           n, latencies[n / 2] * 1e6, latencies[n * 9 / 10] * 1e6, latencies[n * 99 / 100] * 1e6,
+           latencies[n * 999 / 1000] * 1e6, latencies[n - 1] * 1e6);
+    fflush(stdout);
+}
+
+static void runInferenceBenchmarks(const Options *opt) {
+    unsigned nIn = opt->layers[0], nOut = opt->layers[opt->nLayers - 1];
+    size_t n = opt->sampleTime < 0.01 ? 2000 : 20000;
+    TrainingSet *set = syntheticSet(opt, n, true);
+    Network *net = initNetwork(opt->layers, opt->nLayers);
+    double *latencies = malloc(n * sizeof(double));
+
+    /* Single examples with float, bfloat16 and fp16 weights */
+    static const char *feedForwardNames[] = {"feedForward", "bf16_feedForward", "f16_feedForward"};
+    for (unsigned w = WEIGHTS_F32; w <= WEIGHTS_F16; w++) {
+        if (!selected(opt, feedForwardNames[w])) {
+            continue;
+        }
+        setWeightType(net, w);
+        for (size_t e = 0; e < n; e++) {
+            double t = now();
+            Matrix out = feedForward(net, set->inputs + e * nIn, FN_SIGMOID);
+            latencies[e] = now() - t;
+            freeMatrix(out);
+        }
+        reportLatency(feedForwardNames[w], opt, latencies, n);
+    }
+    setWeightType(net, WEIGHTS_F32);
+
+    /* Single requests through a preallocated context, float and int8 */
+    QuantizedNetwork *qnet = quantizeNetwork(net, FN_SIGMOID, set->inputs, n < 1000 ? n : 1000);
+    InferenceContext *contexts[2] = {initInferenceContext(net, 1, 1), initQuantizedInferenceContext(qnet, 1, 1)};
+    const char *names[2] = {"feedForwardBatch_latency", "int8_latency"};
+    float output[nOut];
+    for (unsigned c = 0; c < 2; c++) {
+        if (!selected(opt, names[c])) {
+            continue;
+        }
+        for (size_t e = 0; e < n; e++) {
+            double t = now();
+            feedForwardBatch(contexts[c], set->inputs + e * nIn, 1, FN_SIGMOID, output);
+            latencies[e] = now() - t;
+        }
+        reportLatency(names[c], opt, latencies, n);
+    }
+    freeInferenceContext(contexts[0]);
+    freeInferenceContext(contexts[1]);
+
+    /* Throughput of whole batches */
+    static const size_t chunks[] = {16, 64, 256};
+    int *labels = malloc(n * sizeof(int));
+    static const char *throughputNames[] = {"classifyBatch_throughput", "bf16_throughput", "f16_throughput", "int8_throughput"};
+    for (unsigned q = 0; q < 4; q++) {
+        const char *name = throughputNames[q];
+        if (q <= WEIGHTS_F16) {
+            setWeightType(net, q);
+        }
+        for (unsigned c = 0; c < sizeof(chunks) / sizeof(chunks[0]) && selected(opt, name); c++) {
+            InferenceContext *ctx = q == 3 ? initQuantizedInferenceContext(qnet, chunks[c], opt->threads)
+                                           : initInferenceContext(net, chunks[c], opt->threads);
+            double best = INFINITY;
+            for (unsigned r = 0; r < 5; r++) {
+                double t = now();
+                classifyBatch(ctx, set->inputs, n, FN_SIGMOID, labels);
+                t = now() - t;
+                best = t < best ? t : best;
+            }
+            printf("{\"bench\": \"%s\", \"layers\": ", name);
+            printLayers(opt);
+            printf(", \"chunk\": %zu, \"threads\": %u, \"samples_per_s\": %.1f}\n", chunks[c], opt->threads, n / best);
+            fflush(stdout);
+            freeInferenceContext(ctx);
+        }
+    }
+    free(labels);
+    free(latencies);
+    freeQuantizedNetwork(qnet);
+    freeNetwork(net);
+    freeTrainingSet(set);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--layers 784,100,10] [--examples N] [--threads N] [--filter NAME] [--quick]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    Options opt = {
+        .layers = {784, 100, 10},
+        .nLayers = 3,
+        .examples = 10000,
+        .threads = 1,
+        .sampleTime = 0.02
+    };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--layers") == 0 && i + 1 < argc) {
+            opt.nLayers = 0;
+            for (char *tok = strtok(argv[++i], ","); tok && opt.nLayers < MAX_LAYERS; tok = strtok(NULL, ",")) {
+                opt.layers[opt.nLayers++] = atoi(tok);
+            }
+            if (opt.nLayers < 2) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--examples") == 0 && i + 1 < argc) {
+            opt.examples = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            opt.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            opt.filter = argv[++i];
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            opt.sampleTime = 0.002;
+            opt.examples = opt.examples < 2000 ? opt.examples : 2000;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    printf("{\"bench\": \"run\", \"time\": %ld, \"gemm_kernel\": \"%s\", \"int8_kernel\": \"%s\", \"half_kernel\": \"%s\", "
+           "\"threads\": %u, \"layers\": ", (long)time(NULL), gemmKernelName(), quantKernelName(), halfKernelName(), opt.threads);
+    printLayers(&opt);
+    printf("}\n");
+    runMatrixBenchmarks(&opt);
+    runTrainingBenchmarks(&opt);
+    runSweepBenchmarks(&opt);
+    runInferenceBenchmarks(&opt);
+    return 0;
+}
@@ -0,0 +1,229 @@
+/**
+ * @brief Fused, vectorized activation kernels.
+ *
+ * Each kernel is written once as an always_inline loop taking the activation as a parameter
+ * and instantiated with a constant for every activation, so the per-element switch folds
+ * away and the loops contain no calls. exp is a branch-free polynomial approximation that
+ * the compiler can vectorize, and target_clones builds AVX-512, AVX2 and baseline versions
+ * of each kernel that are picked once at load time.
+ * Derivatives are computed from the activations the forward pass already produced.
+ *
+ * Softmax is not elementwise: it is applied to blocks of columns (examples) at a time, with
+ * the bias add fused into the pass that finds each column's maximum. Subtracting that maximum
+ * before exponentiating keeps every exponent <= 0, so large logits cannot overflow.
+ * Paired with the cross-entropy cost its output error reduces to a - y.
+ */
+#include <assert.h>
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "activation.h"
+
+#define KERNEL_TARGETS __attribute__((target_clones("avx512f", "arch=haswell", "default")))
+#define INLINE static inline __attribute__((always_inline))
+/* Columns normalised together by the softmax kernel, so its per-column state fits on the stack */
+#define SOFTMAX_BLOCK 64
+
+/* Cephes style expf: e^x = 2^n * e^r with |r| <= ln(2)/2 and a degree 6 polynomial for e^r */
+INLINE float fastExp(float x) {
+    x = x < -87.3f ? -87.3f : x;
+    x = x > 88.3f ? 88.3f : x;
+    float t = x * 1.44269504f;
+    int32_t n = (int32_t)(t + (t >= 0 ? 0.5f : -0.5f));
+    float fn = (float)n;
+    float r = x - fn * 0.693359375f + fn * 2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    int32_t bits = (n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+INLINE float activation(float x, enum EActivationFunction af) {
+    switch (af) {
+        case FN_TANH:
+            return 2 / (1 + fastExp(-2 * x)) - 1;
+        case FN_RELU:
+            return x > 0 ? x : 0;
+        case FN_LINEAR:
+            return x;
+        case FN_SIGMOID:
+        default:
+            return 1 / (1 + fastExp(-x));
+    }
+}
+
+/* Derivative of the activation expressed in terms of its output a = f(z) */
+INLINE float activationPrime(float a, enum EActivationFunction af) {
+    switch (af) {
+        case FN_TANH:
+            return 1 - a * a;
+        case FN_RELU:
+            return a > 0 ? 1 : 0;
+        case FN_LINEAR:
+            return 1;
+        case FN_SIGMOID:
+        default:
+            return a * (1 - a);
+    }
+}
+
+INLINE void addBiasActivateKernel(Matrix m, Matrix bias, enum EActivationFunction af) {
+    for (unsigned i = 0; i < m.rows; i++) {
+        float *row = m.data + i * m.cols;
+        float b = bias.data[i];
+        for (unsigned j = 0; j < m.cols; j++) {
+            row[j] = activation(row[j] + b, af);
+        }
+    }
+}
+
+/* Softmax of every column of m + bias: e^(z - max) / sum(e^(z - max)) */
+INLINE void softmaxKernel(Matrix m, Matrix bias) {
+    float max[SOFTMAX_BLOCK], sum[SOFTMAX_BLOCK];
+    for (unsigned j0 = 0; j0 < m.cols; j0 += SOFTMAX_BLOCK) {
+        unsigned nb = m.cols - j0 < SOFTMAX_BLOCK ? m.cols - j0 : SOFTMAX_BLOCK;
+        for (unsigned j = 0; j < nb; j++) {
+            max[j] = -FLT_MAX;
+            sum[j] = 0;
+        }
+        for (unsigned i = 0; i < m.rows; i++) {
+            float *row = m.data + i * m.cols + j0;
+            float b = bias.data[i];
+            for (unsigned j = 0; j < nb; j++) {
+                row[j] += b;
+                max[j] = row[j] > max[j] ? row[j] : max[j];
+            }
+        }
+        for (unsigned i = 0; i < m.rows; i++) {
+            float *row = m.data + i * m.cols + j0;
+            for (unsigned j = 0; j < nb; j++) {
+                row[j] = fastExp(row[j] - max[j]);
+                sum[j] += row[j];
+            }
+        }
+        for (unsigned j = 0; j < nb; j++) {
+            sum[j] = 1 / sum[j];
+        }
+        for (unsigned i = 0; i < m.rows; i++) {
+            float *row = m.data + i * m.cols + j0;
+            for (unsigned j = 0; j < nb; j++) {
+                row[j] *= sum[j];
+            }
+        }
+    }
+}
+
+INLINE void mulActivationPrimeKernel(Matrix delta, Matrix a, enum EActivationFunction af) {
+    for (unsigned i = 0; i < len(delta); i++) {
+        delta.data[i] *= activationPrime(a.data[i], af);
+    }
+}
+
+INLINE void outputDeltaKernel(Matrix delta, Matrix a, Matrix y, enum EActivationFunction af) {
+    for (unsigned i = 0; i < len(delta); i++) {
+        delta.data[i] = (a.data[i] - y.data[i]) * activationPrime(a.data[i], af);
+    }
+}
+
+INLINE void crossEntropyDeltaKernel(Matrix delta, Matrix a, Matrix y) {
+    for (unsigned i = 0; i < len(delta); i++) {
+        delta.data[i] = a.data[i] - y.data[i];
+    }
+}
+
+/**
+ * @brief m = f(m + bias), with the column vector bias added to every column of m
+ */
+KERNEL_TARGETS
+void addBiasActivate(Matrix m, Matrix bias, enum EActivationFunction af) {
+    assert(bias.rows == m.rows && bias.cols == 1);
+    switch (af) {
+        case FN_TANH:
+            addBiasActivateKernel(m, bias, FN_TANH);
+            break;
+        case FN_RELU:
+            addBiasActivateKernel(m, bias, FN_RELU);
+            break;
+        case FN_SOFTMAX:
+            softmaxKernel(m, bias);
+            break;
+        case FN_LINEAR:
+            addBiasActivateKernel(m, bias, FN_LINEAR);
+            break;
+        case FN_SIGMOID:
+        default:
+            addBiasActivateKernel(m, bias, FN_SIGMOID);
+            break;
+    }
+}
+
+/**
+ * @brief delta = delta * f'(z), elementwise, where activations holds f(z)
+ */
+KERNEL_TARGETS
+void mulActivationPrime(Matrix delta, Matrix activations, enum EActivationFunction af) {
+    assert(delta.rows == activations.rows && delta.cols == activations.cols);
+    assert(af != FN_SOFTMAX);
+    switch (af) {
+        case FN_TANH:
+            mulActivationPrimeKernel(delta, activations, FN_TANH);
+            break;
+        case FN_RELU:
+            mulActivationPrimeKernel(delta, activations, FN_RELU);
+            break;
+        case FN_LINEAR:
+            mulActivationPrimeKernel(delta, activations, FN_LINEAR);
+            break;
+        case FN_SIGMOID:
+        default:
+            mulActivationPrimeKernel(delta, activations, FN_SIGMOID);
+            break;
+    }
+}
+
+/**
+ * @brief The output layer error dC/dz. For the quadratic cost this is (activations - expected) * f'(z).
+ * For the cross-entropy cost of a sigmoid or softmax output f' cancels out and it is simply
+ * activations - expected. A softmax output always uses the cross-entropy cost.
+ */
+KERNEL_TARGETS
+void outputDelta(Matrix delta, Matrix activations, Matrix expected, enum EActivationFunction af, enum ECost cost) {
+    assert(delta.rows == activations.rows && delta.cols == activations.cols);
+    assert(expected.rows == activations.rows && expected.cols == activations.cols);
+    assert(cost == COST_QUADRATIC || af == FN_SIGMOID || af == FN_SOFTMAX);
+    if (cost == COST_CROSS_ENTROPY || af == FN_SOFTMAX) {
+        crossEntropyDeltaKernel(delta, activations, expected);
+        return;
+    }
+    switch (af) {
+        case FN_TANH:
+            outputDeltaKernel(delta, activations, expected, FN_TANH);
+            break;
+        case FN_RELU:
+            outputDeltaKernel(delta, activations, expected, FN_RELU);
+            break;
+        case FN_LINEAR:
+            outputDeltaKernel(delta, activations, expected, FN_LINEAR);
+            break;
+        case FN_SIGMOID:
+        default:
+            outputDeltaKernel(delta, activations, expected, FN_SIGMOID);
+            break;
+    }
+}
+
+/**
+ * @brief Whether f is strictly increasing (softmax: within a column), so the index of the highest
+ * output is the same before and after applying it and classification can skip the output activation
+ */
+bool preservesOrder(enum EActivationFunction af) {
+    return af != FN_RELU;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "matrix.h"
+
+enum EActivationFunction {
+    FN_SIGMOID,
+    FN_TANH,
+    FN_RELU,
+    /* Normalises every column (example) into a probability distribution. Output layer only */
+    FN_SOFTMAX,
+    /* f(z) = z, e.g. for a regression output */
+    FN_LINEAR
+};
+
+/* Cost minimised by training, see TrainingConfig */
+enum ECost {
+    /* C = |a - y|^2 / 2 */
+    COST_QUADRATIC,
+    /* C = -sum(y ln a + (1 - y) ln(1 - a)) for sigmoid outputs, -sum(y ln a) for softmax outputs */
+    COST_CROSS_ENTROPY
+};
+
+void addBiasActivate(Matrix m, Matrix bias, enum EActivationFunction af);
+void mulActivationPrime(Matrix delta, Matrix activations, enum EActivationFunction af);
+void outputDelta(Matrix delta, Matrix activations, Matrix expected, enum EActivationFunction af, enum ECost cost);
+bool preservesOrder(enum EActivationFunction af);
@@ -0,0 +1,354 @@
+/**
+ * @brief Checkpointing and resuming training runs.
+ *
+ * A checkpoint is a single binary image:
+ *
+ *   CheckpointHeader                                         128 bytes
+ *   uint32 sizes[nLayers]                                    padded to a multiple of 64 bytes
+ *   float32 parameters: weights[0], biases[0], weights[1], ...  padded
+ *   float32 first and second moments, if the optimizer has them  each padded
+ *   uint64 order[nExamples]                                  padded
+ *
+ * Training copies its state into one of two preallocated images and goes on; a background thread
+ * checksums the image and writes it to a temporary file, which is synced and then renamed over the
+ * previous checkpoint. The file at the checkpoint path is therefore always a complete checkpoint,
+ * whenever the process is killed, and training only waits for the disk when it gets a whole
+ * checkpoint ahead of it.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "checksum.h"
+
+#define CHECKPOINT_MAGIC "PECANNCK"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_ALIGNMENT 64
+
+#define ALIGN(n) (((n) + CHECKPOINT_ALIGNMENT - 1) & ~(uint64_t)(CHECKPOINT_ALIGNMENT - 1))
+
+typedef struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nLayers;
+    /* EOptimizer of the run, which decides which moments are stored */
+    uint32_t optimizer;
+    uint32_t epoch;
+    /* Update steps taken and examples of the epoch trained on */
+    uint64_t step;
+    uint64_t position;
+    uint64_t nExamples;
+    uint64_t nParams;
+    uint64_t rng[4];
+    /* Size of everything after the header, and the CRC-32C of that followed by this header with checksum 0 */
+    uint64_t dataSize;
+    uint64_t checksum;
+    uint8_t reserved[24];
+} CheckpointHeader;
+
+_Static_assert(sizeof(CheckpointHeader) == 2 * CHECKPOINT_ALIGNMENT, "CheckpointHeader must fill two aligned blocks");
+
+/* Offsets of the sections of an image and its total size, in bytes */
+typedef struct CheckpointLayout {
+    size_t shape, params, m, v, order, size;
+} CheckpointLayout;
+
+struct Checkpointer {
+    char *path, *tmpPath, *dir;
+    CheckpointLayout layout;
+    unsigned char *images[2];
+    /* The filled image waiting to be written and the one being written, or NULL */
+    unsigned char *pending, *running;
+    bool started, stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filledCond, freeCond;
+};
+
+static CheckpointLayout checkpointLayout(unsigned nLayers, const Optimizer *opt, size_t nExamples) {
+    CheckpointLayout layout;
+    size_t paramBytes = ALIGN(opt->nParams * sizeof(float));
+    layout.shape = sizeof(CheckpointHeader);
+    layout.params = layout.shape + ALIGN(nLayers * sizeof(uint32_t));
+    layout.m = layout.params + paramBytes;
+    layout.v = layout.m + (opt->m ? paramBytes : 0);
+    layout.order = layout.v + (opt->v ? paramBytes : 0);
+    layout.size = layout.order + ALIGN(nExamples * sizeof(uint64_t));
+    return layout;
+}
+
+/* Checksum of an image, covering the header's epoch, step, position and PRNG state as well as the data */
+static uint64_t checksum(const CheckpointHeader *header, const unsigned char *data) {
+    CheckpointHeader copy = *header;
+    copy.checksum = 0;
+    return crc32c(crc32c(0, data, header->dataSize), &copy, sizeof(copy));
+}
+
+/* Write the image to the temporary file, make it durable and move it over the checkpoint */
+static int writeImage(const Checkpointer *cp, const unsigned char *image) {
+    int fd = open(cp->tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < cp->layout.size) {
+        ssize_t n = write(fd, image + done, cp->layout.size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    int err = done != cp->layout.size || fsync(fd) != 0;
+    err = close(fd) != 0 || err;
+    if (err || rename(cp->tmpPath, cp->path) != 0) {
+        unlink(cp->tmpPath);
+        return -1;
+    }
+    /* Persist the rename itself */
+    fd = open(cp->dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    return 0;
+}
+
+static void *checkpointMain(void *arg) {
+    Checkpointer *cp = arg;
+    for (;;) {
+        pthread_mutex_lock(&cp->lock);
+        while (!cp->pending && !cp->stop) {
+            pthread_cond_wait(&cp->filledCond, &cp->lock);
+        }
+        /* Checkpoints submitted before stopping are still written */
+        if (!cp->pending) {
+            pthread_mutex_unlock(&cp->lock);
+            return NULL;
+        }
+        unsigned char *image = cp->running = cp->pending;
+        cp->pending = NULL;
+        pthread_cond_signal(&cp->freeCond);
+        pthread_mutex_unlock(&cp->lock);
+
+        CheckpointHeader *header = (CheckpointHeader*)image;
+        header->checksum = checksum(header, image + sizeof(CheckpointHeader));
+        if (writeImage(cp, image) != 0) {
+            fprintf(stderr, "Failed to write checkpoint %s\n", cp->path);
+        }
+
+        pthread_mutex_lock(&cp->lock);
+        cp->running = NULL;
+        pthread_mutex_unlock(&cp->lock);
+    }
+}
+
+/**
+ * @brief Start a thread that writes checkpoints of a training run to a file
+ *
+ * @param path The checkpoint file. Checkpoints are first written to path with ".tmp" appended
+ * @param net The network being trained
+ * @param opt The run's optimizer
+ * @param nExamples Size of the permutation of the examples to save, 0 when streaming
+ * @return Checkpointer* The checkpointer or NULL on failure
+ */
+Checkpointer *initCheckpointer(const char *path, const Network *net, const Optimizer *opt, size_t nExamples) {
+    assert(path && net && opt);
+    Checkpointer *cp = calloc(1, sizeof(Checkpointer));
+    if (!cp) {
+        return NULL;
+    }
+    pthread_mutex_init(&cp->lock, NULL);
+    pthread_cond_init(&cp->filledCond, NULL);
+    pthread_cond_init(&cp->freeCond, NULL);
+    size_t pathLen = strlen(path);
+    cp->layout = checkpointLayout(net->nLayers, opt, nExamples);
+    cp->path = strdup(path);
+    cp->tmpPath = malloc(pathLen + sizeof(".tmp"));
+    cp->dir = malloc(pathLen + 2);
+    cp->images[0] = aligned_alloc(CHECKPOINT_ALIGNMENT, cp->layout.size);
+    cp->images[1] = aligned_alloc(CHECKPOINT_ALIGNMENT, cp->layout.size);
+    if (!cp->path || !cp->tmpPath || !cp->dir || !cp->images[0] || !cp->images[1]) {
+        freeCheckpointer(cp);
+        return NULL;
+    }
+    memcpy(cp->tmpPath, path, pathLen);
+    memcpy(cp->tmpPath + pathLen, ".tmp", sizeof(".tmp"));
+    const char *slash = strrchr(path, '/');
+    if (slash) {
+        memcpy(cp->dir, path, slash - path + 1);
+        cp->dir[slash - path + 1] = '\0';
+    } else {
+        strcpy(cp->dir, ".");
+    }
+    /* Padding is written as zeros */
+    memset(cp->images[0], 0, cp->layout.size);
+    memset(cp->images[1], 0, cp->layout.size);
+    cp->started = pthread_create(&cp->thread, NULL, checkpointMain, cp) == 0;
+    if (!cp->started) {
+        freeCheckpointer(cp);
+        return NULL;
+    }
+    return cp;
+}
+
+/**
+ * @brief Copy the training state into a free image and queue it to be written.
+ * Waits only while another checkpoint is still queued.
+ *
+ * @param cp The checkpointer
+ * @param net The network being trained. Its weights must not change during the call
+ * @param opt The run's optimizer. Its moments must not change during the call either
+ * @param state Position of the run. state->nExamples must match initCheckpointer
+ */
+void submitCheckpoint(Checkpointer *cp, const Network *net, const Optimizer *opt, const TrainingState *state) {
+    assert(cp && net && opt && state && opt->nParams == net->nParameters);
+    assert(cp->layout.size == checkpointLayout(net->nLayers, opt, state->nExamples).size);
+    pthread_mutex_lock(&cp->lock);
+    while (cp->pending) {
+        pthread_cond_wait(&cp->freeCond, &cp->lock);
+    }
+    unsigned char *image = cp->running == cp->images[0] ? cp->images[1] : cp->images[0];
+    pthread_mutex_unlock(&cp->lock);
+
+    const CheckpointLayout *layout = &cp->layout;
+    CheckpointHeader header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .nLayers = net->nLayers,
+        .optimizer = opt->config.type,
+        .epoch = state->epoch,
+        .step = state->step,
+        .position = state->position,
+        .nExamples = state->nExamples,
+        .nParams = opt->nParams,
+        .dataSize = layout->size - sizeof(CheckpointHeader)
+    };
+    memcpy(header.rng, state->rng.s, sizeof(header.rng));
+    memcpy(image, &header, sizeof(header));
+    uint32_t *sizes = (uint32_t*)(image + layout->shape);
+    for (unsigned i = 0; i < net->nLayers; i++) {
+        sizes[i] = net->sizes[i];
+    }
+    memcpy(image + layout->params, net->parameters, opt->nParams * sizeof(float));
+    if (opt->m) {
+        memcpy(image + layout->m, opt->m, opt->nParams * sizeof(float));
+    }
+    if (opt->v) {
+        memcpy(image + layout->v, opt->v, opt->nParams * sizeof(float));
+    }
+    uint64_t *order = (uint64_t*)(image + layout->order);
+    for (size_t i = 0; i < state->nExamples; i++) {
+        order[i] = state->order[i];
+    }
+
+    pthread_mutex_lock(&cp->lock);
+    cp->pending = image;
+    pthread_cond_signal(&cp->filledCond);
+    pthread_mutex_unlock(&cp->lock);
+}
+
+/**
+ * @brief Wait for the queued checkpoints to be written, then stop the thread and free the checkpointer
+ */
+void freeCheckpointer(Checkpointer *cp) {
+    if (!cp) {
+        return;
+    }
+    if (cp->started) {
+        pthread_mutex_lock(&cp->lock);
+        cp->stop = true;
+        pthread_cond_signal(&cp->filledCond);
+        pthread_mutex_unlock(&cp->lock);
+        pthread_join(cp->thread, NULL);
+    }
+    pthread_mutex_destroy(&cp->lock);
+    pthread_cond_destroy(&cp->filledCond);
+    pthread_cond_destroy(&cp->freeCond);
+    free(cp->images[0]);
+    free(cp->images[1]);
+    free(cp->path);
+    free(cp->tmpPath);
+    free(cp->dir);
+    free(cp);
+}
+
+/**
+ * @brief Restore a training run from a checkpoint. Nothing is changed unless the checkpoint is
+ * complete and was taken from a run with the same network shape, optimizer and number of examples.
+ *
+ * @param path The checkpoint file
+ * @param net Receives the weights
+ * @param opt Receives the step count and moments
+ * @param state Receives the position and PRNG. state->order must hold state->nExamples entries
+ * @return 0 on success, -1 if there is no usable checkpoint
+ */
+int loadCheckpoint(const char *path, Network *net, Optimizer *opt, TrainingState *state) {
+    assert(path && net && opt && state && opt->nParams == net->nParameters);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+    CheckpointLayout layout = checkpointLayout(net->nLayers, opt, state->nExamples);
+    CheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION ||
+        header.nLayers != net->nLayers ||
+        header.optimizer != opt->config.type ||
+        header.nExamples != state->nExamples ||
+        header.nParams != opt->nParams ||
+        header.position > header.nExamples ||
+        header.dataSize != layout.size - sizeof(CheckpointHeader)) {
+        fclose(fp);
+        return -1;
+    }
+    unsigned char *image = aligned_alloc(CHECKPOINT_ALIGNMENT, layout.size);
+    if (!image) {
+        fclose(fp);
+        return -1;
+    }
+    unsigned char *data = image + sizeof(CheckpointHeader);
+    int err = fread(data, 1, header.dataSize, fp) != header.dataSize ||
+              checksum(&header, data) != header.checksum;
+    fclose(fp);
+    const uint32_t *sizes = (const uint32_t*)(image + layout.shape);
+    for (unsigned i = 0; i < net->nLayers && !err; i++) {
+        err = sizes[i] != net->sizes[i];
+    }
+    const uint64_t *order = (const uint64_t*)(image + layout.order);
+    for (size_t i = 0; i < state->nExamples && !err; i++) {
+        err = order[i] >= state->nExamples;
+    }
+    if (err) {
+        free(image);
+        return -1;
+    }
+
+    memcpy(net->parameters, image + layout.params, opt->nParams * sizeof(float));
+    if (opt->m) {
+        memcpy(opt->m, image + layout.m, opt->nParams * sizeof(float));
+    }
+    if (opt->v) {
+        memcpy(opt->v, image + layout.v, opt->nParams * sizeof(float));
+    }
+    opt->step = state->step = header.step;
+    for (size_t i = 0; i < state->nExamples; i++) {
+        state->order[i] = order[i];
+    }
+    state->epoch = header.epoch;
+    state->position = header.position;
+    memcpy(state->rng.s, header.rng, sizeof(header.rng));
+    free(image);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "network.h"
+#include "optimizer.h"
+#include "random.h"
+
+/*
+ * Checkpoints of a training run, see TrainingConfig.checkpointPath. A checkpoint holds the
+ * weights, the optimizer's moments and step count, the position in the run and the shuffling
+ * PRNG, so a resumed run continues exactly where the checkpointed one was.
+ */
+
+/* Where a run is, besides the weights and optimizer moments */
+typedef struct TrainingState {
+    /* Epoch to continue with, examples of it already trained on and update steps taken in total */
+    unsigned epoch;
+    size_t position, step;
+    /* Permutation of the examples visited by that epoch, NULL with nExamples 0 when streaming */
+    size_t *order;
+    size_t nExamples;
+    Rng rng;
+} TrainingState;
+
+/* Writes checkpoints from a background thread */
+typedef struct Checkpointer Checkpointer;
+
+Checkpointer *initCheckpointer(const char *path, const Network *net, const Optimizer *opt, size_t nExamples);
+void submitCheckpoint(Checkpointer *cp, const Network *net, const Optimizer *opt, const TrainingState *state);
+void freeCheckpointer(Checkpointer *cp);
+int loadCheckpoint(const char *path, Network *net, Optimizer *opt, TrainingState *state);
@@ -0,0 +1,104 @@
+/**
+ * @brief CRC-32C with the SSE4.2 crc32 instruction, or a slicing-by-8 table where it is missing.
+ *
+ * The kernel is chosen once at runtime. PECANN_ISA=scalar forces the table, as it forces the
+ * scalar float kernels. Both give the same checksums, so files written on one machine verify on any other.
+ */
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+
+/* The Castagnoli polynomial, bit reversed */
+#define CRC32C_POLY 0x82f63b78u
+
+typedef uint32_t (*Crc32cKernel)(uint32_t crc, const unsigned char *data, size_t size);
+
+/* table[k][b] is the CRC of byte b followed by k zero bytes */
+static uint32_t table[8][256];
+
+static uint32_t crc32cTable(uint32_t crc, const unsigned char *data, size_t size) {
+    for (; size && ((uintptr_t)data & 7); size--) {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^ table[5][(word >> 16) & 0xff] ^
+              table[4][(word >> 24) & 0xff] ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+    }
+    for (; size; size--) {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t size) {
+    for (; size && ((uintptr_t)data & 7); size--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    uint64_t c = crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (uint32_t)c;
+    for (; size; size--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+static Crc32cKernel selectedKernel;
+static const char *selectedName;
+static pthread_once_t selectOnce = PTHREAD_ONCE_INIT;
+
+static void selectKernel(void) {
+    __builtin_cpu_init();
+    const char *isa = getenv("PECANN_ISA");
+    if (__builtin_cpu_supports("sse4.2") && !(isa && strcmp(isa, "scalar") == 0)) {
+        selectedKernel = crc32cSse42;
+        selectedName = "sse4.2";
+        return;
+    }
+    for (unsigned b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (unsigned k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][b] = crc;
+    }
+    for (unsigned b = 0; b < 256; b++) {
+        for (unsigned k = 1; k < 8; k++) {
+            table[k][b] = table[0][table[k - 1][b] & 0xff] ^ (table[k - 1][b] >> 8);
+        }
+    }
+    selectedKernel = crc32cTable;
+    selectedName = "table";
+}
+
+/**
+ * @brief Extend a CRC-32C with more data: crc32c(crc32c(0, a), b) is the CRC of a followed by b
+ *
+ * @param crc The CRC of the data so far, 0 to start
+ * @param data The data
+ * @param size Its size in bytes
+ * @return uint32_t The CRC including data
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&selectOnce, selectKernel);
+    return ~selectedKernel(~crc, data, size);
+}
+
+/* Name of the CRC-32C kernel selected for this CPU ("sse4.2" or "table") */
+const char *crc32cKernelName(void) {
+    pthread_once(&selectOnce, selectKernel);
+    return selectedName;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli), the checksum of model files and checkpoints. Unlike a multiplicative
+ * hash it detects every error burst up to 32 bits long and every odd number of flipped bits.
+ */
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+const char *crc32cKernelName(void);
@@ -0,0 +1,284 @@
+/**
+ * @brief Emits a network as fixed-topology C inference code, see codegen.h.
+ *
+ * Layer i computes y = W x + b as y[r] += Wt[c][r] * x[c] over the columns c: the transposed
+ * weights are read sequentially and the inner loop over the rows is a plain elementwise update,
+ * which compilers vectorize without reassociating any sums (so without -ffast-math). Rows are
+ * padded to a multiple of 16 floats so every row of Wt starts on a 64 byte boundary, and four
+ * columns are accumulated per pass over y. The activations and exp are those of the library,
+ * so the generated code gives the same results as feedForward up to summation order.
+ */
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "codegen.h"
+
+#define PAD(n) (((n) + 15) & ~15u)
+/* Columns accumulated per pass over a layer's outputs */
+#define COLUMN_BLOCK 4
+
+static const char *activationName(enum EActivationFunction af) {
+    switch (af) {
+        case FN_TANH:
+            return "tanh";
+        case FN_RELU:
+            return "relu";
+        case FN_SOFTMAX:
+            return "softmax";
+        case FN_SIGMOID:
+        default:
+            return "sigmoid";
+    }
+}
+
+/* Whether name can prefix C identifiers */
+static bool validName(const char *name) {
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_') {
+        return false;
+    }
+    for (const char *c = name; *c; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void printUpper(FILE *fp, const char *name) {
+    for (const char *c = name; *c; c++) {
+        fputc(toupper((unsigned char)*c), fp);
+    }
+}
+
+/* Exact hexadecimal literal of a float */
+static int printFloat(FILE *fp, float x) {
+    assert(isfinite(x));
+    return fprintf(fp, "%af", (double)x);
+}
+
+static void emitHeader(FILE *fp, Network *net, const char *name) {
+    unsigned L = net->nLayers - 1;
+    fprintf(fp, "/* Generated by pecann: fixed-topology inference for a");
+    for (unsigned i = 0; i <= L; i++) {
+        fprintf(fp, "%s%u", i ? "-" : " ", net->sizes[i]);
+    }
+    fprintf(fp, " network. Do not edit */\n#pragma once\n\n");
+    fprintf(fp, "#define ");
+    printUpper(fp, name);
+    fprintf(fp, "_INPUTS %u\n#define ", net->sizes[0]);
+    printUpper(fp, name);
+    fprintf(fp, "_OUTPUTS %u\n\n", net->sizes[L]);
+    fprintf(fp, "/* Output activations of the network for one input */\n");
+    fprintf(fp, "void %s_forward(const float *input, float *output);\n\n", name);
+    fprintf(fp, "/* Index of the highest output activation for one input */\n");
+    fprintf(fp, "int %s_classify(const float *input);\n", name);
+}
+
+/* The library's expf approximation, see activation.c */
+static const char expSource[] =
+    "static inline float pecann_exp(float x) {\n"
+    "    x = x < -87.3f ? -87.3f : x;\n"
+    "    x = x > 88.3f ? 88.3f : x;\n"
+    "    float t = x * 1.44269504f;\n"
+    "    int32_t n = (int32_t)(t + (t >= 0 ? 0.5f : -0.5f));\n"
+    "    float fn = (float)n;\n"
+    "    float r = x - fn * 0.693359375f + fn * 2.12194440e-4f;\n"
+    "    float p = 1.9875691500e-4f;\n"
+    "    p = p * r + 1.3981999507e-3f;\n"
+    "    p = p * r + 8.3334519073e-3f;\n"
+    "    p = p * r + 4.1665795894e-2f;\n"
+    "    p = p * r + 1.6666665459e-1f;\n"
+    "    p = p * r + 5.0000001201e-1f;\n"
+    "    p = p * r * r + r + 1.0f;\n"
+    "    int32_t bits = (n + 127) << 23;\n"
+    "    float scale;\n"
+    "    memcpy(&scale, &bits, sizeof(scale));\n"
+    "    return p * scale;\n"
+    "}\n\n";
+
+/* In-place activation of n outputs. Linear layers have none */
+static void emitActivation(FILE *fp, const char *name, enum EActivationFunction af) {
+    assert(af != FN_LINEAR);
+    fprintf(fp, "static inline void %s_%s(float *y, int n) {\n", name, activationName(af));
+    switch (af) {
+        case FN_TANH:
+            fprintf(fp, "    for (int i = 0; i < n; i++) {\n"
+                        "        y[i] = 2 / (1 + pecann_exp(-2 * y[i])) - 1;\n"
+                        "    }\n");
+            break;
+        case FN_RELU:
+            fprintf(fp, "    for (int i = 0; i < n; i++) {\n"
+                        "        y[i] = y[i] > 0 ? y[i] : 0;\n"
+                        "    }\n");
+            break;
+        case FN_SOFTMAX:
+            fprintf(fp, "    float max = y[0], sum = 0;\n"
+                        "    for (int i = 1; i < n; i++) {\n"
+                        "        max = y[i] > max ? y[i] : max;\n"
+                        "    }\n"
+                        "    for (int i = 0; i < n; i++) {\n"
+                        "        y[i] = pecann_exp(y[i] - max);\n"
+                        "        sum += y[i];\n"
+                        "    }\n"
+                        "    sum = 1 / sum;\n"
+                        "    for (int i = 0; i < n; i++) {\n"
+                        "        y[i] *= sum;\n"
+                        "    }\n");
+            break;
+        case FN_SIGMOID:
+        default:
+            fprintf(fp, "    for (int i = 0; i < n; i++) {\n"
+                        "        y[i] = 1 / (1 + pecann_exp(-y[i]));\n"
+                        "    }\n");
+            break;
+    }
+    fprintf(fp, "}\n\n");
+}
+
+/* Transposed, row padded weights and padded biases of layer i */
+static int emitWeights(FILE *fp, Network *net, const char *name, unsigned i) {
+    Matrix w = net->weights[i], b = net->biases[i];
+    unsigned rowsP = PAD(w.rows);
+    fprintf(fp, "static const _Alignas(64) float %s_w%u[%u][%u] = {\n", name, i, w.cols, rowsP);
+    for (unsigned c = 0; c < w.cols; c++) {
+        fprintf(fp, "    {");
+        for (unsigned r = 0; r < rowsP; r++) {
+            fputs(r ? (r % 8 ? ", " : ",\n     ") : "", fp);
+            printFloat(fp, r < w.rows ? get(w, r, c) : 0);
+        }
+        fprintf(fp, "}%s\n", c + 1 < w.cols ? "," : "");
+    }
+    fprintf(fp, "};\n\nstatic const _Alignas(64) float %s_b%u[%u] = {\n    ", name, i, rowsP);
+    for (unsigned r = 0; r < rowsP; r++) {
+        fputs(r ? (r % 8 ? ", " : ",\n    ") : "", fp);
+        printFloat(fp, r < b.rows ? b.data[r] : 0);
+    }
+    return fprintf(fp, "\n};\n\n") < 0 ? -1 : 0;
+}
+
+/* y = W x + b for layer i, over all padded rows */
+static void emitLayer(FILE *fp, Network *net, const char *name, unsigned i) {
+    unsigned cols = net->sizes[i], rowsP = PAD(net->sizes[i + 1]);
+    unsigned blocked = cols / COLUMN_BLOCK * COLUMN_BLOCK;
+    fprintf(fp, "/* Layer %u: %u -> %u */\n", i, cols, net->sizes[i + 1]);
+    fprintf(fp, "static inline void %s_layer%u(const float *restrict x, float *restrict y) {\n", name, i);
+    fprintf(fp, "    for (int r = 0; r < %u; r++) {\n        y[r] = %s_b%u[r];\n    }\n", rowsP, name, i);
+    if (blocked) {
+        fprintf(fp, "    for (int c = 0; c < %u; c += %u) {\n", blocked, COLUMN_BLOCK);
+        for (unsigned k = 0; k < COLUMN_BLOCK; k++) {
+            fprintf(fp, "        const float x%u = x[c + %u];\n", k, k);
+        }
+        fprintf(fp, "        for (int r = 0; r < %u; r++) {\n            y[r] +=", rowsP);
+        for (unsigned k = 0; k < COLUMN_BLOCK; k++) {
+            fprintf(fp, "%s%s_w%u[c + %u][r] * x%u", k ? " + " : " ", name, i, k, k);
+        }
+        fprintf(fp, ";\n        }\n    }\n");
+    }
+    if (blocked < cols) {
+        fprintf(fp, "    for (int c = %u; c < %u; c++) {\n", blocked, cols);
+        fprintf(fp, "        const float xc = x[c];\n");
+        fprintf(fp, "        for (int r = 0; r < %u; r++) {\n", rowsP);
+        fprintf(fp, "            y[r] += %s_w%u[c][r] * xc;\n        }\n    }\n", name, i);
+    }
+    fprintf(fp, "}\n\n");
+}
+
+/*
+ * Body of the forward or classify function: every layer alternates between two stack buffers.
+ * When classifying, an output activation that doesn't change the highest index is skipped.
+ */
+static void emitBody(FILE *fp, Network *net, enum EActivationFunction af, const char *name, bool classify) {
+    unsigned L = net->nLayers - 1, maxP = 0;
+    for (unsigned i = 1; i <= L; i++) {
+        maxP = PAD(net->sizes[i]) > maxP ? PAD(net->sizes[i]) : maxP;
+    }
+    fprintf(fp, "    _Alignas(64) float a[%u], b[%u];\n", maxP, maxP);
+    for (unsigned i = 0; i < L; i++) {
+        const char *x = i == 0 ? "input" : i % 2 ? "a" : "b", *y = i % 2 ? "b" : "a";
+        enum EActivationFunction f = layerActivation(net, i, af);
+        fprintf(fp, "    %s_layer%u(%s, %s);\n", name, i, x, y);
+        if (!(classify && i + 1 == L && preservesOrder(f)) && f != FN_LINEAR) {
+            fprintf(fp, "    %s_%s(%s, %u);\n", name, activationName(f), y, net->sizes[i + 1]);
+        }
+    }
+    const char *out = L % 2 ? "a" : "b";
+    if (classify) {
+        fprintf(fp, "    int best = 0;\n");
+        fprintf(fp, "    for (int i = 1; i < %u; i++) {\n", net->sizes[L]);
+        fprintf(fp, "        best = %s[i] > %s[best] ? i : best;\n    }\n    return best;\n", out, out);
+    } else {
+        fprintf(fp, "    memcpy(output, %s, %u * sizeof(float));\n", out, net->sizes[L]);
+    }
+}
+
+static int emitSource(FILE *fp, Network *net, enum EActivationFunction af, const char *name, const char *header) {
+    unsigned L = net->nLayers - 1;
+    fprintf(fp, "/* Generated by pecann. Do not edit */\n");
+    fprintf(fp, "#include <stdint.h>\n#include <string.h>\n\n#include \"%s\"\n\n", header);
+    bool used[FN_LINEAR + 1] = {false}, needExp = false;
+    for (unsigned i = 0; i < L; i++) {
+        enum EActivationFunction f = layerActivation(net, i, af);
+        used[f] = f != FN_LINEAR;
+        needExp = needExp || f == FN_SIGMOID || f == FN_TANH || f == FN_SOFTMAX;
+    }
+    if (needExp) {
+        fputs(expSource, fp);
+    }
+    for (unsigned f = 0; f <= FN_LINEAR; f++) {
+        if (used[f]) {
+            emitActivation(fp, name, f);
+        }
+    }
+    for (unsigned i = 0; i < L; i++) {
+        if (emitWeights(fp, net, name, i) != 0) {
+            return -1;
+        }
+        emitLayer(fp, net, name, i);
+    }
+    fprintf(fp, "void %s_forward(const float *input, float *output) {\n", name);
+    emitBody(fp, net, af, name, false);
+    fprintf(fp, "}\n\nint %s_classify(const float *input) {\n", name);
+    emitBody(fp, net, af, name, true);
+    return fprintf(fp, "}\n") < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Write a network out as a C header and source that run it for one input at a time, see codegen.h.
+ * Compile the source with optimisations (-O2 or higher, plus -march for the target) to vectorize it.
+ *
+ * @param net The network, with float weights (as read by readNetworkFromFile)
+ * @param af The activation function of the layers the network doesn't specify
+ * @param name Prefix of the generated functions and macros, a valid C identifier
+ * @param headerPath The header to write. The source includes it by its file name
+ * @param sourcePath The source to write
+ * @return 0 on success, -1 otherwise
+ */
+int generateInferenceCode(Network *net, enum EActivationFunction af, const char *name,
+                          const char *headerPath, const char *sourcePath) {
+    assert(net && name && headerPath && sourcePath);
+    assert(net->weights[0].data);
+    if (!validName(name)) {
+        return -1;
+    }
+    FILE *fp = fopen(headerPath, "w");
+    if (!fp) {
+        return -1;
+    }
+    emitHeader(fp, net, name);
+    if (fclose(fp) != 0) {
+        return -1;
+    }
+    fp = fopen(sourcePath, "w");
+    if (!fp) {
+        return -1;
+    }
+    const char *slash = strrchr(headerPath, '/');
+    int err = emitSource(fp, net, af, name, slash ? slash + 1 : headerPath);
+    if (fclose(fp) != 0 || err) {
+        return -1;
+    }
+    return 0;
+}
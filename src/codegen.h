@@ -0,0 +1,22 @@
+#pragma once
+
+#include "network.h"
+
+/*
+ * Generation of fixed-topology inference code.
+ *
+ * A trained network is emitted as a self-contained C header and source with its layer sizes as
+ * compile-time constants and its weights as aligned static arrays, stored transposed and zero
+ * padded so every layer is a run of unrolled, vectorizable multiply-adds over constant bounds.
+ * The generated code makes no allocations, needs no library (not even libm) and is reentrant.
+ *
+ * For a network named "digits" the header declares:
+ *
+ *   #define DIGITS_INPUTS 784
+ *   #define DIGITS_OUTPUTS 10
+ *   void digits_forward(const float *input, float *output);
+ *   int digits_classify(const float *input);
+ */
+
+int generateInferenceCode(Network *net, enum EActivationFunction af, const char *name,
+                          const char *headerPath, const char *sourcePath);
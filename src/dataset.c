@@ -0,0 +1,517 @@
+/**
+ * @brief Binary dataset files and a background mini-batch prefetcher.
+ *
+ * A dataset file holds all inputs in one block followed by all targets in another:
+ *
+ *   DatasetHeader                    64 bytes
+ *   inputs[nExamples][nInputs]       float32 or uint8, padded to a multiple of 64 bytes
+ *   targets[nExamples][nOutputs]     float32
+ *
+ * Files are memory-mapped, so datasets larger than RAM are paged in from disk as they are
+ * read. The prefetcher shuffles in chunks of consecutive examples (shuffled chunk order, then
+ * shuffled examples within each chunk) which keeps reads from such files mostly sequential,
+ * and assembles mini-batches into contiguous buffers on its own thread while training runs.
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataset.h"
+#include "random.h"
+
+#define DATASET_MAGIC "PECANND\n"
+#define DATASET_VERSION 1
+#define DATASET_ALIGNMENT 64
+
+#define ALIGN(n) (((n) + DATASET_ALIGNMENT - 1) & ~(uint64_t)(DATASET_ALIGNMENT - 1))
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a < _b ? _a : _b; })
+
+typedef struct DatasetHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t inputType;
+    uint64_t nExamples;
+    uint32_t nInputs;
+    uint32_t nOutputs;
+    /* Stored inputs are multiplied by this when read */
+    float inputScale;
+    uint32_t reserved0;
+    uint64_t inputOffset;
+    uint64_t outputOffset;
+    uint8_t reserved[8];
+} DatasetHeader;
+
+_Static_assert(sizeof(DatasetHeader) == DATASET_ALIGNMENT, "DatasetHeader must fill one aligned block");
+
+struct DatasetFile {
+    unsigned char *mapping;
+    size_t mappingSize;
+    const DatasetHeader *header;
+    const unsigned char *inputs;
+    const float *outputs;
+};
+
+struct BatchPrefetcher {
+    DatasetFile *ds;
+    size_t batchSize, shuffleChunk;
+    unsigned depth;
+    Rng rng;
+    float *buffer;
+    /* Ring of batches. A slot with size 0 marks the end of an epoch */
+    Batch *slots;
+    unsigned readPos, filled;
+    bool held, stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filledCond, freeCond;
+    /* Producer side: order of the chunks and of the examples within the current chunk */
+    size_t nChunks, chunk, inChunk, chunkLen;
+    size_t *chunkOrder, *order;
+};
+
+static size_t inputTypeSize(enum EDatasetType type) {
+    return type == DATASET_U8 ? 1 : sizeof(float);
+}
+
+/* Pad a block of size bytes that has already been written to the dataset alignment */
+static int writePadding(FILE *fp, size_t size) {
+    static const char zeros[DATASET_ALIGNMENT];
+    size_t pad = ALIGN(size) - size;
+    return fwrite(zeros, 1, pad, fp) == pad ? 0 : -1;
+}
+
+/**
+ * @brief Write examples to a binary dataset file
+ *
+ * @param filename The file name to save to
+ * @param examples The examples to save. They must all have the same input and output sizes
+ * @param nExamples Number of examples
+ * @param type How to store the inputs. DATASET_U8 expects inputs in [0, 1] and stores them in one byte each
+ * @return 0 on success, -1 otherwise
+ */
+int saveDataset(const char *filename, TrainingExample *examples, size_t nExamples, enum EDatasetType type) {
+    assert(filename && examples && nExamples);
+    unsigned nInputs = examples[0].nInputs, nOutputs = examples[0].nOutputs;
+    size_t inputBytes = nExamples * nInputs * inputTypeSize(type);
+    DatasetHeader header = {
+        .magic = DATASET_MAGIC,
+        .version = DATASET_VERSION,
+        .inputType = type,
+        .nExamples = nExamples,
+        .nInputs = nInputs,
+        .nOutputs = nOutputs,
+        .inputScale = type == DATASET_U8 ? 1.0f / 255 : 1,
+        .inputOffset = sizeof(DatasetHeader),
+        .outputOffset = sizeof(DatasetHeader) + ALIGN(inputBytes)
+    };
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        return -1;
+    }
+    int err = fwrite(&header, sizeof(header), 1, fp) != 1;
+    unsigned char bytes[nInputs];
+    for (size_t i = 0; i < nExamples && !err; i++) {
+        assert(examples[i].nInputs == nInputs && examples[i].nOutputs == nOutputs);
+        if (type == DATASET_U8) {
+            for (unsigned j = 0; j < nInputs; j++) {
+                float x = examples[i].input[j];
+                bytes[j] = x <= 0 ? 0 : x >= 1 ? 255 : (unsigned char)(x * 255 + 0.5f);
+            }
+            err = fwrite(bytes, 1, nInputs, fp) != nInputs;
+        } else {
+            err = fwrite(examples[i].input, sizeof(float), nInputs, fp) != nInputs;
+        }
+    }
+    err = err || writePadding(fp, inputBytes);
+    for (size_t i = 0; i < nExamples && !err; i++) {
+        err = fwrite(examples[i].output, sizeof(float), nOutputs, fp) != nOutputs;
+    }
+    if (fclose(fp) != 0 || err) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Check a header against the size of its file, so that every example it describes lies within the file */
+static bool validHeader(const DatasetHeader *h, uint64_t size) {
+    if (memcmp(h->magic, DATASET_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != DATASET_VERSION ||
+        (h->inputType != DATASET_F32 && h->inputType != DATASET_U8) ||
+        h->nExamples == 0 || h->nExamples > size || h->nInputs == 0 || h->nOutputs == 0 ||
+        h->inputOffset % DATASET_ALIGNMENT || h->outputOffset % DATASET_ALIGNMENT ||
+        h->inputOffset < sizeof(DatasetHeader) || h->outputOffset < sizeof(DatasetHeader) ||
+        h->outputOffset > size) {
+        return false;
+    }
+    uint64_t inputBytes, inputEnd, outputBytes;
+    if (__builtin_mul_overflow(h->nExamples, (uint64_t)h->nInputs * inputTypeSize(h->inputType), &inputBytes) ||
+        __builtin_add_overflow(h->inputOffset, inputBytes, &inputEnd) ||
+        __builtin_mul_overflow(h->nExamples, (uint64_t)h->nOutputs * sizeof(float), &outputBytes)) {
+        return false;
+    }
+    return inputEnd <= h->outputOffset && outputBytes <= size - h->outputOffset;
+}
+
+/**
+ * @brief Map a dataset file written by saveDataset
+ *
+ * @param filename the name of the file to open
+ * @return the dataset or NULL on failure
+ */
+DatasetFile *openDataset(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DatasetHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    const DatasetHeader *h = mapping;
+    size_t size = st.st_size;
+    if (!validHeader(h, size)) {
+        munmap(mapping, size);
+        return NULL;
+    }
+    DatasetFile *ds = calloc(1, sizeof(DatasetFile));
+    if (!ds) {
+        munmap(mapping, size);
+        return NULL;
+    }
+    ds->mapping = mapping;
+    ds->mappingSize = size;
+    ds->header = h;
+    ds->inputs = ds->mapping + h->inputOffset;
+    ds->outputs = (const float*)(ds->mapping + h->outputOffset);
+    return ds;
+}
+
+/**
+ * @brief Unmap a dataset. Any prefetcher reading from it must have been freed first
+ */
+void closeDataset(DatasetFile *ds) {
+    if (ds) {
+        munmap(ds->mapping, ds->mappingSize);
+        free(ds);
+    }
+}
+
+size_t datasetSize(DatasetFile *ds) {
+    return ds->header->nExamples;
+}
+
+unsigned datasetInputs(DatasetFile *ds) {
+    return ds->header->nInputs;
+}
+
+unsigned datasetOutputs(DatasetFile *ds) {
+    return ds->header->nOutputs;
+}
+
+/* Decode one example into float rows */
+static void readExample(DatasetFile *ds, size_t i, float *input, float *output) {
+    const DatasetHeader *h = ds->header;
+    if (input) {
+        if (h->inputType == DATASET_U8) {
+            const unsigned char *src = ds->inputs + i * h->nInputs;
+            for (unsigned j = 0; j < h->nInputs; j++) {
+                input[j] = src[j] * h->inputScale;
+            }
+        } else {
+            memcpy(input, ds->inputs + i * h->nInputs * sizeof(float), h->nInputs * sizeof(float));
+        }
+    }
+    if (output) {
+        memcpy(output, ds->outputs + i * h->nOutputs, h->nOutputs * sizeof(float));
+    }
+}
+
+/**
+ * @brief Decode consecutive examples into contiguous float buffers
+ *
+ * @param ds The dataset
+ * @param first Index of the first example
+ * @param n Number of examples
+ * @param inputs Optional: receives n rows of datasetInputs(ds) floats
+ * @param outputs Optional: receives n rows of datasetOutputs(ds) floats
+ */
+void readDatasetExamples(DatasetFile *ds, size_t first, size_t n, float *inputs, float *outputs) {
+    assert(ds && first + n <= ds->header->nExamples);
+    const DatasetHeader *h = ds->header;
+    for (size_t i = 0; i < n; i++) {
+        readExample(ds, first + i,
+                    inputs ? inputs + i * h->nInputs : NULL,
+                    outputs ? outputs + i * h->nOutputs : NULL);
+    }
+}
+
+/**
+ * @brief Allocate an uninitialized in-memory training set
+ *
+ * @param nExamples Number of examples
+ * @param nInputs Inputs per example
+ * @param nOutputs Targets per example
+ * @return TrainingSet* The set or NULL on failure
+ */
+TrainingSet *initTrainingSet(size_t nExamples, unsigned nInputs, unsigned nOutputs) {
+    assert(nExamples && nInputs && nOutputs);
+    TrainingSet *set = calloc(1, sizeof(TrainingSet));
+    if (!set) {
+        return NULL;
+    }
+    set->nExamples = nExamples;
+    set->nInputs = nInputs;
+    set->nOutputs = nOutputs;
+    set->inputs = aligned_alloc(64, ALIGN(nExamples * nInputs * sizeof(float)));
+    set->outputs = aligned_alloc(64, ALIGN(nExamples * nOutputs * sizeof(float)));
+    if (!set->inputs || !set->outputs) {
+        freeTrainingSet(set);
+        return NULL;
+    }
+    return set;
+}
+
+/**
+ * @brief Copy TrainingExamples into a contiguous training set
+ *
+ * @param examples The examples to copy. They must all have the same input and output sizes
+ * @param nExamples Number of examples
+ * @return TrainingSet* The set or NULL on failure
+ */
+TrainingSet *trainingSetFromExamples(TrainingExample *examples, size_t nExamples) {
+    assert(examples && nExamples);
+    unsigned nInputs = examples[0].nInputs, nOutputs = examples[0].nOutputs;
+    TrainingSet *set = initTrainingSet(nExamples, nInputs, nOutputs);
+    if (!set) {
+        return NULL;
+    }
+    for (size_t i = 0; i < nExamples; i++) {
+        assert(examples[i].nInputs == nInputs && examples[i].nOutputs == nOutputs);
+        memcpy(set->inputs + i * nInputs, examples[i].input, nInputs * sizeof(float));
+        memcpy(set->outputs + i * nOutputs, examples[i].output, nOutputs * sizeof(float));
+    }
+    return set;
+}
+
+/**
+ * @brief Load a whole dataset file into memory
+ *
+ * @param ds The dataset
+ * @return TrainingSet* The set or NULL on failure
+ */
+TrainingSet *trainingSetFromDataset(DatasetFile *ds) {
+    assert(ds);
+    TrainingSet *set = initTrainingSet(datasetSize(ds), datasetInputs(ds), datasetOutputs(ds));
+    if (set) {
+        readDatasetExamples(ds, 0, set->nExamples, set->inputs, set->outputs);
+    }
+    return set;
+}
+
+/**
+ * @brief Free a training set and its data
+ */
+void freeTrainingSet(TrainingSet *set) {
+    if (set) {
+        free(set->inputs);
+        free(set->outputs);
+        free(set);
+    }
+}
+
+/* Start on the chunk at position pf->chunk of the chunk order */
+static void beginChunk(BatchPrefetcher *pf) {
+    size_t n = datasetSize(pf->ds);
+    size_t start = pf->chunkOrder[pf->chunk] * pf->shuffleChunk;
+    pf->chunkLen = min(pf->shuffleChunk, n - start);
+    pf->inChunk = 0;
+    for (size_t i = 0; i < pf->chunkLen; i++) {
+        pf->order[i] = start + i;
+    }
+    shuffleIndices(&pf->rng, pf->order, pf->chunkLen);
+    /* Ask the kernel to start reading the chunk in while the previous batches are consumed */
+    const DatasetHeader *h = pf->ds->header;
+    size_t rowBytes = h->nInputs * inputTypeSize(h->inputType);
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = (uintptr_t)(pf->ds->inputs + start * rowBytes) & ~(page - 1);
+    uintptr_t hi = (uintptr_t)(pf->ds->inputs + (start + pf->chunkLen) * rowBytes);
+    madvise((void*)lo, hi - lo, MADV_WILLNEED);
+}
+
+/* Gather the next batch of the epoch into slot. Returns the number of examples, 0 at the end of an epoch */
+static size_t fillBatch(BatchPrefetcher *pf, Batch *slot) {
+    unsigned nIn = datasetInputs(pf->ds), nOut = datasetOutputs(pf->ds);
+    size_t size = 0;
+    while (size < pf->batchSize && pf->chunk < pf->nChunks) {
+        if (pf->inChunk == pf->chunkLen) {
+            if (++pf->chunk == pf->nChunks) {
+                break;
+            }
+            beginChunk(pf);
+            continue;
+        }
+        readExample(pf->ds, pf->order[pf->inChunk++], slot->inputs + size * nIn, slot->outputs + size * nOut);
+        size++;
+    }
+    slot->size = size;
+    return size;
+}
+
+static void beginEpoch(BatchPrefetcher *pf) {
+    for (size_t i = 0; i < pf->nChunks; i++) {
+        pf->chunkOrder[i] = i;
+    }
+    shuffleIndices(&pf->rng, pf->chunkOrder, pf->nChunks);
+    pf->chunk = 0;
+    beginChunk(pf);
+}
+
+static void *prefetchMain(void *arg) {
+    BatchPrefetcher *pf = arg;
+    bool endOfEpoch = true;
+    for (;;) {
+        pthread_mutex_lock(&pf->lock);
+        while (pf->filled + pf->held >= pf->depth && !pf->stop) {
+            pthread_cond_wait(&pf->freeCond, &pf->lock);
+        }
+        if (pf->stop) {
+            pthread_mutex_unlock(&pf->lock);
+            return NULL;
+        }
+        Batch *slot = &pf->slots[(pf->readPos + pf->filled) % pf->depth];
+        pthread_mutex_unlock(&pf->lock);
+
+        if (endOfEpoch) {
+            beginEpoch(pf);
+        }
+        endOfEpoch = fillBatch(pf, slot) == 0;
+
+        pthread_mutex_lock(&pf->lock);
+        pf->filled++;
+        pthread_cond_signal(&pf->filledCond);
+        pthread_mutex_unlock(&pf->lock);
+    }
+}
+
+/**
+ * @brief Start a background thread that assembles shuffled mini-batches of a dataset
+ *
+ * @param ds The dataset to read. It must outlive the prefetcher
+ * @param batchSize Maximum number of examples per batch
+ * @param depth Number of batch buffers, at least 2. Up to depth - 1 batches are prepared ahead
+ * @param shuffleChunk Shuffle granularity in examples, 0 for a full shuffle. Smaller chunks keep
+ *                     reads of datasets larger than RAM sequential at the cost of a weaker shuffle
+ * @param seed Seed for shuffling, 0 to seed from the clock
+ * @return BatchPrefetcher* The prefetcher or NULL on failure
+ */
+BatchPrefetcher *initBatchPrefetcher(DatasetFile *ds, size_t batchSize, unsigned depth, size_t shuffleChunk, unsigned seed) {
+    assert(ds && batchSize && depth >= 2);
+    size_t n = datasetSize(ds);
+    BatchPrefetcher *pf = calloc(1, sizeof(BatchPrefetcher));
+    if (!pf) {
+        return NULL;
+    }
+    pf->ds = ds;
+    pf->batchSize = batchSize;
+    pf->depth = depth;
+    seedRng(&pf->rng, seed ? seed : (uint64_t)time(NULL));
+    pf->shuffleChunk = shuffleChunk && shuffleChunk < n ? shuffleChunk : n;
+    pf->nChunks = (n + pf->shuffleChunk - 1) / pf->shuffleChunk;
+    size_t rowFloats = datasetInputs(ds) + datasetOutputs(ds);
+    pf->buffer = aligned_alloc(64, ALIGN(depth * batchSize * rowFloats * sizeof(float)));
+    pf->slots = calloc(depth, sizeof(Batch));
+    pf->chunkOrder = malloc(pf->nChunks * sizeof(size_t));
+    pf->order = malloc(pf->shuffleChunk * sizeof(size_t));
+    if (!pf->buffer || !pf->slots || !pf->chunkOrder || !pf->order) {
+        free(pf->buffer);
+        free(pf->slots);
+        free(pf->chunkOrder);
+        free(pf->order);
+        free(pf);
+        return NULL;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        pf->slots[i].inputs = pf->buffer + i * batchSize * rowFloats;
+        pf->slots[i].outputs = pf->slots[i].inputs + batchSize * datasetInputs(ds);
+    }
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->filledCond, NULL);
+    pthread_cond_init(&pf->freeCond, NULL);
+    if (pthread_create(&pf->thread, NULL, prefetchMain, pf) != 0) {
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->filledCond);
+        pthread_cond_destroy(&pf->freeCond);
+        free(pf->buffer);
+        free(pf->slots);
+        free(pf->chunkOrder);
+        free(pf->order);
+        free(pf);
+        return NULL;
+    }
+    return pf;
+}
+
+/**
+ * @brief Get the next mini-batch. The batch stays valid until the next call.
+ * Once every example has been returned, NULL is returned to mark the end of the epoch
+ * and the following call starts a new, reshuffled epoch.
+ *
+ * @param pf The prefetcher
+ * @return const Batch* The batch, or NULL at the end of an epoch
+ */
+const Batch *nextBatch(BatchPrefetcher *pf) {
+    assert(pf);
+    pthread_mutex_lock(&pf->lock);
+    if (pf->held) {
+        pf->held = false;
+        pthread_cond_signal(&pf->freeCond);
+    }
+    while (pf->filled == 0) {
+        pthread_cond_wait(&pf->filledCond, &pf->lock);
+    }
+    Batch *batch = &pf->slots[pf->readPos];
+    pf->readPos = (pf->readPos + 1) % pf->depth;
+    pf->filled--;
+    pf->held = true;
+    pthread_mutex_unlock(&pf->lock);
+    return batch->size ? batch : NULL;
+}
+
+/**
+ * @brief Stop the prefetch thread and free the prefetcher. The dataset is not closed
+ */
+void freeBatchPrefetcher(BatchPrefetcher *pf) {
+    if (pf) {
+        pthread_mutex_lock(&pf->lock);
+        pf->stop = true;
+        pthread_cond_signal(&pf->freeCond);
+        pthread_mutex_unlock(&pf->lock);
+        pthread_join(pf->thread, NULL);
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->filledCond);
+        pthread_cond_destroy(&pf->freeCond);
+        free(pf->buffer);
+        free(pf->slots);
+        free(pf->chunkOrder);
+        free(pf->order);
+        free(pf);
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "network.h"
+
+/* Storage type of the inputs in a dataset file. Targets are always float32 */
+enum EDatasetType {
+    DATASET_F32,
+    /* One byte per input, scaled back to [0, 1] when read */
+    DATASET_U8
+};
+
+/* A mini-batch stored as contiguous rows: input i starts at inputs + i * nInputs, target i at outputs + i * nOutputs */
+typedef struct Batch {
+    size_t size;
+    float *inputs, *outputs;
+} Batch;
+
+/* Examples held in memory as two contiguous, 64 byte aligned blocks of rows */
+typedef struct TrainingSet {
+    size_t nExamples;
+    unsigned nInputs, nOutputs;
+    float *inputs, *outputs;
+} TrainingSet;
+
+/* A dataset file mapped into memory, see openDataset */
+typedef struct DatasetFile DatasetFile;
+
+/* Streams shuffled mini-batches of a DatasetFile from a background thread */
+typedef struct BatchPrefetcher BatchPrefetcher;
+
+int saveDataset(const char *filename, TrainingExample *examples, size_t nExamples, enum EDatasetType type);
+DatasetFile *openDataset(const char *filename);
+void closeDataset(DatasetFile *ds);
+size_t datasetSize(DatasetFile *ds);
+unsigned datasetInputs(DatasetFile *ds);
+unsigned datasetOutputs(DatasetFile *ds);
+void readDatasetExamples(DatasetFile *ds, size_t first, size_t n, float *inputs, float *outputs);
+
+TrainingSet *initTrainingSet(size_t nExamples, unsigned nInputs, unsigned nOutputs);
+TrainingSet *trainingSetFromExamples(TrainingExample *examples, size_t nExamples);
+TrainingSet *trainingSetFromDataset(DatasetFile *ds);
+void freeTrainingSet(TrainingSet *set);
+
+BatchPrefetcher *initBatchPrefetcher(DatasetFile *ds, size_t batchSize, unsigned depth, size_t shuffleChunk, unsigned seed);
+const Batch *nextBatch(BatchPrefetcher *pf);
+void freeBatchPrefetcher(BatchPrefetcher *pf);
+void trainNetworkOnSet(
+    Network *net,
+    const TrainingSet *set,
+    const TrainingConfig *config,
+    const TrainingSet *testSet);
+void trainNetworksOnSet(
+    Network **nets,
+    const TrainingConfig *configs,
+    unsigned nModels,
+    const TrainingSet *set,
+    const TrainingSet *testSet,
+    const SweepConfig *sweep,
+    SweepResult *results);
+void trainNetworkFromDataset(
+    Network *net,
+    BatchPrefetcher *stream,
+    const TrainingConfig *config,
+    const TrainingSet *testSet);
@@ -0,0 +1,533 @@
+/**
+ * @brief Ring all-reduce between training processes over sockets or shared memory.
+ *
+ * Setup connects every rank to the next one around the ring over TCP or a Unix socket. Sums run
+ * on a background thread that works through a FIFO of requests, so training can queue a layer's
+ * gradients as soon as backprop has produced them and go on with the next layer meanwhile.
+ *
+ * Each step of the ring sends one chunk to the next rank while receiving another from the
+ * previous rank. Over sockets both directions are non-blocking and driven by one poll loop, and
+ * received bytes are summed into place a piece at a time. Over shared memory every rank has an
+ * inbox of one piece guarded by a pair of process-shared semaphores: a rank writes a piece into
+ * the next rank's inbox, then sums the piece waiting in its own, so the ring moves in lock step
+ * with a single copy per hop. The sockets stay open to notice a peer that died.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "distributed.h"
+#include "socket.h"
+
+#define COMM_MAGIC 0x50434e52u
+/* All-reduce requests that can be queued at once */
+#define COMM_QUEUE 256
+/* Floats per socket receive and per shared memory message */
+#define COMM_PIECE 16384
+/* Interval at which waits on shared memory check that the peers are alive, in milliseconds */
+#define COMM_POLL_MS 100
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a < _b ? _a : _b; })
+
+typedef struct Request {
+    float *data;
+    size_t n;
+} Request;
+
+/* A rank's receive slot in the shared memory segment */
+typedef struct Inbox {
+    sem_t full, empty;
+    _Alignas(64) float data[COMM_PIECE];
+} Inbox;
+
+typedef struct SharedSegment {
+    uint32_t magic, nRanks;
+    Inbox inboxes[];
+} SharedSegment;
+
+/* Sent to the next rank when connecting */
+typedef struct Hello {
+    uint32_t magic, rank, nRanks;
+} Hello;
+
+struct Communicator {
+    unsigned rank, nRanks;
+    int timeoutMs;
+    /* Sockets to the next rank and from the previous one, non-blocking once connected */
+    int next, prev;
+    SharedSegment *shared;
+    size_t sharedSize;
+    /* COMM_PIECE floats receiving the chunks to sum from a socket */
+    float *scratch;
+    /* Queue of requests for the reduction thread: head is the oldest, tail the next free slot */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t queuedCond, doneCond;
+    Request queue[COMM_QUEUE];
+    size_t head, tail;
+    bool started, stop, failed;
+};
+
+static int64_t nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Connect, retrying until the peer listens or the deadline passes */
+static int connectTo(const struct sockaddr_storage *sa, socklen_t saLen, int64_t deadline) {
+    for (;;) {
+        int fd = socket(sa->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, (const struct sockaddr*)sa, saLen) == 0) {
+            return fd;
+        }
+        close(fd);
+        if (nowMs() >= deadline) {
+            return -1;
+        }
+        nanosleep(&(struct timespec){0, 20 * 1000000}, NULL);
+    }
+}
+
+static int acceptFrom(int listener, int64_t deadline) {
+    struct pollfd pfd = {listener, POLLIN, 0};
+    int ready;
+    do {
+        ready = poll(&pfd, 1, (int)(deadline > nowMs() ? deadline - nowMs() : 0));
+    } while (ready < 0 && errno == EINTR);
+    int fd = ready > 0 ? accept(listener, NULL, NULL) : -1;
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/**
+ * @brief Send size bytes to the next rank while receiving recvSize bytes from the previous one
+ *
+ * @param received Receives the bytes, or has them added to it as floats when add is set
+ * @return 0 on success, -1 if a peer failed or timed out
+ */
+static int exchangeSockets(Communicator *c, const void *data, size_t size, void *received, size_t recvSize, bool add) {
+    const char *out = data;
+    char *in = received, *scratch = (char*)c->scratch;
+    /* Bytes received, and received bytes in scratch not yet summed because they don't make a whole float */
+    size_t got = 0, pending = 0;
+    while (size || got < recvSize) {
+        /* A direction that is done is left out, so a neighbour that finished and hung up is no error */
+        struct pollfd fds[2] = {
+            {size ? c->next : -1, POLLOUT, 0},
+            {got < recvSize ? c->prev : -1, POLLIN, 0}
+        };
+        int ready = poll(fds, 2, c->timeoutMs);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0 || (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) || (fds[1].revents & POLLNVAL)) {
+            return -1;
+        }
+        if (fds[0].revents & POLLOUT) {
+            ssize_t k = send(c->next, out, size, MSG_NOSIGNAL);
+            if (k < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+            if (k > 0) {
+                out += k;
+                size -= k;
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t k = add ? recv(c->prev, scratch + pending, min(COMM_PIECE * sizeof(float) - pending, recvSize - got), 0)
+                            : recv(c->prev, in + got, recvSize - got, 0);
+            if (k == 0 || (k < 0 && errno != EAGAIN && errno != EINTR)) {
+                return -1;
+            }
+            if (k > 0 && add) {
+                float *dst = (float*)(in + got - pending);
+                pending += k;
+                size_t whole = pending / sizeof(float);
+                for (size_t i = 0; i < whole; i++) {
+                    dst[i] += c->scratch[i];
+                }
+                memmove(scratch, scratch + whole * sizeof(float), pending - whole * sizeof(float));
+                pending -= whole * sizeof(float);
+            }
+            got += k > 0 ? (size_t)k : 0;
+        }
+    }
+    return 0;
+}
+
+/* Whether both neighbours still have their sockets open. Neither sends anything while the data goes through shared memory */
+static bool peersAlive(Communicator *c) {
+    int fds[2] = {c->next, c->prev};
+    for (unsigned i = 0; i < 2; i++) {
+        char byte;
+        ssize_t k = recv(fds[i], &byte, 1, MSG_PEEK);
+        if (k == 0 || (k < 0 && errno != EAGAIN && errno != EINTR)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Wait on a shared memory semaphore, giving up if a neighbour died or on timeout */
+static int waitShared(Communicator *c, sem_t *sem) {
+    int64_t deadline = nowMs() + c->timeoutMs;
+    for (;;) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += COMM_POLL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (sem_timedwait(sem, &ts) == 0) {
+            return 0;
+        }
+        if ((errno != ETIMEDOUT && errno != EINTR) || !peersAlive(c) || nowMs() >= deadline) {
+            return -1;
+        }
+    }
+}
+
+/* exchangeSockets for floats through the inboxes of the shared memory segment */
+static int exchangeShared(Communicator *c, const float *data, size_t n, float *received, size_t recvN, bool add) {
+    Inbox *out = &c->shared->inboxes[(c->rank + 1) % c->nRanks], *in = &c->shared->inboxes[c->rank];
+    /* The next rank receives exactly what this one sends, so both sides agree on the pieces */
+    for (size_t a = 0; a < n || a < recvN; a += COMM_PIECE) {
+        if (a < n) {
+            if (waitShared(c, &out->empty) != 0) {
+                return -1;
+            }
+            memcpy(out->data, data + a, min((size_t)COMM_PIECE, n - a) * sizeof(float));
+            sem_post(&out->full);
+        }
+        if (a < recvN) {
+            if (waitShared(c, &in->full) != 0) {
+                return -1;
+            }
+            size_t m = min((size_t)COMM_PIECE, recvN - a);
+            if (add) {
+                for (size_t i = 0; i < m; i++) {
+                    received[a + i] += in->data[i];
+                }
+            } else {
+                memcpy(received + a, in->data, m * sizeof(float));
+            }
+            sem_post(&in->empty);
+        }
+    }
+    return 0;
+}
+
+static int exchange(Communicator *c, const float *data, size_t n, float *received, size_t recvN, bool add) {
+    if (c->shared) {
+        return exchangeShared(c, data, n, received, recvN, add);
+    }
+    return exchangeSockets(c, data, n * sizeof(float), received, recvN * sizeof(float), add);
+}
+
+/*
+ * Sum n floats over all ranks. Chunk i is data[n * i / N, n * (i + 1) / N). In step k of the
+ * reduce-scatter rank r passes on chunk r - k, to which it has added its own values, so after
+ * N - 1 steps it holds the complete sum of chunk r + 1, which the all-gather then passes around.
+ */
+static int ringAllReduce(Communicator *c, float *data, size_t n) {
+    unsigned N = c->nRanks, r = c->rank;
+    #define CHUNK(i) data + n * (i) / N, n * ((i) + 1) / N - n * (i) / N
+    for (unsigned k = 0; k + 1 < N; k++) {
+        if (exchange(c, CHUNK((r + N - k) % N), CHUNK((r + 2 * N - k - 1) % N), true) != 0) {
+            return -1;
+        }
+    }
+    for (unsigned k = 0; k + 1 < N; k++) {
+        if (exchange(c, CHUNK((r + 1 + N - k) % N), CHUNK((r + N - k) % N), false) != 0) {
+            return -1;
+        }
+    }
+    #undef CHUNK
+    return 0;
+}
+
+static void *reductionMain(void *arg) {
+    Communicator *c = arg;
+    pthread_mutex_lock(&c->mutex);
+    for (;;) {
+        while (c->head == c->tail && !c->stop) {
+            pthread_cond_wait(&c->queuedCond, &c->mutex);
+        }
+        if (c->head == c->tail) {
+            break;
+        }
+        Request request = c->queue[c->head % COMM_QUEUE];
+        bool failed = c->failed;
+        pthread_mutex_unlock(&c->mutex);
+        /* After a failure the sums are skipped; the waiter gets the error */
+        int err = failed ? -1 : ringAllReduce(c, request.data, request.n);
+        pthread_mutex_lock(&c->mutex);
+        c->failed = c->failed || err != 0;
+        c->head++;
+        pthread_cond_broadcast(&c->doneCond);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return NULL;
+}
+
+/* Map the shared memory segment, created by rank 0 and opened by the others in turn around the ring */
+static int attachShared(Communicator *c, const char *name) {
+    c->sharedSize = sizeof(SharedSegment) + c->nRanks * sizeof(Inbox);
+    char token = 0;
+    int fd;
+    if (c->rank == 0) {
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0 && ftruncate(fd, c->sharedSize) != 0) {
+            close(fd);
+            shm_unlink(name);
+            fd = -1;
+        }
+    } else {
+        if (exchangeSockets(c, NULL, 0, &token, 1, false) != 0) {
+            return -1;
+        }
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    void *segment = mmap(NULL, c->sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        if (c->rank == 0) {
+            shm_unlink(name);
+        }
+        return -1;
+    }
+    c->shared = segment;
+    if (c->rank == 0) {
+        c->shared->magic = COMM_MAGIC;
+        c->shared->nRanks = c->nRanks;
+        for (unsigned i = 0; i < c->nRanks; i++) {
+            sem_init(&c->shared->inboxes[i].full, 1, 0);
+            sem_init(&c->shared->inboxes[i].empty, 1, 1);
+        }
+    } else if (c->shared->magic != COMM_MAGIC || c->shared->nRanks != c->nRanks) {
+        return -1;
+    }
+    /* Once the token is back at rank 0 every rank has the segment mapped and the name can go */
+    int err = exchangeSockets(c, &token, 1, NULL, 0, false);
+    if (c->rank == 0) {
+        err = err || exchangeSockets(c, NULL, 0, &token, 1, false);
+        shm_unlink(name);
+    }
+    return err;
+}
+
+/**
+ * @brief Join a distributed training run. Every rank calls this with the same addresses, in any
+ * order; it returns once the ring is connected. The communicator is then passed to training in
+ * TrainingConfig.communicator. Only one thread may use a communicator.
+ *
+ * @param config This rank, the addresses of all ranks and the transport
+ * @return The communicator or NULL if the ring could not be set up in time
+ */
+Communicator *initCommunicator(const DistributedConfig *config) {
+    assert(config && config->rank < config->nRanks && (config->nRanks == 1 || config->addresses));
+    Communicator *c = calloc(1, sizeof(Communicator));
+    if (!c) {
+        return NULL;
+    }
+    c->rank = config->rank;
+    c->nRanks = config->nRanks;
+    c->timeoutMs = (config->timeout ? config->timeout : 60) * 1000;
+    c->next = c->prev = -1;
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->queuedCond, NULL);
+    pthread_cond_init(&c->doneCond, NULL);
+    if (c->nRanks == 1) {
+        return c;
+    }
+    struct sockaddr_storage self, next;
+    socklen_t selfLen = parseSocketAddress(config->addresses[c->rank], &self);
+    socklen_t nextLen = parseSocketAddress(config->addresses[(c->rank + 1) % c->nRanks], &next);
+    int listener = selfLen && nextLen ? listenOnAddress(&self, selfLen, 1) : -1;
+    if (listener < 0) {
+        freeCommunicator(c);
+        return NULL;
+    }
+    int64_t deadline = nowMs() + c->timeoutMs;
+    c->next = connectTo(&next, nextLen, deadline);
+    c->prev = c->next >= 0 ? acceptFrom(listener, deadline) : -1;
+    close(listener);
+    unlinkSocketAddress(&self);
+    c->scratch = aligned_alloc(64, COMM_PIECE * sizeof(float));
+    if (c->prev < 0 || !c->scratch) {
+        freeCommunicator(c);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(c->next, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(c->prev, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(c->next, F_SETFL, fcntl(c->next, F_GETFL) | O_NONBLOCK);
+    fcntl(c->prev, F_SETFL, fcntl(c->prev, F_GETFL) | O_NONBLOCK);
+
+    Hello hello = {COMM_MAGIC, c->rank, c->nRanks}, previous;
+    if (exchangeSockets(c, &hello, sizeof(hello), &previous, sizeof(previous), false) != 0 ||
+        previous.magic != COMM_MAGIC || previous.nRanks != c->nRanks ||
+        previous.rank != (c->rank + c->nRanks - 1) % c->nRanks ||
+        (config->sharedMemory && attachShared(c, config->sharedMemory) != 0) ||
+        pthread_create(&c->thread, NULL, reductionMain, c) != 0) {
+        freeCommunicator(c);
+        return NULL;
+    }
+    c->started = true;
+    return c;
+}
+
+/**
+ * @brief Leave the distributed run, after the queued sums have finished
+ *
+ * @param comm The communicator to free
+ */
+void freeCommunicator(Communicator *comm) {
+    if (comm) {
+        if (comm->started) {
+            pthread_mutex_lock(&comm->mutex);
+            comm->stop = true;
+            pthread_cond_signal(&comm->queuedCond);
+            pthread_mutex_unlock(&comm->mutex);
+            pthread_join(comm->thread, NULL);
+        }
+        if (comm->shared) {
+            munmap(comm->shared, comm->sharedSize);
+        }
+        if (comm->next >= 0) {
+            close(comm->next);
+        }
+        if (comm->prev >= 0) {
+            close(comm->prev);
+        }
+        free(comm->scratch);
+        pthread_mutex_destroy(&comm->mutex);
+        pthread_cond_destroy(&comm->queuedCond);
+        pthread_cond_destroy(&comm->doneCond);
+        free(comm);
+    }
+}
+
+unsigned communicatorRank(const Communicator *comm) {
+    return comm->rank;
+}
+
+unsigned communicatorSize(const Communicator *comm) {
+    return comm->nRanks;
+}
+
+/**
+ * @brief Whether a sum failed because a peer died, hung up or timed out. The run can't continue then
+ */
+bool communicatorFailed(const Communicator *comm) {
+    Communicator *c = (Communicator*)comm;
+    pthread_mutex_lock(&c->mutex);
+    bool failed = c->failed;
+    pthread_mutex_unlock(&c->mutex);
+    return failed;
+}
+
+/**
+ * @brief Queue a sum of n floats over all ranks, done in place in the background. Every rank must
+ * queue the same sums in the same order. data must not be touched until allReduceWait returns
+ *
+ * @param comm The communicator
+ * @param data The floats to sum
+ * @param n Number of floats, the same on every rank
+ */
+void allReduceAsync(Communicator *comm, float *data, size_t n) {
+    assert(comm && (data || !n));
+    if (comm->nRanks == 1) {
+        return;
+    }
+    pthread_mutex_lock(&comm->mutex);
+    while (comm->tail - comm->head == COMM_QUEUE) {
+        pthread_cond_wait(&comm->doneCond, &comm->mutex);
+    }
+    comm->queue[comm->tail++ % COMM_QUEUE] = (Request){data, n};
+    pthread_cond_signal(&comm->queuedCond);
+    pthread_mutex_unlock(&comm->mutex);
+}
+
+/**
+ * @brief Wait for all queued sums
+ *
+ * @param comm The communicator
+ * @return 0 on success, -1 if the communicator failed
+ */
+int allReduceWait(Communicator *comm) {
+    assert(comm);
+    pthread_mutex_lock(&comm->mutex);
+    while (comm->head != comm->tail) {
+        pthread_cond_wait(&comm->doneCond, &comm->mutex);
+    }
+    bool failed = comm->failed;
+    pthread_mutex_unlock(&comm->mutex);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Sum n floats over all ranks in place, waiting for any queued sums first
+ *
+ * @return 0 on success, -1 if the communicator failed
+ */
+int allReduce(Communicator *comm, float *data, size_t n) {
+    allReduceAsync(comm, data, n);
+    return allReduceWait(comm);
+}
+
+/**
+ * @brief Gather size bytes from every rank, in rank order, over the sockets
+ *
+ * @param comm The communicator
+ * @param local This rank's bytes
+ * @param size Bytes per rank, the same on every rank
+ * @param all Receives nRanks * size bytes
+ * @return 0 on success, -1 if the communicator failed
+ */
+int allGather(Communicator *comm, const void *local, size_t size, void *all) {
+    assert(comm && local && all);
+    unsigned N = comm->nRanks, r = comm->rank;
+    char *slots = all;
+    memcpy(slots + r * size, local, size);
+    if (allReduceWait(comm) != 0) {
+        return -1;
+    }
+    /* Step k passes on the slot of rank r - k, received in the step before */
+    for (unsigned k = 0; k + 1 < N; k++) {
+        if (exchangeSockets(comm, slots + (r + N - k) % N * size, size,
+                            slots + (r + N - k - 1) % N * size, size, false) != 0) {
+            pthread_mutex_lock(&comm->mutex);
+            comm->failed = true;
+            pthread_mutex_unlock(&comm->mutex);
+            return -1;
+        }
+    }
+    return 0;
+}
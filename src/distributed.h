@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "network.h"
+
+/*
+ * Communication between the processes of a distributed training run, see TrainingConfig.communicator.
+ *
+ * The processes ("ranks") form a ring: every rank listens on its own address, connects to the next
+ * rank and accepts the previous one. Sums are ring all-reduces: each rank's buffer is cut into one
+ * chunk per rank, the chunks travel once around the ring being summed (reduce-scatter) and once
+ * more being copied (all-gather), so every rank sends and receives about twice the buffer whatever
+ * the number of ranks. Every rank ends up with bit-identical sums.
+ *
+ * When all ranks run on one host, the bulk data can go through a shared memory segment instead of
+ * the sockets, which are then only used to set up and to notice a dead peer.
+ */
+
+typedef struct DistributedConfig {
+    /* This process's rank in [0, nRanks) */
+    unsigned rank, nRanks;
+    /* Address every rank listens on, indexed by rank: "unix:PATH" or "tcp:HOST:PORT" */
+    const char *const *addresses;
+    /* Optional: name of a shared memory segment ("/name") to move the data through instead of the
+       sockets. The ranks must then all be on this host */
+    const char *sharedMemory;
+    /* Seconds to wait for a peer to connect or to make progress before giving up, 0 for 60 */
+    unsigned timeout;
+} DistributedConfig;
+
+Communicator *initCommunicator(const DistributedConfig *config);
+void freeCommunicator(Communicator *comm);
+unsigned communicatorRank(const Communicator *comm);
+unsigned communicatorSize(const Communicator *comm);
+bool communicatorFailed(const Communicator *comm);
+void allReduceAsync(Communicator *comm, float *data, size_t n);
+int allReduceWait(Communicator *comm);
+int allReduce(Communicator *comm, float *data, size_t n);
+int allGather(Communicator *comm, const void *local, size_t size, void *all);
@@ -0,0 +1,575 @@
+/**
+ * @brief Cache-blocked, register-tiled single precision GEMM and GEMV.
+ *
+ * The GEMM follows the usual Goto/BLIS layout: B is packed into KC x NC panels
+ * that stay resident in L2, A is packed into MC x KC panels that stay in L1/L2,
+ * and a micro-kernel computes an MR x NR tile of C entirely in registers.
+ * Transposed operands are handled by the packing routines, which read A and B through
+ * row and column strides, so A^T * B and A * B^T cost no extra pass over memory.
+ * The micro-kernel and GEMV kernels are chosen once at runtime based on the CPU
+ * (AVX-512, AVX2+FMA or a portable scalar fallback). The choice can be forced
+ * with the PECANN_ISA environment variable ("avx512", "avx2" or "scalar").
+ */
+#include <assert.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gemm.h"
+#include "profile.h"
+
+/* Cache blocking parameters. MC and NC must be multiples of every kernel's MR and NR */
+#define KC 256
+#define MC 96
+#define NC 1024
+#define MAX_MR 6
+#define MAX_NR 32
+
+/* Below this many multiply-adds packing costs more than it saves */
+#define SMALL_GEMM (32 * 32 * 32)
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a < _b ? _a : _b; })
+
+/*
+ * C[MR x NR] += A_panel * B_panel over a depth of kc. B is always a packed panel; element (i, p)
+ * of A is read from a[i * rsa + p * csa] so that the kernel can run on packed (rsa = 1, csa = MR)
+ * or unpacked row-major (rsa = lda, csa = 1) A.
+ */
+typedef void (*MicroKernel)(size_t kc, const float *a, size_t rsa, size_t csa,
+                            const float *b, float *c, size_t ldc);
+typedef void (*GemvKernel)(size_t m, size_t n, float alpha, const float *a, size_t lda,
+                           const float *x, float beta, float *y);
+
+/* C += alpha * op(A) * op(B) without packing, for tiny products and rank-1 updates. Strides as in packA and packB */
+typedef void (*SmallKernel)(size_t m, size_t n, size_t k, float alpha, const float *a, size_t rsa, size_t csa,
+                            const float *b, size_t rsb, size_t csb, float *c, size_t ldc);
+
+typedef struct KernelSet {
+    const char *name;
+    size_t mr, nr;
+    MicroKernel gemm;
+    SmallKernel small;
+    /* y = alpha * A * x + beta * y and y = alpha * A^T * x + beta * y */
+    GemvKernel gemv, gemvT;
+} KernelSet;
+
+/*
+ * Loops shared by every ISA. They are inlined into each ISA's wrapper below so that the
+ * compiler vectorizes them for that ISA.
+ */
+
+static inline __attribute__((always_inline))
+void smallGemm(size_t m, size_t n, size_t k, float alpha, const float *a, size_t rsa, size_t csa,
+               const float *b, size_t rsb, size_t csb, float *c, size_t ldc) {
+    for (size_t i = 0; i < m; i++) {
+        float *crow = c + i * ldc;
+        if (csb == 1) {
+            /* i-k-j order streams rows of B and C */
+            for (size_t p = 0; p < k; p++) {
+                float aip = alpha * a[i * rsa + p * csa];
+                const float *brow = b + p * rsb;
+                for (size_t j = 0; j < n; j++) {
+                    crow[j] += aip * brow[j];
+                }
+            }
+        } else {
+            /* Columns of op(B) are contiguous rows of B: one dot product per element */
+            for (size_t j = 0; j < n; j++) {
+                const float *bcol = b + j * csb;
+                float dot = 0;
+                for (size_t p = 0; p < k; p++) {
+                    dot += a[i * rsa + p * csa] * bcol[p];
+                }
+                crow[j] += alpha * dot;
+            }
+        }
+    }
+}
+
+/* y = alpha * A^T * x + beta * y for an m x n A, streaming rows of A into y four at a time */
+static inline __attribute__((always_inline))
+void gemvTransposed(size_t m, size_t n, float alpha, const float *a, size_t lda,
+                    const float *x, float beta, float *y) {
+    for (size_t j = 0; j < n; j++) {
+        y[j] = beta == 0 ? 0 : beta * y[j];
+    }
+    size_t i = 0;
+    for (; i + 4 <= m; i += 4) {
+        const float *r0 = a + i * lda, *r1 = r0 + lda, *r2 = r1 + lda, *r3 = r2 + lda;
+        float x0 = alpha * x[i], x1 = alpha * x[i + 1], x2 = alpha * x[i + 2], x3 = alpha * x[i + 3];
+        for (size_t j = 0; j < n; j++) {
+            y[j] += x0 * r0[j] + x1 * r1[j] + x2 * r2[j] + x3 * r3[j];
+        }
+    }
+    for (; i < m; i++) {
+        const float *row = a + i * lda;
+        float xi = alpha * x[i];
+        for (size_t j = 0; j < n; j++) {
+            y[j] += xi * row[j];
+        }
+    }
+}
+
+/* Scalar kernels. Written so that the compiler can auto-vectorize them for the baseline ISA. */
+
+static void kernelScalar(size_t kc, const float *a, size_t rsa, size_t csa,
+                         const float *b, float *c, size_t ldc) {
+    float acc[4][8] = {{0}};
+    for (size_t p = 0; p < kc; p++) {
+        for (unsigned i = 0; i < 4; i++) {
+            for (unsigned j = 0; j < 8; j++) {
+                acc[i][j] += a[i * rsa] * b[j];
+            }
+        }
+        a += csa;
+        b += 8;
+    }
+    for (unsigned i = 0; i < 4; i++) {
+        for (unsigned j = 0; j < 8; j++) {
+            c[i * ldc + j] += acc[i][j];
+        }
+    }
+}
+
+static void gemvScalar(size_t m, size_t n, float alpha, const float *a, size_t lda,
+                       const float *x, float beta, float *y) {
+    for (size_t i = 0; i < m; i++) {
+        const float *row = a + i * lda;
+        float dot = 0;
+        for (size_t j = 0; j < n; j++) {
+            dot += row[j] * x[j];
+        }
+        y[i] = alpha * dot + (beta == 0 ? 0 : beta * y[i]);
+    }
+}
+
+static void smallScalar(size_t m, size_t n, size_t k, float alpha, const float *a, size_t rsa, size_t csa,
+                        const float *b, size_t rsb, size_t csb, float *c, size_t ldc) {
+    smallGemm(m, n, k, alpha, a, rsa, csa, b, rsb, csb, c, ldc);
+}
+
+static void gemvTScalar(size_t m, size_t n, float alpha, const float *a, size_t lda,
+                        const float *x, float beta, float *y) {
+    gemvTransposed(m, n, alpha, a, lda, x, beta, y);
+}
+
+/* AVX2 + FMA kernels */
+
+__attribute__((target("avx2,fma")))
+static inline float hsum256(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static void kernelAvx2(size_t kc, const float *a, size_t rsa, size_t csa,
+                       const float *b, float *c, size_t ldc) {
+    __m256 c0[6], c1[6];
+    #pragma GCC unroll 6
+    for (unsigned i = 0; i < 6; i++) {
+        c0[i] = _mm256_setzero_ps();
+        c1[i] = _mm256_setzero_ps();
+    }
+    for (size_t p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        #pragma GCC unroll 6
+        for (unsigned i = 0; i < 6; i++) {
+            __m256 ai = _mm256_broadcast_ss(a + i * rsa);
+            c0[i] = _mm256_fmadd_ps(ai, b0, c0[i]);
+            c1[i] = _mm256_fmadd_ps(ai, b1, c1[i]);
+        }
+        a += csa;
+        b += 16;
+    }
+    #pragma GCC unroll 6
+    for (unsigned i = 0; i < 6; i++) {
+        float *row = c + i * ldc;
+        _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), c0[i]));
+        _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), c1[i]));
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void gemvAvx2(size_t m, size_t n, float alpha, const float *a, size_t lda,
+                     const float *x, float beta, float *y) {
+    size_t i = 0;
+    for (; i + 4 <= m; i += 4) {
+        const float *r0 = a + i * lda, *r1 = r0 + lda, *r2 = r1 + lda, *r3 = r2 + lda;
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        size_t j = 0;
+        for (; j + 8 <= n; j += 8) {
+            __m256 xv = _mm256_loadu_ps(x + j);
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(r0 + j), xv, s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(r1 + j), xv, s1);
+            s2 = _mm256_fmadd_ps(_mm256_loadu_ps(r2 + j), xv, s2);
+            s3 = _mm256_fmadd_ps(_mm256_loadu_ps(r3 + j), xv, s3);
+        }
+        float d[4] = {hsum256(s0), hsum256(s1), hsum256(s2), hsum256(s3)};
+        for (; j < n; j++) {
+            d[0] += r0[j] * x[j];
+            d[1] += r1[j] * x[j];
+            d[2] += r2[j] * x[j];
+            d[3] += r3[j] * x[j];
+        }
+        for (unsigned q = 0; q < 4; q++) {
+            y[i + q] = alpha * d[q] + (beta == 0 ? 0 : beta * y[i + q]);
+        }
+    }
+    for (; i < m; i++) {
+        const float *row = a + i * lda;
+        __m256 s = _mm256_setzero_ps();
+        size_t j = 0;
+        for (; j + 8 <= n; j += 8) {
+            s = _mm256_fmadd_ps(_mm256_loadu_ps(row + j), _mm256_loadu_ps(x + j), s);
+        }
+        float dot = hsum256(s);
+        for (; j < n; j++) {
+            dot += row[j] * x[j];
+        }
+        y[i] = alpha * dot + (beta == 0 ? 0 : beta * y[i]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void smallAvx2(size_t m, size_t n, size_t k, float alpha, const float *a, size_t rsa, size_t csa,
+                      const float *b, size_t rsb, size_t csb, float *c, size_t ldc) {
+    smallGemm(m, n, k, alpha, a, rsa, csa, b, rsb, csb, c, ldc);
+}
+
+__attribute__((target("avx2,fma")))
+static void gemvTAvx2(size_t m, size_t n, float alpha, const float *a, size_t lda,
+                      const float *x, float beta, float *y) {
+    gemvTransposed(m, n, alpha, a, lda, x, beta, y);
+}
+
+/* AVX-512 kernels */
+
+__attribute__((target("avx512f")))
+static void kernelAvx512(size_t kc, const float *a, size_t rsa, size_t csa,
+                         const float *b, float *c, size_t ldc) {
+    __m512 c0[6], c1[6];
+    #pragma GCC unroll 6
+    for (unsigned i = 0; i < 6; i++) {
+        c0[i] = _mm512_setzero_ps();
+        c1[i] = _mm512_setzero_ps();
+    }
+    for (size_t p = 0; p < kc; p++) {
+        __m512 b0 = _mm512_load_ps(b);
+        __m512 b1 = _mm512_load_ps(b + 16);
+        #pragma GCC unroll 6
+        for (unsigned i = 0; i < 6; i++) {
+            __m512 ai = _mm512_set1_ps(a[i * rsa]);
+            c0[i] = _mm512_fmadd_ps(ai, b0, c0[i]);
+            c1[i] = _mm512_fmadd_ps(ai, b1, c1[i]);
+        }
+        a += csa;
+        b += 32;
+    }
+    #pragma GCC unroll 6
+    for (unsigned i = 0; i < 6; i++) {
+        float *row = c + i * ldc;
+        _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), c0[i]));
+        _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), c1[i]));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void gemvAvx512(size_t m, size_t n, float alpha, const float *a, size_t lda,
+                       const float *x, float beta, float *y) {
+    __mmask16 tail = (__mmask16)((1u << (n % 16)) - 1);
+    size_t nFull = n - n % 16;
+    size_t i = 0;
+    for (; i + 4 <= m; i += 4) {
+        const float *r0 = a + i * lda, *r1 = r0 + lda, *r2 = r1 + lda, *r3 = r2 + lda;
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        for (size_t j = 0; j < nFull; j += 16) {
+            __m512 xv = _mm512_loadu_ps(x + j);
+            s0 = _mm512_fmadd_ps(_mm512_loadu_ps(r0 + j), xv, s0);
+            s1 = _mm512_fmadd_ps(_mm512_loadu_ps(r1 + j), xv, s1);
+            s2 = _mm512_fmadd_ps(_mm512_loadu_ps(r2 + j), xv, s2);
+            s3 = _mm512_fmadd_ps(_mm512_loadu_ps(r3 + j), xv, s3);
+        }
+        if (tail) {
+            __m512 xv = _mm512_maskz_loadu_ps(tail, x + nFull);
+            s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, r0 + nFull), xv, s0);
+            s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, r1 + nFull), xv, s1);
+            s2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, r2 + nFull), xv, s2);
+            s3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, r3 + nFull), xv, s3);
+        }
+        float d[4] = {_mm512_reduce_add_ps(s0), _mm512_reduce_add_ps(s1),
+                      _mm512_reduce_add_ps(s2), _mm512_reduce_add_ps(s3)};
+        for (unsigned q = 0; q < 4; q++) {
+            y[i + q] = alpha * d[q] + (beta == 0 ? 0 : beta * y[i + q]);
+        }
+    }
+    for (; i < m; i++) {
+        const float *row = a + i * lda;
+        __m512 s = _mm512_setzero_ps();
+        for (size_t j = 0; j < nFull; j += 16) {
+            s = _mm512_fmadd_ps(_mm512_loadu_ps(row + j), _mm512_loadu_ps(x + j), s);
+        }
+        if (tail) {
+            s = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, row + nFull),
+                                _mm512_maskz_loadu_ps(tail, x + nFull), s);
+        }
+        y[i] = alpha * _mm512_reduce_add_ps(s) + (beta == 0 ? 0 : beta * y[i]);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void smallAvx512(size_t m, size_t n, size_t k, float alpha, const float *a, size_t rsa, size_t csa,
+                        const float *b, size_t rsb, size_t csb, float *c, size_t ldc) {
+    smallGemm(m, n, k, alpha, a, rsa, csa, b, rsb, csb, c, ldc);
+}
+
+__attribute__((target("avx512f")))
+static void gemvTAvx512(size_t m, size_t n, float alpha, const float *a, size_t lda,
+                        const float *x, float beta, float *y) {
+    gemvTransposed(m, n, alpha, a, lda, x, beta, y);
+}
+
+static const KernelSet scalarKernels = {"scalar", 4, 8, kernelScalar, smallScalar, gemvScalar, gemvTScalar};
+static const KernelSet avx2Kernels = {"avx2", 6, 16, kernelAvx2, smallAvx2, gemvAvx2, gemvTAvx2};
+static const KernelSet avx512Kernels = {"avx512", 6, 32, kernelAvx512, smallAvx512, gemvAvx512, gemvTAvx512};
+
+static const KernelSet *selectedKernels;
+static pthread_once_t selectOnce = PTHREAD_ONCE_INIT;
+
+static void selectKernels(void) {
+    __builtin_cpu_init();
+    bool hasAvx512 = __builtin_cpu_supports("avx512f");
+    bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    const char *isa = getenv("PECANN_ISA");
+    if (isa && strcmp(isa, "scalar") == 0) {
+        hasAvx512 = hasAvx2 = false;
+    } else if (isa && strcmp(isa, "avx2") == 0) {
+        hasAvx512 = false;
+    }
+    if (hasAvx512) {
+        selectedKernels = &avx512Kernels;
+    } else if (hasAvx2) {
+        selectedKernels = &avx2Kernels;
+    } else {
+        selectedKernels = &scalarKernels;
+    }
+}
+
+static const KernelSet *kernels(void) {
+    pthread_once(&selectOnce, selectKernels);
+    return selectedKernels;
+}
+
+const char *gemmKernelName(void) {
+    return kernels()->name;
+}
+
+/* Packing buffers are allocated once per thread and released when the thread exits */
+static pthread_key_t bufferKey;
+static pthread_once_t bufferOnce = PTHREAD_ONCE_INIT;
+
+static void createBufferKey(void) {
+    pthread_key_create(&bufferKey, free);
+}
+
+static float *packBuffer(void) {
+    pthread_once(&bufferOnce, createBufferKey);
+    float *buf = pthread_getspecific(bufferKey);
+    if (!buf) {
+        buf = aligned_alloc(64, (MC * KC + KC * NC) * sizeof(float));
+        assert(buf);
+        PROFILE_ALLOCATION();
+        pthread_setspecific(bufferKey, buf);
+    }
+    return buf;
+}
+
+/*
+ * Pack an mc x kc block of A into row panels of height mr, scaling by alpha and zero padding.
+ * Element (i, p) of the block is a[i * rsa + p * csa].
+ */
+static void packA(size_t mr, size_t mc, size_t kc, float alpha, const float *a, size_t rsa, size_t csa, float *pa) {
+    for (size_t i0 = 0; i0 < mc; i0 += mr) {
+        size_t mb = min(mr, mc - i0);
+        const float *panel = a + i0 * rsa;
+        for (size_t p = 0; p < kc; p++) {
+            size_t i = 0;
+            for (; i < mb; i++) {
+                *pa++ = alpha * panel[i * rsa + p * csa];
+            }
+            for (; i < mr; i++) {
+                *pa++ = 0;
+            }
+        }
+    }
+}
+
+/*
+ * Pack a kc x nc block of B into column panels of width nr, zero padding.
+ * Element (p, j) of the block is b[p * rsb + j * csb].
+ */
+static void packB(size_t nr, size_t kc, size_t nc, const float *b, size_t rsb, size_t csb, float *pb) {
+    for (size_t j0 = 0; j0 < nc; j0 += nr) {
+        size_t nb = min(nr, nc - j0);
+        if (csb == 1) {
+            for (size_t p = 0; p < kc; p++) {
+                const float *row = b + p * rsb + j0;
+                size_t j = 0;
+                for (; j < nb; j++) {
+                    *pb++ = row[j];
+                }
+                for (; j < nr; j++) {
+                    *pb++ = 0;
+                }
+            }
+        } else {
+            /* Transposed B: walk each column of the panel contiguously */
+            for (size_t j = 0; j < nr; j++) {
+                const float *col = b + (j0 + j) * csb;
+                for (size_t p = 0; p < kc; p++) {
+                    pb[p * nr + j] = j < nb ? col[p * rsb] : 0;
+                }
+            }
+            pb += kc * nr;
+        }
+    }
+}
+
+static void macroKernel(const KernelSet *ks, size_t mc, size_t nc, size_t kc,
+                        const float *pa, const float *pb, float *c, size_t ldc) {
+    float tile[MAX_MR * MAX_NR];
+    size_t mr = ks->mr, nr = ks->nr;
+    for (size_t jr = 0; jr < nc; jr += nr) {
+        size_t nb = min(nr, nc - jr);
+        for (size_t ir = 0; ir < mc; ir += mr) {
+            size_t mb = min(mr, mc - ir);
+            const float *a = pa + ir * kc;
+            const float *b = pb + jr * kc;
+            float *cc = c + ir * ldc + jr;
+            if (mb == mr && nb == nr) {
+                ks->gemm(kc, a, 1, mr, b, cc, ldc);
+            } else {
+                /* Edge tile: compute the full tile into scratch and copy out the valid part */
+                memset(tile, 0, mr * nr * sizeof(float));
+                ks->gemm(kc, a, 1, mr, b, tile, nr);
+                for (size_t i = 0; i < mb; i++) {
+                    for (size_t j = 0; j < nb; j++) {
+                        cc[i * ldc + j] += tile[i * nr + j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * GEMM for B narrower than one kernel tile (e.g. a weight matrix times a small mini-batch).
+ * Packing A would cost as much as the multiply itself, so full row panels are read in place
+ * and only the trailing partial panel is packed.
+ */
+static void narrowGemm(const KernelSet *ks, size_t m, size_t n, size_t k, float alpha,
+                       const float *a, size_t rsa, size_t csa, const float *b, size_t rsb, size_t csb,
+                       float *c, size_t ldc) {
+    float tile[MAX_MR * MAX_NR];
+    size_t mr = ks->mr, nr = ks->nr;
+    float *pa = packBuffer();
+    float *pb = pa + MC * KC;
+    for (size_t pc = 0; pc < k; pc += KC) {
+        size_t kc = min((size_t)KC, k - pc);
+        packB(nr, kc, n, b + pc * rsb, rsb, csb, pb);
+        for (size_t ir = 0; ir < m; ir += mr) {
+            size_t mb = min(mr, m - ir);
+            const float *panel = a + ir * rsa + pc * csa;
+            memset(tile, 0, mr * nr * sizeof(float));
+            if (mb == mr) {
+                ks->gemm(kc, panel, rsa, csa, pb, tile, nr);
+            } else {
+                packA(mr, mb, kc, 1, panel, rsa, csa, pa);
+                ks->gemm(kc, pa, 1, mr, pb, tile, nr);
+            }
+            for (size_t i = 0; i < mb; i++) {
+                for (size_t j = 0; j < n; j++) {
+                    c[(ir + i) * ldc + j] += alpha * tile[i * nr + j];
+                }
+            }
+        }
+    }
+}
+
+static void scaleC(size_t m, size_t n, float beta, float *c, size_t ldc) {
+    if (beta == 1) {
+        return;
+    }
+    for (size_t i = 0; i < m; i++) {
+        float *row = c + i * ldc;
+        if (beta == 0) {
+            memset(row, 0, n * sizeof(float));
+        } else {
+            for (size_t j = 0; j < n; j++) {
+                row[j] *= beta;
+            }
+        }
+    }
+}
+
+void sgemm(bool transA, bool transB, size_t m, size_t n, size_t k, float alpha,
+           const float *a, size_t lda,
+           const float *b, size_t ldb,
+           float beta, float *c, size_t ldc) {
+    assert(a && b && c);
+    scaleC(m, n, beta, c, ldc);
+    if (m == 0 || n == 0 || k == 0 || alpha == 0) {
+        return;
+    }
+    /* Element (i, p) of op(A) is a[i * rsa + p * csa], element (p, j) of op(B) is b[p * rsb + j * csb] */
+    size_t rsa = transA ? 1 : lda, csa = transA ? lda : 1;
+    size_t rsb = transB ? 1 : ldb, csb = transB ? ldb : 1;
+    const KernelSet *ks = kernels();
+    if (m * n * k <= SMALL_GEMM || (k == 1 && csb == 1)) {
+        ks->small(m, n, k, alpha, a, rsa, csa, b, rsb, csb, c, ldc);
+        return;
+    }
+    if (ks == &avx512Kernels && n <= avx2Kernels.nr) {
+        /* A 32 wide tile would be mostly padding */
+        ks = &avx2Kernels;
+    }
+    if (n <= ks->nr) {
+        narrowGemm(ks, m, n, k, alpha, a, rsa, csa, b, rsb, csb, c, ldc);
+        return;
+    }
+    float *pa = packBuffer();
+    float *pb = pa + MC * KC;
+    for (size_t jc = 0; jc < n; jc += NC) {
+        size_t nc = min((size_t)NC, n - jc);
+        for (size_t pc = 0; pc < k; pc += KC) {
+            size_t kc = min((size_t)KC, k - pc);
+            packB(ks->nr, kc, nc, b + pc * rsb + jc * csb, rsb, csb, pb);
+            for (size_t ic = 0; ic < m; ic += MC) {
+                size_t mc = min((size_t)MC, m - ic);
+                packA(ks->mr, mc, kc, alpha, a + ic * rsa + pc * csa, rsa, csa, pa);
+                macroKernel(ks, mc, nc, kc, pa, pb, c + ic * ldc + jc, ldc);
+            }
+        }
+    }
+}
+
+void sgemv(bool transA, size_t m, size_t n, float alpha,
+           const float *a, size_t lda,
+           const float *x,
+           float beta, float *y) {
+    assert(a && x && y);
+    if (transA) {
+        kernels()->gemvT(m, n, alpha, a, lda, x, beta, y);
+    } else if (m) {
+        kernels()->gemv(m, n, alpha, a, lda, x, beta, y);
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Single precision GEMM/GEMV kernels backing the Matrix API.
+ * All operands are row-major with explicit leading dimensions.
+ */
+
+/*
+ * C = alpha * op(A) * op(B) + beta * C, where op(A) is m x k, op(B) is k x n and C is m x n.
+ * op(X) is X^T when the matching trans flag is set; lda and ldb are the strides of A and B as stored.
+ */
+void sgemm(bool transA, bool transB, size_t m, size_t n, size_t k, float alpha,
+           const float *a, size_t lda,
+           const float *b, size_t ldb,
+           float beta, float *c, size_t ldc);
+
+/* y = alpha * op(A) * x + beta * y, where A is m x n as stored, so y has n elements when transA is set */
+void sgemv(bool transA, size_t m, size_t n, float alpha,
+           const float *a, size_t lda,
+           const float *x,
+           float beta, float *y);
+
+/* Name of the kernel set selected for this CPU ("avx512", "avx2" or "scalar") */
+const char *gemmKernelName(void);
@@ -0,0 +1,498 @@
+/**
+ * @brief Reduced precision (bfloat16 and fp16) weights: conversions, GEMV and GEMM.
+ *
+ * bfloat16 is the upper half of a float, so widening it is a 16 bit shift and rounding to it is
+ * an integer add. fp16 uses the F16C/AVX-512 conversion instructions where available and a
+ * bit-exact software conversion otherwise. The kernels are chosen once at runtime: AVX-512 with
+ * the AVX-512 BF16 rounding instruction, AVX-512, AVX2+FMA+F16C or a portable scalar fallback.
+ * PECANN_ISA ("avx512", "avx2" or "scalar") caps the choice as it does for the float kernels.
+ *
+ * The GEMV widens the weights in registers as it streams them, so it reads half the bytes of the
+ * float GEMV. The GEMM widens a block of weight rows at a time into scratch and hands it to sgemm,
+ * where the conversion is amortised over every column of B.
+ */
+#include <assert.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gemm.h"
+#include "half.h"
+
+#define INLINE static inline __attribute__((always_inline))
+
+/* Weight rows widened per sgemm call by hgemm */
+#define HGEMM_ROWS 64
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a < _b ? _a : _b; })
+
+typedef void (*ToHalfKernel)(enum EWeightType type, const float *x, uint16_t *h, size_t n);
+typedef void (*ToFloatKernel)(enum EWeightType type, const uint16_t *h, float *x, size_t n);
+typedef void (*HalfGemvKernel)(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw,
+                               const float *x, float *y);
+
+/* Scalar conversions, also used for the tails of the vector kernels */
+
+/* Round to nearest even by adding just under half of the dropped bits, plus the lowest kept bit */
+INLINE uint16_t bf16FromFloat(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return (uint16_t)((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+INLINE float floatFromBf16(uint16_t h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+INLINE uint16_t f16FromFloat(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000, abs = bits & 0x7fffffff;
+    if (abs >= 0x7f800000) {
+        /* Infinity, or NaN kept quiet */
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    }
+    if (abs >= 0x477ff000) {
+        /* 65520 and above round to infinity */
+        return sign | 0x7c00;
+    }
+    uint32_t h, rem, half;
+    if (abs < 0x38800000) {
+        /* Below 2^-14: a subnormal in units of 2^-24 */
+        if (abs < 0x33000000) {
+            return sign;
+        }
+        uint32_t mant = (abs & 0x7fffff) | 0x800000, shift = 126 - (abs >> 23);
+        h = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+    } else {
+        /* Rebias the exponent from 127 to 15 and drop 13 mantissa bits */
+        h = (abs - 0x38000000) >> 13;
+        rem = abs & 0x1fff;
+        half = 0x1000;
+    }
+    h += rem > half || (rem == half && (h & 1));
+    return sign | h;
+}
+
+INLINE float floatFromF16(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff, bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else if (exp) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else {
+        float f = mant * 0x1p-24f;
+        memcpy(&bits, &f, sizeof(bits));
+        bits |= sign;
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+INLINE uint16_t toHalf(enum EWeightType type, float f) {
+    return type == WEIGHTS_F16 ? f16FromFloat(f) : bf16FromFloat(f);
+}
+
+INLINE float toFloat(enum EWeightType type, uint16_t h) {
+    return type == WEIGHTS_F16 ? floatFromF16(h) : floatFromBf16(h);
+}
+
+/* Scalar kernels */
+
+INLINE void toHalfScalarBody(enum EWeightType type, const float *x, uint16_t *h, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h[i] = toHalf(type, x[i]);
+    }
+}
+
+INLINE void toFloatScalarBody(enum EWeightType type, const uint16_t *h, float *x, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        x[i] = toFloat(type, h[i]);
+    }
+}
+
+INLINE void gemvScalarBody(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw,
+                           const float *x, float *y) {
+    for (size_t r = 0; r < rows; r++) {
+        const uint16_t *row = w + r * ldw;
+        float dot = 0;
+        for (size_t j = 0; j < cols; j++) {
+            dot += toFloat(type, row[j]) * x[j];
+        }
+        y[r] = dot;
+    }
+}
+
+static void toHalfScalar(enum EWeightType type, const float *x, uint16_t *h, size_t n) {
+    if (type == WEIGHTS_F16) {
+        toHalfScalarBody(WEIGHTS_F16, x, h, n);
+    } else {
+        toHalfScalarBody(WEIGHTS_BF16, x, h, n);
+    }
+}
+
+static void toFloatScalar(enum EWeightType type, const uint16_t *h, float *x, size_t n) {
+    if (type == WEIGHTS_F16) {
+        toFloatScalarBody(WEIGHTS_F16, h, x, n);
+    } else {
+        toFloatScalarBody(WEIGHTS_BF16, h, x, n);
+    }
+}
+
+static void gemvScalar(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw,
+                       const float *x, float *y) {
+    if (type == WEIGHTS_F16) {
+        gemvScalarBody(WEIGHTS_F16, rows, cols, w, ldw, x, y);
+    } else {
+        gemvScalarBody(WEIGHTS_BF16, rows, cols, w, ldw, x, y);
+    }
+}
+
+/* AVX2 + FMA + F16C kernels, 8 weights per vector */
+
+__attribute__((target("avx2,fma,f16c"), always_inline))
+static inline __m256 widen8(enum EWeightType type, const uint16_t *p) {
+    __m128i h = _mm_loadu_si128((const __m128i*)p);
+    if (type == WEIGHTS_F16) {
+        return _mm256_cvtph_ps(h);
+    }
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+}
+
+__attribute__((target("avx2,fma,f16c"), always_inline))
+static inline float hsum256(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma,f16c"), always_inline))
+static inline void toHalfF16cBody(enum EWeightType type, const float *x, uint16_t *h, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        __m128i out;
+        if (type == WEIGHTS_F16) {
+            out = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        } else {
+            __m256i bits = _mm256_castps_si256(v);
+            __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+            bits = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7fff))), 16);
+            out = _mm_packus_epi32(_mm256_castsi256_si128(bits), _mm256_extracti128_si256(bits, 1));
+        }
+        _mm_storeu_si128((__m128i*)(h + i), out);
+    }
+    toHalfScalarBody(type, x + i, h + i, n - i);
+}
+
+__attribute__((target("avx2,fma,f16c"), always_inline))
+static inline void toFloatF16cBody(enum EWeightType type, const uint16_t *h, float *x, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(x + i, widen8(type, h + i));
+    }
+    toFloatScalarBody(type, h + i, x + i, n - i);
+}
+
+__attribute__((target("avx2,fma,f16c"), always_inline))
+static inline void gemvF16cBody(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw,
+                                const float *x, float *y) {
+    size_t r = 0;
+    for (; r + 4 <= rows; r += 4) {
+        const uint16_t *r0 = w + r * ldw, *r1 = r0 + ldw, *r2 = r1 + ldw, *r3 = r2 + ldw;
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        size_t j = 0;
+        for (; j + 8 <= cols; j += 8) {
+            __m256 xv = _mm256_loadu_ps(x + j);
+            s0 = _mm256_fmadd_ps(widen8(type, r0 + j), xv, s0);
+            s1 = _mm256_fmadd_ps(widen8(type, r1 + j), xv, s1);
+            s2 = _mm256_fmadd_ps(widen8(type, r2 + j), xv, s2);
+            s3 = _mm256_fmadd_ps(widen8(type, r3 + j), xv, s3);
+        }
+        float d[4] = {hsum256(s0), hsum256(s1), hsum256(s2), hsum256(s3)};
+        for (; j < cols; j++) {
+            d[0] += toFloat(type, r0[j]) * x[j];
+            d[1] += toFloat(type, r1[j]) * x[j];
+            d[2] += toFloat(type, r2[j]) * x[j];
+            d[3] += toFloat(type, r3[j]) * x[j];
+        }
+        memcpy(y + r, d, sizeof(d));
+    }
+    gemvScalarBody(type, rows - r, cols, w + r * ldw, ldw, x, y + r);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void toHalfF16c(enum EWeightType type, const float *x, uint16_t *h, size_t n) {
+    if (type == WEIGHTS_F16) {
+        toHalfF16cBody(WEIGHTS_F16, x, h, n);
+    } else {
+        toHalfF16cBody(WEIGHTS_BF16, x, h, n);
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void toFloatF16c(enum EWeightType type, const uint16_t *h, float *x, size_t n) {
+    if (type == WEIGHTS_F16) {
+        toFloatF16cBody(WEIGHTS_F16, h, x, n);
+    } else {
+        toFloatF16cBody(WEIGHTS_BF16, h, x, n);
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void gemvF16c(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw,
+                     const float *x, float *y) {
+    if (type == WEIGHTS_F16) {
+        gemvF16cBody(WEIGHTS_F16, rows, cols, w, ldw, x, y);
+    } else {
+        gemvF16cBody(WEIGHTS_BF16, rows, cols, w, ldw, x, y);
+    }
+}
+
+/* AVX-512 kernels, 16 weights per vector */
+
+__attribute__((target("avx512f"), always_inline))
+static inline __m512 widen16(enum EWeightType type, const uint16_t *p) {
+    __m256i h = _mm256_loadu_si256((const __m256i*)p);
+    if (type == WEIGHTS_F16) {
+        return _mm512_cvtph_ps(h);
+    }
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void toHalfAvx512Body(enum EWeightType type, const float *x, uint16_t *h, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_loadu_ps(x + i);
+        __m256i out;
+        if (type == WEIGHTS_F16) {
+            out = _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        } else {
+            __m512i bits = _mm512_castps_si512(v);
+            __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(bits, 16), _mm512_set1_epi32(1));
+            out = _mm512_cvtepi32_epi16(_mm512_srli_epi32(
+                _mm512_add_epi32(bits, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7fff))), 16));
+        }
+        _mm256_storeu_si256((__m256i*)(h + i), out);
+    }
+    toHalfScalarBody(type, x + i, h + i, n - i);
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void toFloatAvx512Body(enum EWeightType type, const uint16_t *h, float *x, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(x + i, widen16(type, h + i));
+    }
+    toFloatScalarBody(type, h + i, x + i, n - i);
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void gemvAvx512Body(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw,
+                                  const float *x, float *y) {
+    size_t r = 0;
+    for (; r + 4 <= rows; r += 4) {
+        const uint16_t *r0 = w + r * ldw, *r1 = r0 + ldw, *r2 = r1 + ldw, *r3 = r2 + ldw;
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        size_t j = 0;
+        for (; j + 16 <= cols; j += 16) {
+            __m512 xv = _mm512_loadu_ps(x + j);
+            s0 = _mm512_fmadd_ps(widen16(type, r0 + j), xv, s0);
+            s1 = _mm512_fmadd_ps(widen16(type, r1 + j), xv, s1);
+            s2 = _mm512_fmadd_ps(widen16(type, r2 + j), xv, s2);
+            s3 = _mm512_fmadd_ps(widen16(type, r3 + j), xv, s3);
+        }
+        float d[4] = {_mm512_reduce_add_ps(s0), _mm512_reduce_add_ps(s1),
+                      _mm512_reduce_add_ps(s2), _mm512_reduce_add_ps(s3)};
+        for (; j < cols; j++) {
+            d[0] += toFloat(type, r0[j]) * x[j];
+            d[1] += toFloat(type, r1[j]) * x[j];
+            d[2] += toFloat(type, r2[j]) * x[j];
+            d[3] += toFloat(type, r3[j]) * x[j];
+        }
+        memcpy(y + r, d, sizeof(d));
+    }
+    gemvScalarBody(type, rows - r, cols, w + r * ldw, ldw, x, y + r);
+}
+
+__attribute__((target("avx512f")))
+static void toHalfAvx512(enum EWeightType type, const float *x, uint16_t *h, size_t n) {
+    if (type == WEIGHTS_F16) {
+        toHalfAvx512Body(WEIGHTS_F16, x, h, n);
+    } else {
+        toHalfAvx512Body(WEIGHTS_BF16, x, h, n);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void toFloatAvx512(enum EWeightType type, const uint16_t *h, float *x, size_t n) {
+    if (type == WEIGHTS_F16) {
+        toFloatAvx512Body(WEIGHTS_F16, h, x, n);
+    } else {
+        toFloatAvx512Body(WEIGHTS_BF16, h, x, n);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void gemvAvx512(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw,
+                       const float *x, float *y) {
+    if (type == WEIGHTS_F16) {
+        gemvAvx512Body(WEIGHTS_F16, rows, cols, w, ldw, x, y);
+    } else {
+        gemvAvx512Body(WEIGHTS_BF16, rows, cols, w, ldw, x, y);
+    }
+}
+
+/* AVX-512 BF16: vcvtneps2bf16 rounds 16 floats to nearest even in one instruction */
+__attribute__((target("avx512f,avx512bf16")))
+static void toHalfAvx512Bf16(enum EWeightType type, const float *x, uint16_t *h, size_t n) {
+    if (type == WEIGHTS_F16) {
+        toHalfAvx512Body(WEIGHTS_F16, x, h, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm256_storeu_si256((__m256i*)(h + i), (__m256i)_mm512_cvtneps_pbh(_mm512_loadu_ps(x + i)));
+    }
+    toHalfScalarBody(WEIGHTS_BF16, x + i, h + i, n - i);
+}
+
+typedef struct HalfKernelSet {
+    const char *name;
+    ToHalfKernel toHalf;
+    ToFloatKernel toFloat;
+    HalfGemvKernel gemv;
+} HalfKernelSet;
+
+static const HalfKernelSet scalarKernel = {"scalar", toHalfScalar, toFloatScalar, gemvScalar};
+static const HalfKernelSet f16cKernel = {"f16c", toHalfF16c, toFloatF16c, gemvF16c};
+static const HalfKernelSet avx512Kernel = {"avx512", toHalfAvx512, toFloatAvx512, gemvAvx512};
+static const HalfKernelSet avx512Bf16Kernel = {"avx512-bf16", toHalfAvx512Bf16, toFloatAvx512, gemvAvx512};
+
+static const HalfKernelSet *selectedKernel;
+static pthread_once_t selectOnce = PTHREAD_ONCE_INIT;
+
+static void selectKernel(void) {
+    __builtin_cpu_init();
+    bool hasAvx512 = __builtin_cpu_supports("avx512f");
+    bool hasBf16 = hasAvx512 && __builtin_cpu_supports("avx512bf16");
+    bool hasF16c = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    const char *isa = getenv("PECANN_ISA");
+    if (isa && strcmp(isa, "scalar") == 0) {
+        hasAvx512 = hasBf16 = hasF16c = false;
+    } else if (isa && strcmp(isa, "avx2") == 0) {
+        hasAvx512 = hasBf16 = false;
+    }
+    if (hasBf16) {
+        selectedKernel = &avx512Bf16Kernel;
+    } else if (hasAvx512) {
+        selectedKernel = &avx512Kernel;
+    } else if (hasF16c) {
+        selectedKernel = &f16cKernel;
+    } else {
+        selectedKernel = &scalarKernel;
+    }
+}
+
+static const HalfKernelSet *kernel(void) {
+    pthread_once(&selectOnce, selectKernel);
+    return selectedKernel;
+}
+
+const char *halfKernelName(void) {
+    return kernel()->name;
+}
+
+void floatToHalf(enum EWeightType type, const float *x, uint16_t *h, size_t n) {
+    assert(type == WEIGHTS_BF16 || type == WEIGHTS_F16);
+    kernel()->toHalf(type, x, h, n);
+}
+
+void halfToFloat(enum EWeightType type, const uint16_t *h, float *x, size_t n) {
+    assert(type == WEIGHTS_BF16 || type == WEIGHTS_F16);
+    kernel()->toFloat(type, h, x, n);
+}
+
+void hgemv(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw, const float *x, float *y) {
+    assert(type == WEIGHTS_BF16 || type == WEIGHTS_F16);
+    kernel()->gemv(type, rows, cols, w, ldw, x, y);
+}
+
+size_t hgemmScratchSize(size_t k) {
+    return HGEMM_ROWS * k;
+}
+
+void hgemm(enum EWeightType type, size_t rows, size_t n, size_t k, const uint16_t *w,
+           const float *b, float *c, float *scratch) {
+    assert(type == WEIGHTS_BF16 || type == WEIGHTS_F16);
+    const HalfKernelSet *ks = kernel();
+    if (n == 1) {
+        ks->gemv(type, rows, k, w, k, b, c);
+        return;
+    }
+    for (size_t r = 0; r < rows; r += HGEMM_ROWS) {
+        size_t rb = min((size_t)HGEMM_ROWS, rows - r);
+        ks->toFloat(type, w + r * k, scratch, rb * k);
+        sgemm(false, false, rb, n, k, 1, scratch, k, b, n, 0, c + r * n, n);
+    }
+}
+
+/**
+ * @brief Store a network's weights in reduced precision for inference, halving their memory traffic.
+ *
+ * The float weights are kept as the master copy: training updates them and rounds them into the
+ * reduced precision copy again when it finishes. feedForward and inference contexts created
+ * afterwards use the reduced precision copy, and saveNetworkToFile saves it, halving the file.
+ *
+ * @param net Pointer to a network that is not mapped from a file
+ * @param type WEIGHTS_BF16 (float range, 8 bit mantissa), WEIGHTS_F16 (11 bit mantissa, up to 65504),
+ *             or WEIGHTS_F32 to drop the reduced precision copy
+ * @return 0 on success, -1 otherwise
+ */
+int setWeightType(Network *net, enum EWeightType type) {
+    assert(net && !net->mapping && type <= WEIGHTS_F16);
+    unsigned L = net->nLayers - 1;
+    if (type == WEIGHTS_F32) {
+        for (unsigned i = 0; net->halfWeights && i < L; i++) {
+            free(net->halfWeights[i]);
+        }
+        free(net->halfWeights);
+        net->halfWeights = NULL;
+        net->weightType = WEIGHTS_F32;
+        return 0;
+    }
+    if (!net->halfWeights) {
+        net->halfWeights = calloc(L, sizeof(uint16_t*));
+        if (!net->halfWeights) {
+            return -1;
+        }
+        for (unsigned i = 0; i < L; i++) {
+            size_t bytes = (len(net->weights[i]) * sizeof(uint16_t) + 63) & ~(size_t)63;
+            net->halfWeights[i] = aligned_alloc(64, bytes);
+            if (!net->halfWeights[i]) {
+                setWeightType(net, WEIGHTS_F32);
+                return -1;
+            }
+        }
+    }
+    for (unsigned i = 0; i < L; i++) {
+        floatToHalf(type, net->weights[i].data, net->halfWeights[i], len(net->weights[i]));
+    }
+    net->weightType = type;
+    return 0;
+}
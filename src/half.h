@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "network.h"
+
+/*
+ * Reduced precision weight storage for inference, see setWeightType.
+ *
+ * Weights are stored as bfloat16 or IEEE fp16 and widened to fp32 as they are loaded, so every
+ * product is computed and accumulated in fp32 and only the rounding of the weights themselves is
+ * lost. Both formats halve the memory traffic of the weights, which is what bounds a GEMV.
+ */
+
+/* Round n floats to the weight type (round to nearest even) and widen them back */
+void floatToHalf(enum EWeightType type, const float *x, uint16_t *h, size_t n);
+void halfToFloat(enum EWeightType type, const uint16_t *h, float *x, size_t n);
+
+/* y = W * x for a rows x cols W stored in the weight type with row stride ldw */
+void hgemv(enum EWeightType type, size_t rows, size_t cols, const uint16_t *w, size_t ldw, const float *x, float *y);
+
+/*
+ * C = W * B for a rows x k W stored in the weight type, a k x n B and a rows x n C, all row-major.
+ * Blocks of W are widened into scratch, which must hold hgemmScratchSize(k) floats, and multiplied with sgemm.
+ */
+void hgemm(enum EWeightType type, size_t rows, size_t n, size_t k, const uint16_t *w,
+           const float *b, float *c, float *scratch);
+size_t hgemmScratchSize(size_t k);
+
+/* Name of the conversion kernels selected for this CPU ("avx512-bf16", "avx512", "f16c" or "scalar") */
+const char *halfKernelName(void);
@@ -3,7 +3,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "gemm.h"
 #include "matrix.h"
+#include "profile.h"
 
 Matrix matrix(unsigned rows, unsigned cols) {
     assert(rows > 0 && cols > 0);
@@ -13,6 +15,7 @@ Matrix matrix(unsigned rows, unsigned cols) {
     };
     m.data = (float*) calloc(len(m), sizeof(float));
     assert(m.data);
+    PROFILE_ALLOCATION();
     return m;
 }
 
@@ -30,31 +33,67 @@ Matrix copy(Matrix m) {
     float *orig = m.data;
     m.data = (float*) malloc(len(m) * sizeof(float));
     assert(m.data);
+    PROFILE_ALLOCATION();
     memcpy(m.data, orig, len(m) * sizeof(float));
     return m;
 }
 
+void copyInto(Matrix result, Matrix m) {
+    assert(result.rows == m.rows && result.cols == m.cols);
+    memcpy(result.data, m.data, len(m) * sizeof(float));
+}
+
+void zeroMatrix(Matrix m) {
+    memset(m.data, 0, len(m) * sizeof(float));
+}
+
 Matrix mult(Matrix m1, Matrix m2) {
     Matrix result = matrix(m1.rows, m2.cols);
-    float *ptr = result.data;
-    for (unsigned i = 0; i < m1.rows; i++) {
-        for (unsigned j = 0; j < m2.cols; j++) {
-            for (unsigned k = 0; k < m1.cols; k++) {
-                ptr[0] += get(m1,i,k) * get(m2,k,j); 
-            }
-            ptr++;
-        }
-    }
+    multInto(result, m1, m2);
     return result;
 }
 
+void multInto(Matrix result, Matrix m1, Matrix m2) {
+    gemmInto(result, m1, NO_TRANSPOSE, m2, NO_TRANSPOSE, 1, 0);
+}
+
+/**
+ * @brief result = alpha * op(m1) * op(m2) + beta * result, where op transposes its operand when
+ * asked to. The transposes are never materialized, and beta = 1 accumulates into result.
+ *
+ * @param result Matrix with as many rows as op(m1) and as many columns as op(m2)
+ * @param m1 Left operand
+ * @param t1 Whether to use m1^T
+ * @param m2 Right operand
+ * @param t2 Whether to use m2^T
+ * @param alpha Scale of the product
+ * @param beta Scale of the previous contents of result, 0 to overwrite it
+ */
+void gemmInto(Matrix result, Matrix m1, enum ETranspose t1, Matrix m2, enum ETranspose t2, float alpha, float beta) {
+    unsigned m = t1 ? m1.cols : m1.rows, k = t1 ? m1.rows : m1.cols;
+    unsigned n = t2 ? m2.rows : m2.cols;
+    assert(k == (t2 ? m2.cols : m2.rows) && result.rows == m && result.cols == n);
+    assert(result.data != m1.data && result.data != m2.data);
+    if (n == 1) {
+        /* op(m2) is a single contiguous column either way */
+        sgemv(t1, m1.rows, m1.cols, alpha, m1.data, m1.cols, m2.data, beta, result.data);
+    } else {
+        sgemm(t1, t2, m, n, k, alpha, m1.data, m1.cols, m2.data, m2.cols, beta, result.data, result.cols);
+    }
+}
+
 Matrix add(Matrix m1, Matrix m2) {
-    assert(m1.rows == m2.rows && m1.cols == m2.cols);
     Matrix result = matrix(m1.rows, m1.cols);
+    addInto(result, m1, m2);
+    return result;
+}
+
+void addInto(Matrix result, Matrix m1, Matrix m2) {
+    assert(m1.rows == m2.rows && m1.cols == m2.cols);
+    assert(result.rows == m1.rows && result.cols == m1.cols);
     for (unsigned i = 0; i < len(m1); i++) {
         result.data[i] = m1.data[i] + m2.data[i];
     }
-    return result;
 }
 
 void addInPlace(Matrix m1, Matrix m2) {
@@ -64,13 +103,46 @@ void addInPlace(Matrix m1, Matrix m2) {
     }
 }
 
+void addColumnInPlace(Matrix m, Matrix col) {
+    assert(col.rows == m.rows && col.cols == 1);
+    for (unsigned i = 0; i < m.rows; i++) {
+        float *row = m.data + i * m.cols;
+        for (unsigned j = 0; j < m.cols; j++) {
+            row[j] += col.data[i];
+        }
+    }
+}
+
+Matrix rowSums(Matrix m) {
+    Matrix result = matrix(m.rows, 1);
+    rowSumsInto(result, m);
+    return result;
+}
+
+void rowSumsInto(Matrix result, Matrix m) {
+    assert(result.rows == m.rows && result.cols == 1);
+    for (unsigned i = 0; i < m.rows; i++) {
+        const float *row = m.data + i * m.cols;
+        float sum = 0;
+        for (unsigned j = 0; j < m.cols; j++) {
+            sum += row[j];
+        }
+        result.data[i] = sum;
+    }
+}
+
 Matrix sub(Matrix m1, Matrix m2) {
-    assert(m1.rows == m2.rows && m1.cols == m2.cols);
     Matrix result = matrix(m1.rows, m1.cols);
+    subInto(result, m1, m2);
+    return result;
+}
+
+void subInto(Matrix result, Matrix m1, Matrix m2) {
+    assert(m1.rows == m2.rows && m1.cols == m2.cols);
+    assert(result.rows == m1.rows && result.cols == m1.cols);
     for (unsigned i = 0; i < len(m1); i++) {
         result.data[i] = m1.data[i] - m2.data[i];
     }
-    return result;
 }
 
 void subInPlace(Matrix m1, Matrix m2) {
@@ -80,6 +152,13 @@ void subInPlace(Matrix m1, Matrix m2) {
     }
 }
 
+void subScaledInPlace(Matrix m1, Matrix m2, float f) {
+    assert(m1.rows == m2.rows && m1.cols == m2.cols);
+    for (unsigned i = 0; i < len(m1); i++) {
+        m1.data[i] -= f * m2.data[i];
+    }
+}
+
 Matrix scalarMult(Matrix m1, float f) {
     Matrix result = copy(m1);
     for (unsigned i = 0; i < len(m1); i++) {
@@ -89,30 +168,60 @@ Matrix scalarMult(Matrix m1, float f) {
 }
 
 Matrix hadamard(Matrix m1, Matrix m2) {
-    assert(m1.cols == m2.cols && m1.rows == m2.rows);
     Matrix result = matrix(m1.rows, m1.cols);
+    hadamardInto(result, m1, m2);
+    return result;
+}
+
+void hadamardInto(Matrix result, Matrix m1, Matrix m2) {
+    assert(m1.cols == m2.cols && m1.rows == m2.rows);
+    assert(result.rows == m1.rows && result.cols == m1.cols);
     for (unsigned i = 0; i < len(m1); i++) {
         result.data[i] = m1.data[i] * m2.data[i];
     }
-    return result;
+}
+
+void hadamardInPlace(Matrix m1, Matrix m2) {
+    assert(m1.cols == m2.cols && m1.rows == m2.rows);
+    for (unsigned i = 0; i < len(m1); i++) {
+        m1.data[i] *= m2.data[i];
+    }
 }
 
 Matrix transpose(Matrix m) {
     Matrix result = matrix(m.cols,m.rows);
-    for (unsigned i = 0; i < m.rows; i++) {
-        for (unsigned j = 0; j < m.cols; j++) {
-            result.data[j*result.cols + i] = m.data[i*m.cols + j];
+    transposeInto(result, m);
+    return result;
+}
+
+void transposeInto(Matrix result, Matrix m) {
+    assert(result.rows == m.cols && result.cols == m.rows && result.data != m.data);
+    /* Transpose in square tiles so that both the reads and the writes stay within a few cache lines */
+    const unsigned tile = 16;
+    for (unsigned i0 = 0; i0 < m.rows; i0 += tile) {
+        unsigned iEnd = i0 + tile < m.rows ? i0 + tile : m.rows;
+        for (unsigned j0 = 0; j0 < m.cols; j0 += tile) {
+            unsigned jEnd = j0 + tile < m.cols ? j0 + tile : m.cols;
+            for (unsigned i = i0; i < iEnd; i++) {
+                for (unsigned j = j0; j < jEnd; j++) {
+                    result.data[j*result.cols + i] = m.data[i*m.cols + j];
+                }
+            }
         }
     }
-    return result;
 }
 
 Matrix applyFunc(Matrix m, float (*func)(float)) {
     Matrix result = matrix(m.rows, m.cols);
+    applyFuncInto(result, m, func);
+    return result;
+}
+
+void applyFuncInto(Matrix result, Matrix m, float (*func)(float)) {
+    assert(result.rows == m.rows && result.cols == m.cols);
     for (unsigned i = 0; i < len(m); i++) {
         result.data[i] = func(m.data[i]);
     }
-    return result;
 }
 
 int maxIndex(Matrix m) {
@@ -125,6 +234,22 @@ int maxIndex(Matrix m) {
     return maxIndex;
 }
 
+void maxIndexPerColumn(Matrix m, int *indices) {
+    assert(indices);
+    for (unsigned j = 0; j < m.cols; j++) {
+        indices[j] = 0;
+    }
+    /* Walk row by row so the scan over a batch of column vectors reads memory sequentially */
+    for (unsigned i = 1; i < m.rows; i++) {
+        const float *row = m.data + i * m.cols;
+        for (unsigned j = 0; j < m.cols; j++) {
+            if (row[j] > get(m, indices[j], j)) {
+                indices[j] = i;
+            }
+        }
+    }
+}
+
 void applyFuncInPlace(Matrix m, float (*func)(float)) {
     for (unsigned i = 0; i < len(m); i++) {
         m.data[i] = func(m.data[i]);
@@ -156,11 +281,16 @@ void saveMatrixToFile(FILE *file, Matrix m) {
 
 Matrix readMatrixFromFile(FILE *file) {
     unsigned rows, cols;
-    assert(fscanf(file, "%d %d", &rows, &cols) == 2);
-    Matrix m = matrix(rows,cols);
+    Matrix m = {0};
+    if (fscanf(file, "%u %u", &rows, &cols) != 2 || rows == 0 || cols == 0) {
+        return m;
+    }
+    m = matrix(rows,cols);
     for (unsigned i = 0; i < len(m); i++) {
-        assert(fscanf(file, "%f", &m.data[i]) == 1);
+        if (fscanf(file, "%f", &m.data[i]) != 1) {
+            freeMatrix(m);
+            return (Matrix){0};
+        }
     }
     return m;
 }
-
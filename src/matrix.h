@@ -1,26 +1,49 @@
 #pragma once
 
+#include <stdio.h>
+
 typedef struct Matrix {
     float *data;
     unsigned rows, cols;
 } Matrix;
 
+/* Whether a product operand is used as is or transposed, see gemmInto */
+enum ETranspose {
+    NO_TRANSPOSE,
+    TRANSPOSE
+};
+
 #define get(m,row,col) (m.data[(row) * (m.cols) + (col)])
 #define len(m) (m.rows * m.cols)
 
 Matrix matrix(unsigned rows, unsigned cols);
 Matrix matrixFromData(unsigned rows, unsigned cols, float *data);
 Matrix copy(Matrix m);
+void copyInto(Matrix result, Matrix m);
+void zeroMatrix(Matrix m);
 Matrix add(Matrix m1, Matrix m2);
+void addInto(Matrix result, Matrix m1, Matrix m2);
 void addInPlace(Matrix m1, Matrix m2);
 void subInPlace(Matrix m1, Matrix m2);
+void subScaledInPlace(Matrix m1, Matrix m2, float f);
+void addColumnInPlace(Matrix m, Matrix col);
+Matrix rowSums(Matrix m);
+void rowSumsInto(Matrix result, Matrix m);
 Matrix sub(Matrix m1, Matrix m2);
+void subInto(Matrix result, Matrix m1, Matrix m2);
 Matrix scalarMult(Matrix m1, float f);
 Matrix mult(Matrix m1, Matrix m2);
+void multInto(Matrix result, Matrix m1, Matrix m2);
+void gemmInto(Matrix result, Matrix m1, enum ETranspose t1, Matrix m2, enum ETranspose t2, float alpha, float beta);
 Matrix hadamard(Matrix m1, Matrix m2);
+void hadamardInto(Matrix result, Matrix m1, Matrix m2);
+void hadamardInPlace(Matrix m1, Matrix m2);
 Matrix transpose(Matrix m);
+void transposeInto(Matrix result, Matrix m);
 int maxIndex(Matrix m);
+void maxIndexPerColumn(Matrix m, int *indices);
 Matrix applyFunc(Matrix m, float (*func)(float));
+void applyFuncInto(Matrix result, Matrix m, float (*func)(float));
 void applyFuncInPlace(Matrix m, float (*func)(float));
 void freeMatrix(Matrix m);
 void printMatrix(Matrix m);
@@ -0,0 +1,749 @@
+/**
+ * @brief Reading and writing networks to disk.
+ *
+ * Networks are saved in a versioned binary format:
+ *
+ *   ModelHeader                                          64 bytes
+ *   uint32 sizes[nLayers], uint32 activations[nLayers - 1]  padded to a multiple of 64 bytes
+ *   weights[0], biases[0], ...                           float32, each block padded to a multiple of 64 bytes
+ *
+ * A network with reduced precision weights (see setWeightType) is saved with the bf16 or f16
+ * dtype and the same layout, except that its weight blocks hold 16 bit values. A pruned network
+ * (see pruneNetwork) is saved with the csr dtype when that is smaller, every weight block then being
+ *
+ *   uint32 rowStart[rows + 1], uint32 columns[nnz], float32 values[nnz]   each padded to a multiple of 64 bytes
+ *
+ * with nnz = rowStart[rows], as in SparseMatrix. Such files are read but can't be mapped.
+ * Every weight block starts on a 64 byte boundary of the file, so a saved network can be
+ * mmap'ed and used for inference in place, sharing the pages between processes.
+ * activations holds the EActivationFunction of every weight layer, or MODEL_AF_UNSET in all of
+ * them for a network that leaves its activations to the caller. Version 1 files have no
+ * activations and can still be read, as can the older whitespace separated text format.
+ * The checksum is a CRC-32C of the whole file; versions 1 and 2 only hash the data section.
+ *
+ * Quantized networks use the same header with the int8 dtype and a different data section:
+ *
+ *   uint32 af, then {float32 inScale, int32 inZero} per layer    padded to a multiple of 64 bytes
+ *   per layer: int8 weights[rows][stride], float32 scales[rows],
+ *              float32 biases[rows], int32 rowSums[rows]         each padded to a multiple of 64 bytes
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "half.h"
+#include "network.h"
+#include "quant.h"
+#include "sparse.h"
+
+#define MODEL_MAGIC "PECANN\x1a\n"
+#define MODEL_VERSION 3
+#define MODEL_ALIGNMENT 64
+#define MODEL_DTYPE_F32 0
+#define MODEL_DTYPE_I8 1
+#define MODEL_DTYPE_BF16 2
+#define MODEL_DTYPE_F16 3
+#define MODEL_DTYPE_CSR 4
+#define MODEL_AF_UNSET 0xffffffffu
+
+#define ALIGN(n) (((n) + MODEL_ALIGNMENT - 1) & ~(uint64_t)(MODEL_ALIGNMENT - 1))
+
+typedef struct ModelHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nLayers;
+    uint32_t dtype;
+    uint32_t alignment;
+    /* Offset of the first weight block and size of all blocks, in bytes */
+    uint64_t dataOffset;
+    uint64_t dataSize;
+    /* CRC-32C of the rest of the file followed by this header with checksum 0, see checksumBlock.
+       Versions 1 and 2 hold legacyChecksumBlock() of the data section only */
+    uint64_t checksum;
+    uint8_t reserved[16];
+} ModelHeader;
+
+_Static_assert(sizeof(ModelHeader) == MODEL_ALIGNMENT, "ModelHeader must fill one aligned block");
+
+/*
+ * Extend a CRC-32C with a block as if it were zero padded to the model alignment, matching how
+ * it is laid out in the file.
+ */
+static uint32_t checksumBlock(uint32_t crc, const void *data, size_t size) {
+    static const unsigned char zeros[MODEL_ALIGNMENT];
+    crc = crc32c(crc, data, size);
+    return crc32c(crc, zeros, ALIGN(size) - size);
+}
+
+/* The checksum of a whole file of the current version: everything after the header, then the header with checksum 0 */
+static uint32_t fileChecksum(const unsigned char *file, uint64_t end) {
+    ModelHeader header;
+    memcpy(&header, file, sizeof(header));
+    header.checksum = 0;
+    uint32_t crc = crc32c(0, file + sizeof(header), end - sizeof(header));
+    return crc32c(crc, &header, sizeof(header));
+}
+
+#define LEGACY_CHECKSUM_SEED 0xcbf29ce484222325ULL
+
+/*
+ * The checksum of version 1 and 2 files: FNV-1a over 8 byte words of the data section, zero padded
+ * like checksumBlock. It misses some multi-bit errors, so files are no longer written with it.
+ */
+static uint64_t legacyChecksumBlock(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < ALIGN(size); i += 8) {
+        uint64_t word = 0;
+        if (i + 8 <= size) {
+            memcpy(&word, bytes + i, 8);
+        } else if (i < size) {
+            memcpy(&word, bytes + i, size - i);
+        }
+        hash ^= word;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Size of the layer sizes and activations block */
+static uint64_t shapeBytes(unsigned nLayers) {
+    return ALIGN((2 * (uint64_t)nLayers - 1) * sizeof(uint32_t));
+}
+
+/*
+ * Block sizes come from the uint32 layer sizes of a file, so they are computed saturating at
+ * UINT64_MAX, which is larger than any file, rather than wrapping around to a size that fits
+ */
+static uint64_t blockBytes(uint64_t count, uint64_t elementSize) {
+    uint64_t size;
+    if (__builtin_mul_overflow(count, elementSize, &size) || size > UINT64_MAX - MODEL_ALIGNMENT) {
+        return UINT64_MAX;
+    }
+    return ALIGN(size);
+}
+
+static uint64_t addBytes(uint64_t a, uint64_t b) {
+    uint64_t sum;
+    return __builtin_add_overflow(a, b, &sum) ? UINT64_MAX : sum;
+}
+
+static uint64_t layerBytes(unsigned rows, unsigned cols) {
+    return blockBytes((uint64_t)rows * cols, sizeof(float));
+}
+
+static uint32_t weightDtype(enum EWeightType type) {
+    return type == WEIGHTS_BF16 ? MODEL_DTYPE_BF16 : type == WEIGHTS_F16 ? MODEL_DTYPE_F16 : MODEL_DTYPE_F32;
+}
+
+/* Size of a weight block of a float network with the given dtype */
+static uint64_t weightBytes(uint32_t dtype, unsigned rows, unsigned cols) {
+    return dtype == MODEL_DTYPE_F32 ? layerBytes(rows, cols) : blockBytes((uint64_t)rows * cols, sizeof(uint16_t));
+}
+
+/* Size of a weight block of the csr dtype */
+static uint64_t sparseBytes(unsigned rows, uint64_t nnz) {
+    return addBytes(addBytes(blockBytes((uint64_t)rows + 1, sizeof(uint32_t)), blockBytes(nnz, sizeof(uint32_t))),
+                    blockBytes(nnz, sizeof(float)));
+}
+
+/* Quantization parameters of one layer as stored in the file */
+typedef struct QuantParams {
+    float inScale;
+    int32_t inZero;
+} QuantParams;
+
+static uint64_t quantParamBytes(unsigned nLayers) {
+    return ALIGN(sizeof(uint32_t) + (nLayers - 1) * sizeof(QuantParams));
+}
+
+static uint64_t quantLayerBytes(unsigned rows, unsigned cols) {
+    return addBytes(blockBytes(rows, ALIGN((uint64_t)cols)), 3 * blockBytes(rows, sizeof(float)));
+}
+
+/* Check the stored activations: all valid with softmax on the output layer only, or all unset */
+static int checkActivations(const uint32_t *activations, unsigned nLayers) {
+    unsigned L = nLayers - 1, nUnset = 0;
+    for (unsigned i = 0; i < L; i++) {
+        if (activations[i] == MODEL_AF_UNSET) {
+            nUnset++;
+        } else if (activations[i] > FN_LINEAR || (activations[i] == FN_SOFTMAX && i + 1 != L)) {
+            return -1;
+        }
+    }
+    return nUnset == 0 || nUnset == L ? 0 : -1;
+}
+
+static bool dtypeMatches(uint32_t stored, uint32_t dtype) {
+    if (dtype == MODEL_DTYPE_I8) {
+        return stored == MODEL_DTYPE_I8;
+    }
+    return stored == MODEL_DTYPE_F32 || stored == MODEL_DTYPE_BF16 || stored == MODEL_DTYPE_F16 ||
+           stored == MODEL_DTYPE_CSR;
+}
+
+/**
+ * @brief Check a mapped model file and locate its layer sizes, activations and data section
+ *
+ * @param dtype MODEL_DTYPE_I8, or MODEL_DTYPE_F32 to accept any float dtype
+ * @param activations Receives the stored activations, or NULL for a version 1 file
+ * @return 0 if the file is a valid model, -1 otherwise
+ */
+static int parseModel(const unsigned char *file, size_t size, bool verifyChecksum, uint32_t dtype,
+                      const uint32_t **sizes, const uint32_t **activations, const unsigned char **data) {
+    const ModelHeader *header = (const ModelHeader*)file;
+    if (size < sizeof(ModelHeader) ||
+        memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version < 1 || header->version > MODEL_VERSION ||
+        !dtypeMatches(header->dtype, dtype) ||
+        header->alignment != MODEL_ALIGNMENT ||
+        header->nLayers < 2 ||
+        header->dataOffset % MODEL_ALIGNMENT != 0 ||
+        header->dataOffset < sizeof(ModelHeader) + (header->version == 1 ? ALIGN(header->nLayers * sizeof(uint32_t))
+                                                                         : shapeBytes(header->nLayers)) ||
+        header->dataOffset > size ||
+        header->dataSize > size - header->dataOffset) {
+        return -1;
+    }
+    *sizes = (const uint32_t*)(file + sizeof(ModelHeader));
+    *activations = header->version == 1 ? NULL : *sizes + header->nLayers;
+    if (*activations && checkActivations(*activations, header->nLayers) != 0) {
+        return -1;
+    }
+    uint64_t expected = dtype == MODEL_DTYPE_I8 ? quantParamBytes(header->nLayers) : 0;
+    for (unsigned i = 0; i < header->nLayers; i++) {
+        if ((*sizes)[i] == 0) {
+            return -1;
+        }
+        if (i > 0 && dtype == MODEL_DTYPE_I8) {
+            expected = addBytes(expected, quantLayerBytes((*sizes)[i], (*sizes)[i - 1]));
+        } else if (i > 0 && header->dtype == MODEL_DTYPE_CSR) {
+            /* The nonzero count ends the row offsets at the start of the block */
+            uint32_t nnz;
+            if (addBytes(expected, sparseBytes((*sizes)[i], 0)) > header->dataSize) {
+                return -1;
+            }
+            memcpy(&nnz, file + header->dataOffset + expected + (uint64_t)(*sizes)[i] * sizeof(uint32_t), sizeof(nnz));
+            if (nnz > (uint64_t)(*sizes)[i] * (*sizes)[i - 1]) {
+                return -1;
+            }
+            expected = addBytes(expected, addBytes(sparseBytes((*sizes)[i], nnz), layerBytes((*sizes)[i], 1)));
+        } else if (i > 0) {
+            expected = addBytes(expected, addBytes(weightBytes(header->dtype, (*sizes)[i], (*sizes)[i - 1]),
+                                                   layerBytes((*sizes)[i], 1)));
+        }
+    }
+    *data = file + header->dataOffset;
+    if (expected != header->dataSize) {
+        return -1;
+    }
+    if (verifyChecksum && header->version < 3 &&
+        legacyChecksumBlock(LEGACY_CHECKSUM_SEED, *data, header->dataSize) != header->checksum) {
+        return -1;
+    }
+    if (verifyChecksum && header->version >= 3 &&
+        fileChecksum(file, header->dataOffset + header->dataSize) != header->checksum) {
+        return -1;
+    }
+    return 0;
+}
+
+static int writePadded(FILE *fp, const void *data, size_t size) {
+    static const char zeros[MODEL_ALIGNMENT];
+    if (fwrite(data, 1, size, fp) != size) {
+        return -1;
+    }
+    size_t pad = ALIGN(size) - size;
+    return fwrite(zeros, 1, pad, fp) == pad ? 0 : -1;
+}
+
+/*
+ * CSR copies of a pruned network's float weights to save it with, when they make the file smaller.
+ * Returns false with csr all NULL otherwise
+ */
+static bool sparseLayers(Network *net, SparseMatrix **csr) {
+    unsigned L = net->nLayers - 1;
+    for (unsigned i = 0; i < L; i++) {
+        csr[i] = NULL;
+    }
+    if (!net->pruned || net->weightType != WEIGHTS_F32) {
+        return false;
+    }
+    uint64_t sparse = 0, dense = 0;
+    for (unsigned i = 0; i < L && sparse != UINT64_MAX; i++) {
+        csr[i] = sparseFromDense(net->weights[i]);
+        sparse = csr[i] ? sparse + sparseBytes(csr[i]->rows, csr[i]->nnz) : UINT64_MAX;
+        dense += layerBytes(net->weights[i].rows, net->weights[i].cols);
+    }
+    if (sparse < dense) {
+        return true;
+    }
+    for (unsigned i = 0; i < L; i++) {
+        freeSparseMatrix(csr[i]);
+        csr[i] = NULL;
+    }
+    return false;
+}
+
+/**
+ * @brief Save a neural network to a file in the binary model format. A network with reduced
+ * precision weights is saved with them, making the file about half the size, and a pruned
+ * network is saved in CSR form if that is smaller
+ *
+ * @param filename The file name to save to
+ * @param net A pointer to a network
+ * @return 0 on success, -1 otherwise
+ */
+int saveNetworkToFile(const char *filename, Network *net) {
+    assert(filename && net);
+    ModelHeader header = {
+        .magic = MODEL_MAGIC,
+        .version = MODEL_VERSION,
+        .nLayers = net->nLayers,
+        .dtype = weightDtype(net->weightType),
+        .alignment = MODEL_ALIGNMENT,
+        .dataOffset = sizeof(ModelHeader) + shapeBytes(net->nLayers)
+    };
+    size_t elementSize = net->weightType == WEIGHTS_F32 ? sizeof(float) : sizeof(uint16_t);
+    const void *weights[net->nLayers - 1];
+    SparseMatrix *csr[net->nLayers - 1];
+    if (sparseLayers(net, csr)) {
+        header.dtype = MODEL_DTYPE_CSR;
+    }
+    uint32_t shape[2 * net->nLayers - 1];
+    for (unsigned i = 0; i < net->nLayers; i++) {
+        shape[i] = net->sizes[i];
+    }
+    for (unsigned i = 0; i < net->nLayers - 1; i++) {
+        shape[net->nLayers + i] = net->activations ? (uint32_t)net->activations[i] : MODEL_AF_UNSET;
+    }
+    uint32_t crc = checksumBlock(0, shape, sizeof(shape));
+    for (unsigned i = 0; i < net->nLayers - 1; i++) {
+        if (csr[i]) {
+            crc = checksumBlock(crc, csr[i]->rowStart, (csr[i]->rows + 1) * sizeof(uint32_t));
+            crc = checksumBlock(crc, csr[i]->columns, csr[i]->nnz * sizeof(uint32_t));
+            crc = checksumBlock(crc, csr[i]->values, csr[i]->nnz * sizeof(float));
+            header.dataSize += sparseBytes(csr[i]->rows, csr[i]->nnz);
+        } else {
+            weights[i] = net->weightType == WEIGHTS_F32 ? (const void*)net->weights[i].data : net->halfWeights[i];
+            crc = checksumBlock(crc, weights[i], len(net->weights[i]) * elementSize);
+            header.dataSize += weightBytes(header.dtype, net->weights[i].rows, net->weights[i].cols);
+        }
+        crc = checksumBlock(crc, net->biases[i].data, len(net->biases[i]) * sizeof(float));
+        header.dataSize += layerBytes(net->biases[i].rows, 1);
+    }
+    header.checksum = crc32c(crc, &header, sizeof(header));
+
+    FILE *fp = fopen(filename, "wb");
+    int err = fp == NULL;
+    err = err || fwrite(&header, sizeof(header), 1, fp) != 1;
+    err = err || writePadded(fp, shape, sizeof(shape));
+    for (unsigned i = 0; i < net->nLayers - 1 && !err; i++) {
+        if (csr[i]) {
+            err = writePadded(fp, csr[i]->rowStart, (csr[i]->rows + 1) * sizeof(uint32_t)) ||
+                  writePadded(fp, csr[i]->columns, csr[i]->nnz * sizeof(uint32_t)) ||
+                  writePadded(fp, csr[i]->values, csr[i]->nnz * sizeof(float));
+        } else {
+            err = writePadded(fp, weights[i], len(net->weights[i]) * elementSize);
+        }
+        err = err || writePadded(fp, net->biases[i].data, len(net->biases[i]) * sizeof(float));
+    }
+    for (unsigned i = 0; i < net->nLayers - 1; i++) {
+        freeSparseMatrix(csr[i]);
+    }
+    if ((fp && fclose(fp) != 0) || err) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Import a network saved in the old text format
+ */
+static Network *readNetworkFromTextFile(FILE *file) {
+    Network *net = calloc(1, sizeof(Network));
+    if (net == NULL) {
+        return NULL;
+    }
+    if (fscanf(file, "%u", &net->nLayers) != 1 || net->nLayers < 2) {
+        net->nLayers = 0;
+        freeNetwork(net);
+        return NULL;
+    }
+    net->sizes = malloc(net->nLayers * sizeof(unsigned));
+    if (!net->sizes) {
+        freeNetwork(net);
+        return NULL;
+    }
+    for (unsigned i = 0; i < net->nLayers; i++) {
+        if (fscanf(file, "%u", &net->sizes[i]) != 1) {
+            freeNetwork(net);
+            return NULL;
+        }
+    }
+    if (allocParameters(net) != 0) {
+        freeNetwork(net);
+        return NULL;
+    }
+    for (unsigned i = 0; i < net->nLayers - 1; i++) {
+        Matrix w = readMatrixFromFile(file);
+        Matrix b = readMatrixFromFile(file);
+        bool valid = w.data && b.data && w.rows == net->sizes[i + 1] && w.cols == net->sizes[i] &&
+                     b.rows == net->sizes[i + 1] && b.cols == 1;
+        if (valid) {
+            copyInto(net->weights[i], w);
+            copyInto(net->biases[i], b);
+        }
+        freeMatrix(w);
+        freeMatrix(b);
+        if (!valid) {
+            freeNetwork(net);
+            return NULL;
+        }
+    }
+    return net;
+}
+
+/* Map a whole file read-only. Returns NULL on failure */
+static unsigned char *mapFile(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *file = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        return NULL;
+    }
+    *size = st.st_size;
+    return file;
+}
+
+/* Scatter a weight block of the csr dtype into zeroed weights. Returns -1 if its indices are invalid */
+static int scatterSparseBlock(const unsigned char *block, Matrix w) {
+    const uint32_t *rowStart = (const uint32_t*)block;
+    uint64_t nnz = rowStart[w.rows];
+    const uint32_t *columns = (const uint32_t*)(block + ALIGN(((uint64_t)w.rows + 1) * sizeof(uint32_t)));
+    const float *values = (const float*)((const unsigned char*)columns + ALIGN(nnz * sizeof(uint32_t)));
+    if (rowStart[0] != 0) {
+        return -1;
+    }
+    for (unsigned r = 0; r < w.rows; r++) {
+        if (rowStart[r + 1] < rowStart[r]) {
+            return -1;
+        }
+        for (size_t k = rowStart[r]; k < rowStart[r + 1]; k++) {
+            if (columns[k] >= w.cols) {
+                return -1;
+            }
+            w.data[(size_t)r * w.cols + columns[k]] = values[k];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Build a network around a validated model file, pointing into it or copying out of it.
+ * Reduced precision weights are widened into float master weights when copying; a mapped
+ * reduced precision network only has the weights in the file. CSR weights are always copied.
+ */
+static Network *networkFromModel(const uint32_t *sizes, const uint32_t *activations, const unsigned char *data,
+                                 unsigned nLayers, uint32_t dtype, bool copyData) {
+    enum EWeightType type = dtype == MODEL_DTYPE_BF16 ? WEIGHTS_BF16 : dtype == MODEL_DTYPE_F16 ? WEIGHTS_F16 : WEIGHTS_F32;
+    Network *net = calloc(1, sizeof(Network));
+    if (!net) {
+        return NULL;
+    }
+    net->nLayers = nLayers;
+    net->sizes = malloc(nLayers * sizeof(unsigned));
+    if (!net->sizes) {
+        freeNetwork(net);
+        return NULL;
+    }
+    for (unsigned i = 0; i < nLayers; i++) {
+        net->sizes[i] = sizes[i];
+    }
+    if (copyData) {
+        if (allocParameters(net) != 0) {
+            freeNetwork(net);
+            return NULL;
+        }
+    } else {
+        net->biases = calloc(nLayers - 1, sizeof(Matrix));
+        net->weights = calloc(nLayers - 1, sizeof(Matrix));
+        if (!net->biases || !net->weights) {
+            freeNetwork(net);
+            return NULL;
+        }
+    }
+    if (activations && activations[0] != MODEL_AF_UNSET) {
+        net->activations = malloc((nLayers - 1) * sizeof(enum EActivationFunction));
+        if (!net->activations) {
+            freeNetwork(net);
+            return NULL;
+        }
+        for (unsigned i = 0; i < nLayers - 1; i++) {
+            net->activations[i] = activations[i];
+        }
+    }
+    if (type != WEIGHTS_F32 && !copyData) {
+        net->weightType = type;
+        net->halfWeights = calloc(nLayers - 1, sizeof(uint16_t*));
+        if (!net->halfWeights) {
+            freeNetwork(net);
+            return NULL;
+        }
+    }
+    for (unsigned i = 0; i < nLayers - 1; i++) {
+        unsigned rows = sizes[i + 1], cols = sizes[i];
+        const unsigned char *w = data;
+        data += dtype == MODEL_DTYPE_CSR ? sparseBytes(rows, ((const uint32_t*)w)[rows]) : weightBytes(dtype, rows, cols);
+        float *b = (float*)data;
+        data += layerBytes(rows, 1);
+        if (copyData) {
+            /* The parameters start out zeroed, which the pruned weights are */
+            if (dtype == MODEL_DTYPE_CSR && scatterSparseBlock(w, net->weights[i]) != 0) {
+                freeNetwork(net);
+                return NULL;
+            } else if (dtype != MODEL_DTYPE_CSR && type != WEIGHTS_F32) {
+                halfToFloat(type, (const uint16_t*)w, net->weights[i].data, (size_t)rows * cols);
+            } else if (dtype != MODEL_DTYPE_CSR) {
+                copyInto(net->weights[i], matrixFromData(rows, cols, (float*)w));
+            }
+            copyInto(net->biases[i], matrixFromData(rows, 1, b));
+        } else {
+            assert(dtype != MODEL_DTYPE_CSR);
+            if (type != WEIGHTS_F32) {
+                net->weights[i] = (Matrix){NULL, rows, cols};
+                net->halfWeights[i] = (uint16_t*)w;
+            } else {
+                net->weights[i] = matrixFromData(rows, cols, (float*)w);
+            }
+            net->biases[i] = matrixFromData(rows, 1, b);
+        }
+    }
+    /* Only the pruned weights were left out */
+    if (dtype == MODEL_DTYPE_CSR) {
+        net->pruned = true;
+        if (updateSparseWeights(net) != 0) {
+            freeNetwork(net);
+            return NULL;
+        }
+    }
+    /* The widened masters round back to exactly the stored weights */
+    if (type != WEIGHTS_F32 && copyData && setWeightType(net, type) != 0) {
+        freeNetwork(net);
+        return NULL;
+    }
+    return net;
+}
+
+/**
+ * @brief Read a network from a file. Both the binary format and the old text format are accepted
+ *
+ * @param filename the name of the file to open
+ * @return the deserialized network or NULL on failure
+ */
+Network *readNetworkFromFile(const char *filename) {
+    size_t size;
+    unsigned char *file = mapFile(filename, &size);
+    if (file && size >= sizeof(ModelHeader) && memcmp(file, MODEL_MAGIC, 8) == 0) {
+        const uint32_t *sizes, *activations;
+        const unsigned char *data;
+        Network *net = NULL;
+        const ModelHeader *header = (const ModelHeader*)file;
+        if (parseModel(file, size, true, MODEL_DTYPE_F32, &sizes, &activations, &data) == 0) {
+            net = networkFromModel(sizes, activations, data, header->nLayers, header->dtype, true);
+        }
+        munmap(file, size);
+        return net;
+    }
+    if (file) {
+        munmap(file, size);
+    }
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+    Network *net = readNetworkFromTextFile(fp);
+    fclose(fp);
+    return net;
+}
+
+/**
+ * @brief Map a network saved in the binary format straight from the page cache without copying it.
+ * The weights are read-only, so the network can be used for inference but not trained.
+ * Several processes mapping the same file share its memory. A network saved with reduced precision
+ * weights is mapped with only those, so it can run feedForward and inference contexts but not be quantized.
+ * Pruned networks saved in CSR form can't be mapped; read them with readNetworkFromFile.
+ *
+ * @param filename the name of the file to map
+ * @param verifyChecksum Whether to checksum the weights, which reads the whole file up front
+ * @return the mapped network or NULL on failure. Release it with freeNetwork
+ */
+Network *mapNetworkFromFile(const char *filename, bool verifyChecksum) {
+    size_t size;
+    unsigned char *file = mapFile(filename, &size);
+    if (!file) {
+        return NULL;
+    }
+    const uint32_t *sizes, *activations;
+    const unsigned char *data;
+    const ModelHeader *header = (const ModelHeader*)file;
+    Network *net = NULL;
+    if (parseModel(file, size, verifyChecksum, MODEL_DTYPE_F32, &sizes, &activations, &data) == 0 &&
+        header->dtype != MODEL_DTYPE_CSR) {
+        net = networkFromModel(sizes, activations, data, header->nLayers, header->dtype, false);
+    }
+    if (!net) {
+        munmap(file, size);
+        return NULL;
+    }
+    net->mapping = file;
+    net->mappingSize = size;
+    return net;
+}
+
+/**
+ * @brief Save a quantized network in the binary model format with the int8 dtype
+ *
+ * @param filename The file name to save to
+ * @param qnet The quantized network
+ * @return 0 on success, -1 otherwise
+ */
+int saveQuantizedNetwork(const char *filename, QuantizedNetwork *qnet) {
+    assert(filename && qnet);
+    unsigned L = qnet->nLayers - 1;
+    ModelHeader header = {
+        .magic = MODEL_MAGIC,
+        .version = MODEL_VERSION,
+        .nLayers = qnet->nLayers,
+        .dtype = MODEL_DTYPE_I8,
+        .alignment = MODEL_ALIGNMENT,
+        .dataOffset = sizeof(ModelHeader) + shapeBytes(qnet->nLayers)
+    };
+    /* The activation function followed by the per layer quantization parameters */
+    size_t paramsSize = sizeof(uint32_t) + L * sizeof(QuantParams);
+    unsigned char params[paramsSize];
+    uint32_t af = qnet->af;
+    memcpy(params, &af, sizeof(af));
+    for (unsigned i = 0; i < L; i++) {
+        QuantParams p = {qnet->layers[i].inScale, qnet->layers[i].inZero};
+        memcpy(params + sizeof(uint32_t) + i * sizeof(QuantParams), &p, sizeof(p));
+    }
+    uint32_t shape[2 * qnet->nLayers - 1];
+    for (unsigned i = 0; i < qnet->nLayers; i++) {
+        shape[i] = qnet->sizes[i];
+    }
+    for (unsigned i = 0; i < L; i++) {
+        shape[qnet->nLayers + i] = qnet->layers[i].af;
+    }
+    uint32_t crc = checksumBlock(checksumBlock(0, shape, sizeof(shape)), params, paramsSize);
+    header.dataSize = quantParamBytes(qnet->nLayers);
+    for (unsigned i = 0; i < L; i++) {
+        QuantizedLayer *layer = &qnet->layers[i];
+        crc = checksumBlock(crc, layer->weights, (size_t)layer->rows * layer->stride);
+        crc = checksumBlock(crc, layer->scales, layer->rows * sizeof(float));
+        crc = checksumBlock(crc, layer->biases, layer->rows * sizeof(float));
+        crc = checksumBlock(crc, layer->rowSums, layer->rows * sizeof(int32_t));
+        header.dataSize += quantLayerBytes(layer->rows, layer->cols);
+    }
+    header.checksum = crc32c(crc, &header, sizeof(header));
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    int err = fwrite(&header, sizeof(header), 1, fp) != 1;
+    err = err || writePadded(fp, shape, sizeof(shape)) || writePadded(fp, params, paramsSize);
+    for (unsigned i = 0; i < L && !err; i++) {
+        QuantizedLayer *layer = &qnet->layers[i];
+        err = writePadded(fp, layer->weights, (size_t)layer->rows * layer->stride) ||
+              writePadded(fp, layer->scales, layer->rows * sizeof(float)) ||
+              writePadded(fp, layer->biases, layer->rows * sizeof(float)) ||
+              writePadded(fp, layer->rowSums, layer->rows * sizeof(int32_t));
+    }
+    if (fclose(fp) != 0 || err) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Map a quantized network saved by saveQuantizedNetwork. The weights are used in place
+ *
+ * @param filename the name of the file to read
+ * @return the quantized network or NULL on failure. Release it with freeQuantizedNetwork
+ */
+QuantizedNetwork *readQuantizedNetwork(const char *filename) {
+    size_t size;
+    unsigned char *file = mapFile(filename, &size);
+    if (!file) {
+        return NULL;
+    }
+    const uint32_t *sizes, *activations;
+    const unsigned char *data;
+    if (parseModel(file, size, true, MODEL_DTYPE_I8, &sizes, &activations, &data) != 0 ||
+        (activations && activations[0] == MODEL_AF_UNSET)) {
+        munmap(file, size);
+        return NULL;
+    }
+    unsigned nLayers = ((ModelHeader*)file)->nLayers;
+    QuantizedNetwork *qnet = calloc(1, sizeof(QuantizedNetwork));
+    if (!qnet) {
+        munmap(file, size);
+        return NULL;
+    }
+    qnet->mapping = file;
+    qnet->mappingSize = size;
+    qnet->nLayers = nLayers;
+    qnet->sizes = malloc(nLayers * sizeof(unsigned));
+    qnet->layers = calloc(nLayers - 1, sizeof(QuantizedLayer));
+    if (!qnet->sizes || !qnet->layers) {
+        freeQuantizedNetwork(qnet);
+        return NULL;
+    }
+    for (unsigned i = 0; i < nLayers; i++) {
+        qnet->sizes[i] = sizes[i];
+    }
+    uint32_t af;
+    memcpy(&af, data, sizeof(af));
+    if (af > FN_LINEAR) {
+        freeQuantizedNetwork(qnet);
+        return NULL;
+    }
+    qnet->af = af;
+    const unsigned char *params = data + sizeof(uint32_t);
+    data += quantParamBytes(nLayers);
+    for (unsigned i = 0; i < nLayers - 1; i++) {
+        QuantizedLayer *layer = &qnet->layers[i];
+        QuantParams p;
+        memcpy(&p, params + i * sizeof(QuantParams), sizeof(p));
+        layer->rows = sizes[i + 1];
+        layer->cols = sizes[i];
+        layer->stride = ALIGN(layer->cols);
+        layer->inScale = p.inScale;
+        layer->inZero = p.inZero;
+        layer->af = activations ? activations[i] : af;
+        layer->weights = (int8_t*)data;
+        data += ALIGN((uint64_t)layer->rows * layer->stride);
+        layer->scales = (float*)data;
+        data += ALIGN(layer->rows * sizeof(float));
+        layer->biases = (float*)data;
+        data += ALIGN(layer->rows * sizeof(float));
+        layer->rowSums = (int32_t*)data;
+        data += ALIGN(layer->rows * sizeof(int32_t));
+    }
+    return qnet;
+}
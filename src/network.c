@@ -5,14 +5,18 @@
  * @date 2022-07-08
  */
 #include <assert.h>
-#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
 
+#include "half.h"
 #include "network.h"
+#include "quant.h"
+#include "sparse.h"
+#include "threadpool.h"
 
 #define RAND() (((float)rand()/(float)RAND_MAX)/100)
 
@@ -21,36 +25,27 @@
       __typeof__ (b) _b = (b); \
       _a < _b ? _a : _b; })
 
-static void shuffleTrainingData(TrainingExample *data, size_t size);
-static void backprop(Network *net, TrainingExample example, Matrix *dBiases, Matrix *dWeights, enum EActivationFunction af);
-
-/* Activation functions and their derivatives */
-static inline float _sigmoid(float x) { return 1/(1 + exp(-x)); }
-static inline float _sigmoidPrime(float x) { return _sigmoid(x) * (1 - _sigmoid(x)); }
-static inline float _tanh(float x) { return tanh(x); }
-static inline float _tanhPrime(float x) { return 1 - pow(tanh(x),2); }
-static inline float _relu(float x) { return x > 0 ? x : 0; }
-static inline float _reluPrime(float x) { return x >= 0 ? 1 : 0; }
-
 /**
  * @brief Create a neural network initialized with random wieghts and biases
  * 
- * @param layerSizes An array containing the size of each layer. Ex: {784, 100, 10}
+ * @param layerSizes An array containing the size of each layer. Ex: {784, 100, 10}. It is copied
  * @param nLayers The amount of layers which is the number of elements in the size array
  * @return Network* A pointer to a fully initialized network.
  */
-Network *initNetwork(unsigned *layerSizes, size_t nLayers) {
-    assert(nLayers > 0 && layerSizes);
+Network *initNetwork(const unsigned *layerSizes, size_t nLayers) {
+    assert(nLayers > 1 && layerSizes);
     Network *net = calloc(1, sizeof(Network));
     if (!net) {
         return NULL;
     }
-    net->sizes = layerSizes;
     net->nLayers = nLayers;
-    net->biases = malloc((nLayers - 1) * sizeof(Matrix));
-    net->weights = malloc((nLayers - 1) * sizeof(Matrix));
-    
-    if (!net->biases || !net->weights) {
+    net->sizes = malloc(nLayers * sizeof(unsigned));
+    if (!net->sizes) {
+        freeNetwork(net);
+        return NULL;
+    }
+    memcpy(net->sizes, layerSizes, nLayers * sizeof(unsigned));
+    if (allocParameters(net) != 0) {
         freeNetwork(net);
         return NULL;
     }
@@ -59,92 +54,107 @@ Network *initNetwork(unsigned *layerSizes, size_t nLayers) {
 
     /* Initialize weights and biases to random values */
     for (unsigned i = 0; i < nLayers - 1; i++) {
-        unsigned prevSize = layerSizes[i];
-        unsigned size = layerSizes[i + 1];
-        /* Biases */
-        Matrix b = matrix(size,1);
+        Matrix b = net->biases[i], w = net->weights[i];
         for (unsigned j = 0; j < len(b); j++) {
             b.data[j] = RAND();
         }
-        net->biases[i] = b;
-        /* Weights */
-        Matrix w = matrix(size, prevSize);
         for (unsigned j = 0; j < len(w); j++) {
             w.data[j] = RAND();
         }
-        net->weights[i] = w;
     }
     return net;
 }
 
 /**
- * @brief Save a neural network to a file stream
- * 
- * @param filename The file name to save to
- * @param net A pointer to a network
- * @return 0 on success, -1 otherwise
+ * @brief Lay out the weights and biases of a network with the given layer sizes in one flat buffer,
+ * in the order weights[0], biases[0], weights[1], ... This is the numbering the optimizer state,
+ * training gradients and checkpoints use as well.
+ *
+ * @param sizes The layer sizes
+ * @param nLayers Number of layers
+ * @param buffer The buffer, or NULL to only count
+ * @param weights If buffer is set, receives nLayers - 1 views of the weights in the buffer
+ * @param biases If buffer is set, receives nLayers - 1 views of the biases in the buffer
+ * @return size_t Number of floats in the buffer
  */
-int saveNetworkToFile(const char *filename, Network *net) {
-    FILE *fp = fopen(filename, "w");
-    if (fp == NULL) {
-        return -1;
-    }
-    fprintf(fp,"%d ",net->nLayers);
-    for (unsigned i = 0; i < net->nLayers; i++) {
-        fprintf(fp, "%d ", net->sizes[i]);
+size_t layoutParameters(const unsigned *sizes, unsigned nLayers, float *buffer, Matrix *weights, Matrix *biases) {
+    size_t n = 0;
+    for (unsigned i = 0; i < nLayers - 1; i++) {
+        if (buffer) {
+            weights[i] = matrixFromData(sizes[i + 1], sizes[i], buffer + n);
+        }
+        n += (size_t)sizes[i + 1] * sizes[i];
+        if (buffer) {
+            biases[i] = matrixFromData(sizes[i + 1], 1, buffer + n);
+        }
+        n += sizes[i + 1];
     }
-    for (unsigned i = 0; i < net->nLayers - 1; i++) {
-        saveMatrixToFile(fp, net->weights[i]);
-        saveMatrixToFile(fp, net->biases[i]);
+    return n;
+}
+
+/**
+ * @brief Give a network with its sizes set a zeroed parameter buffer and point its weights and biases into it
+ *
+ * @param net Pointer to a network without weights
+ * @return 0 on success, -1 on failure
+ */
+int allocParameters(Network *net) {
+    assert(net && net->sizes && !net->weights && !net->biases);
+    unsigned L = net->nLayers - 1;
+    net->nParameters = layoutParameters(net->sizes, net->nLayers, NULL, NULL, NULL);
+    size_t bytes = (net->nParameters * sizeof(float) + 63) & ~(size_t)63;
+    net->parameters = aligned_alloc(64, bytes);
+    net->weights = malloc(L * sizeof(Matrix));
+    net->biases = malloc(L * sizeof(Matrix));
+    if (!net->parameters || !net->weights || !net->biases) {
+        return -1;
     }
-    fclose(fp);
+    memset(net->parameters, 0, bytes);
+    layoutParameters(net->sizes, net->nLayers, net->parameters, net->weights, net->biases);
     return 0;
 }
 
 /**
- * @brief Read a network from a file stream
- * 
- * @param filename the name of the file to open
- * @return the deserialized network or NULL on failure
+ * @brief Give every layer of a network its own activation function, which is then used in place of
+ * the one passed to training and inference and is saved with the network.
+ * FN_SOFTMAX may only be used by the output layer
+ *
+ * @param net Pointer to a network
+ * @param afs nLayers - 1 activations, one per weight layer starting with the first hidden layer.
+ *            NULL goes back to the activation passed at each call
+ * @return 0 on success, -1 otherwise
  */
-Network *readNetworkFromFile(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        return NULL;
+int setLayerActivations(Network *net, const enum EActivationFunction *afs) {
+    assert(net);
+    unsigned L = net->nLayers - 1;
+    if (!afs) {
+        free(net->activations);
+        net->activations = NULL;
+        return 0;
     }
-    Network *net = calloc(1, sizeof(Network));
-    if (net == NULL) {
-        return NULL;
+    for (unsigned i = 0; i < L; i++) {
+        assert(afs[i] <= FN_LINEAR && (afs[i] != FN_SOFTMAX || i + 1 == L));
     }
-    int read;
-    read = fscanf(file, "%d", &net->nLayers);
-    if (read != 1) {
-        freeNetwork(net);
-        return NULL;
-    }
-    net->sizes = malloc(net->nLayers * sizeof(unsigned));
-    if (!net->sizes) {
-        freeNetwork(net);
-        return NULL;
-    }
-    for (unsigned i = 0; i < net->nLayers; i++) {
-        read = fscanf(file, "%d", &net->sizes[i]);
-        if (read != 1) {
-            freeNetwork(net);
-            return NULL;
+    if (!net->activations) {
+        net->activations = malloc(L * sizeof(enum EActivationFunction));
+        if (!net->activations) {
+            return -1;
         }
     }
-    net->biases = malloc((net->nLayers - 1) * sizeof(Matrix));
-    net->weights = malloc((net->nLayers - 1) * sizeof(Matrix));
-    if (!net->biases || !net->weights) {
-        freeNetwork(net);
-        return NULL;
-    }
-    for (unsigned i = 0; i < net->nLayers - 1; i++) {
-        net->weights[i] = readMatrixFromFile(file);
-        net->biases[i] = readMatrixFromFile(file);
-    }
-    return net;
+    memcpy(net->activations, afs, L * sizeof(enum EActivationFunction));
+    return 0;
+}
+
+/**
+ * @brief The activation function of a weight layer
+ *
+ * @param net Pointer to a network
+ * @param layer Index of the weight layer, 0 for the first hidden layer
+ * @param af Returned when the network doesn't specify its activations
+ */
+enum EActivationFunction layerActivation(const Network *net, unsigned layer, enum EActivationFunction af) {
+    assert(layer < net->nLayers - 1);
+    return net->activations ? net->activations[layer] : af;
 }
 
 /**
@@ -156,213 +166,217 @@ Network *readNetworkFromFile(const char *filename) {
  */
 Matrix feedForward(Network *net, float *input, enum EActivationFunction af) {
     assert(net && input);
-    float (*activationFunction)(float);
-    switch(af){
-        case FN_SIGMOID:
-            activationFunction = _sigmoid;
-            break;
-        case FN_RELU:
-            activationFunction = _relu;
-            break;
-        case FN_TANH:
-            activationFunction = _tanh;
-            break;
-        default:
-            activationFunction = _sigmoid;
-            break;
-    }
-    Matrix result = {0}, a, b, w, wa;
+    Matrix result = {0}, a;
     a = matrixFromData(net->sizes[0], 1, input);
     for (unsigned i = 0; i < net->nLayers - 1; i++) {
-        b = net->biases[i];
-        w = net->weights[i];
-        wa = mult(w, a);
+        Matrix z;
+        const SparseMatrix *s = net->sparseWeights ? net->sparseWeights[i] : NULL;
+        if (s && s->nnz <= SPARSE_MAX_GEMV_DENSITY * len(net->weights[i])) {
+            z = matrix(net->sizes[i + 1], 1);
+            spmv(s, a.data, z.data);
+        } else if (net->weightType != WEIGHTS_F32) {
+            z = matrix(net->sizes[i + 1], 1);
+            hgemv(net->weightType, z.rows, a.rows, net->halfWeights[i], a.rows, a.data, z.data);
+        } else {
+            z = mult(net->weights[i], a);
+        }
+        addBiasActivate(z, net->biases[i], layerActivation(net, i, af));
         freeMatrix(result);
-        result = add(wa, b);
-        applyFuncInPlace(result,activationFunction);
+        result = z;
         a = result;
-        freeMatrix(wa);
     }
     return result;
 }
 
-/**
- * @brief Train the network using SGD algorithm
- * 
- * @param net Pointer to a network
- * @param trainingData Array of TrainingExamples to train the network with
- * @param nExamples Number of TrainingExamples in trainingData
- * @param epochs Amount of epochs
- * @param batchSize Maximum size of each mini-batch
- * @param learningRate Learning rate variable
- * @param af The activation function
- * @param testData Optional: Array of TrainingExamples to test the network against.
- * @param nTestData Optional: Number of TrainingExamples in testData
- * Note: The TrainingExamples in trainingData should have the same output size as the network, contianing the desired activation for each output perceptron.
- *       The TrainingExamples in testData should have output size 1, containing the index of the desired highest activation perceptron.
- */
-void stochasticGradientDescent(
-    Network* net,
-    TrainingExample *trainingData,
-    size_t nExamples,
-    unsigned epochs, 
-    size_t batchSize,
-    float learningRate,
-    enum EActivationFunction af,
-    TrainingExample *testData,
-    unsigned nTestData) 
-{
-    assert( net &&
-        nExamples && 
-        trainingData &&
-        epochs && 
-        batchSize && 
-        learningRate && 
-        (!!nTestData == !!testData));
-    for (unsigned i = 0; i < epochs; i++) {
-        shuffleTrainingData(trainingData, nExamples);
-        /* Run the backpropagation algorithm on each mini batch and update the network */
-        for (TrainingExample *b = trainingData; b < trainingData + nExamples; b+=batchSize) {
-            
-            size_t bSize;
-            if (b + batchSize - 1 < trainingData + nExamples) {
-                bSize = batchSize;
-            } else {
-                bSize = trainingData + nExamples - b + 1;
-            }
-            Matrix dWeights[net->nLayers - 1], dBiases[net->nLayers - 1];
-            for (unsigned j = 0; j < net->nLayers - 1; j++) {
-                    dBiases[j] = matrix(net->biases[j].rows, net->biases[j].cols);
-                    dWeights[j] = matrix(net->weights[j].rows, net->weights[j].cols);
-            }
-            for (unsigned j = 0; j < bSize; j++) {
-                TrainingExample example = b[j];
-                backprop(net,example, dBiases, dWeights, af);
-            }
-            for (unsigned j = 0; j < net->nLayers - 1; j++) {
-                Matrix changeWeight = scalarMult(dWeights[j], (learningRate/(float)bSize));
-                subInPlace(net->weights[j],changeWeight);
-                Matrix changeBias = scalarMult(dBiases[j], (learningRate/bSize));
-                subInPlace(net->biases[j],changeBias);
+struct InferenceContext {
+    Network *net;
+    /* Set instead of net for an int8 network, see initQuantizedInferenceContext */
+    QuantizedNetwork *qnet;
+    /* Weights the float network had when the context was created */
+    enum EWeightType weightType;
+    /* Examples per GEMM pass of a worker */
+    size_t chunk;
+    size_t maxSize;
+    ThreadPool *pool;
+    /* Per worker scratch of perWorker floats */
+    float *scratch;
+    size_t perWorker;
+    /* The request being served */
+    const float *inputs;
+    size_t n;
+    enum EActivationFunction af;
+    float *outputs;
+    int *labels;
+};
 
-                freeMatrix(dWeights[j]);
-                freeMatrix(dBiases[j]);
-                freeMatrix(changeWeight);
-                freeMatrix(changeBias);
-            }
-        }
-         if (testData) {
-                unsigned nPassed = 0;
-                for (unsigned j = 0; j < nTestData; j++) {
-                    TrainingExample test = testData[j];
-                    Matrix result = feedForward(net, test.input, af);
-                    if (maxIndex(result) == *test.output) {
-                        nPassed++;
-                    }
-                    freeMatrix(result);
-                }
-                printf("Epoch %d complete. %d/%d passing\n", i+1, nPassed, nTestData);
-        } else {
-            printf("Epoch %d complete\n", i+1);
+/* Start the context's workers and give each perWorker floats of 64 byte aligned scratch */
+static InferenceContext *initContextScratch(InferenceContext *ctx, size_t perWorker, unsigned nThreads) {
+    if (nThreads != 1) {
+        ctx->pool = initThreadPool(nThreads);
+        if (!ctx->pool) {
+            freeInferenceContext(ctx);
+            return NULL;
         }
     }
+    ctx->perWorker = (perWorker + 15) & ~(size_t)15;
+    ctx->scratch = aligned_alloc(64, threadPoolSize(ctx->pool) * ctx->perWorker * sizeof(float));
+    if (!ctx->scratch) {
+        freeInferenceContext(ctx);
+        return NULL;
+    }
+    return ctx;
 }
 
 /**
- * @brief Runs the backpropagation algorithm. Helper for SGD
+ * @brief Create the scratch space to run batched inference on a network
  * 
- * @param net Pointer to a network
- * @param example The TrainingExample to feed forward
- * @param dBiases An array which will be modified according to delta nabla b
- * @param dWeights An array which will be modified according to delta nabla w
- * @param af The activation function to use
+ * A context serves one request at a time; use one context per calling thread. It uses the network's
+ * reduced precision weights if setWeightType was called before the context was created, and the
+ * CSR weights of the sparse layers of a pruned network (see pruneNetwork) as they are when it runs.
+ * 
+ * @param net Pointer to a network. It must outlive the context
+ * @param maxBatch Number of examples each worker pushes through the network per GEMM pass
+ * @param nThreads Worker threads to fan batches out to, 0 for one per online CPU
+ * @return InferenceContext* The context or NULL on failure
  */
-static void backprop(Network *net, TrainingExample example, Matrix *dBiases, Matrix *dWeights, enum EActivationFunction af) {
-    assert(net && dBiases && dWeights);
-    float (*activationFunction)(float);
-    float (*activationFunctionDerivative)(float);
-    switch(af){
-        case FN_SIGMOID:
-            activationFunction = _sigmoid;
-            activationFunctionDerivative = _sigmoidPrime;
-            break;
-        case FN_RELU:
-            activationFunction = _relu;
-            activationFunctionDerivative = _reluPrime;
-            break;
-        case FN_TANH:
-            activationFunction = _tanh;
-            activationFunctionDerivative = _tanhPrime;
-            break;
-        default:
-            activationFunction = _sigmoid;
-            activationFunctionDerivative = _sigmoidPrime;
-            break;
+InferenceContext *initInferenceContext(Network *net, size_t maxBatch, unsigned nThreads) {
+    assert(net && maxBatch);
+    InferenceContext *ctx = calloc(1, sizeof(InferenceContext));
+    if (!ctx) {
+        return NULL;
     }
-    Matrix zs[net->nLayers - 1], activations[net->nLayers], a, b, w, wa, z;
-
-    a = matrixFromData(example.nInputs, 1, example.input);
-    activations[0] = copy(a);
-    /* Feed Forward but save z's */
-    for (unsigned i = 0; i < net->nLayers - 1; i++) {
-        b = net->biases[i];
-        w = net->weights[i];
-        wa = mult(w, a);
-        z = add(wa, b);
-        a = applyFunc(z,activationFunction);
-        
-        zs[i] = z;
-
-        activations[i + 1] = a;
-        
-        freeMatrix(wa);
+    ctx->net = net;
+    ctx->weightType = net->weightType;
+    ctx->chunk = maxBatch;
+    for (unsigned i = 0; i < net->nLayers; i++) {
+        ctx->maxSize = net->sizes[i] > ctx->maxSize ? net->sizes[i] : ctx->maxSize;
     }
-    Matrix costDerivative, delta, aT, deltaAT, wT, wTdelta, newDelta;
-
-    costDerivative = sub(activations[net->nLayers - 1], matrixFromData(example.nOutputs,1,example.output));
-    applyFuncInPlace(zs[net->nLayers - 2], activationFunctionDerivative);
-    delta = hadamard(costDerivative, zs[net->nLayers - 2]);
+    /* Two ping-pong activation buffers per worker, plus the widened weights of reduced precision layers */
+    size_t halfScratch = net->weightType != WEIGHTS_F32 ? hgemmScratchSize(ctx->maxSize) : 0;
+    return initContextScratch(ctx, 2 * ctx->maxSize * maxBatch + halfScratch, nThreads);
+}
 
-    freeMatrix(costDerivative);
+/**
+ * @brief Create an inference context running a quantized network. feedForwardBatch and classifyBatch
+ * then use the int8 kernels and the activation function the network was quantized with.
+ * 
+ * @param qnet The quantized network. It must outlive the context
+ * @param maxBatch Number of examples each worker pushes through the network per GEMM pass
+ * @param nThreads Worker threads to fan batches out to, 0 for one per online CPU
+ * @return InferenceContext* The context or NULL on failure
+ */
+InferenceContext *initQuantizedInferenceContext(QuantizedNetwork *qnet, size_t maxBatch, unsigned nThreads) {
+    assert(qnet && maxBatch);
+    InferenceContext *ctx = calloc(1, sizeof(InferenceContext));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->qnet = qnet;
+    ctx->chunk = maxBatch;
+    return initContextScratch(ctx, quantizedScratchSize(qnet, maxBatch), nThreads);
+}
 
-    addInPlace(dBiases[net->nLayers - 2],delta);
-    aT = transpose(activations[net->nLayers - 2]);
-    deltaAT = mult(delta, aT);
-    
-    addInPlace(dWeights[net->nLayers - 2], deltaAT);
-    freeMatrix(deltaAT);
-    freeMatrix(aT);
-    for (unsigned i = 2; i < net->nLayers; i++) {
-        z = zs[net->nLayers - 1 - i];
-        applyFuncInPlace(z, activationFunctionDerivative);
-        wT = transpose(net->weights[net->nLayers - i]);
-        wTdelta = mult(wT, delta);
-        newDelta = hadamard(wTdelta, z);
-        
-        addInPlace(dBiases[net->nLayers - 1 - i], newDelta);
-        aT = transpose(activations[net->nLayers - 1 - i]);
-        deltaAT = mult(newDelta,aT);
-        addInPlace(dWeights[net->nLayers - 1 - i], deltaAT);
-        
-        freeMatrix(delta);
-        freeMatrix(deltaAT);
-        freeMatrix(wT);
-        freeMatrix(wTdelta);
-        freeMatrix(aT);
-        
-        delta = newDelta;
+/**
+ * @brief Free an inference context. The network is not freed
+ * 
+ * @param ctx The context to free
+ */
+void freeInferenceContext(InferenceContext *ctx) {
+    if (ctx) {
+        freeThreadPool(ctx->pool);
+        free(ctx->scratch);
+        free(ctx);
     }
+}
 
-    freeMatrix(delta);
-    
-    for (unsigned i = 0; i < net->nLayers - 1; i++){
-        freeMatrix(zs[i]);
+/* Worker w handles chunks w, w + nWorkers, ... of the request */
+static void inferenceJob(void *arg, unsigned worker, unsigned nWorkers) {
+    InferenceContext *ctx = arg;
+    float *scratch = ctx->scratch + worker * ctx->perWorker;
+    if (ctx->qnet) {
+        unsigned nIn = ctx->qnet->sizes[0], nOut = ctx->qnet->sizes[ctx->qnet->nLayers - 1];
+        for (size_t start = worker * ctx->chunk; start < ctx->n; start += nWorkers * ctx->chunk) {
+            size_t c = min(ctx->chunk, ctx->n - start);
+            quantizedForward(ctx->qnet, ctx->inputs + start * nIn, c, scratch,
+                             ctx->outputs ? ctx->outputs + start * nOut : NULL,
+                             ctx->labels ? ctx->labels + start : NULL);
+        }
+        return;
     }
-    for (unsigned i = 0; i < net->nLayers; i++) {
-        freeMatrix(activations[i]);
+    Network *net = ctx->net;
+    unsigned L = net->nLayers - 1;
+    float *bufs[3] = {scratch, scratch + ctx->maxSize * ctx->chunk, scratch + 2 * ctx->maxSize * ctx->chunk};
+    assert(ctx->weightType == net->weightType);
+
+    for (size_t start = worker * ctx->chunk; start < ctx->n; start += nWorkers * ctx->chunk) {
+        size_t c = min(ctx->chunk, ctx->n - start);
+        Matrix in = matrixFromData(c, net->sizes[0], (float*)ctx->inputs + start * net->sizes[0]);
+        Matrix a = matrixFromData(net->sizes[0], c, bufs[0]);
+        transposeInto(a, in);
+        for (unsigned i = 0; i < L; i++) {
+            Matrix z = matrixFromData(net->sizes[i + 1], c, bufs[(i + 1) % 2]);
+            if (net->sparseWeights && net->sparseWeights[i]) {
+                spmm(net->sparseWeights[i], a.data, c, z.data);
+            } else if (ctx->weightType != WEIGHTS_F32) {
+                hgemm(ctx->weightType, z.rows, c, a.rows, net->halfWeights[i], a.data, z.data, bufs[2]);
+            } else {
+                multInto(z, net->weights[i], a);
+            }
+            enum EActivationFunction af = layerActivation(net, i, ctx->af);
+            /* Only the highest output is needed when classifying, which the output activation rarely changes */
+            if (i + 1 == L && !ctx->outputs && preservesOrder(af)) {
+                af = FN_LINEAR;
+            }
+            addBiasActivate(z, net->biases[i], af);
+            a = z;
+        }
+        if (ctx->outputs) {
+            transposeInto(matrixFromData(c, net->sizes[L], ctx->outputs + start * net->sizes[L]), a);
+        }
+        if (ctx->labels) {
+            maxIndexPerColumn(a, ctx->labels + start);
+        }
     }
 }
 
+/**
+ * @brief Feed a batch of inputs forward as one GEMM per layer, spread over the context's threads
+ * 
+ * @param ctx Inference context for the network
+ * @param inputs n inputs stored one after another, each with as many elements as the input layer
+ * @param n Number of inputs
+ * @param af The activation function of the layers the network doesn't specify, see setLayerActivations
+ * @param outputs Buffer receiving the n outputs one after another, each with as many elements as the output layer
+ */
+void feedForwardBatch(InferenceContext *ctx, const float *inputs, size_t n, enum EActivationFunction af, float *outputs) {
+    assert(ctx && inputs && outputs && (!ctx->qnet || ctx->qnet->af == af));
+    ctx->inputs = inputs;
+    ctx->n = n;
+    ctx->af = af;
+    ctx->outputs = outputs;
+    ctx->labels = NULL;
+    threadPoolRun(ctx->pool, inferenceJob, ctx);
+}
+
+/**
+ * @brief Classify a batch of inputs, i.e. find the index of the highest output activation of each
+ * 
+ * @param ctx Inference context for the network
+ * @param inputs n inputs stored one after another, each with as many elements as the input layer
+ * @param n Number of inputs
+ * @param af The activation function of the layers the network doesn't specify, see setLayerActivations
+ * @param labels Buffer receiving the n predicted indices
+ */
+void classifyBatch(InferenceContext *ctx, const float *inputs, size_t n, enum EActivationFunction af, int *labels) {
+    assert(ctx && inputs && labels && (!ctx->qnet || ctx->qnet->af == af));
+    ctx->inputs = inputs;
+    ctx->n = n;
+    ctx->af = af;
+    ctx->outputs = NULL;
+    ctx->labels = labels;
+    threadPoolRun(ctx->pool, inferenceJob, ctx);
+}
+
 /**
  * @brief Create a Training Example object
  * 
@@ -385,34 +399,26 @@ TrainingExample createTrainingExample(float *expectedInput, float *expectedOutpu
  */
 void freeNetwork(Network *net) {
     if (net) {
-        if (net->biases) {
-            for (unsigned i = 0; i < net->nLayers - 1; i++) {
-                freeMatrix(net->biases[i]);
+        free(net->parameters);
+        free(net->biases);
+        free(net->weights);
+        free(net->sizes);
+        free(net->activations);
+        if (net->halfWeights) {
+            for (unsigned i = 0; i < net->nLayers - 1 && !net->mapping; i++) {
+                free(net->halfWeights[i]);
             }
-            free(net->biases);
+            free(net->halfWeights);
         }
-        if (net->weights) {
+        if (net->sparseWeights) {
             for (unsigned i = 0; i < net->nLayers - 1; i++) {
-                freeMatrix(net->weights[i]);
+                freeSparseMatrix(net->sparseWeights[i]);
             }
-            free(net->weights);
+            free(net->sparseWeights);
+        }
+        if (net->mapping) {
+            munmap(net->mapping, net->mappingSize);
         }
         free(net);
     }
 }
-
-/**
- * @brief Shuffle elements in the array data. Helper for SGD. 
- * 
- * @param data The array to shuffle
- * @param size Number of elements in data array.
- */
-static void shuffleTrainingData(TrainingExample *data, size_t size){
-    assert(data && size);
-    for (unsigned i = 0; i < size; i++) {
-        unsigned j = rand() % size;
-        TrainingExample tmp = data[i];
-        data[i] = data[j];
-        data[j] = tmp;
-    }
-}
\ No newline at end of file
@@ -1,30 +1,261 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "activation.h"
 #include "matrix.h"
 
+/* Storage type of the weights used for inference, see setWeightType */
+enum EWeightType {
+    WEIGHTS_F32,
+    /* bfloat16: the upper half of a float, same range with an 8 bit mantissa */
+    WEIGHTS_BF16,
+    /* IEEE half precision: 11 bit mantissa, up to 65504 */
+    WEIGHTS_F16
+};
+
 typedef struct Network {
     unsigned nLayers, *sizes;
+    /* Views into parameters, see layoutParameters */
     Matrix *biases;
     Matrix *weights;
+    /* Every weight and bias in one 64 byte aligned buffer of nParameters floats, ordered weights[0],
+       biases[0], weights[1], ... NULL when the weights point into a file mapping */
+    float *parameters;
+    size_t nParameters;
+    /* Activation of every weight layer, or NULL to use the one passed to training and inference. See setLayerActivations */
+    enum EActivationFunction *activations;
+    /* Reduced precision copies of the weights used for inference unless weightType is WEIGHTS_F32.
+       weights holds the float master copy, except in a reduced precision network mapped from a file */
+    enum EWeightType weightType;
+    uint16_t **halfWeights;
+    /* Set by pruning: weights that are exactly zero are pruned and stay zero through training */
+    bool pruned;
+    /* CSR copies of the weights of the layers sparse enough to use them for inference, NULL for the
+       others, or NULL when the network isn't pruned. See updateSparseWeights */
+    struct SparseMatrix **sparseWeights;
+    /* Set when the weights point into a read-only file mapping, see mapNetworkFromFile */
+    void *mapping;
+    size_t mappingSize;
 } Network;
 
-enum EActivationFunction {
-    FN_SIGMOID,
-    FN_TANH,
-    FN_RELU
-};
-
 typedef struct TrainingExample {
     unsigned nInputs, nOutputs;
     float *input, *output;
 } TrainingExample;
 
-Network *initNetwork(unsigned *layerSizes, size_t nLayers);
+/* Preallocated scratch for batched inference on one network, see initInferenceContext */
+typedef struct InferenceContext InferenceContext;
+
+/* Connection to the other processes of a distributed training run, see initCommunicator */
+typedef struct Communicator Communicator;
+
+/* Parameter update rule, see OptimizerConfig */
+enum EOptimizer {
+    /* w -= lr * g */
+    OPT_SGD,
+    /* v = momentum * v + g, w -= lr * v */
+    OPT_MOMENTUM,
+    /* v = momentum * v + g, w -= lr * (g + momentum * v) */
+    OPT_NESTEROV,
+    /* Adam, with weight decay added to the gradient (L2 regularisation) */
+    OPT_ADAM,
+    /* Adam with weight decay applied directly to the weights */
+    OPT_ADAMW
+};
+
+/* Learning rate as a function of the epoch */
+enum ESchedule {
+    SCHEDULE_CONSTANT,
+    /* Multiplied by decay every stepEpochs epochs */
+    SCHEDULE_STEP,
+    /* Multiplied by decay every epoch */
+    SCHEDULE_EXPONENTIAL,
+    /* Cosine annealing from the learning rate down to minLearningRate over all epochs */
+    SCHEDULE_COSINE
+};
+
+/* Optimizer and learning rate schedule. A zeroed config is plain SGD at a constant rate; zero fields take their defaults */
+typedef struct OptimizerConfig {
+    enum EOptimizer type;
+    /* Momentum and Nesterov (default 0.9) */
+    float momentum;
+    /* Adam (defaults 0.9, 0.999 and 1e-8) */
+    float beta1, beta2, epsilon;
+    /* Applied to the weights but not the biases */
+    float weightDecay;
+    enum ESchedule schedule;
+    /* Step and exponential schedules (default decay 0.1 for step, 0.9 for exponential; default stepEpochs 10) */
+    float decay;
+    unsigned stepEpochs;
+    float minLearningRate;
+    /* Number of update steps over which the learning rate ramps up linearly from 0 */
+    unsigned warmupSteps;
+} OptimizerConfig;
+
+/* Phases of a training epoch, see TrainingStats */
+enum ETrainingPhase {
+    /* Gathering and packing mini-batches, including waiting for a prefetcher */
+    PHASE_BATCH,
+    PHASE_FORWARD,
+    PHASE_BACKWARD,
+    /* Summing the workers' gradients, and waiting for their sums over the ranks of a distributed run */
+    PHASE_REDUCE,
+    /* Applying the gradient step to the weights */
+    PHASE_UPDATE,
+    /* Waiting for the other workers at a barrier */
+    PHASE_WAIT,
+    /* Shuffling the example order between epochs */
+    PHASE_SHUFFLE,
+    /* Testing the network after an epoch, or snapshotting the weights for a background test */
+    PHASE_EVALUATION,
+    /* Copying the training state for a checkpoint */
+    PHASE_CHECKPOINT,
+    PHASE_COUNT
+};
+
+/* Throughput of one weight layer over an epoch. Layer i connects sizes[i] to sizes[i + 1] */
+typedef struct LayerStats {
+    double forwardSeconds, backwardSeconds;
+    /* Achieved over all workers together */
+    double forwardGflops, backwardGflops;
+} LayerStats;
+
+/* Progress and performance of one epoch, passed to TrainingConfig.onEpoch */
+typedef struct TrainingStats {
+    /* Zero based epoch number and the total number of epochs */
+    unsigned epoch, epochs;
+    size_t nExamples;
+    /* Test examples classified correctly and tested, both 0 without a test set or with asyncEvaluation */
+    size_t nPassed, nTested;
+    /* Learning rate of the epoch before any warmup */
+    float learningRate;
+    /* Wall time of the epoch's training, excluding shuffling and evaluation */
+    double seconds, samplesPerSecond;
+    /* Time spent per phase. Phases run by the workers are averaged over the workers */
+    double phaseSeconds[PHASE_COUNT];
+    /* Heap allocations made by the library while training the epoch */
+    size_t allocations;
+    /* One entry per weight layer, valid during the callback only */
+    unsigned nLayers;
+    const LayerStats *layers;
+} TrainingStats;
+
+/* Called after every epoch instead of printing the progress */
+typedef void (*TrainingCallback)(const TrainingStats *stats, void *userData);
+
+/* Result of one test of the network, passed to TrainingConfig.onEvaluation */
+typedef struct EvaluationStats {
+    /* Zero based epoch the tested weights were taken in, and the update steps taken up to then */
+    unsigned epoch;
+    size_t step;
+    /* Whether the weights are those at the end of the epoch rather than every evaluateEvery steps */
+    bool endOfEpoch;
+    size_t nPassed, nTested;
+    /* Time spent testing */
+    double seconds;
+} EvaluationStats;
+
+/* Called after every test. Background tests call it from the evaluation thread */
+typedef void (*EvaluationCallback)(const EvaluationStats *stats, void *userData);
+
+typedef struct TrainingConfig {
+    unsigned epochs;
+    size_t batchSize;
+    float learningRate;
+    /* Activation of the layers the network doesn't specify itself */
+    enum EActivationFunction af;
+    /* Cross-entropy needs a sigmoid or softmax output layer. A softmax output always uses cross-entropy */
+    enum ECost cost;
+    /* Worker threads, 0 for one per online CPU */
+    unsigned nThreads;
+    /* Let workers update the shared weights without synchronising (faster, not deterministic) */
+    bool hogwild;
+    /* Seed for shuffling, 0 to seed from the clock. Runs with the same seed and thread count are identical */
+    unsigned seed;
+    OptimizerConfig optimizer;
+    /* Test on a snapshot of the weights in a background thread while the next epoch trains. The
+       results go to onEvaluation, or are printed, instead of into the epoch's stats */
+    bool asyncEvaluation;
+    /* Also test, in the background, after every evaluateEvery update steps (of worker 0 with
+       Hogwild). 0 to test at the end of every epoch only */
+    size_t evaluateEvery;
+    /* Optional: file the weights, optimizer state, position and PRNG are checkpointed to after every
+       epoch, written in the background and atomically replaced */
+    const char *checkpointPath;
+    /* Also checkpoint every checkpointEvery update steps. In-memory training without Hogwild only */
+    size_t checkpointEvery;
+    /* Continue from the checkpoint at checkpointPath if there is one from the same network, optimizer
+       and training set; the run then goes on exactly as if it had not been interrupted */
+    bool resume;
+    /* Optional: train together with the other processes of a communicator, each on the examples it
+       is given and with one worker thread. Every step takes a batch from each process and sums the
+       gradients over all of them, and all processes start from the weights of rank 0 and keep
+       identical weights. In-memory training without Hogwild, resuming or checkpointEvery only */
+    Communicator *communicator;
+    /* Optional: receives the stats of every epoch. Progress is printed to stdout when unset */
+    TrainingCallback onEpoch;
+    /* Optional: receives the result of every test. Background results are printed when unset */
+    EvaluationCallback onEvaluation;
+    void *userData;
+} TrainingConfig;
+
+/* Outcome of one network of a sweep, see trainNetworksOnSet */
+typedef struct SweepResult {
+    /* Epochs trained, fewer than its config's when it was stopped early */
+    unsigned epochs;
+    bool stopped;
+    /* Test examples classified correctly after its last epoch, 0 without a test set */
+    size_t nPassed;
+} SweepResult;
+
+/* Progress of one epoch of a sweep, passed to SweepConfig.onEpoch */
+typedef struct SweepStats {
+    /* Zero based epoch number and the number of networks */
+    unsigned epoch, nModels;
+    /* Every network's result so far, valid during the callback only */
+    const SweepResult *models;
+    /* Networks trained in this epoch, and those going on to the next one */
+    unsigned nTrained, nActive;
+    size_t nTested;
+    /* Wall time of the epoch's training, excluding testing, and examples trained per second by all networks */
+    double seconds, samplesPerSecond;
+} SweepStats;
+
+/* Called after every epoch of a sweep instead of printing the progress */
+typedef void (*SweepCallback)(const SweepStats *stats, void *userData);
+
+/* Scheduling and early stopping of a sweep. A zeroed config trains every network for all its epochs */
+typedef struct SweepConfig {
+    /* Worker threads shared by all the networks, 0 for one per online CPU */
+    unsigned nThreads;
+    /* With a test set, a network whose share of test examples passed trails the best network's
+       of the same epoch by more than maxAccuracyGap stops training, from epoch minEpochs on. 0 to never stop early */
+    float maxAccuracyGap;
+    unsigned minEpochs;
+    /* Optional: receives the progress of every epoch. It is printed to stdout when unset */
+    SweepCallback onEpoch;
+    void *userData;
+} SweepConfig;
+
+Network *initNetwork(const unsigned *layerSizes, size_t nLayers);
+size_t layoutParameters(const unsigned *sizes, unsigned nLayers, float *buffer, Matrix *weights, Matrix *biases);
+int allocParameters(Network *net);
+int setLayerActivations(Network *net, const enum EActivationFunction *afs);
+enum EActivationFunction layerActivation(const Network *net, unsigned layer, enum EActivationFunction af);
+int setWeightType(Network *net, enum EWeightType type);
 Matrix feedForward(Network *net, float *input, enum EActivationFunction af);
+InferenceContext *initInferenceContext(Network *net, size_t maxBatch, unsigned nThreads);
+void freeInferenceContext(InferenceContext *ctx);
+void feedForwardBatch(InferenceContext *ctx, const float *inputs, size_t n, enum EActivationFunction af, float *outputs);
+void classifyBatch(InferenceContext *ctx, const float *inputs, size_t n, enum EActivationFunction af, int *labels);
 TrainingExample createTrainingExample(float *expectedInput, float *expectedOutput, size_t nInputs, size_t nOutputs);
 void freeNetwork(Network *net);
 int saveNetworkToFile(const char *filename, Network *net);
 Network *readNetworkFromFile(const char *filename);
+Network *mapNetworkFromFile(const char *filename, bool verifyChecksum);
+const char *trainingPhaseName(enum ETrainingPhase phase);
 void stochasticGradientDescent(
     Network* net,
     TrainingExample *trainingData,
@@ -35,3 +266,10 @@ void stochasticGradientDescent(
     enum EActivationFunction af,
     TrainingExample *testData,
     unsigned nTestData);
+void trainNetwork(
+    Network *net,
+    TrainingExample *trainingData,
+    size_t nExamples,
+    const TrainingConfig *config,
+    TrainingExample *testData,
+    unsigned nTestData);
@@ -0,0 +1,182 @@
+/**
+ * @brief Optimizers: fused, vectorized parameter updates and learning rate schedules.
+ *
+ * Each update reads a slice of the parameters, the matching gradients and optimizer state once
+ * and writes them back in the same pass. The loops are compiled for every ISA the GEMM kernels
+ * support and the same one is used (see gemmKernelName and PECANN_ISA).
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gemm.h"
+#include "optimizer.h"
+
+/*
+ * The update rules, shared by every ISA and inlined into each wrapper below so that they are
+ * vectorized for it. g is the gradient times gradScale, plus decay * w unless decay is decoupled.
+ */
+static inline __attribute__((always_inline))
+void fusedUpdate(const Optimizer *opt, float lr, float gradScale, float decay, size_t step,
+                 float *restrict w, const float *restrict grads, float *restrict m, float *restrict v, size_t n) {
+    const OptimizerConfig *c = &opt->config;
+    switch (c->type) {
+    case OPT_SGD: {
+        float s = lr * gradScale, d = lr * decay;
+        for (size_t i = 0; i < n; i++) {
+            w[i] -= s * grads[i] + d * w[i];
+        }
+        break;
+    }
+    case OPT_MOMENTUM:
+        for (size_t i = 0; i < n; i++) {
+            float g = gradScale * grads[i] + decay * w[i];
+            m[i] = c->momentum * m[i] + g;
+            w[i] -= lr * m[i];
+        }
+        break;
+    case OPT_NESTEROV:
+        for (size_t i = 0; i < n; i++) {
+            float g = gradScale * grads[i] + decay * w[i];
+            m[i] = c->momentum * m[i] + g;
+            w[i] -= lr * (g + c->momentum * m[i]);
+        }
+        break;
+    case OPT_ADAM:
+    case OPT_ADAMW: {
+        /* Bias corrections folded into the step size and epsilon */
+        float b1 = c->beta1, b2 = c->beta2;
+        float c1 = 1 - powf(b1, step), c2 = sqrtf(1 - powf(b2, step));
+        float alpha = lr * c2 / c1, eps = c->epsilon * c2;
+        float l2 = c->type == OPT_ADAM ? decay : 0, shrink = c->type == OPT_ADAMW ? 1 - lr * decay : 1;
+        for (size_t i = 0; i < n; i++) {
+            float g = gradScale * grads[i] + l2 * w[i];
+            m[i] = b1 * m[i] + (1 - b1) * g;
+            v[i] = b2 * v[i] + (1 - b2) * g * g;
+            w[i] = shrink * w[i] - alpha * m[i] / (sqrtf(v[i]) + eps);
+        }
+        break;
+    }
+    }
+}
+
+static void updateScalar(const Optimizer *opt, float lr, float gradScale, float decay, size_t step,
+                         float *params, const float *grads, float *m, float *v, size_t n) {
+    fusedUpdate(opt, lr, gradScale, decay, step, params, grads, m, v, n);
+}
+
+__attribute__((target("avx2,fma")))
+static void updateAvx2(const Optimizer *opt, float lr, float gradScale, float decay, size_t step,
+                       float *params, const float *grads, float *m, float *v, size_t n) {
+    fusedUpdate(opt, lr, gradScale, decay, step, params, grads, m, v, n);
+}
+
+__attribute__((target("avx512f")))
+static void updateAvx512(const Optimizer *opt, float lr, float gradScale, float decay, size_t step,
+                         float *params, const float *grads, float *m, float *v, size_t n) {
+    fusedUpdate(opt, lr, gradScale, decay, step, params, grads, m, v, n);
+}
+
+/**
+ * @brief Create the state of an optimizer
+ *
+ * @param config The optimizer, or NULL for plain SGD
+ * @param nParams Total number of parameters it will update
+ * @return Optimizer* The optimizer with zeroed moments, or NULL on failure
+ */
+Optimizer *initOptimizer(const OptimizerConfig *config, size_t nParams) {
+    Optimizer *opt = calloc(1, sizeof(Optimizer));
+    if (!opt) {
+        return NULL;
+    }
+    if (config) {
+        opt->config = *config;
+    }
+    OptimizerConfig *c = &opt->config;
+    assert(c->type <= OPT_ADAMW && c->schedule <= SCHEDULE_COSINE);
+    c->momentum = c->momentum ? c->momentum : 0.9f;
+    c->beta1 = c->beta1 ? c->beta1 : 0.9f;
+    c->beta2 = c->beta2 ? c->beta2 : 0.999f;
+    c->epsilon = c->epsilon ? c->epsilon : 1e-8f;
+    c->decay = c->decay ? c->decay : c->schedule == SCHEDULE_EXPONENTIAL ? 0.9f : 0.1f;
+    c->stepEpochs = c->stepEpochs ? c->stepEpochs : 10;
+    opt->nParams = nParams;
+
+    unsigned nMoments = c->type == OPT_SGD ? 0 : c->type <= OPT_NESTEROV ? 1 : 2;
+    size_t bytes = ((nParams * sizeof(float) + 63) & ~(size_t)63);
+    float **moments[2] = {&opt->m, &opt->v};
+    for (unsigned i = 0; i < nMoments; i++) {
+        *moments[i] = aligned_alloc(64, bytes);
+        if (!*moments[i]) {
+            freeOptimizer(opt);
+            return NULL;
+        }
+        memset(*moments[i], 0, bytes);
+    }
+
+    const char *isa = gemmKernelName();
+    opt->kernel = strcmp(isa, "avx512") == 0 ? updateAvx512 : strcmp(isa, "avx2") == 0 ? updateAvx2 : updateScalar;
+    return opt;
+}
+
+/**
+ * @brief Free an optimizer created by initOptimizer
+ *
+ * @param opt The optimizer to free
+ */
+void freeOptimizer(Optimizer *opt) {
+    if (opt) {
+        free(opt->m);
+        free(opt->v);
+        free(opt);
+    }
+}
+
+/**
+ * @brief Learning rate of an epoch under the optimizer's schedule, before warmup
+ *
+ * @param opt The optimizer
+ * @param learningRate The base learning rate
+ * @param epoch Zero based epoch number
+ * @param epochs Total number of epochs
+ * @return float The learning rate to use for the epoch
+ */
+float scheduledLearningRate(const Optimizer *opt, float learningRate, unsigned epoch, unsigned epochs) {
+    const OptimizerConfig *c = &opt->config;
+    switch (c->schedule) {
+    case SCHEDULE_STEP:
+        return learningRate * powf(c->decay, epoch / c->stepEpochs);
+    case SCHEDULE_EXPONENTIAL:
+        return learningRate * powf(c->decay, epoch);
+    case SCHEDULE_COSINE:
+        return c->minLearningRate + (learningRate - c->minLearningRate) * 0.5f * (1 + cosf(M_PI * epoch / epochs));
+    default:
+        return learningRate;
+    }
+}
+
+/**
+ * @brief Apply one update step to a slice of the parameters
+ *
+ * @param opt The optimizer
+ * @param learningRate Learning rate of the current epoch, see scheduledLearningRate
+ * @param gradScale Factor applied to the gradients, e.g. 1 / batch size for summed gradients
+ * @param isWeight Whether the slice holds weights, which weight decay applies to
+ * @param step One based number of this update step, for warmup and Adam's bias correction
+ * @param params The parameters to update
+ * @param grads Their gradients
+ * @param offset Position of params[0] in the flat parameter numbering, to locate the optimizer state
+ * @param n Number of parameters in the slice
+ */
+void optimizerUpdate(const Optimizer *opt, float learningRate, float gradScale, bool isWeight, size_t step,
+                     float *params, const float *grads, size_t offset, size_t n) {
+    assert(step && offset + n <= opt->nParams);
+    const OptimizerConfig *c = &opt->config;
+    if (c->warmupSteps && step < c->warmupSteps) {
+        learningRate *= (float)step / c->warmupSteps;
+    }
+    float decay = isWeight ? c->weightDecay : 0;
+    opt->kernel(opt, learningRate, gradScale, decay, step, params, grads,
+                opt->m ? opt->m + offset : NULL, opt->v ? opt->v + offset : NULL, n);
+}
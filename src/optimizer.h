@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "network.h"
+
+typedef struct Optimizer Optimizer;
+
+/* Fused update of n parameters, see optimizerUpdate */
+typedef void (*UpdateKernel)(const Optimizer *opt, float lr, float gradScale, float decay, size_t step,
+                             float *params, const float *grads, float *m, float *v, size_t n);
+
+/*
+ * State of an optimizer over a network's parameters. The moment buffers follow the flat
+ * parameter numbering used by training: weights[0], biases[0], weights[1], ...
+ */
+struct Optimizer {
+    /* The configuration with defaults filled in */
+    OptimizerConfig config;
+    size_t nParams;
+    /* First and second moments, NULL when the optimizer does not use them */
+    float *m, *v;
+    /* Update steps taken so far */
+    size_t step;
+    UpdateKernel kernel;
+};
+
+Optimizer *initOptimizer(const OptimizerConfig *config, size_t nParams);
+void freeOptimizer(Optimizer *opt);
+float scheduledLearningRate(const Optimizer *opt, float learningRate, unsigned epoch, unsigned epochs);
+void optimizerUpdate(const Optimizer *opt, float learningRate, float gradScale, bool isWeight, size_t step,
+                     float *params, const float *grads, size_t offset, size_t n);
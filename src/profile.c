@@ -0,0 +1,21 @@
+#include <assert.h>
+
+#include "profile.h"
+
+#if PECANN_PROFILE
+size_t profileAllocations;
+#endif
+
+/**
+ * @brief Name of a training phase, for printing TrainingStats
+ *
+ * @param phase The phase
+ * @return const char* Its lowercase name, e.g. "forward"
+ */
+const char *trainingPhaseName(enum ETrainingPhase phase) {
+    static const char *names[PHASE_COUNT] = {
+        "batch", "forward", "backward", "reduce", "update", "wait", "shuffle", "evaluation", "checkpoint"
+    };
+    assert(phase < PHASE_COUNT);
+    return names[phase];
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+
+#include "network.h"
+
+/*
+ * Low-overhead instrumentation of the training loop, reported through TrainingStats.
+ * Build with -DPECANN_PROFILE=0 (make PROFILE=0) to compile the timers and counters out;
+ * the stats then only carry the epoch totals and test results.
+ */
+#ifndef PECANN_PROFILE
+#define PECANN_PROFILE 1
+#endif
+
+/* Time spent by one worker, accumulated over an epoch */
+typedef struct Profile {
+    double phases[PHASE_COUNT];
+    /* Seconds per weight layer, one entry per layer */
+    double *layerForward, *layerBackward;
+} Profile;
+
+static inline double profileClock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+#if PECANN_PROFILE
+extern size_t profileAllocations;
+/* Start a timer */
+#define PROFILE_NOW() profileClock()
+/* Add the time since start to acc */
+#define PROFILE_ADD(acc, start) ((acc) += profileClock() - (start))
+/* Add the time since start to acc and restart the timer */
+#define PROFILE_LAP(acc, start) do { double _now = profileClock(); (acc) += _now - (start); (start) = _now; } while (0)
+/* Count a heap allocation made by the library */
+#define PROFILE_ALLOCATION() __atomic_fetch_add(&profileAllocations, 1, __ATOMIC_RELAXED)
+#define PROFILE_ALLOCATIONS() __atomic_load_n(&profileAllocations, __ATOMIC_RELAXED)
+#else
+#define PROFILE_NOW() 0.0
+#define PROFILE_ADD(acc, start) ((void)(acc), (void)(start))
+#define PROFILE_LAP(acc, start) ((void)(acc), (void)(start))
+#define PROFILE_ALLOCATION() ((void)0)
+#define PROFILE_ALLOCATIONS() ((size_t)0)
+#endif
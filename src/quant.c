@@ -0,0 +1,555 @@
+/**
+ * @brief Int8 quantized inference: quantization, calibration and the int8 x uint8 GEMM kernels.
+ *
+ * The kernels compute acc[r][e] = sum_k w[r][k] * x[e][k], the dot products of weight rows with
+ * quantized example rows, exactly in int32. They are chosen once at runtime: AVX-512 VNNI,
+ * AVX-VNNI, AVX2 (widening to 16 bit products, no saturation) or a portable scalar loop. All of
+ * them produce identical results. PECANN_ISA ("avx512", "avx2" or "scalar") caps the choice as it
+ * does for the float kernels, "avx2" leaving out AVX-VNNI as well, and "avx-vnni" caps it there.
+ */
+#include <assert.h>
+#include <float.h>
+#include <immintrin.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "quant.h"
+
+#define ROW_ALIGNMENT 64
+#define ALIGN(n) (((n) + ROW_ALIGNMENT - 1) & ~(size_t)(ROW_ALIGNMENT - 1))
+
+/* Examples per calibration pass */
+#define CALIBRATION_CHUNK 256
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a < _b ? _a : _b; })
+
+typedef void (*Int8Kernel)(size_t rows, size_t n, size_t k, const int8_t *w, size_t ldw,
+                           const uint8_t *x, size_t ldx, int32_t *acc, size_t ldc);
+
+/* Scalar kernel */
+
+static void int8Scalar(size_t rows, size_t n, size_t k, const int8_t *w, size_t ldw,
+                       const uint8_t *x, size_t ldx, int32_t *acc, size_t ldc) {
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t e = 0; e < n; e++) {
+            int32_t dot = 0;
+            for (size_t p = 0; p < k; p++) {
+                dot += w[r * ldw + p] * x[e * ldx + p];
+            }
+            acc[r * ldc + e] = dot;
+        }
+    }
+}
+
+/* AVX2 kernel: bytes are widened to 16 bits so that pairs of products can be summed without saturating */
+
+__attribute__((target("avx2")))
+static inline int32_t hsumEpi32(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void blockAvx2(size_t k, const int8_t *w, size_t ldw, const uint8_t *x, size_t ldx,
+                             int32_t *acc, size_t ldc, unsigned R, unsigned E) {
+    __m256i c[2][4];
+    #pragma GCC unroll 2
+    for (unsigned r = 0; r < R; r++) {
+        #pragma GCC unroll 4
+        for (unsigned e = 0; e < E; e++) {
+            c[r][e] = _mm256_setzero_si256();
+        }
+    }
+    for (size_t p = 0; p < k; p += 16) {
+        __m256i xv[4] = {0};
+        #pragma GCC unroll 4
+        for (unsigned e = 0; e < E; e++) {
+            xv[e] = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*)(x + e * ldx + p)));
+        }
+        #pragma GCC unroll 2
+        for (unsigned r = 0; r < R; r++) {
+            __m256i wv = _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*)(w + r * ldw + p)));
+            #pragma GCC unroll 4
+            for (unsigned e = 0; e < E; e++) {
+                c[r][e] = _mm256_add_epi32(c[r][e], _mm256_madd_epi16(wv, xv[e]));
+            }
+        }
+    }
+    for (unsigned r = 0; r < R; r++) {
+        for (unsigned e = 0; e < E; e++) {
+            acc[r * ldc + e] = hsumEpi32(c[r][e]);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void int8Avx2(size_t rows, size_t n, size_t k, const int8_t *w, size_t ldw,
+                     const uint8_t *x, size_t ldx, int32_t *acc, size_t ldc) {
+    for (size_t r = 0; r < rows; r += 2) {
+        unsigned R = min(rows - r, (size_t)2);
+        for (size_t e = 0; e < n; e += 4) {
+            unsigned E = min(n - e, (size_t)4);
+            int32_t *c = acc + r * ldc + e;
+            if (R == 2 && E == 4) {
+                blockAvx2(k, w + r * ldw, ldw, x + e * ldx, ldx, c, ldc, 2, 4);
+            } else {
+                blockAvx2(k, w + r * ldw, ldw, x + e * ldx, ldx, c, ldc, R, E);
+            }
+        }
+    }
+}
+
+/* AVX-VNNI kernel: vpdpbusd multiplies 4 byte pairs and accumulates them into each int32 lane */
+
+__attribute__((target("avx2,avxvnni"), always_inline))
+static inline void blockAvxVnni(size_t k, const int8_t *w, size_t ldw, const uint8_t *x, size_t ldx,
+                                int32_t *acc, size_t ldc, unsigned R, unsigned E) {
+    __m256i c[2][4];
+    #pragma GCC unroll 2
+    for (unsigned r = 0; r < R; r++) {
+        #pragma GCC unroll 4
+        for (unsigned e = 0; e < E; e++) {
+            c[r][e] = _mm256_setzero_si256();
+        }
+    }
+    for (size_t p = 0; p < k; p += 32) {
+        __m256i xv[4] = {0};
+        #pragma GCC unroll 4
+        for (unsigned e = 0; e < E; e++) {
+            xv[e] = _mm256_load_si256((const __m256i*)(x + e * ldx + p));
+        }
+        #pragma GCC unroll 2
+        for (unsigned r = 0; r < R; r++) {
+            __m256i wv = _mm256_load_si256((const __m256i*)(w + r * ldw + p));
+            #pragma GCC unroll 4
+            for (unsigned e = 0; e < E; e++) {
+                c[r][e] = _mm256_dpbusd_avx_epi32(c[r][e], xv[e], wv);
+            }
+        }
+    }
+    for (unsigned r = 0; r < R; r++) {
+        for (unsigned e = 0; e < E; e++) {
+            acc[r * ldc + e] = hsumEpi32(c[r][e]);
+        }
+    }
+}
+
+__attribute__((target("avx2,avxvnni")))
+static void int8AvxVnni(size_t rows, size_t n, size_t k, const int8_t *w, size_t ldw,
+                        const uint8_t *x, size_t ldx, int32_t *acc, size_t ldc) {
+    for (size_t r = 0; r < rows; r += 2) {
+        unsigned R = min(rows - r, (size_t)2);
+        for (size_t e = 0; e < n; e += 4) {
+            unsigned E = min(n - e, (size_t)4);
+            int32_t *c = acc + r * ldc + e;
+            if (R == 2 && E == 4) {
+                blockAvxVnni(k, w + r * ldw, ldw, x + e * ldx, ldx, c, ldc, 2, 4);
+            } else {
+                blockAvxVnni(k, w + r * ldw, ldw, x + e * ldx, ldx, c, ldc, R, E);
+            }
+        }
+    }
+}
+
+/* AVX-512 VNNI kernel */
+
+__attribute__((target("avx512f,avx512bw,avx512vnni"), always_inline))
+static inline void blockAvx512Vnni(size_t k, const int8_t *w, size_t ldw, const uint8_t *x, size_t ldx,
+                                   int32_t *acc, size_t ldc, unsigned R, unsigned E) {
+    __m512i c[4][4];
+    #pragma GCC unroll 4
+    for (unsigned r = 0; r < R; r++) {
+        #pragma GCC unroll 4
+        for (unsigned e = 0; e < E; e++) {
+            c[r][e] = _mm512_setzero_si512();
+        }
+    }
+    for (size_t p = 0; p < k; p += 64) {
+        __m512i xv[4] = {0};
+        #pragma GCC unroll 4
+        for (unsigned e = 0; e < E; e++) {
+            xv[e] = _mm512_load_si512(x + e * ldx + p);
+        }
+        #pragma GCC unroll 4
+        for (unsigned r = 0; r < R; r++) {
+            __m512i wv = _mm512_load_si512(w + r * ldw + p);
+            #pragma GCC unroll 4
+            for (unsigned e = 0; e < E; e++) {
+                c[r][e] = _mm512_dpbusd_epi32(c[r][e], xv[e], wv);
+            }
+        }
+    }
+    for (unsigned r = 0; r < R; r++) {
+        for (unsigned e = 0; e < E; e++) {
+            acc[r * ldc + e] = _mm512_reduce_add_epi32(c[r][e]);
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void int8Avx512Vnni(size_t rows, size_t n, size_t k, const int8_t *w, size_t ldw,
+                           const uint8_t *x, size_t ldx, int32_t *acc, size_t ldc) {
+    for (size_t r = 0; r < rows; r += 4) {
+        unsigned R = min(rows - r, (size_t)4);
+        for (size_t e = 0; e < n; e += 4) {
+            unsigned E = min(n - e, (size_t)4);
+            int32_t *c = acc + r * ldc + e;
+            if (R == 4 && E == 4) {
+                blockAvx512Vnni(k, w + r * ldw, ldw, x + e * ldx, ldx, c, ldc, 4, 4);
+            } else {
+                blockAvx512Vnni(k, w + r * ldw, ldw, x + e * ldx, ldx, c, ldc, R, E);
+            }
+        }
+    }
+}
+
+typedef struct Int8KernelSet {
+    const char *name;
+    Int8Kernel gemm;
+} Int8KernelSet;
+
+static const Int8KernelSet scalarKernel = {"scalar", int8Scalar};
+static const Int8KernelSet avx2Kernel = {"avx2", int8Avx2};
+static const Int8KernelSet avxVnniKernel = {"avx-vnni", int8AvxVnni};
+static const Int8KernelSet avx512VnniKernel = {"avx512-vnni", int8Avx512Vnni};
+
+static const Int8KernelSet *selectedKernel;
+static pthread_once_t selectOnce = PTHREAD_ONCE_INIT;
+
+static void selectKernel(void) {
+    __builtin_cpu_init();
+    bool hasAvx512 = __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw");
+    bool hasAvxVnni = __builtin_cpu_supports("avxvnni") && __builtin_cpu_supports("avx2");
+    bool hasAvx2 = __builtin_cpu_supports("avx2");
+    const char *isa = getenv("PECANN_ISA");
+    if (isa && strcmp(isa, "scalar") == 0) {
+        hasAvx512 = hasAvxVnni = hasAvx2 = false;
+    } else if (isa && strcmp(isa, "avx2") == 0) {
+        hasAvx512 = hasAvxVnni = false;
+    } else if (isa && strcmp(isa, "avx-vnni") == 0) {
+        hasAvx512 = false;
+    }
+    if (hasAvx512) {
+        selectedKernel = &avx512VnniKernel;
+    } else if (hasAvxVnni) {
+        selectedKernel = &avxVnniKernel;
+    } else if (hasAvx2) {
+        selectedKernel = &avx2Kernel;
+    } else {
+        selectedKernel = &scalarKernel;
+    }
+}
+
+static const Int8KernelSet *kernel(void) {
+    pthread_once(&selectOnce, selectKernel);
+    return selectedKernel;
+}
+
+const char *quantKernelName(void) {
+    return kernel()->name;
+}
+
+/* Quantize n values to uint8: q = round(x / scale) + zero, saturated to [0, 255] */
+static void quantizeRow(const float *x, size_t n, float scale, int32_t zero, uint8_t *q) {
+    float inv = 1 / scale, z = zero + 0.5f;
+    for (size_t i = 0; i < n; i++) {
+        float v = x[i] * inv + z;
+        v = v < 0 ? 0 : v > 255 ? 255 : v;
+        q[i] = (uint8_t)v;
+    }
+}
+
+/* Scale and zero point mapping [lo, hi] onto [0, 255]. The range always contains 0 so it is exact */
+static void chooseInputScale(float lo, float hi, float *scale, int32_t *zero) {
+    lo = lo < 0 ? lo : 0;
+    hi = hi > 0 ? hi : 0;
+    if (hi - lo < FLT_EPSILON) {
+        hi = lo + 1;
+    }
+    *scale = (hi - lo) / 255;
+    *zero = (int32_t)lrintf(-lo / *scale);
+}
+
+/* Run the float network over the calibration inputs and record the range of every layer's input */
+static void calibrate(Network *net, enum EActivationFunction af, const float *inputs, size_t n, float *lo, float *hi) {
+    unsigned L = net->nLayers - 1, maxSize = 0;
+    for (unsigned i = 0; i < net->nLayers; i++) {
+        maxSize = net->sizes[i] > maxSize ? net->sizes[i] : maxSize;
+    }
+    float *bufs[2] = {malloc(maxSize * CALIBRATION_CHUNK * sizeof(float)), malloc(maxSize * CALIBRATION_CHUNK * sizeof(float))};
+    assert(bufs[0] && bufs[1]);
+    for (unsigned i = 0; i < L; i++) {
+        lo[i] = FLT_MAX;
+        hi[i] = -FLT_MAX;
+    }
+    for (size_t start = 0; start < n; start += CALIBRATION_CHUNK) {
+        size_t c = min((size_t)CALIBRATION_CHUNK, n - start);
+        const float *in = inputs + start * net->sizes[0];
+        for (size_t j = 0; j < c * net->sizes[0]; j++) {
+            lo[0] = in[j] < lo[0] ? in[j] : lo[0];
+            hi[0] = in[j] > hi[0] ? in[j] : hi[0];
+        }
+        Matrix a = matrixFromData(net->sizes[0], c, bufs[0]);
+        transposeInto(a, matrixFromData(c, net->sizes[0], (float*)in));
+        for (unsigned i = 0; i + 1 < L; i++) {
+            Matrix z = matrixFromData(net->sizes[i + 1], c, bufs[(i + 1) % 2]);
+            multInto(z, net->weights[i], a);
+            addBiasActivate(z, net->biases[i], layerActivation(net, i, af));
+            for (size_t j = 0; j < len(z); j++) {
+                lo[i + 1] = z.data[j] < lo[i + 1] ? z.data[j] : lo[i + 1];
+                hi[i + 1] = z.data[j] > hi[i + 1] ? z.data[j] : hi[i + 1];
+            }
+            a = z;
+        }
+    }
+    free(bufs[0]);
+    free(bufs[1]);
+}
+
+static void *alignedZalloc(size_t size) {
+    void *p = aligned_alloc(ROW_ALIGNMENT, ALIGN(size ? size : 1));
+    if (p) {
+        memset(p, 0, ALIGN(size ? size : 1));
+    }
+    return p;
+}
+
+/**
+ * @brief Convert a trained network into an int8 network for inference
+ *
+ * @param net The trained network
+ * @param af The activation function the network was trained with, for the layers it doesn't specify
+ * @param calibration Sample inputs stored one after another, used to pick the quantization range
+ *                    of every layer's input. A few hundred representative examples are enough
+ * @param nCalibration Number of sample inputs
+ * @return QuantizedNetwork* The quantized network or NULL on failure
+ */
+QuantizedNetwork *quantizeNetwork(Network *net, enum EActivationFunction af, const float *calibration, size_t nCalibration) {
+    assert(net && calibration && nCalibration && net->weights[0].data);
+    unsigned L = net->nLayers - 1;
+    QuantizedNetwork *qnet = calloc(1, sizeof(QuantizedNetwork));
+    if (!qnet) {
+        return NULL;
+    }
+    qnet->nLayers = net->nLayers;
+    qnet->af = af;
+    qnet->sizes = malloc(net->nLayers * sizeof(unsigned));
+    qnet->layers = calloc(L, sizeof(QuantizedLayer));
+    if (!qnet->sizes || !qnet->layers) {
+        freeQuantizedNetwork(qnet);
+        return NULL;
+    }
+    memcpy(qnet->sizes, net->sizes, net->nLayers * sizeof(unsigned));
+
+    float lo[L], hi[L];
+    calibrate(net, af, calibration, nCalibration, lo, hi);
+    for (unsigned i = 0; i < L; i++) {
+        QuantizedLayer *layer = &qnet->layers[i];
+        Matrix w = net->weights[i];
+        layer->rows = w.rows;
+        layer->cols = w.cols;
+        layer->stride = ALIGN(w.cols);
+        layer->af = layerActivation(net, i, af);
+        layer->weights = alignedZalloc((size_t)w.rows * layer->stride);
+        layer->scales = alignedZalloc(w.rows * sizeof(float));
+        layer->biases = alignedZalloc(w.rows * sizeof(float));
+        layer->rowSums = alignedZalloc(w.rows * sizeof(int32_t));
+        if (!layer->weights || !layer->scales || !layer->biases || !layer->rowSums) {
+            freeQuantizedNetwork(qnet);
+            return NULL;
+        }
+        chooseInputScale(lo[i], hi[i], &layer->inScale, &layer->inZero);
+        memcpy(layer->biases, net->biases[i].data, w.rows * sizeof(float));
+        for (unsigned r = 0; r < w.rows; r++) {
+            const float *row = w.data + (size_t)r * w.cols;
+            float maxAbs = 0;
+            for (unsigned c = 0; c < w.cols; c++) {
+                maxAbs = fabsf(row[c]) > maxAbs ? fabsf(row[c]) : maxAbs;
+            }
+            float scale = maxAbs > 0 ? maxAbs / 127 : 1;
+            int32_t sum = 0;
+            for (unsigned c = 0; c < w.cols; c++) {
+                int8_t q = (int8_t)lrintf(row[c] / scale);
+                layer->weights[(size_t)r * layer->stride + c] = q;
+                sum += q;
+            }
+            layer->scales[r] = scale;
+            layer->rowSums[r] = sum;
+        }
+    }
+    return qnet;
+}
+
+/**
+ * @brief Free a quantized network
+ */
+void freeQuantizedNetwork(QuantizedNetwork *qnet) {
+    if (qnet) {
+        if (qnet->layers && !qnet->mapping) {
+            for (unsigned i = 0; i < qnet->nLayers - 1; i++) {
+                free(qnet->layers[i].weights);
+                free(qnet->layers[i].scales);
+                free(qnet->layers[i].biases);
+                free(qnet->layers[i].rowSums);
+            }
+        }
+        free(qnet->layers);
+        free(qnet->sizes);
+        if (qnet->mapping) {
+            munmap(qnet->mapping, qnet->mappingSize);
+        }
+        free(qnet);
+    }
+}
+
+/* Scratch of quantizedForward: the int32/float layer output and two uint8 input buffers */
+static size_t maxRows(QuantizedNetwork *qnet) {
+    size_t m = 0;
+    for (unsigned i = 0; i < qnet->nLayers - 1; i++) {
+        m = qnet->layers[i].rows > m ? qnet->layers[i].rows : m;
+    }
+    return m;
+}
+
+static size_t maxStride(QuantizedNetwork *qnet) {
+    size_t m = 0;
+    for (unsigned i = 0; i < qnet->nLayers - 1; i++) {
+        m = qnet->layers[i].stride > m ? qnet->layers[i].stride : m;
+    }
+    return m;
+}
+
+/**
+ * @brief Scratch needed by quantizedForward for up to maxBatch examples, in floats
+ */
+size_t quantizedScratchSize(QuantizedNetwork *qnet, size_t maxBatch) {
+    size_t bytes = ALIGN(maxRows(qnet) * maxBatch * sizeof(float)) + 2 * ALIGN(maxStride(qnet) * maxBatch);
+    return bytes / sizeof(float);
+}
+
+/**
+ * @brief Run a batch through a quantized network
+ *
+ * @param qnet The quantized network
+ * @param inputs n inputs stored one after another
+ * @param n Number of inputs
+ * @param scratch 64 byte aligned buffer of quantizedScratchSize(qnet, n) floats
+ * @param outputs Optional: receives the n float outputs one after another
+ * @param labels Optional: receives the index of the highest output of each input
+ */
+void quantizedForward(QuantizedNetwork *qnet, const float *inputs, size_t n, void *scratch, float *outputs, int *labels) {
+    assert(qnet && inputs && n && scratch);
+    unsigned L = qnet->nLayers - 1;
+    Int8Kernel gemm = kernel()->gemm;
+    float *z = scratch;
+    uint8_t *q[2];
+    q[0] = (uint8_t*)scratch + ALIGN(maxRows(qnet) * n * sizeof(float));
+    q[1] = q[0] + ALIGN(maxStride(qnet) * n);
+
+    QuantizedLayer *first = &qnet->layers[0];
+    for (size_t e = 0; e < n; e++) {
+        uint8_t *row = q[0] + e * first->stride;
+        quantizeRow(inputs + e * first->cols, first->cols, first->inScale, first->inZero, row);
+        memset(row + first->cols, 0, first->stride - first->cols);
+    }
+    for (unsigned i = 0; i < L; i++) {
+        QuantizedLayer *layer = &qnet->layers[i];
+        int32_t *acc = (int32_t*)z;
+        gemm(layer->rows, n, layer->stride, layer->weights, layer->stride, q[i % 2], layer->stride, acc, n);
+        for (unsigned r = 0; r < layer->rows; r++) {
+            float scale = layer->scales[r] * layer->inScale;
+            int32_t offset = layer->inZero * layer->rowSums[r];
+            for (size_t e = 0; e < n; e++) {
+                z[r * n + e] = scale * (float)(acc[r * n + e] - offset);
+            }
+        }
+        Matrix out = matrixFromData(layer->rows, n, z);
+        bool classify = i + 1 == L && !outputs && preservesOrder(layer->af);
+        addBiasActivate(out, matrixFromData(layer->rows, 1, layer->biases), classify ? FN_LINEAR : layer->af);
+        if (i + 1 == L) {
+            if (outputs) {
+                transposeInto(matrixFromData(n, layer->rows, outputs), out);
+            }
+            if (labels) {
+                maxIndexPerColumn(out, labels);
+            }
+            break;
+        }
+        /* Quantize the activations into the next layer's input rows */
+        QuantizedLayer *next = &qnet->layers[i + 1];
+        uint8_t *dst = q[(i + 1) % 2];
+        float inv = 1 / next->inScale, zero = next->inZero + 0.5f;
+        for (size_t e = 0; e < n; e++) {
+            uint8_t *row = dst + e * next->stride;
+            for (unsigned r = 0; r < layer->rows; r++) {
+                float v = z[r * n + e] * inv + zero;
+                v = v < 0 ? 0 : v > 255 ? 255 : v;
+                row[r] = (uint8_t)v;
+            }
+            memset(row + layer->rows, 0, next->stride - layer->rows);
+        }
+    }
+}
+
+/**
+ * @brief Compare a quantized network with the float network it was made from
+ *
+ * @param net The float network
+ * @param qnet The quantized network
+ * @param testSet Test examples. A single output is taken as the index of the expected class,
+ *                several outputs as a target vector whose highest element is the expected class
+ * @param report Receives the comparison
+ */
+void evaluateQuantization(Network *net, QuantizedNetwork *qnet, const TrainingSet *testSet, QuantizationReport *report) {
+    assert(net && qnet && testSet && report && testSet->nInputs == net->sizes[0]);
+    unsigned nOut = net->sizes[net->nLayers - 1];
+    size_t n = testSet->nExamples;
+    float *expected = malloc(n * nOut * sizeof(float)), *actual = malloc(n * nOut * sizeof(float));
+    InferenceContext *floatCtx = initInferenceContext(net, 64, 0);
+    InferenceContext *quantCtx = initQuantizedInferenceContext(qnet, 64, 0);
+    assert(expected && actual && floatCtx && quantCtx);
+    feedForwardBatch(floatCtx, testSet->inputs, n, qnet->af, expected);
+    feedForwardBatch(quantCtx, testSet->inputs, n, qnet->af, actual);
+
+    memset(report, 0, sizeof(QuantizationReport));
+    report->nExamples = n;
+    size_t floatCorrect = 0, quantCorrect = 0, agree = 0;
+    double sumErr = 0;
+    for (size_t e = 0; e < n; e++) {
+        const float *target = testSet->outputs + e * testSet->nOutputs;
+        int label = testSet->nOutputs == 1 ? (int)*target
+                  : maxIndex(matrixFromData(testSet->nOutputs, 1, (float*)target));
+        int fl = maxIndex(matrixFromData(nOut, 1, expected + e * nOut));
+        int ql = maxIndex(matrixFromData(nOut, 1, actual + e * nOut));
+        floatCorrect += fl == label;
+        quantCorrect += ql == label;
+        agree += fl == ql;
+        for (unsigned j = 0; j < nOut; j++) {
+            float err = fabsf(expected[e * nOut + j] - actual[e * nOut + j]);
+            report->maxAbsError = err > report->maxAbsError ? err : report->maxAbsError;
+            sumErr += err;
+        }
+    }
+    report->floatAccuracy = (float)floatCorrect / n;
+    report->quantizedAccuracy = (float)quantCorrect / n;
+    report->agreement = (float)agree / n;
+    report->meanAbsError = sumErr / ((double)n * nOut);
+    for (unsigned i = 0; i < net->nLayers - 1; i++) {
+        QuantizedLayer *layer = &qnet->layers[i];
+        report->floatBytes += (len(net->weights[i]) + len(net->biases[i])) * sizeof(float);
+        report->quantizedBytes += (size_t)layer->rows * layer->cols + layer->rows * (2 * sizeof(float) + sizeof(int32_t));
+    }
+    freeInferenceContext(floatCtx);
+    freeInferenceContext(quantCtx);
+    free(expected);
+    free(actual);
+}
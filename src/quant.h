@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dataset.h"
+#include "network.h"
+
+/*
+ * Post-training int8 quantization for inference.
+ *
+ * Weights are quantized symmetrically with one scale per output row: w ~= scale[r] * q.
+ * The input of every layer is quantized to uint8 with a scale and zero point found by running
+ * a calibration set through the float network: x ~= inScale * (q - inZero).
+ * Products are accumulated exactly in int32, then rescaled to float for the bias and activation.
+ */
+typedef struct QuantizedLayer {
+    unsigned rows, cols;
+    /* Row stride of weights in bytes: cols rounded up to a multiple of 64, zero padded */
+    unsigned stride;
+    int8_t *weights;
+    float *scales;
+    float *biases;
+    /* Sum of each row's quantized weights, to take the input zero point out of the dot products */
+    int32_t *rowSums;
+    float inScale;
+    int32_t inZero;
+    enum EActivationFunction af;
+} QuantizedLayer;
+
+typedef struct QuantizedNetwork {
+    unsigned nLayers, *sizes;
+    /* The activation passed to quantizeNetwork. Each layer applies its own, see QuantizedLayer.af */
+    enum EActivationFunction af;
+    QuantizedLayer *layers;
+    /* Set when the network was read from a file and points into its mapping */
+    void *mapping;
+    size_t mappingSize;
+} QuantizedNetwork;
+
+/* Float vs int8 comparison on a test set, see evaluateQuantization */
+typedef struct QuantizationReport {
+    size_t nExamples;
+    /* Fraction classified correctly by each network, and fraction where both agree */
+    float floatAccuracy, quantizedAccuracy, agreement;
+    /* Error of the int8 outputs relative to the float outputs */
+    float maxAbsError, meanAbsError;
+    /* Size of the parameters */
+    size_t floatBytes, quantizedBytes;
+} QuantizationReport;
+
+QuantizedNetwork *quantizeNetwork(Network *net, enum EActivationFunction af, const float *calibration, size_t nCalibration);
+void freeQuantizedNetwork(QuantizedNetwork *qnet);
+InferenceContext *initQuantizedInferenceContext(QuantizedNetwork *qnet, size_t maxBatch, unsigned nThreads);
+void evaluateQuantization(Network *net, QuantizedNetwork *qnet, const TrainingSet *testSet, QuantizationReport *report);
+int saveQuantizedNetwork(const char *filename, QuantizedNetwork *qnet);
+QuantizedNetwork *readQuantizedNetwork(const char *filename);
+
+/* Used by the inference context */
+size_t quantizedScratchSize(QuantizedNetwork *qnet, size_t maxBatch);
+void quantizedForward(QuantizedNetwork *qnet, const float *inputs, size_t n, void *scratch, float *outputs, int *labels);
+
+/* Name of the int8 kernel selected for this CPU ("avx512-vnni", "avx-vnni", "avx2" or "scalar") */
+const char *quantKernelName(void);
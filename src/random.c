@@ -0,0 +1,85 @@
+#include <assert.h>
+
+#include "random.h"
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* splitmix64, used to spread a single seed over the whole state */
+static uint64_t splitMix(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * @brief Initialize a generator. The same seed always produces the same sequence
+ *
+ * @param rng The generator
+ * @param seed Any value, including 0
+ */
+void seedRng(Rng *rng, uint64_t seed) {
+    assert(rng);
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitMix(&seed);
+    }
+}
+
+/**
+ * @brief Next 64 random bits
+ */
+uint64_t rngNext(Rng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/**
+ * @brief Uniform integer in [0, n) without modulo bias (Lemire's multiply and reject)
+ *
+ * @param rng The generator
+ * @param n Upper bound, must be non-zero
+ */
+uint64_t rngBelow(Rng *rng, uint64_t n) {
+    assert(n);
+    unsigned __int128 m = (unsigned __int128)rngNext(rng) * n;
+    if ((uint64_t)m < n) {
+        uint64_t threshold = -n % n;
+        while ((uint64_t)m < threshold) {
+            m = (unsigned __int128)rngNext(rng) * n;
+        }
+    }
+    return m >> 64;
+}
+
+/**
+ * @brief Uniform float in [0, 1)
+ */
+float rngUniform(Rng *rng) {
+    return (rngNext(rng) >> 40) * (1.0f / (1 << 24));
+}
+
+/**
+ * @brief Fisher-Yates shuffle of an index array
+ *
+ * @param rng The generator
+ * @param indices The array to shuffle
+ * @param n Number of elements in indices
+ */
+void shuffleIndices(Rng *rng, size_t *indices, size_t n) {
+    for (size_t i = n; i > 1; i--) {
+        size_t j = rngBelow(rng, i);
+        size_t tmp = indices[i - 1];
+        indices[i - 1] = indices[j];
+        indices[j] = tmp;
+    }
+}
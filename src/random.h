@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Small, fast, seedable pseudo-random generator (xoshiro256**). Unlike rand() its state is
+ * explicit, so every user gets its own reproducible stream and it is safe to use from threads.
+ */
+typedef struct Rng {
+    uint64_t s[4];
+} Rng;
+
+void seedRng(Rng *rng, uint64_t seed);
+uint64_t rngNext(Rng *rng);
+uint64_t rngBelow(Rng *rng, uint64_t n);
+float rngUniform(Rng *rng);
+void shuffleIndices(Rng *rng, size_t *indices, size_t n);
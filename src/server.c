@@ -0,0 +1,739 @@
+/**
+ * @brief Inference server: requests from many connections are queued and run in dynamic batches.
+ *
+ * One I/O thread polls the listening socket, the connections and a wakeup pipe. It reads requests
+ * into preallocated slots, appends them to a FIFO, and writes the answers the workers hand back.
+ * Each worker owns a single threaded inference context. It waits for the oldest queued request,
+ * then until maxBatch requests are queued or that one has waited maxWaitUs, and runs all it takes
+ * as one batch. Under light load a request is answered after at most maxWaitUs plus a small batch;
+ * under heavy load batches fill up at once, and each request costs a slice of a large GEMM instead
+ * of a matrix-vector product of its own. Workers run the network of a ModelHandle through a reader
+ * each, and rebuild their context when they find a new version published.
+ *
+ * The slots bound the requests in flight. When none are free the I/O thread stops reading, so
+ * clients that send faster than the workers keep up are held back by their sockets rather than
+ * by the server's memory.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "socket.h"
+#include "swap.h"
+#include "threadpool.h"
+
+/* Requests read from a connection at a time */
+#define SERVER_READ_REQUESTS 16
+/* Bytes of unsent answers beyond which a connection isn't read from */
+#define SERVER_OUTPUT_LIMIT (1 << 20)
+/* Requests a client keeps in flight, see remoteFeedForward */
+#define CLIENT_WINDOW 64
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a < _b ? _a : _b; })
+
+/* A request from being read until its answer is queued for writing */
+typedef struct Slot {
+    float *input, *output;
+    /* The answer's EServerStatus */
+    uint32_t id, status;
+    /* The connection it came from and that connection's generation, so answers to a closed connection are dropped */
+    unsigned connection, generation;
+    int64_t arrivalUs;
+} Slot;
+
+typedef struct Connection {
+    int fd;
+    unsigned generation;
+    /* Bytes read but not yet parsed into requests */
+    char *in;
+    size_t inLen;
+    /* Answers to write, of which outSent bytes are written */
+    char *out;
+    size_t outLen, outSent, outCapacity;
+    /* Close once the answers are written, after a bad request */
+    bool closing;
+} Connection;
+
+typedef struct Worker {
+    struct InferenceServer *server;
+    ModelReader *reader;
+    /* Context of the model version last run, rebuilt when a new one is published */
+    InferenceContext *ctx;
+    uint64_t version;
+    float *inputs, *outputs;
+    unsigned *taken;
+    pthread_t thread;
+    bool started;
+} Worker;
+
+struct InferenceServer {
+    ServerConfig config;
+    ModelHandle *model;
+    unsigned nInputs, nOutputs;
+    int listener, wake[2];
+    struct sockaddr_storage address;
+    Slot *slots;
+    float *buffers;
+    unsigned nSlots;
+    /* Free slots and requests read in this round, used by the I/O thread only */
+    unsigned *freeSlots, nFree, *incoming, nIncoming;
+    /* Rings of the queued slots and the answered ones, guarded by lock */
+    unsigned *queue, queueHead, queueLength;
+    unsigned *answered, answeredHead, answeredLength;
+    Connection *connections;
+    Worker *workers;
+    pthread_t ioThread;
+    bool ioStarted;
+    pthread_mutex_t lock;
+    pthread_cond_t queuedCond;
+    bool stop;
+    ServerStats stats;
+};
+
+static int64_t nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void record(uint64_t *histogram, uint64_t value) {
+    unsigned bucket = 0;
+    while ((1ull << bucket) < value && bucket + 1 < SERVER_HISTOGRAM_BUCKETS) {
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+/**
+ * @brief Estimate a percentile from a histogram of ServerStats
+ *
+ * @param histogram SERVER_HISTOGRAM_BUCKETS buckets
+ * @param q The percentile as a fraction, e.g. 0.99
+ * @return The upper bound of the bucket holding the percentile, or 0 for an empty histogram
+ */
+double histogramPercentile(const uint64_t *histogram, double q) {
+    uint64_t total = 0, seen = 0;
+    for (unsigned i = 0; i < SERVER_HISTOGRAM_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    for (unsigned i = 0; i < SERVER_HISTOGRAM_BUCKETS && total; i++) {
+        seen += histogram[i];
+        if (seen >= q * total) {
+            return (double)(1ull << i);
+        }
+    }
+    return 0;
+}
+
+/* Wake the I/O thread from poll */
+static void wakeIo(InferenceServer *s) {
+    char byte = 0;
+    ssize_t k = write(s->wake[1], &byte, 1);
+    (void)k;
+}
+
+static void *workerMain(void *arg) {
+    Worker *w = arg;
+    InferenceServer *s = w->server;
+    unsigned nIn = s->nInputs, nOut = s->nOutputs;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->queueLength && !s->stop) {
+            pthread_cond_wait(&s->queuedCond, &s->lock);
+        }
+        /* Let the batch fill up until the oldest request has used up its wait */
+        int64_t deadline = s->queueLength ? s->slots[s->queue[s->queueHead]].arrivalUs + s->config.maxWaitUs : 0;
+        while (!s->stop && s->queueLength && s->queueLength < s->config.maxBatch && nowUs() < deadline) {
+            struct timespec ts = {deadline / 1000000, deadline % 1000000 * 1000};
+            pthread_cond_timedwait(&s->queuedCond, &s->lock, &ts);
+        }
+        if (s->stop) {
+            break;
+        }
+        /* Another worker may have taken them meanwhile */
+        size_t n = min((size_t)s->queueLength, s->config.maxBatch);
+        if (!n) {
+            continue;
+        }
+        int64_t now = nowUs();
+        record(s->stats.queueDepths, s->queueLength);
+        record(s->stats.batchSizes, n);
+        s->stats.batches++;
+        for (size_t i = 0; i < n; i++) {
+            w->taken[i] = s->queue[(s->queueHead + i) % s->nSlots];
+            record(s->stats.queueUs, now - s->slots[w->taken[i]].arrivalUs);
+        }
+        s->queueHead = (s->queueHead + n) % s->nSlots;
+        s->queueLength -= n;
+        s->stats.queueDepth = s->queueLength;
+        pthread_mutex_unlock(&s->lock);
+
+        for (size_t i = 0; i < n; i++) {
+            memcpy(w->inputs + i * nIn, s->slots[w->taken[i]].input, nIn * sizeof(float));
+        }
+        uint64_t version;
+        Network *net = enterModel(w->reader, &version);
+        if (!w->ctx || version != w->version) {
+            freeInferenceContext(w->ctx);
+            w->ctx = initInferenceContext(net, s->config.maxBatch, 1);
+            w->version = version;
+        }
+        if (w->ctx) {
+            feedForwardBatch(w->ctx, w->inputs, n, s->config.af, w->outputs);
+        }
+        leaveModel(w->reader);
+        for (size_t i = 0; i < n; i++) {
+            s->slots[w->taken[i]].status = w->ctx ? SERVER_OK : SERVER_ERROR;
+            memcpy(s->slots[w->taken[i]].output, w->outputs + i * nOut, nOut * sizeof(float));
+        }
+
+        pthread_mutex_lock(&s->lock);
+        for (size_t i = 0; i < n; i++) {
+            s->answered[(s->answeredHead + s->answeredLength++) % s->nSlots] = w->taken[i];
+        }
+        wakeIo(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* Append an answer to a connection's output */
+static void answer(Connection *c, uint32_t status, uint32_t id, const void *payload, size_t size) {
+    size_t needed = c->outLen + sizeof(ServerMessage) + size;
+    if (needed > c->outCapacity) {
+        size_t capacity = c->outCapacity ? c->outCapacity : 4096;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *out = realloc(c->out, capacity);
+        if (!out) {
+            c->closing = true;
+            return;
+        }
+        c->out = out;
+        c->outCapacity = capacity;
+    }
+    ServerMessage m = {SERVER_MAGIC, status, id, (uint32_t)size};
+    memcpy(c->out + c->outLen, &m, sizeof(m));
+    if (size) {
+        memcpy(c->out + c->outLen + sizeof(m), payload, size);
+    }
+    c->outLen = needed;
+}
+
+static void closeConnection(InferenceServer *s, Connection *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->generation++;
+    free(c->in);
+    c->in = NULL;
+    c->inLen = c->outLen = c->outSent = 0;
+    c->closing = false;
+    (void)s;
+}
+
+static void acceptConnection(InferenceServer *s) {
+    int fd = accept(s->listener, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    Connection *c = NULL;
+    for (unsigned i = 0; i < s->config.maxConnections && !c; i++) {
+        c = s->connections[i].fd < 0 ? &s->connections[i] : NULL;
+    }
+    size_t capacity = SERVER_READ_REQUESTS * (sizeof(ServerMessage) + s->nInputs * sizeof(float));
+    char *in = c ? malloc(capacity) : NULL;
+    if (!in) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (s->address.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    c->fd = fd;
+    c->in = in;
+    pthread_mutex_lock(&s->lock);
+    s->stats.connections++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void readConnection(InferenceServer *s, Connection *c) {
+    size_t capacity = SERVER_READ_REQUESTS * (sizeof(ServerMessage) + s->nInputs * sizeof(float));
+    ssize_t k = recv(c->fd, c->in + c->inLen, capacity - c->inLen, 0);
+    if (k == 0 || (k < 0 && errno != EAGAIN && errno != EINTR)) {
+        closeConnection(s, c);
+    } else if (k > 0) {
+        c->inLen += k;
+    }
+}
+
+/* Turn the whole requests read from a connection into slots, as long as there are free slots */
+static void parseRequests(InferenceServer *s, Connection *c, int64_t now) {
+    size_t used = 0;
+    while (c->inLen - used >= sizeof(ServerMessage)) {
+        ServerMessage m;
+        memcpy(&m, c->in + used, sizeof(m));
+        bool valid = m.magic == SERVER_MAGIC &&
+            ((m.code == SERVER_INFER && m.size == s->nInputs * sizeof(float)) || (m.code == SERVER_STATS && m.size == 0));
+        if (!valid) {
+            pthread_mutex_lock(&s->lock);
+            s->stats.badRequests++;
+            pthread_mutex_unlock(&s->lock);
+            answer(c, SERVER_BAD_REQUEST, m.id, NULL, 0);
+            c->closing = true;
+            used = c->inLen;
+            break;
+        }
+        if (c->inLen - used < sizeof(m) + m.size || (m.code == SERVER_INFER && !s->nFree)) {
+            break;
+        }
+        if (m.code == SERVER_INFER) {
+            unsigned index = s->freeSlots[--s->nFree];
+            Slot *slot = &s->slots[index];
+            memcpy(slot->input, c->in + used + sizeof(m), m.size);
+            slot->id = m.id;
+            slot->connection = c - s->connections;
+            slot->generation = c->generation;
+            slot->arrivalUs = now;
+            s->incoming[s->nIncoming++] = index;
+        } else {
+            ServerStats stats;
+            inferenceServerStats(s, &stats);
+            answer(c, SERVER_OK, m.id, &stats, sizeof(stats));
+        }
+        used += sizeof(m) + m.size;
+    }
+    memmove(c->in, c->in + used, c->inLen - used);
+    c->inLen -= used;
+}
+
+static void flushConnection(InferenceServer *s, Connection *c) {
+    while (c->outSent < c->outLen) {
+        ssize_t k = send(c->fd, c->out + c->outSent, c->outLen - c->outSent, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (k <= 0) {
+            closeConnection(s, c);
+            return;
+        }
+        c->outSent += k;
+    }
+    c->outLen = c->outSent = 0;
+    if (c->closing) {
+        closeConnection(s, c);
+    }
+}
+
+/* Queue the answers of the batches run since the last round and free their slots */
+static void deliverAnswers(InferenceServer *s) {
+    char drain[64];
+    while (read(s->wake[0], drain, sizeof(drain)) > 0) {
+    }
+    pthread_mutex_lock(&s->lock);
+    unsigned n = s->answeredLength, first = s->answeredHead;
+    s->answeredHead = (s->answeredHead + n) % s->nSlots;
+    s->answeredLength = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    /* Answered slots only return to the free list here, so the ring entries can't be reused meanwhile */
+    uint64_t latencies[SERVER_HISTOGRAM_BUCKETS] = {0};
+    int64_t now = nowUs();
+    for (unsigned i = 0; i < n; i++) {
+        unsigned index = s->answered[(first + i) % s->nSlots];
+        Slot *slot = &s->slots[index];
+        Connection *c = &s->connections[slot->connection];
+        if (c->fd >= 0 && c->generation == slot->generation) {
+            size_t size = slot->status == SERVER_OK ? s->nOutputs * sizeof(float) : 0;
+            answer(c, slot->status, slot->id, slot->output, size);
+        }
+        record(latencies, now - slot->arrivalUs);
+        s->freeSlots[s->nFree++] = index;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->stats.requests += n;
+    for (unsigned b = 0; b < SERVER_HISTOGRAM_BUCKETS; b++) {
+        s->stats.latencyUs[b] += latencies[b];
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *ioMain(void *arg) {
+    InferenceServer *s = arg;
+    unsigned maxConnections = s->config.maxConnections;
+    struct pollfd fds[maxConnections + 2];
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        bool stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop) {
+            return NULL;
+        }
+        bool full = true;
+        for (unsigned i = 0; i < maxConnections; i++) {
+            Connection *c = &s->connections[i];
+            bool readable = c->fd >= 0 && !c->closing && s->nFree && c->outLen < SERVER_OUTPUT_LIMIT;
+            fds[i + 2] = (struct pollfd){c->fd, (readable ? POLLIN : 0) | (c->outLen ? POLLOUT : 0), 0};
+            full = full && c->fd >= 0;
+        }
+        fds[0] = (struct pollfd){full ? -1 : s->listener, POLLIN, 0};
+        fds[1] = (struct pollfd){s->wake[0], POLLIN, 0};
+        if (poll(fds, maxConnections + 2, -1) < 0) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            deliverAnswers(s);
+        }
+        if (fds[0].revents & POLLIN) {
+            acceptConnection(s);
+        }
+        int64_t now = nowUs();
+        for (unsigned i = 0; i < maxConnections; i++) {
+            Connection *c = &s->connections[i];
+            /* A connection accepted or reopened in this round has nothing to report yet */
+            if (c->fd >= 0 && fds[i + 2].fd == c->fd && (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) {
+                readConnection(s, c);
+            }
+            if (c->fd >= 0 && c->inLen) {
+                parseRequests(s, c, now);
+            }
+            if (c->fd >= 0 && c->outLen) {
+                flushConnection(s, c);
+            }
+        }
+        if (s->nIncoming) {
+            pthread_mutex_lock(&s->lock);
+            for (unsigned i = 0; i < s->nIncoming; i++) {
+                s->queue[(s->queueHead + s->queueLength++) % s->nSlots] = s->incoming[i];
+            }
+            s->stats.queueDepth = s->queueLength;
+            s->stats.maxQueueDepth = s->queueLength > s->stats.maxQueueDepth ? s->queueLength : s->stats.maxQueueDepth;
+            pthread_cond_broadcast(&s->queuedCond);
+            pthread_mutex_unlock(&s->lock);
+            s->nIncoming = 0;
+        }
+    }
+}
+
+/**
+ * @brief Start serving a network: listen on config->address and answer inference requests from
+ * other processes until stopInferenceServer, batching the requests that arrive close together.
+ * See server.h for the protocol, and connectInferenceServer for a client.
+ *
+ * @param model Handle to the network, which must outlive the server. Networks published to it
+ *              while the server runs are picked up by each worker at its next batch
+ * @param config Address, batching, threads and limits. Zero fields take their defaults
+ * @return InferenceServer* The running server, or NULL if the address can't be listened on or on failure
+ */
+InferenceServer *startInferenceServer(ModelHandle *model, const ServerConfig *config) {
+    assert(model && config && config->address);
+    /* Published networks keep the inputs and outputs of the first */
+    ModelReader *reader = initModelReader(model);
+    if (!reader) {
+        return NULL;
+    }
+    Network *net = enterModel(reader, NULL);
+    unsigned nInputs = net->sizes[0], nOutputs = net->sizes[net->nLayers - 1];
+    leaveModel(reader);
+    freeModelReader(reader);
+
+    InferenceServer *s = calloc(1, sizeof(InferenceServer));
+    if (!s) {
+        return NULL;
+    }
+    s->config = *config;
+    s->config.maxBatch = config->maxBatch ? config->maxBatch : 64;
+    s->config.maxWaitUs = config->maxWaitUs ? config->maxWaitUs : 500;
+    s->config.nThreads = config->nThreads ? config->nThreads : defaultThreadCount();
+    s->config.maxPending = config->maxPending ? config->maxPending : 4096;
+    s->config.maxConnections = config->maxConnections ? config->maxConnections : 256;
+    s->model = model;
+    s->nInputs = nInputs;
+    s->nOutputs = nOutputs;
+    s->stats.nInputs = s->nInputs;
+    s->stats.nOutputs = s->nOutputs;
+    s->listener = s->wake[0] = s->wake[1] = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->queuedCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* Every slot can be queued, so neither ring can overflow */
+    unsigned nSlots = s->nSlots = s->config.maxPending;
+    s->slots = calloc(nSlots, sizeof(Slot));
+    s->buffers = malloc((size_t)nSlots * (s->nInputs + s->nOutputs) * sizeof(float));
+    s->freeSlots = malloc(nSlots * sizeof(unsigned));
+    s->incoming = malloc(nSlots * sizeof(unsigned));
+    s->queue = malloc(nSlots * sizeof(unsigned));
+    s->answered = malloc(nSlots * sizeof(unsigned));
+    s->connections = calloc(s->config.maxConnections, sizeof(Connection));
+    s->workers = calloc(s->config.nThreads, sizeof(Worker));
+    socklen_t addressLen = parseSocketAddress(config->address, &s->address);
+    bool ok = s->slots && s->buffers && s->freeSlots && s->incoming && s->queue && s->answered && s->connections &&
+              s->workers && addressLen && pipe(s->wake) == 0;
+    if (ok) {
+        fcntl(s->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(s->wake[1], F_SETFL, O_NONBLOCK);
+        fcntl(s->wake[0], F_SETFD, FD_CLOEXEC);
+        fcntl(s->wake[1], F_SETFD, FD_CLOEXEC);
+        s->listener = listenOnAddress(&s->address, addressLen, 64);
+        ok = s->listener >= 0;
+    }
+    for (unsigned i = 0; ok && i < nSlots; i++) {
+        s->slots[i].input = s->buffers + (size_t)i * (s->nInputs + s->nOutputs);
+        s->slots[i].output = s->slots[i].input + s->nInputs;
+        s->freeSlots[i] = nSlots - 1 - i;
+    }
+    s->nFree = nSlots;
+    for (unsigned i = 0; s->connections && i < s->config.maxConnections; i++) {
+        s->connections[i].fd = -1;
+    }
+    for (unsigned i = 0; ok && i < s->config.nThreads; i++) {
+        Worker *w = &s->workers[i];
+        w->server = s;
+        w->reader = initModelReader(model);
+        w->inputs = malloc(s->config.maxBatch * s->nInputs * sizeof(float));
+        w->outputs = malloc(s->config.maxBatch * s->nOutputs * sizeof(float));
+        w->taken = malloc(s->config.maxBatch * sizeof(unsigned));
+        ok = w->reader && w->inputs && w->outputs && w->taken;
+        w->started = ok && pthread_create(&w->thread, NULL, workerMain, w) == 0;
+        ok = w->started;
+    }
+    s->ioStarted = ok && pthread_create(&s->ioThread, NULL, ioMain, s) == 0;
+    if (!s->ioStarted) {
+        stopInferenceServer(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * @brief Stop a server: close the connections, including those with requests in flight, and free it
+ */
+void stopInferenceServer(InferenceServer *s) {
+    if (!s) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->queuedCond);
+    pthread_mutex_unlock(&s->lock);
+    if (s->ioStarted) {
+        wakeIo(s);
+        pthread_join(s->ioThread, NULL);
+    }
+    for (unsigned i = 0; s->workers && i < s->config.nThreads; i++) {
+        Worker *w = &s->workers[i];
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+        }
+        freeInferenceContext(w->ctx);
+        freeModelReader(w->reader);
+        free(w->inputs);
+        free(w->outputs);
+        free(w->taken);
+    }
+    for (unsigned i = 0; s->connections && i < s->config.maxConnections; i++) {
+        if (s->connections[i].fd >= 0) {
+            closeConnection(s, &s->connections[i]);
+        }
+        free(s->connections[i].out);
+    }
+    if (s->listener >= 0) {
+        close(s->listener);
+        unlinkSocketAddress(&s->address);
+    }
+    if (s->wake[0] >= 0) {
+        close(s->wake[0]);
+        close(s->wake[1]);
+    }
+    pthread_cond_destroy(&s->queuedCond);
+    pthread_mutex_destroy(&s->lock);
+    free(s->slots);
+    free(s->buffers);
+    free(s->freeSlots);
+    free(s->incoming);
+    free(s->queue);
+    free(s->answered);
+    free(s->connections);
+    free(s->workers);
+    free(s);
+}
+
+/**
+ * @brief Copy a server's counters and histograms, which SERVER_STATS requests return as well
+ */
+void inferenceServerStats(InferenceServer *s, ServerStats *stats) {
+    assert(s && stats);
+    pthread_mutex_lock(&s->lock);
+    *stats = s->stats;
+    pthread_mutex_unlock(&s->lock);
+    stats->modelVersion = modelVersion(s->model);
+}
+
+/* Client side: a blocking connection that pipelines up to CLIENT_WINDOW requests */
+
+struct InferenceClient {
+    int fd;
+    unsigned nInputs, nOutputs;
+    /* A request or an answer at a time */
+    char *buffer;
+};
+
+static int sendAll(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size) {
+        ssize_t k = send(fd, p, size, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            return -1;
+        }
+        p += k;
+        size -= k;
+    }
+    return 0;
+}
+
+static int receiveAll(int fd, void *data, size_t size) {
+    char *p = data;
+    while (size) {
+        ssize_t k = recv(fd, p, size, 0);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            return -1;
+        }
+        p += k;
+        size -= k;
+    }
+    return 0;
+}
+
+/* Read one answer, whose payload of at most size bytes goes to payload. Returns its id, or -1 on failure */
+static int64_t receiveAnswer(InferenceClient *c, void *payload, size_t size) {
+    ServerMessage m;
+    if (receiveAll(c->fd, &m, sizeof(m)) != 0 || m.magic != SERVER_MAGIC || m.code != SERVER_OK || m.size != size ||
+        receiveAll(c->fd, payload, size) != 0) {
+        return -1;
+    }
+    return m.id;
+}
+
+/**
+ * @brief Connect to an inference server and ask it for the network's input and output sizes
+ *
+ * @param address The server's address, "unix:PATH" or "tcp:HOST:PORT"
+ * @return InferenceClient* The client, or NULL if the server can't be reached
+ */
+InferenceClient *connectInferenceServer(const char *address) {
+    assert(address);
+    struct sockaddr_storage sa;
+    socklen_t saLen = parseSocketAddress(address, &sa);
+    InferenceClient *c = calloc(1, sizeof(InferenceClient));
+    if (!c || !saLen) {
+        free(c);
+        return NULL;
+    }
+    c->fd = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || connect(c->fd, (const struct sockaddr*)&sa, saLen) != 0) {
+        closeInferenceClient(c);
+        return NULL;
+    }
+    if (sa.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    ServerStats stats;
+    if (remoteServerStats(c, &stats) != 0) {
+        closeInferenceClient(c);
+        return NULL;
+    }
+    c->nInputs = stats.nInputs;
+    c->nOutputs = stats.nOutputs;
+    c->buffer = malloc(sizeof(ServerMessage) + (c->nInputs > c->nOutputs ? c->nInputs : c->nOutputs) * sizeof(float));
+    if (!c->buffer) {
+        closeInferenceClient(c);
+        return NULL;
+    }
+    return c;
+}
+
+void closeInferenceClient(InferenceClient *c) {
+    if (c) {
+        if (c->fd >= 0) {
+            close(c->fd);
+        }
+        free(c->buffer);
+        free(c);
+    }
+}
+
+/**
+ * @brief Fetch the counters and histograms of the server
+ *
+ * @return 0 on success, -1 if the connection failed
+ */
+int remoteServerStats(InferenceClient *c, ServerStats *stats) {
+    assert(c && stats);
+    ServerMessage m = {SERVER_MAGIC, SERVER_STATS, 0, 0};
+    return sendAll(c->fd, &m, sizeof(m)) == 0 && receiveAnswer(c, stats, sizeof(*stats)) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Feed inputs forward on the server. Each input is a request of its own, and up to
+ * CLIENT_WINDOW of them are in flight at once, so they are batched with each other and with the
+ * requests of other clients.
+ *
+ * @param c The client
+ * @param inputs n inputs stored one after another, each with as many elements as the input layer
+ * @param n Number of inputs
+ * @param outputs Buffer receiving the n outputs one after another, each with as many elements as the output layer
+ * @return 0 on success, -1 if the connection failed, after which the client can only be closed
+ */
+int remoteFeedForward(InferenceClient *c, const float *inputs, size_t n, float *outputs) {
+    assert(c && inputs && outputs && n <= UINT32_MAX);
+    size_t sent = 0, received = 0, requestSize = c->nInputs * sizeof(float);
+    while (received < n) {
+        if (sent < n && sent - received < CLIENT_WINDOW) {
+            ServerMessage m = {SERVER_MAGIC, SERVER_INFER, (uint32_t)sent, (uint32_t)requestSize};
+            memcpy(c->buffer, &m, sizeof(m));
+            memcpy(c->buffer + sizeof(m), inputs + sent * c->nInputs, requestSize);
+            if (sendAll(c->fd, c->buffer, sizeof(m) + requestSize) != 0) {
+                return -1;
+            }
+            sent++;
+            continue;
+        }
+        int64_t id = receiveAnswer(c, c->buffer, c->nOutputs * sizeof(float));
+        if (id < 0 || (size_t)id >= sent) {
+            return -1;
+        }
+        memcpy(outputs + id * c->nOutputs, c->buffer, c->nOutputs * sizeof(float));
+        received++;
+    }
+    return 0;
+}
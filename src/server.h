@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "network.h"
+#include "swap.h"
+
+/*
+ * A local inference server that answers requests from other processes with dynamic batching, see
+ * startInferenceServer, and its client.
+ *
+ * Clients connect over a Unix socket or TCP and exchange messages in host byte order: a
+ * ServerMessage header followed by size bytes of payload. A SERVER_INFER request carries one input
+ * (nInputs floats) and is answered with its outputs (nOutputs floats) under the same id. A
+ * SERVER_STATS request has no payload and is answered with a ServerStats. Requests may be pipelined,
+ * and answers may come back in a different order. A malformed request is answered with
+ * SERVER_BAD_REQUEST and the connection is closed.
+ */
+
+#define SERVER_MAGIC 0x50434e53u
+#define SERVER_HISTOGRAM_BUCKETS 32
+
+enum EServerOp {
+    SERVER_INFER,
+    SERVER_STATS
+};
+
+enum EServerStatus {
+    SERVER_OK,
+    SERVER_BAD_REQUEST,
+    /* The server couldn't run the request, e.g. out of memory. The connection stays open */
+    SERVER_ERROR
+};
+
+/* Header of every request and answer: code is an EServerOp in requests and an EServerStatus in answers */
+typedef struct ServerMessage {
+    uint32_t magic, code, id, size;
+} ServerMessage;
+
+typedef struct ServerConfig {
+    /* "unix:PATH" or "tcp:HOST:PORT" to listen on */
+    const char *address;
+    /* Largest batch run at once (default 64), and microseconds the oldest queued request may wait
+       for others to join its batch (default 500; 1 runs whatever is queued almost at once) */
+    size_t maxBatch;
+    unsigned maxWaitUs;
+    /* Worker threads, each running one batch at a time on its own inference context, 0 for one per online CPU */
+    unsigned nThreads;
+    /* Requests read but not answered yet, beyond which no more are read (default 4096) */
+    unsigned maxPending;
+    /* Simultaneous connections (default 256) */
+    unsigned maxConnections;
+    /* Activation of the layers the network doesn't specify, see setLayerActivations */
+    enum EActivationFunction af;
+} ServerConfig;
+
+/* Counters of a server since it started. Histogram bucket i counts the values in (2^(i - 1), 2^i],
+   and bucket 0 counts 0 as well, see histogramPercentile */
+typedef struct ServerStats {
+    uint32_t nInputs, nOutputs;
+    uint64_t requests, batches, badRequests, connections;
+    /* Version of the network being served, see publishModel */
+    uint64_t modelVersion;
+    /* Requests waiting for a worker, now and at most */
+    uint64_t queueDepth, maxQueueDepth;
+    /* Microseconds from reading a request to queueing its answer, and the part of it spent waiting for a worker */
+    uint64_t latencyUs[SERVER_HISTOGRAM_BUCKETS], queueUs[SERVER_HISTOGRAM_BUCKETS];
+    /* Sizes of the batches run, and the queue depth whenever one was formed */
+    uint64_t batchSizes[SERVER_HISTOGRAM_BUCKETS], queueDepths[SERVER_HISTOGRAM_BUCKETS];
+} ServerStats;
+
+typedef struct InferenceServer InferenceServer;
+typedef struct InferenceClient InferenceClient;
+
+InferenceServer *startInferenceServer(ModelHandle *model, const ServerConfig *config);
+void stopInferenceServer(InferenceServer *s);
+void inferenceServerStats(InferenceServer *s, ServerStats *stats);
+double histogramPercentile(const uint64_t *histogram, double q);
+
+InferenceClient *connectInferenceServer(const char *address);
+void closeInferenceClient(InferenceClient *c);
+int remoteServerStats(InferenceClient *c, ServerStats *stats);
+int remoteFeedForward(InferenceClient *c, const float *inputs, size_t n, float *outputs);
@@ -0,0 +1,79 @@
+/**
+ * @brief Parsing and listening on the socket addresses of distributed training and the inference server.
+ */
+#include <netdb.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "socket.h"
+
+/**
+ * @brief Fill a socket address from "unix:PATH" or "tcp:HOST:PORT", resolving HOST
+ *
+ * @param address The address
+ * @param sa Receives the socket address
+ * @return Its length, or 0 if the address is invalid or HOST can't be resolved
+ */
+socklen_t parseSocketAddress(const char *address, struct sockaddr_storage *sa) {
+    memset(sa, 0, sizeof(*sa));
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un*)sa;
+        size_t pathLen = strlen(address + 5);
+        if (pathLen == 0 || pathLen >= sizeof(un->sun_path)) {
+            return 0;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, address + 5, pathLen + 1);
+        return sizeof(struct sockaddr_un);
+    }
+    const char *port = strrchr(address, ':');
+    if (strncmp(address, "tcp:", 4) != 0 || port <= address + 4) {
+        return 0;
+    }
+    char host[port - address - 4 + 1];
+    memcpy(host, address + 4, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *info;
+    if (getaddrinfo(host, port + 1, &hints, &info) != 0) {
+        return 0;
+    }
+    socklen_t saLen = info->ai_addrlen <= sizeof(*sa) ? info->ai_addrlen : 0;
+    memcpy(sa, info->ai_addr, saLen);
+    freeaddrinfo(info);
+    return saLen;
+}
+
+/**
+ * @brief Create a listening socket. A stale Unix socket file at the path is replaced, and TCP ports
+ * are bound with SO_REUSEADDR so a restarted process can take its port back at once
+ *
+ * @param sa The address, see parseSocketAddress
+ * @param saLen Its length
+ * @param backlog Connections that may wait to be accepted
+ * @return The socket, or -1 on failure
+ */
+int listenOnAddress(const struct sockaddr_storage *sa, socklen_t saLen, int backlog) {
+    int fd = socket(sa->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (sa->ss_family == AF_UNIX) {
+        unlinkSocketAddress(sa);
+    } else {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(fd, (const struct sockaddr*)sa, saLen) != 0 || listen(fd, backlog) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Remove the file of a Unix socket address; other addresses have none */
+void unlinkSocketAddress(const struct sockaddr_storage *sa) {
+    if (sa->ss_family == AF_UNIX) {
+        unlink(((const struct sockaddr_un*)sa)->sun_path);
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <sys/socket.h>
+
+/*
+ * Stream socket addresses written as "unix:PATH" or "tcp:HOST:PORT", shared by distributed
+ * training and the inference server.
+ */
+
+socklen_t parseSocketAddress(const char *address, struct sockaddr_storage *sa);
+int listenOnAddress(const struct sockaddr_storage *sa, socklen_t saLen, int backlog);
+void unlinkSocketAddress(const struct sockaddr_storage *sa);
@@ -0,0 +1,280 @@
+/**
+ * @brief Magnitude pruning and compressed sparse row (CSR) inference kernels.
+ *
+ * A layer is pruned by zeroing the given fraction of its weights with the smallest magnitudes.
+ * Training leaves the zeros of a pruned network alone (their gradients are masked), so pruning can
+ * alternate with fine-tuning and reach a high sparsity with little loss of accuracy.
+ *
+ * The CSR kernels do work proportional to the nonzeros only. The matrix-vector product gathers the
+ * inputs of each row's nonzeros; the matrix-matrix product streams a whole row of B per nonzero,
+ * so its inner loop is a contiguous multiply-add over the examples, four nonzeros at a time.
+ * Both are built for AVX-512, AVX2 and baseline with target_clones as the activations are.
+ * The dense kernels run much closer to peak, so CSR only wins on sparse enough layers: below
+ * about 40% density for a batch of 64 and about 10% for a single input, as the gathers of the
+ * matrix-vector product cost nearly as much as streaming the dense row. Hence SPARSE_MAX_DENSITY
+ * and SPARSE_MAX_GEMV_DENSITY, which leave some margin.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+
+#define KERNEL_TARGETS __attribute__((target_clones("avx512f", "arch=haswell", "default")))
+
+/**
+ * @brief Compress the nonzeros of a dense matrix
+ *
+ * @param m The matrix
+ * @return The CSR matrix or NULL on failure. Release it with freeSparseMatrix
+ */
+SparseMatrix *sparseFromDense(Matrix m) {
+    assert(m.data && len(m) <= UINT32_MAX);
+    SparseMatrix *s = calloc(1, sizeof(SparseMatrix));
+    if (!s) {
+        return NULL;
+    }
+    s->rows = m.rows;
+    s->cols = m.cols;
+    for (size_t i = 0; i < len(m); i++) {
+        s->nnz += m.data[i] != 0;
+    }
+    size_t bytes = ((s->nnz ? s->nnz : 1) * sizeof(float) + 63) & ~(size_t)63;
+    s->rowStart = malloc((m.rows + 1) * sizeof(uint32_t));
+    s->columns = aligned_alloc(64, bytes);
+    s->values = aligned_alloc(64, bytes);
+    if (!s->rowStart || !s->columns || !s->values) {
+        freeSparseMatrix(s);
+        return NULL;
+    }
+    size_t k = 0;
+    for (unsigned r = 0; r < m.rows; r++) {
+        s->rowStart[r] = k;
+        const float *row = m.data + (size_t)r * m.cols;
+        for (unsigned c = 0; c < m.cols; c++) {
+            if (row[c] != 0) {
+                s->columns[k] = c;
+                s->values[k++] = row[c];
+            }
+        }
+    }
+    s->rowStart[m.rows] = k;
+    return s;
+}
+
+void freeSparseMatrix(SparseMatrix *s) {
+    if (s) {
+        free(s->rowStart);
+        free(s->columns);
+        free(s->values);
+        free(s);
+    }
+}
+
+KERNEL_TARGETS
+void spmv(const SparseMatrix *s, const float *restrict x, float *restrict y) {
+    const uint32_t *restrict columns = s->columns;
+    const float *restrict values = s->values;
+    for (unsigned r = 0; r < s->rows; r++) {
+        float sum = 0;
+        for (size_t k = s->rowStart[r]; k < s->rowStart[r + 1]; k++) {
+            sum += values[k] * x[columns[k]];
+        }
+        y[r] = sum;
+    }
+}
+
+KERNEL_TARGETS
+void spmm(const SparseMatrix *s, const float *restrict b, size_t n, float *restrict c) {
+    const uint32_t *restrict columns = s->columns;
+    const float *restrict values = s->values;
+    for (unsigned r = 0; r < s->rows; r++) {
+        float *restrict cr = c + r * n;
+        memset(cr, 0, n * sizeof(float));
+        size_t k = s->rowStart[r], end = s->rowStart[r + 1];
+        for (; k + 4 <= end; k += 4) {
+            const float *b0 = b + columns[k] * n, *b1 = b + columns[k + 1] * n;
+            const float *b2 = b + columns[k + 2] * n, *b3 = b + columns[k + 3] * n;
+            float v0 = values[k], v1 = values[k + 1], v2 = values[k + 2], v3 = values[k + 3];
+            for (size_t j = 0; j < n; j++) {
+                cr[j] += v0 * b0[j] + v1 * b1[j] + v2 * b2[j] + v3 * b3[j];
+            }
+        }
+        for (; k < end; k++) {
+            const float *b0 = b + columns[k] * n;
+            float v0 = values[k];
+            for (size_t j = 0; j < n; j++) {
+                cr[j] += v0 * b0[j];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Fraction of a weight layer's weights that are nonzero
+ *
+ * @param net Pointer to a network with float weights
+ * @param layer Index of the weight layer
+ */
+float layerDensity(const Network *net, unsigned layer) {
+    assert(net && layer < net->nLayers - 1 && net->weights[layer].data);
+    Matrix w = net->weights[layer];
+    size_t nnz = 0;
+    for (size_t i = 0; i < len(w); i++) {
+        nnz += w.data[i] != 0;
+    }
+    return (float)nnz / len(w);
+}
+
+/**
+ * @brief Rebuild the CSR copies of a pruned network's weights from its float weights, for the
+ * layers at most SPARSE_MAX_DENSITY dense; the other layers keep using the dense kernels.
+ * Pruning, training and reading a network do this already; call it after changing the weights directly.
+ *
+ * @param net Pointer to a network with float weights. Its CSR copies are dropped if it isn't pruned
+ * @return 0 on success, -1 otherwise, in which case every layer uses the dense kernels
+ */
+int updateSparseWeights(Network *net) {
+    assert(net);
+    unsigned L = net->nLayers - 1;
+    for (unsigned i = 0; net->sparseWeights && i < L; i++) {
+        freeSparseMatrix(net->sparseWeights[i]);
+        net->sparseWeights[i] = NULL;
+    }
+    if (!net->pruned) {
+        free(net->sparseWeights);
+        net->sparseWeights = NULL;
+        return 0;
+    }
+    if (!net->sparseWeights) {
+        net->sparseWeights = calloc(L, sizeof(SparseMatrix*));
+        if (!net->sparseWeights) {
+            return -1;
+        }
+    }
+    for (unsigned i = 0; i < L; i++) {
+        if (layerDensity(net, i) <= SPARSE_MAX_DENSITY) {
+            net->sparseWeights[i] = sparseFromDense(net->weights[i]);
+            if (!net->sparseWeights[i]) {
+                for (unsigned j = 0; j < i; j++) {
+                    freeSparseMatrix(net->sparseWeights[j]);
+                    net->sparseWeights[j] = NULL;
+                }
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int compareMagnitudes(const void *a, const void *b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/* Zero the round(sparsity * len(w)) weights of smallest magnitude, counting those already zero */
+static int pruneWeights(Matrix w, float sparsity) {
+    size_t n = len(w), count = (size_t)(sparsity * n + 0.5f);
+    if (count == 0) {
+        return 0;
+    }
+    float *magnitudes = malloc(n * sizeof(float));
+    if (!magnitudes) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        magnitudes[i] = fabsf(w.data[i]);
+    }
+    qsort(magnitudes, n, sizeof(float), compareMagnitudes);
+    float threshold = magnitudes[count - 1];
+    free(magnitudes);
+    /* Everything below the threshold, then as many of the weights equal to it as are needed */
+    size_t pruned = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (fabsf(w.data[i]) < threshold) {
+            w.data[i] = 0;
+            pruned++;
+        }
+    }
+    for (size_t i = 0; i < n && pruned < count; i++) {
+        if (w.data[i] != 0 && fabsf(w.data[i]) == threshold) {
+            w.data[i] = 0;
+            pruned++;
+        }
+    }
+    return 0;
+}
+
+/* Mark the network pruned and bring its reduced precision and CSR copies up to date */
+static int finishPruning(Network *net) {
+    net->pruned = true;
+    if (net->weightType != WEIGHTS_F32 && setWeightType(net, net->weightType) != 0) {
+        return -1;
+    }
+    return updateSparseWeights(net);
+}
+
+/**
+ * @brief Prune one weight layer: zero the weights with the smallest magnitudes. The biases are kept
+ *
+ * @param net Pointer to a network that is not mapped from a file
+ * @param layer Index of the weight layer
+ * @param sparsity Fraction of the layer's weights to be zero afterwards, including those already zero
+ * @return 0 on success, -1 otherwise
+ */
+int pruneLayer(Network *net, unsigned layer, float sparsity) {
+    assert(net && !net->mapping && layer < net->nLayers - 1 && sparsity >= 0 && sparsity <= 1);
+    if (pruneWeights(net->weights[layer], sparsity) != 0) {
+        return -1;
+    }
+    return finishPruning(net);
+}
+
+/**
+ * @brief Prune every weight layer to the same sparsity by weight magnitude. The zeroed weights stay
+ * zero when the network is trained further, and layers sparse enough are then multiplied in CSR form
+ * by feedForward and inference contexts (see updateSparseWeights) and saved in CSR form.
+ *
+ * @param net Pointer to a network that is not mapped from a file
+ * @param sparsity Fraction of each layer's weights to be zero afterwards, including those already zero
+ * @return 0 on success, -1 otherwise
+ */
+int pruneNetwork(Network *net, float sparsity) {
+    assert(net && !net->mapping && sparsity >= 0 && sparsity <= 1);
+    for (unsigned i = 0; i < net->nLayers - 1; i++) {
+        if (pruneWeights(net->weights[i], sparsity) != 0) {
+            return -1;
+        }
+    }
+    return finishPruning(net);
+}
+
+/**
+ * @brief Prune a network gradually, fine-tuning it after every step, which loses much less
+ * accuracy than pruning to the final sparsity at once. The sparsity of round r of n is
+ * sparsity * (1 - (1 - r / n)^3), pruning most while the network has most redundant weights.
+ *
+ * @param net Pointer to a network that is not mapped from a file
+ * @param sparsity Fraction of each layer's weights to be zero in the end
+ * @param rounds Number of pruning steps, each followed by config->epochs epochs of training
+ * @param trainingData Array of TrainingExamples to fine-tune the network with
+ * @param nExamples Number of TrainingExamples in trainingData
+ * @param config Fine-tuning hyperparameters, see trainNetwork. stochasticGradientDescent's are
+ *               a config with epochs, batchSize, learningRate, af and one thread
+ * @param testData Optional: Array of TrainingExamples to test the network against after every round
+ * @param nTestData Optional: Number of TrainingExamples in testData
+ * @return 0 on success, -1 if pruning failed
+ */
+int pruneIteratively(Network *net, float sparsity, unsigned rounds, TrainingExample *trainingData, size_t nExamples,
+                     const TrainingConfig *config, TrainingExample *testData, unsigned nTestData) {
+    assert(net && rounds && config);
+    for (unsigned r = 1; r <= rounds; r++) {
+        float remaining = 1 - (float)r / rounds;
+        if (pruneNetwork(net, sparsity * (1 - remaining * remaining * remaining)) != 0) {
+            return -1;
+        }
+        trainNetwork(net, trainingData, nExamples, config, testData, nTestData);
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "network.h"
+
+/*
+ * Magnitude pruning and sparse inference, see pruneNetwork.
+ *
+ * Pruning zeroes the smallest weights of a layer. A pruned network keeps its zeros through further
+ * training, and every layer whose density is low enough gets a compressed sparse row (CSR) copy of
+ * its weights that feedForward and inference contexts use instead of the dense GEMM. The float
+ * weights stay the master copy, as with reduced precision weights.
+ */
+
+/* A rows x cols matrix in compressed sparse row form */
+typedef struct SparseMatrix {
+    unsigned rows, cols;
+    size_t nnz;
+    /* The nonzeros of row r are values[rowStart[r]] .. values[rowStart[r + 1] - 1], by column */
+    uint32_t *rowStart;
+    uint32_t *columns;
+    float *values;
+} SparseMatrix;
+
+/* Layers at most this dense are multiplied in CSR form by inference contexts, and at most
+   SPARSE_MAX_GEMV_DENSITY dense by feedForward, where a single input makes the dense kernel harder to beat */
+#define SPARSE_MAX_DENSITY 0.3f
+#define SPARSE_MAX_GEMV_DENSITY 0.1f
+
+SparseMatrix *sparseFromDense(Matrix m);
+void freeSparseMatrix(SparseMatrix *s);
+
+/* y = S * x */
+void spmv(const SparseMatrix *s, const float *x, float *y);
+/* C = S * B for a cols x n B and a rows x n C, both row-major */
+void spmm(const SparseMatrix *s, const float *b, size_t n, float *c);
+
+int pruneLayer(Network *net, unsigned layer, float sparsity);
+int pruneNetwork(Network *net, float sparsity);
+int pruneIteratively(Network *net, float sparsity, unsigned rounds, TrainingExample *trainingData, size_t nExamples,
+                     const TrainingConfig *config, TrainingExample *testData, unsigned nTestData);
+int updateSparseWeights(Network *net);
+float layerDensity(const Network *net, unsigned layer);
@@ -0,0 +1,290 @@
+/**
+ * @brief Hot-swapping the network served by a running process, with epoch-based reclamation.
+ *
+ * The handle holds the current version and a global epoch. A reader announces the epoch it enters
+ * in, then loads the current version; leaving clears the announcement. Replacing the network swaps
+ * in the new version and then advances the epoch, so a reader that loaded the old version announced
+ * an epoch no later than the one the old version was retired in. The old version is freed once no
+ * reader announces such an epoch. Every access is sequentially consistent, which orders a reader's
+ * announcement before its load of the version, and the swap before the writer's scan of the readers.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "half.h"
+#include "swap.h"
+
+/* Nanoseconds a writer sleeps between scans of the readers still using a retired version */
+#define SWAP_POLL_NS 20000
+
+typedef struct ModelVersion {
+    Network *net;
+    uint64_t version;
+} ModelVersion;
+
+struct ModelReader {
+    /* Epoch the reader entered in, 0 while it is outside. Alone on its cache line, see initModelReader */
+    uint64_t epoch;
+    ModelHandle *handle;
+    ModelReader *next;
+};
+
+struct ModelHandle {
+    ModelVersion *current;
+    uint64_t epoch;
+    /* Guards the list of readers */
+    pthread_mutex_t readersLock;
+    ModelReader *readers;
+    /* Serializes the writers */
+    pthread_mutex_t writeLock;
+};
+
+static ModelVersion *initVersion(Network *net, uint64_t version) {
+    ModelVersion *v = malloc(sizeof(ModelVersion));
+    if (v) {
+        v->net = net;
+        v->version = version;
+    }
+    return v;
+}
+
+/**
+ * @brief Create a handle serving a network
+ *
+ * @param net Pointer to a network. The handle takes ownership of it, and of every network published to it
+ * @return ModelHandle* The handle, at version 1, or NULL on failure
+ */
+ModelHandle *initModelHandle(Network *net) {
+    assert(net);
+    ModelHandle *h = calloc(1, sizeof(ModelHandle));
+    if (!h) {
+        return NULL;
+    }
+    h->current = initVersion(net, 1);
+    if (!h->current) {
+        free(h);
+        return NULL;
+    }
+    h->epoch = 1;
+    pthread_mutex_init(&h->readersLock, NULL);
+    pthread_mutex_init(&h->writeLock, NULL);
+    return h;
+}
+
+/**
+ * @brief Free a handle and its current network. Its readers must have been freed
+ */
+void freeModelHandle(ModelHandle *h) {
+    if (h) {
+        assert(!h->readers);
+        freeNetwork(h->current->net);
+        free(h->current);
+        pthread_mutex_destroy(&h->readersLock);
+        pthread_mutex_destroy(&h->writeLock);
+        free(h);
+    }
+}
+
+/**
+ * @brief Register a thread that runs inference on the handle's network. Registering takes a lock;
+ * entering and leaving the model with the reader don't.
+ *
+ * @param h The handle
+ * @return ModelReader* The reader, to be used by one thread at a time, or NULL on failure
+ */
+ModelReader *initModelReader(ModelHandle *h) {
+    assert(h);
+    /* A cache line of its own, so readers entering and leaving don't contend on it */
+    ModelReader *r = aligned_alloc(64, 64);
+    if (!r) {
+        return NULL;
+    }
+    r->epoch = 0;
+    r->handle = h;
+    pthread_mutex_lock(&h->readersLock);
+    r->next = h->readers;
+    h->readers = r;
+    pthread_mutex_unlock(&h->readersLock);
+    return r;
+}
+
+/**
+ * @brief Unregister a reader. It must be outside the model
+ */
+void freeModelReader(ModelReader *r) {
+    if (r) {
+        assert(!r->epoch);
+        ModelHandle *h = r->handle;
+        pthread_mutex_lock(&h->readersLock);
+        ModelReader **p = &h->readers;
+        while (*p != r) {
+            p = &(*p)->next;
+        }
+        *p = r->next;
+        pthread_mutex_unlock(&h->readersLock);
+        free(r);
+    }
+}
+
+/**
+ * @brief Get the current network, which stays valid until leaveModel even if another is published meanwhile
+ *
+ * @param r The calling thread's reader, outside the model
+ * @param version If not NULL, receives the network's version, which grows by one with every publishModel
+ * @return Network* The network. It must not be changed
+ */
+Network *enterModel(ModelReader *r, uint64_t *version) {
+    assert(r && !r->epoch);
+    ModelHandle *h = r->handle;
+    __atomic_store_n(&r->epoch, __atomic_load_n(&h->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    ModelVersion *v = __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+    if (version) {
+        *version = v->version;
+    }
+    return v->net;
+}
+
+/**
+ * @brief Stop using the network returned by enterModel
+ */
+void leaveModel(ModelReader *r) {
+    assert(r && r->epoch);
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief The version of the current network
+ */
+uint64_t modelVersion(ModelHandle *h) {
+    assert(h);
+    return __atomic_load_n(&h->current, __ATOMIC_SEQ_CST)->version;
+}
+
+/* Whether a reader is in an epoch up to retired. Takes the lock only for the scan, so readers can
+ * register and unregister while the writer waits */
+static bool readersInEpoch(ModelHandle *h, uint64_t retired) {
+    bool found = false;
+    pthread_mutex_lock(&h->readersLock);
+    for (ModelReader *r = h->readers; r && !found; r = r->next) {
+        uint64_t epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+        found = epoch && epoch <= retired;
+    }
+    pthread_mutex_unlock(&h->readersLock);
+    return found;
+}
+
+/* Wait until no reader is in an epoch up to retired. Readers registered meanwhile enter in a later epoch */
+static void waitForReaders(ModelHandle *h, uint64_t retired) {
+    struct timespec pause = {0, SWAP_POLL_NS};
+    while (readersInEpoch(h, retired)) {
+        nanosleep(&pause, NULL);
+    }
+}
+
+/* Tests the exponent bits, as isfinite() is folded to true under -ffast-math */
+static bool allFinite(const float *x, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t bits;
+        memcpy(&bits, x + i, sizeof(bits));
+        if ((bits & 0x7f800000u) == 0x7f800000u) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Widen the reduced precision weights of a layer a row at a time into row, which holds cols floats */
+static bool finiteHalfWeights(const Network *net, unsigned l, float *row) {
+    const Matrix *w = &net->weights[l];
+    for (unsigned r = 0; r < w->rows; r++) {
+        halfToFloat(net->weightType, net->halfWeights[l] + (size_t)r * w->cols, row, w->cols);
+        if (!allFinite(row, w->cols)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * A network can replace current if it has the same inputs and outputs and finite parameters. That
+ * covers the float master weights when there are any, and the reduced precision copies used for
+ * inference, where a finite master can still have overflowed to inf in f16
+ */
+static bool validReplacement(const Network *net, const Network *current) {
+    if (net->nLayers < 2 || net->sizes[0] != current->sizes[0] ||
+        net->sizes[net->nLayers - 1] != current->sizes[current->nLayers - 1]) {
+        return false;
+    }
+    float *row = NULL;
+    if (net->weightType != WEIGHTS_F32) {
+        unsigned maxCols = 0;
+        for (unsigned l = 0; l < net->nLayers - 1; l++) {
+            maxCols = net->weights[l].cols > maxCols ? net->weights[l].cols : maxCols;
+        }
+        row = malloc(maxCols * sizeof(float));
+        if (!row) {
+            return false;
+        }
+    }
+    bool valid = true;
+    for (unsigned l = 0; l < net->nLayers - 1 && valid; l++) {
+        valid = allFinite(net->biases[l].data, len(net->biases[l])) &&
+                (!net->weights[l].data || allFinite(net->weights[l].data, len(net->weights[l]))) &&
+                (net->weightType == WEIGHTS_F32 || finiteHalfWeights(net, l, row));
+    }
+    free(row);
+    return valid;
+}
+
+/**
+ * @brief Replace the handle's network. Readers entering from now on get the new network, those
+ * inside keep the old one, which is freed once they have all left. Returns after that, so it
+ * should be called from a thread that isn't itself inside the model.
+ *
+ * @param h The handle
+ * @param net Pointer to the new network, which must have as many inputs and outputs as the current one
+ *            and only finite weights and biases. The handle takes ownership of it if it is published
+ * @return 0 when published, -1 if the network is rejected or on failure, in which case the caller keeps it
+ */
+int publishModel(ModelHandle *h, Network *net) {
+    assert(h && net);
+    pthread_mutex_lock(&h->writeLock);
+    ModelVersion *old = h->current;
+    ModelVersion *v = validReplacement(net, old->net) ? initVersion(net, old->version + 1) : NULL;
+    if (!v) {
+        pthread_mutex_unlock(&h->writeLock);
+        return -1;
+    }
+    __atomic_store_n(&h->current, v, __ATOMIC_SEQ_CST);
+    uint64_t retired = __atomic_fetch_add(&h->epoch, 1, __ATOMIC_SEQ_CST);
+    waitForReaders(h, retired);
+    freeNetwork(old->net);
+    free(old);
+    pthread_mutex_unlock(&h->writeLock);
+    return 0;
+}
+
+/**
+ * @brief Read a network from a file and publish it, see publishModel. The file is read and checked
+ * on the calling thread while the readers go on with the current network.
+ *
+ * @param h The handle
+ * @param filename Path to a network saved with saveNetworkToFile
+ * @return 0 when published, -1 if the file can't be read or the network is rejected
+ */
+int reloadModel(ModelHandle *h, const char *filename) {
+    assert(h && filename);
+    Network *net = readNetworkFromFile(filename);
+    if (!net) {
+        return -1;
+    }
+    if (publishModel(h, net) != 0) {
+        freeNetwork(net);
+        return -1;
+    }
+    return 0;
+}
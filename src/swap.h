@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "network.h"
+
+/*
+ * A versioned handle to the network a process serves, whose weights can be replaced while other
+ * threads run inference on it, see initModelHandle. Readers take no locks: enterModel and
+ * leaveModel are a few atomic loads and stores. A replaced network is freed once every reader that
+ * may still use it has left, by the thread that replaced it.
+ */
+
+typedef struct ModelHandle ModelHandle;
+
+/* A thread's registration with a handle, see initModelReader */
+typedef struct ModelReader ModelReader;
+
+ModelHandle *initModelHandle(Network *net);
+void freeModelHandle(ModelHandle *h);
+ModelReader *initModelReader(ModelHandle *h);
+void freeModelReader(ModelReader *r);
+Network *enterModel(ModelReader *r, uint64_t *version);
+void leaveModel(ModelReader *r);
+uint64_t modelVersion(ModelHandle *h);
+int publishModel(ModelHandle *h, Network *net);
+int reloadModel(ModelHandle *h, const char *filename);
@@ -0,0 +1,170 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+struct ThreadPool {
+    unsigned nThreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    pthread_barrier_t barrier;
+    /* Incremented for every job so sleeping workers can tell a new job from a spurious wakeup */
+    unsigned long generation;
+    unsigned running;
+    bool shutdown;
+    ThreadPoolJob job;
+    void *arg;
+};
+
+typedef struct WorkerArgs {
+    ThreadPool *pool;
+    unsigned worker;
+} WorkerArgs;
+
+static void *workerMain(void *p) {
+    WorkerArgs args = *(WorkerArgs*)p;
+    free(p);
+    ThreadPool *pool = args.pool;
+    unsigned long seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        ThreadPoolJob job = pool->job;
+        void *arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        job(arg, args.worker, pool->nThreads);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * @brief Number of online CPUs, used when a caller asks for 0 threads
+ */
+unsigned defaultThreadCount(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+/**
+ * @brief Create a pool of nThreads workers, including the calling thread
+ *
+ * @param nThreads Number of workers. 0 means one per online CPU
+ * @return ThreadPool* The pool or NULL on failure
+ */
+ThreadPool *initThreadPool(unsigned nThreads) {
+    if (nThreads == 0) {
+        nThreads = defaultThreadCount();
+    }
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->nThreads = nThreads;
+    pool->threads = calloc(nThreads, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_barrier_init(&pool->barrier, NULL, nThreads);
+    for (unsigned i = 1; i < nThreads; i++) {
+        WorkerArgs *args = malloc(sizeof(WorkerArgs));
+        if (args) {
+            args->pool = pool;
+            args->worker = i;
+        }
+        if (!args || pthread_create(&pool->threads[i], NULL, workerMain, args) != 0) {
+            free(args);
+            pool->nThreads = i;
+            freeThreadPool(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+unsigned threadPoolSize(ThreadPool *pool) {
+    return pool ? pool->nThreads : 1;
+}
+
+/**
+ * @brief Run job on every worker and wait until all of them have returned
+ *
+ * @param pool The pool, or NULL to run the job inline as a single worker
+ * @param job The job to run
+ * @param arg Argument passed to every invocation of job
+ */
+void threadPoolRun(ThreadPool *pool, ThreadPoolJob job, void *arg) {
+    assert(job);
+    if (!pool || pool->nThreads == 1) {
+        job(arg, 0, 1);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->arg = arg;
+    pool->running = pool->nThreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    job(arg, 0, pool->nThreads);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Block until every worker of the running job has reached the barrier.
+ * Must be called by all workers of a job, or by none of them.
+ */
+void threadPoolBarrier(ThreadPool *pool) {
+    if (pool && pool->nThreads > 1) {
+        pthread_barrier_wait(&pool->barrier);
+    }
+}
+
+/**
+ * @brief Stop all workers and free the pool
+ *
+ * @param pool The pool to free
+ */
+void freeThreadPool(ThreadPool *pool) {
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = true;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+        for (unsigned i = 1; i < pool->nThreads; i++) {
+            pthread_join(pool->threads[i], NULL);
+        }
+        pthread_barrier_destroy(&pool->barrier);
+        pthread_cond_destroy(&pool->start);
+        pthread_cond_destroy(&pool->done);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+        free(pool);
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * A fixed-size fork-join thread pool. The calling thread takes part in every job as worker 0,
+ * so a pool of size 1 runs jobs inline without any extra threads.
+ */
+typedef struct ThreadPool ThreadPool;
+
+/* Job run once on every worker. worker is in [0, nWorkers) */
+typedef void (*ThreadPoolJob)(void *arg, unsigned worker, unsigned nWorkers);
+
+ThreadPool *initThreadPool(unsigned nThreads);
+unsigned threadPoolSize(ThreadPool *pool);
+void threadPoolRun(ThreadPool *pool, ThreadPoolJob job, void *arg);
+void threadPoolBarrier(ThreadPool *pool);
+void freeThreadPool(ThreadPool *pool);
+unsigned defaultThreadCount(void);
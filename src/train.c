@@ -0,0 +1,1643 @@
+/**
+ * @brief Training: mini-batch backpropagation and the single and multithreaded SGD drivers.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checkpoint.h"
+#include "dataset.h"
+#include "distributed.h"
+#include "network.h"
+#include "optimizer.h"
+#include "profile.h"
+#include "random.h"
+#include "sparse.h"
+#include "threadpool.h"
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a < _b ? _a : _b; })
+
+/*
+ * Preallocated buffers for training a network, carved out of a single arena. Examples are columns
+ * of the activations, except for the inputs: activations[0] is a bSize x nInputs view of the batch's
+ * rows, set by gatherBatch or packRows, and the first layer multiplies by its transpose.
+ */
+typedef struct Workspace {
+    size_t batchSize;
+    float *arena;
+    Matrix *activations, *deltas;
+    /* Views into gradients, which is laid out as the network's parameters */
+    Matrix *dWeights, *dBiases;
+    float *gradients;
+    Matrix y;
+    /* Staging rows that scattered examples are gathered into */
+    float *xRows, *yRows;
+    Profile profile;
+} Workspace;
+
+/* View of a workspace buffer resized for a batch of bSize examples */
+static inline Matrix batchView(Matrix m, size_t bSize) {
+    m.cols = bSize;
+    return m;
+}
+
+static Workspace *initWorkspace(Network *net, size_t batchSize);
+static void freeWorkspace(Workspace *ws);
+static void packRows(Network *net, Workspace *ws, const float *inputs, const float *outputs, size_t bSize);
+static void forwardBatch(Network *net, Workspace *ws, size_t bSize, enum EActivationFunction af, bool classify, bool stacked);
+static void backprop(Network *net, Workspace *ws, size_t bSize, const TrainingConfig *config, Communicator *comm, bool stacked);
+
+/**
+ * @brief Train the network using SGD algorithm
+ *
+ * @param net Pointer to a network
+ * @param trainingData Array of TrainingExamples to train the network with
+ * @param nExamples Number of TrainingExamples in trainingData
+ * @param epochs Amount of epochs
+ * @param batchSize Maximum size of each mini-batch
+ * @param learningRate Learning rate variable
+ * @param af The activation function
+ * @param testData Optional: Array of TrainingExamples to test the network against.
+ * @param nTestData Optional: Number of TrainingExamples in testData
+ * Note: The TrainingExamples in trainingData should have the same output size as the network, contianing the desired activation for each output perceptron.
+ *       The TrainingExamples in testData should have output size 1, containing the index of the desired highest activation perceptron.
+ */
+void stochasticGradientDescent(
+    Network* net,
+    TrainingExample *trainingData,
+    size_t nExamples,
+    unsigned epochs,
+    size_t batchSize,
+    float learningRate,
+    enum EActivationFunction af,
+    TrainingExample *testData,
+    unsigned nTestData)
+{
+    TrainingConfig config = {
+        .epochs = epochs,
+        .batchSize = batchSize,
+        .learningRate = learningRate,
+        .af = af,
+        .nThreads = 1
+    };
+    trainNetwork(net, trainingData, nExamples, &config, testData, nTestData);
+}
+
+/* In-memory examples, either as separate TrainingExamples or as a contiguous TrainingSet */
+typedef struct ExampleSource {
+    TrainingExample *examples;
+    const TrainingSet *set;
+    size_t n;
+} ExampleSource;
+
+static inline const float *sourceInput(const ExampleSource *src, size_t k) {
+    return src->set ? src->set->inputs + k * src->set->nInputs : src->examples[k].input;
+}
+
+static inline const float *sourceOutput(const ExampleSource *src, size_t k) {
+    return src->set ? src->set->outputs + k * src->set->nOutputs : src->examples[k].output;
+}
+
+/* Background tester of weight snapshots, see TrainingConfig.asyncEvaluation */
+typedef struct Evaluator Evaluator;
+
+/* Shared state of a training run, handed to every worker */
+typedef struct TrainingJob {
+    Network *net;
+    const TrainingConfig *config;
+    /* Where the examples come from: in memory, visited in the order of a shuffled permutation, or a prefetcher */
+    ExampleSource source;
+    size_t *order;
+    Rng rng;
+    /* Examples of the current epoch trained on before it started, when resuming mid-epoch */
+    size_t position;
+    BatchPrefetcher *stream;
+    const Batch *batch;
+    ThreadPool *pool;
+    Workspace **workspaces;
+    size_t nParams;
+    /* Set in sweeps, whose first layer weights and gradients are rows of their cohort's stacks
+       rather than part of the flat buffers, see stackCohort */
+    bool stacked;
+    Optimizer *optimizer;
+    /* Current epoch, its learning rate, and update steps taken in it by worker 0 */
+    unsigned epoch;
+    float learningRate;
+    size_t nBatches;
+    /* Examples trained on in the current epoch when streaming */
+    size_t nStreamed;
+    /* Set when testing in the background and when checkpointing */
+    Evaluator *evaluator;
+    Checkpointer *checkpointer;
+    /* Distributed training: examples held by every rank, and the update steps of an epoch */
+    size_t *shardSizes;
+    size_t nSteps;
+} TrainingJob;
+
+/* Parameters are numbered weights[0], biases[0], weights[1], ... for slicing work between workers */
+static inline Matrix parameter(Network *net, unsigned i) {
+    return i % 2 ? net->biases[i / 2] : net->weights[i / 2];
+}
+
+static inline Matrix gradient(Workspace *ws, unsigned i) {
+    return i % 2 ? ws->dBiases[i / 2] : ws->dWeights[i / 2];
+}
+
+/* Zero the gradients of a pruned network's zero weights, so the optimizer leaves them at zero */
+static void maskPrunedGradients(const float *weights, float *grads, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        grads[i] = weights[i] == 0 ? 0 : grads[i];
+    }
+}
+
+/**
+ * @brief Apply the optimizer's update to parameters lo .. hi - 1 of the flat numbering with the
+ * gradients of a workspace. Without weight decay or pruning, which treat weights and biases
+ * differently, the whole slice is one pass over the flat buffers.
+ */
+static void updateParameters(TrainingJob *job, Workspace *ws, float gradScale, size_t step, size_t lo, size_t hi) {
+    Network *net = job->net;
+    if (!net->pruned && !job->optimizer->config.weightDecay && !job->stacked) {
+        optimizerUpdate(job->optimizer, job->learningRate, gradScale, true, step,
+                        net->parameters + lo, ws->gradients + lo, lo, hi - lo);
+        return;
+    }
+    size_t offset = 0;
+    for (unsigned p = 0; p < 2 * (net->nLayers - 1) && offset < hi; p++) {
+        Matrix param = parameter(net, p);
+        size_t n = len(param);
+        if (offset + n > lo) {
+            size_t a = lo > offset ? lo - offset : 0;
+            size_t b = min(n, hi - offset);
+            float *grad = gradient(ws, p).data;
+            if (net->pruned && p % 2 == 0) {
+                maskPrunedGradients(param.data + a, grad + a, b - a);
+            }
+            optimizerUpdate(job->optimizer, job->learningRate, gradScale, p % 2 == 0, step,
+                            param.data + a, grad + a, offset + a, b - a);
+        }
+        offset += n;
+    }
+}
+
+/**
+ * @brief Sum the workers' gradients with a pairwise tree and apply the optimizer's update, for
+ * this worker's slice of the parameters only, so the update runs in parallel over all layers.
+ * The summation order only depends on the number of workers, so results are reproducible for a
+ * fixed seed and thread count.
+ *
+ * @param job The training run
+ * @param worker This worker
+ * @param nWorkers Number of workers
+ * @param gradScale Factor applied to the summed gradients, 1 / batch size
+ * @param step One based number of the update step
+ */
+static void reduceAndUpdate(TrainingJob *job, unsigned worker, unsigned nWorkers, float gradScale, size_t step) {
+    Profile *profile = &job->workspaces[worker]->profile;
+    double t = PROFILE_NOW();
+    size_t lo = job->nParams * worker / nWorkers, hi = job->nParams * (worker + 1) / nWorkers;
+    assert(nWorkers == 1 || !job->stacked);
+    for (unsigned s = 1; s < nWorkers; s <<= 1) {
+        for (unsigned w = 0; w + s < nWorkers; w += 2 * s) {
+            float *restrict dst = job->workspaces[w]->gradients;
+            const float *restrict src = job->workspaces[w + s]->gradients;
+            for (size_t i = lo; i < hi; i++) {
+                dst[i] += src[i];
+            }
+        }
+    }
+    PROFILE_LAP(profile->phases[PHASE_REDUCE], t);
+    updateParameters(job, job->workspaces[0], gradScale, step, lo, hi);
+    PROFILE_LAP(profile->phases[PHASE_UPDATE], t);
+}
+
+/**
+ * @brief Gather examples of an in-memory source into the workspace. Whole rows are copied into
+ * staging buffers, so the reads are sequential; consecutive rows of a TrainingSet are used in place.
+ *
+ * @param net Pointer to a network
+ * @param ws Workspace created for net
+ * @param src The examples
+ * @param indices Indices of the examples to gather, or NULL for the consecutive examples starting at first
+ * @param first Index of the first example when indices is NULL
+ * @param bSize Number of examples, at most ws->batchSize
+ * @param targets Whether to gather the expected outputs too
+ */
+static void gatherBatch(Network *net, Workspace *ws, const ExampleSource *src, const size_t *indices,
+                        size_t first, size_t bSize, bool targets) {
+    assert(bSize && bSize <= ws->batchSize);
+    unsigned nIn = net->sizes[0], nOut = net->sizes[net->nLayers - 1];
+    const float *inputs = ws->xRows, *outputs = ws->yRows;
+    if (src->set && !indices) {
+        /* Already contiguous rows */
+        inputs = sourceInput(src, first);
+        outputs = sourceOutput(src, first);
+    } else {
+        for (size_t j = 0; j < bSize; j++) {
+            size_t k = indices ? indices[j] : first + j;
+            assert(src->set || src->examples[k].nInputs == nIn);
+            memcpy(ws->xRows + j * nIn, sourceInput(src, k), nIn * sizeof(float));
+            if (targets) {
+                assert(src->set || src->examples[k].nOutputs == nOut);
+                memcpy(ws->yRows + j * nOut, sourceOutput(src, k), nOut * sizeof(float));
+            }
+        }
+    }
+    if (targets) {
+        packRows(net, ws, inputs, outputs, bSize);
+    } else {
+        ws->activations[0] = matrixFromData(bSize, nIn, (float*)inputs);
+    }
+}
+
+/* Workers left without examples still take part in the reduction, with a zero gradient */
+static void zeroGradients(Network *net, Workspace *ws) {
+    memset(ws->gradients, 0, net->nParameters * sizeof(float));
+}
+
+/* Test examples handed to the inference context at a time when they have to be gathered */
+#define EVALUATION_CHUNK 256
+
+/* A copy of the weights taken during training and the result of testing it */
+typedef struct Snapshot {
+    Network net;
+    InferenceContext *ctx;
+    EvaluationStats stats;
+} Snapshot;
+
+/*
+ * Snapshots are double-buffered: training copies the weights into one while the thread tests the
+ * other, so it only waits for the thread when it gets a whole test ahead.
+ */
+struct Evaluator {
+    const TrainingConfig *config;
+    /* Test examples whose single output is the index of the expected highest activation */
+    ExampleSource test;
+    Snapshot snapshots[2];
+    /* The snapshot waiting to be tested and the one being tested, or NULL */
+    Snapshot *pending, *running;
+    bool started, stop;
+    /* Rows of scattered test examples, and the predicted labels */
+    float *inputs;
+    int *labels;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filledCond, freeCond;
+};
+
+/**
+ * @brief Count the test examples whose highest output activation is at the expected index
+ */
+static size_t countPassed(Evaluator *ev, Snapshot *s) {
+    const ExampleSource *test = &ev->test;
+    unsigned nIn = s->net.sizes[0];
+    size_t nPassed = 0;
+    for (size_t j = 0; j < test->n; j += EVALUATION_CHUNK) {
+        size_t n = min((size_t)EVALUATION_CHUNK, test->n - j);
+        const float *inputs = ev->inputs;
+        if (test->set) {
+            inputs = sourceInput(test, j);
+        } else {
+            for (size_t k = 0; k < n; k++) {
+                assert(test->examples[j + k].nInputs == nIn);
+                memcpy(ev->inputs + k * nIn, sourceInput(test, j + k), nIn * sizeof(float));
+            }
+        }
+        classifyBatch(s->ctx, inputs, n, ev->config->af, ev->labels);
+        for (size_t k = 0; k < n; k++) {
+            if (ev->labels[k] == *sourceOutput(test, j + k)) {
+                nPassed++;
+            }
+        }
+    }
+    return nPassed;
+}
+
+static void reportEvaluation(const TrainingConfig *config, const EvaluationStats *stats) {
+    if (config->onEvaluation) {
+        config->onEvaluation(stats, config->userData);
+    } else if (stats->endOfEpoch) {
+        printf("Epoch %u tested. %zu/%zu passing\n", stats->epoch + 1, stats->nPassed, stats->nTested);
+    } else {
+        printf("Epoch %u, step %zu: %zu/%zu passing\n", stats->epoch + 1, stats->step, stats->nPassed, stats->nTested);
+    }
+}
+
+static void *evaluatorMain(void *arg) {
+    Evaluator *ev = arg;
+    for (;;) {
+        pthread_mutex_lock(&ev->lock);
+        while (!ev->pending && !ev->stop) {
+            pthread_cond_wait(&ev->filledCond, &ev->lock);
+        }
+        /* Snapshots submitted before stopping are still tested */
+        if (!ev->pending) {
+            pthread_mutex_unlock(&ev->lock);
+            return NULL;
+        }
+        Snapshot *s = ev->running = ev->pending;
+        ev->pending = NULL;
+        pthread_cond_signal(&ev->freeCond);
+        pthread_mutex_unlock(&ev->lock);
+
+        double start = profileClock();
+        s->stats.nPassed = countPassed(ev, s);
+        s->stats.nTested = ev->test.n;
+        s->stats.seconds = profileClock() - start;
+        reportEvaluation(ev->config, &s->stats);
+
+        pthread_mutex_lock(&ev->lock);
+        ev->running = NULL;
+        pthread_mutex_unlock(&ev->lock);
+    }
+}
+
+static void freeEvaluator(Evaluator *ev);
+
+/**
+ * @brief Start a thread that tests snapshots of the network's weights, each on its own single threaded
+ * inference context, so testing overlaps with training instead of pausing it.
+ *
+ * @param net The network being trained
+ * @param config The training config, which must outlive the evaluator
+ * @param test Test examples, which must outlive the evaluator
+ * @return Evaluator* The evaluator or NULL on failure
+ */
+static Evaluator *initEvaluator(Network *net, const TrainingConfig *config, const ExampleSource *test) {
+    assert(net && config && test->n);
+    Evaluator *ev = calloc(1, sizeof(Evaluator));
+    if (!ev) {
+        return NULL;
+    }
+    ev->config = config;
+    ev->test = *test;
+    unsigned L = net->nLayers - 1;
+    ev->inputs = malloc((size_t)EVALUATION_CHUNK * net->sizes[0] * sizeof(float));
+    ev->labels = malloc(EVALUATION_CHUNK * sizeof(int));
+    bool ok = ev->inputs && ev->labels;
+    for (unsigned i = 0; i < 2 && ok; i++) {
+        Network *snapshot = &ev->snapshots[i].net;
+        /* Shares the shape and activations, with float weights of its own */
+        *snapshot = (Network){
+            .nLayers = net->nLayers,
+            .sizes = net->sizes,
+            .activations = net->activations,
+            .weights = calloc(L, sizeof(Matrix)),
+            .biases = calloc(L, sizeof(Matrix)),
+            .parameters = aligned_alloc(64, (net->nParameters * sizeof(float) + 63) & ~(size_t)63),
+            .nParameters = net->nParameters
+        };
+        ok = snapshot->weights && snapshot->biases && snapshot->parameters;
+        if (ok) {
+            layoutParameters(net->sizes, net->nLayers, snapshot->parameters, snapshot->weights, snapshot->biases);
+        }
+        ev->snapshots[i].ctx = ok ? initInferenceContext(snapshot, 64, 1) : NULL;
+        ok = ok && ev->snapshots[i].ctx;
+    }
+    if (!ok) {
+        freeEvaluator(ev);
+        return NULL;
+    }
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->filledCond, NULL);
+    pthread_cond_init(&ev->freeCond, NULL);
+    ev->started = pthread_create(&ev->thread, NULL, evaluatorMain, ev) == 0;
+    if (!ev->started) {
+        freeEvaluator(ev);
+        return NULL;
+    }
+    return ev;
+}
+
+/**
+ * @brief Copy the network's weights into a free snapshot and queue it for testing.
+ * Waits only while another snapshot is still queued.
+ *
+ * @param ev The evaluator
+ * @param net The network being trained. Its weights must not change during the call
+ * @param epoch Zero based epoch
+ * @param step Update steps taken so far
+ * @param endOfEpoch Whether the epoch has finished
+ */
+static void submitEvaluation(Evaluator *ev, Network *net, unsigned epoch, size_t step, bool endOfEpoch) {
+    pthread_mutex_lock(&ev->lock);
+    while (ev->pending) {
+        pthread_cond_wait(&ev->freeCond, &ev->lock);
+    }
+    Snapshot *s = ev->running == &ev->snapshots[0] ? &ev->snapshots[1] : &ev->snapshots[0];
+    pthread_mutex_unlock(&ev->lock);
+
+    memcpy(s->net.parameters, net->parameters, net->nParameters * sizeof(float));
+    s->stats = (EvaluationStats){
+        .epoch = epoch,
+        .step = step,
+        .endOfEpoch = endOfEpoch
+    };
+
+    pthread_mutex_lock(&ev->lock);
+    ev->pending = s;
+    pthread_cond_signal(&ev->filledCond);
+    pthread_mutex_unlock(&ev->lock);
+}
+
+/**
+ * @brief Wait for the queued tests to be reported, then stop the thread and free the evaluator
+ */
+static void freeEvaluator(Evaluator *ev) {
+    if (!ev) {
+        return;
+    }
+    if (ev->started) {
+        pthread_mutex_lock(&ev->lock);
+        ev->stop = true;
+        pthread_cond_signal(&ev->filledCond);
+        pthread_mutex_unlock(&ev->lock);
+        pthread_join(ev->thread, NULL);
+    }
+    if (ev->snapshots[1].ctx) {
+        pthread_mutex_destroy(&ev->lock);
+        pthread_cond_destroy(&ev->filledCond);
+        pthread_cond_destroy(&ev->freeCond);
+    }
+    for (unsigned i = 0; i < 2; i++) {
+        Network *snapshot = &ev->snapshots[i].net;
+        freeInferenceContext(ev->snapshots[i].ctx);
+        free(snapshot->parameters);
+        free(snapshot->weights);
+        free(snapshot->biases);
+    }
+    free(ev->inputs);
+    free(ev->labels);
+    free(ev);
+}
+
+/* Worker 0 hands the weights to the evaluator every config->evaluateEvery update steps */
+static void evaluateEveryStep(TrainingJob *job, size_t step, double *phases) {
+    if (job->evaluator && job->config->evaluateEvery && step % job->config->evaluateEvery == 0) {
+        double t = PROFILE_NOW();
+        submitEvaluation(job->evaluator, job->net, job->epoch, step, false);
+        PROFILE_ADD(phases[PHASE_EVALUATION], t);
+    }
+}
+
+/* Worker 0 checkpoints the run every config->checkpointEvery update steps, position examples into the epoch */
+static void checkpointEveryStep(TrainingJob *job, size_t step, size_t position, double *phases) {
+    if (job->checkpointer && job->config->checkpointEvery && step % job->config->checkpointEvery == 0) {
+        double t = PROFILE_NOW();
+        TrainingState state = {job->epoch, position, step, job->order, job->source.n, job->rng};
+        submitCheckpoint(job->checkpointer, job->net, job->optimizer, &state);
+        PROFILE_ADD(phases[PHASE_CHECKPOINT], t);
+    }
+}
+
+/**
+ * @brief One synchronous data-parallel epoch. Every mini-batch is split evenly between the
+ * workers, each computes the gradient of its share into a private workspace, and the gradients
+ * are then reduced and applied in parallel before moving on to the next mini-batch.
+ */
+static void dataParallelEpoch(void *arg, unsigned worker, unsigned nWorkers) {
+    TrainingJob *job = arg;
+    const TrainingConfig *config = job->config;
+    Workspace *ws = job->workspaces[worker];
+    double *phases = ws->profile.phases;
+    size_t nExamples = job->source.n, step = job->optimizer->step;
+    for (size_t start = job->position; start < nExamples; start += config->batchSize) {
+        size_t bSize = min(config->batchSize, nExamples - start);
+        size_t lo = start + bSize * worker / nWorkers, hi = start + bSize * (worker + 1) / nWorkers;
+        if (worker == 0 && start > job->position) {
+            evaluateEveryStep(job, step, phases);
+            checkpointEveryStep(job, step, start, phases);
+        }
+        double t = PROFILE_NOW();
+        if (hi > lo) {
+            gatherBatch(job->net, ws, &job->source, job->order + lo, 0, hi - lo, true);
+            PROFILE_ADD(phases[PHASE_BATCH], t);
+            backprop(job->net, ws, hi - lo, config, NULL, false);
+        } else {
+            zeroGradients(job->net, ws);
+        }
+        t = PROFILE_NOW();
+        threadPoolBarrier(job->pool);
+        PROFILE_ADD(phases[PHASE_WAIT], t);
+        reduceAndUpdate(job, worker, nWorkers, 1.0f / bSize, ++step);
+        t = PROFILE_NOW();
+        threadPoolBarrier(job->pool);
+        PROFILE_ADD(phases[PHASE_WAIT], t);
+    }
+    if (worker == 0) {
+        job->nBatches = step - job->optimizer->step;
+    }
+}
+
+/**
+ * @brief Same as dataParallelEpoch for batches coming from a prefetcher. Worker 0 fetches
+ * each batch and publishes it to the others until the prefetcher reports the end of the epoch.
+ */
+static void streamEpoch(void *arg, unsigned worker, unsigned nWorkers) {
+    TrainingJob *job = arg;
+    const TrainingConfig *config = job->config;
+    Workspace *ws = job->workspaces[worker];
+    double *phases = ws->profile.phases;
+    unsigned nIn = job->net->sizes[0], nOut = job->net->sizes[job->net->nLayers - 1];
+    size_t step = job->optimizer->step;
+    for (;;) {
+        double t = PROFILE_NOW();
+        if (worker == 0) {
+            job->batch = nextBatch(job->stream);
+            job->nStreamed += job->batch ? job->batch->size : 0;
+            PROFILE_LAP(phases[PHASE_BATCH], t);
+        }
+        threadPoolBarrier(job->pool);
+        PROFILE_LAP(phases[PHASE_WAIT], t);
+        const Batch *batch = job->batch;
+        if (!batch) {
+            if (worker == 0) {
+                job->nBatches = step - job->optimizer->step;
+            }
+            break;
+        }
+        assert(batch->size <= config->batchSize);
+        if (worker == 0 && step > job->optimizer->step) {
+            evaluateEveryStep(job, step, phases);
+            t = PROFILE_NOW();
+        }
+        size_t lo = batch->size * worker / nWorkers, hi = batch->size * (worker + 1) / nWorkers;
+        if (hi > lo) {
+            packRows(job->net, ws, batch->inputs + lo * nIn, batch->outputs + lo * nOut, hi - lo);
+            PROFILE_ADD(phases[PHASE_BATCH], t);
+            backprop(job->net, ws, hi - lo, config, NULL, false);
+        } else {
+            zeroGradients(job->net, ws);
+        }
+        t = PROFILE_NOW();
+        threadPoolBarrier(job->pool);
+        PROFILE_ADD(phases[PHASE_WAIT], t);
+        reduceAndUpdate(job, worker, nWorkers, 1.0f / batch->size, ++step);
+        t = PROFILE_NOW();
+        threadPoolBarrier(job->pool);
+        PROFILE_ADD(phases[PHASE_WAIT], t);
+    }
+}
+
+/**
+ * @brief One Hogwild epoch. Each worker trains on its own contiguous shard of the shuffled data
+ * and applies its updates to the shared weights, and the shared optimizer state, without any
+ * synchronisation.
+ */
+static void hogwildEpoch(void *arg, unsigned worker, unsigned nWorkers) {
+    TrainingJob *job = arg;
+    const TrainingConfig *config = job->config;
+    Workspace *ws = job->workspaces[worker];
+    double *phases = ws->profile.phases;
+    size_t n = job->source.n - job->position;
+    size_t lo = job->position + n * worker / nWorkers, hi = job->position + n * (worker + 1) / nWorkers;
+    size_t step = job->optimizer->step;
+    for (size_t start = lo; start < hi; start += config->batchSize) {
+        size_t bSize = min(config->batchSize, hi - start);
+        if (worker == 0 && start > lo) {
+            evaluateEveryStep(job, step, phases);
+        }
+        double t = PROFILE_NOW();
+        gatherBatch(job->net, ws, &job->source, job->order + start, 0, bSize, true);
+        PROFILE_ADD(phases[PHASE_BATCH], t);
+        backprop(job->net, ws, bSize, config, NULL, false);
+        t = PROFILE_NOW();
+        updateParameters(job, ws, 1.0f / bSize, ++step, 0, job->nParams);
+        PROFILE_ADD(phases[PHASE_UPDATE], t);
+    }
+    if (worker == 0) {
+        job->nBatches = step - job->optimizer->step;
+    }
+}
+
+/* Queue the sum over all ranks of weight layer i's gradients, which lie next to each other in the workspace */
+static void reduceLayerAsync(Communicator *comm, Workspace *ws, unsigned i) {
+    const float *end = ws->dBiases[i].data + ws->dBiases[i].rows;
+    allReduceAsync(comm, ws->dWeights[i].data, end - ws->dWeights[i].data);
+}
+
+/**
+ * @brief Train an epoch as one rank of a distributed run, see TrainingConfig.communicator. Every
+ * rank takes the same number of steps, those that run out of examples first contributing zero
+ * gradients. Backprop queues each layer's gradients to be summed over the ranks as soon as they
+ * are complete, last layer first, so the sums overlap the rest of the backward pass. The update
+ * waits for them and divides by the examples of the step over all ranks; every rank applies the
+ * same sums, so the ranks keep identical weights.
+ */
+static void distributedEpoch(void *arg, unsigned worker, unsigned nWorkers) {
+    TrainingJob *job = arg;
+    const TrainingConfig *config = job->config;
+    Communicator *comm = config->communicator;
+    Workspace *ws = job->workspaces[worker];
+    double *phases = ws->profile.phases;
+    size_t n = job->source.n, step = job->optimizer->step;
+    assert(nWorkers == 1);
+    for (size_t s = 0; s < job->nSteps; s++) {
+        size_t start = s * config->batchSize;
+        size_t bSize = start < n ? min(config->batchSize, n - start) : 0;
+        if (s > 0) {
+            evaluateEveryStep(job, step, phases);
+        }
+        double t = PROFILE_NOW();
+        if (bSize) {
+            gatherBatch(job->net, ws, &job->source, job->order + start, 0, bSize, true);
+            PROFILE_ADD(phases[PHASE_BATCH], t);
+            backprop(job->net, ws, bSize, config, comm, false);
+        } else {
+            zeroGradients(job->net, ws);
+            for (unsigned i = job->net->nLayers - 1; i-- > 0;) {
+                reduceLayerAsync(comm, ws, i);
+            }
+        }
+        t = PROFILE_NOW();
+        if (allReduceWait(comm) != 0) {
+            fputs("Lost the other ranks of the distributed run, training stopped\n", stderr);
+            break;
+        }
+        PROFILE_ADD(phases[PHASE_REDUCE], t);
+        size_t total = 0;
+        for (unsigned r = 0; r < communicatorSize(comm); r++) {
+            total += job->shardSizes[r] > start ? min(config->batchSize, job->shardSizes[r] - start) : 0;
+        }
+        reduceAndUpdate(job, 0, 1, 1.0f / total, ++step);
+    }
+    job->nBatches = step - job->optimizer->step;
+}
+
+/* Start every rank from the weights of rank 0, to whose weights the others add zeros */
+static int broadcastWeights(Communicator *comm, Network *net) {
+    if (communicatorRank(comm) != 0) {
+        memset(net->parameters, 0, net->nParameters * sizeof(float));
+    }
+    allReduceAsync(comm, net->parameters, net->nParameters);
+    return allReduceWait(comm);
+}
+
+/*
+ * Set up a rank of a distributed run: agree on the weights and on the number of steps per epoch,
+ * that of the rank with the most examples. On failure no steps are taken
+ */
+static void joinDistributedRun(TrainingJob *job, Communicator *comm) {
+    unsigned N = communicatorSize(comm);
+    uint64_t local = job->source.n, all[N];
+    job->shardSizes = malloc(N * sizeof(size_t));
+    assert(job->shardSizes);
+    if (broadcastWeights(comm, job->net) != 0 || allGather(comm, &local, sizeof(local), all) != 0) {
+        fputs("Could not reach the other ranks of the distributed run\n", stderr);
+        return;
+    }
+    for (unsigned r = 0; r < N; r++) {
+        job->shardSizes[r] = all[r];
+        size_t steps = (all[r] + job->config->batchSize - 1) / job->config->batchSize;
+        job->nSteps = steps > job->nSteps ? steps : job->nSteps;
+    }
+}
+
+/* Test set evaluation shared between the training workers */
+typedef struct EvaluationJob {
+    TrainingJob *training;
+    /* Test examples whose single output is the index of the expected highest activation */
+    ExampleSource test;
+    unsigned *nPassed;
+} EvaluationJob;
+
+/**
+ * @brief Count the test examples in this worker's share whose highest output activation is at the expected index
+ */
+static void evaluate(void *arg, unsigned worker, unsigned nWorkers) {
+    EvaluationJob *job = arg;
+    Network *net = job->training->net;
+    Workspace *ws = job->training->workspaces[worker];
+    unsigned L = net->nLayers - 1, nPassed = 0;
+    size_t lo = job->test.n * worker / nWorkers, hi = job->test.n * (worker + 1) / nWorkers;
+    int labels[ws->batchSize];
+    for (size_t j = lo; j < hi; j += ws->batchSize) {
+        size_t n = min(ws->batchSize, hi - j);
+        gatherBatch(net, ws, &job->test, NULL, j, n, false);
+        forwardBatch(net, ws, n, job->training->config->af, true, false);
+        maxIndexPerColumn(batchView(ws->activations[L], n), labels);
+        for (unsigned k = 0; k < n; k++) {
+            if (labels[k] == *sourceOutput(&job->test, j + k)) {
+                nPassed++;
+            }
+        }
+    }
+    job->nPassed[worker] = nPassed;
+}
+
+/**
+ * @brief Set up the thread pool and per-worker workspaces of a training run
+ */
+static void initTrainingJob(TrainingJob *job, Network *net, const TrainingConfig *config, const ExampleSource *test) {
+    if (job->source.n) {
+        job->order = malloc(job->source.n * sizeof(size_t));
+        assert(job->order);
+        for (size_t i = 0; i < job->source.n; i++) {
+            job->order[i] = i;
+        }
+    }
+    unsigned nThreads = config->nThreads ? config->nThreads : defaultThreadCount();
+    if (config->communicator) {
+        assert(job->source.n && !config->hogwild && !config->resume && !config->checkpointEvery);
+        nThreads = 1;
+    }
+    job->net = net;
+    job->config = config;
+    job->pool = nThreads > 1 ? initThreadPool(nThreads) : NULL;
+    nThreads = threadPoolSize(job->pool);
+    enum EActivationFunction out = layerActivation(net, net->nLayers - 2, config->af);
+    assert(config->cost == COST_QUADRATIC || out == FN_SIGMOID || out == FN_SOFTMAX);
+    /* A network mapped from a file is read-only */
+    assert(net->parameters);
+    job->nParams = net->nParameters;
+    job->optimizer = initOptimizer(&config->optimizer, job->nParams);
+    assert(job->optimizer);
+    job->workspaces = malloc(nThreads * sizeof(Workspace*));
+    assert(job->workspaces);
+    for (unsigned w = 0; w < nThreads; w++) {
+        size_t capacity = config->hogwild ? config->batchSize : (config->batchSize + nThreads - 1) / nThreads;
+        job->workspaces[w] = initWorkspace(net, capacity);
+        assert(job->workspaces[w]);
+    }
+    if (test->n && (config->asyncEvaluation || config->evaluateEvery)) {
+        job->evaluator = initEvaluator(net, config, test);
+        assert(job->evaluator);
+    }
+    if (config->checkpointPath) {
+        job->checkpointer = initCheckpointer(config->checkpointPath, net, job->optimizer, job->source.n);
+        assert(job->checkpointer);
+    }
+    if (config->communicator) {
+        joinDistributedRun(job, config->communicator);
+    }
+}
+
+/**
+ * @brief Restore the weights, optimizer, position and PRNG of the job from config->checkpointPath
+ * when resuming and there is a checkpoint of this run
+ *
+ * @return unsigned The epoch to continue with
+ */
+static unsigned resumeTrainingJob(TrainingJob *job) {
+    const TrainingConfig *config = job->config;
+    if (!config->resume || !config->checkpointPath) {
+        return 0;
+    }
+    TrainingState state = {.order = job->order, .nExamples = job->source.n};
+    if (loadCheckpoint(config->checkpointPath, job->net, job->optimizer, &state) != 0) {
+        return 0;
+    }
+    job->position = state.position;
+    job->rng = state.rng;
+    return state.epoch;
+}
+
+static void freeTrainingJob(TrainingJob *job) {
+    freeEvaluator(job->evaluator);
+    freeCheckpointer(job->checkpointer);
+    /* Round the trained master weights into the network's reduced precision copy */
+    if (job->net->weightType != WEIGHTS_F32) {
+        setWeightType(job->net, job->net->weightType);
+    }
+    if (job->net->pruned) {
+        updateSparseWeights(job->net);
+    }
+    for (unsigned w = 0; w < threadPoolSize(job->pool); w++) {
+        freeWorkspace(job->workspaces[w]);
+    }
+    free(job->workspaces);
+    freeOptimizer(job->optimizer);
+    free(job->order);
+    free(job->shardSizes);
+    freeThreadPool(job->pool);
+}
+
+/**
+ * @brief Fill in the phase and per-layer times of an epoch from the workers' profiles.
+ * Worker times are averaged, and layer throughput is the work of all workers over that average.
+ */
+static void collectProfiles(TrainingJob *job, TrainingStats *stats, LayerStats *layers) {
+    unsigned nWorkers = threadPoolSize(job->pool);
+    for (unsigned w = 0; w < nWorkers; w++) {
+        Profile *profile = &job->workspaces[w]->profile;
+        for (unsigned p = 0; p < PHASE_COUNT; p++) {
+            stats->phaseSeconds[p] += profile->phases[p] / nWorkers;
+        }
+        for (unsigned i = 0; i < stats->nLayers; i++) {
+            layers[i].forwardSeconds += profile->layerForward[i] / nWorkers;
+            layers[i].backwardSeconds += profile->layerBackward[i] / nWorkers;
+        }
+    }
+    for (unsigned i = 0; i < stats->nLayers; i++) {
+        /* One GEMM per layer forward; the weight gradient and, below the first layer, the propagated delta backward */
+        double flops = 2.0 * job->net->sizes[i] * job->net->sizes[i + 1] * stats->nExamples;
+        stats->phaseSeconds[PHASE_FORWARD] += layers[i].forwardSeconds;
+        stats->phaseSeconds[PHASE_BACKWARD] += layers[i].backwardSeconds;
+        layers[i].forwardGflops = layers[i].forwardSeconds ? flops / layers[i].forwardSeconds * 1e-9 : 0;
+        layers[i].backwardGflops = layers[i].backwardSeconds ? (i ? 2 : 1) * flops / layers[i].backwardSeconds * 1e-9 : 0;
+    }
+}
+
+static void resetProfiles(TrainingJob *job) {
+    unsigned L = job->net->nLayers - 1;
+    for (unsigned w = 0; w < threadPoolSize(job->pool); w++) {
+        Profile *profile = &job->workspaces[w]->profile;
+        memset(profile->phases, 0, sizeof(profile->phases));
+        memset(profile->layerForward, 0, 2 * L * sizeof(double));
+    }
+}
+
+/**
+ * @brief Train one epoch on the job's pool, then evaluate the network on the test data if there
+ * is any and report the epoch's stats to config->onEpoch, or print the progress without a callback.
+ * With config->asyncEvaluation the test is only queued on the evaluator and runs during the next epoch.
+ *
+ * @param job The training run
+ * @param epoch Zero based epoch number
+ * @param fn The epoch function run on every worker
+ * @param shuffleSeconds Time spent shuffling before the epoch
+ * @param test Test examples, or an empty source
+ */
+static void runEpoch(TrainingJob *job, unsigned epoch, ThreadPoolJob fn, double shuffleSeconds, const ExampleSource *test) {
+    const TrainingConfig *config = job->config;
+    unsigned L = job->net->nLayers - 1;
+    LayerStats layers[L];
+    memset(layers, 0, sizeof(layers));
+    TrainingStats stats = {
+        .epoch = epoch,
+        .epochs = config->epochs,
+        .nLayers = L,
+        .layers = layers
+    };
+    resetProfiles(job);
+    job->epoch = epoch;
+    job->nStreamed = 0;
+    job->learningRate = stats.learningRate = scheduledLearningRate(job->optimizer, config->learningRate, epoch, config->epochs);
+    size_t allocations = PROFILE_ALLOCATIONS();
+    double start = profileClock();
+    threadPoolRun(job->pool, fn, job);
+    stats.seconds = profileClock() - start;
+    job->optimizer->step += job->nBatches;
+    job->position = 0;
+    stats.allocations = PROFILE_ALLOCATIONS() - allocations;
+    stats.nExamples = job->stream ? job->nStreamed : job->source.n;
+    stats.samplesPerSecond = stats.nExamples / stats.seconds;
+    collectProfiles(job, &stats, layers);
+    stats.phaseSeconds[PHASE_SHUFFLE] = shuffleSeconds;
+
+    if (job->checkpointer) {
+        start = profileClock();
+        TrainingState state = {epoch + 1, 0, job->optimizer->step, job->order, job->source.n, job->rng};
+        submitCheckpoint(job->checkpointer, job->net, job->optimizer, &state);
+        stats.phaseSeconds[PHASE_CHECKPOINT] += profileClock() - start;
+    }
+
+    if (test->n && config->asyncEvaluation) {
+        start = profileClock();
+        submitEvaluation(job->evaluator, job->net, epoch, job->optimizer->step, true);
+        stats.phaseSeconds[PHASE_EVALUATION] += profileClock() - start;
+    } else if (test->n) {
+        unsigned nThreads = threadPoolSize(job->pool);
+        unsigned passedPerWorker[nThreads];
+        EvaluationJob evaluation = {job, *test, passedPerWorker};
+        start = profileClock();
+        threadPoolRun(job->pool, evaluate, &evaluation);
+        double seconds = profileClock() - start;
+        stats.phaseSeconds[PHASE_EVALUATION] += seconds;
+        for (unsigned w = 0; w < nThreads; w++) {
+            stats.nPassed += passedPerWorker[w];
+        }
+        stats.nTested = test->n;
+        if (config->onEvaluation) {
+            EvaluationStats result = {epoch, job->optimizer->step, true, stats.nPassed, stats.nTested, seconds};
+            config->onEvaluation(&result, config->userData);
+        }
+    }
+
+    if (config->onEpoch) {
+        config->onEpoch(&stats, config->userData);
+    } else if (stats.nTested) {
+        printf("Epoch %d complete. %zu/%zu passing\n", epoch + 1, stats.nPassed, stats.nTested);
+    } else {
+        printf("Epoch %d complete\n", epoch + 1);
+    }
+}
+
+/**
+ * @brief Shared driver of trainNetwork and trainNetworkOnSet. The examples are never moved;
+ * each epoch shuffles a permutation of their indices with a PRNG seeded from config->seed.
+ * An epoch resumed part way through keeps the permutation it was checkpointed with.
+ */
+static void trainInMemory(Network *net, const ExampleSource *source, const TrainingConfig *config, const ExampleSource *test) {
+    assert(source->n && config->epochs && config->batchSize && config->learningRate);
+    TrainingJob job = {
+        .source = *source
+    };
+    initTrainingJob(&job, net, config, test);
+    seedRng(&job.rng, config->seed ? config->seed : (uint64_t)time(NULL));
+    ThreadPoolJob epoch = config->communicator ? distributedEpoch : config->hogwild ? hogwildEpoch : dataParallelEpoch;
+    for (unsigned i = resumeTrainingJob(&job); i < config->epochs; i++) {
+        if (config->communicator && communicatorFailed(config->communicator)) {
+            break;
+        }
+        double start = profileClock();
+        if (!job.position) {
+            shuffleIndices(&job.rng, job.order, source->n);
+        }
+        runEpoch(&job, i, epoch, profileClock() - start, test);
+    }
+    freeTrainingJob(&job);
+}
+
+/**
+ * @brief Train the network using SGD, optionally spread over several threads
+ *
+ * With config->hogwild unset, each mini-batch is split between the workers and their gradients
+ * are summed before a single update, so the result is the same SGD step as on one thread.
+ * With config->hogwild set, every worker runs SGD on its own shard of each epoch and updates the
+ * shared weights lock-free.
+ *
+ * @param net Pointer to a network
+ * @param trainingData Array of TrainingExamples to train the network with
+ * @param nExamples Number of TrainingExamples in trainingData
+ * @param config Training hyperparameters and threading options
+ * @param testData Optional: Array of TrainingExamples to test the network against.
+ * @param nTestData Optional: Number of TrainingExamples in testData
+ * Note: See stochasticGradientDescent for the expected layout of trainingData and testData.
+ */
+void trainNetwork(
+    Network *net,
+    TrainingExample *trainingData,
+    size_t nExamples,
+    const TrainingConfig *config,
+    TrainingExample *testData,
+    unsigned nTestData)
+{
+    assert( net &&
+        config &&
+        nExamples &&
+        trainingData &&
+        (!!nTestData == !!testData));
+    ExampleSource source = {.examples = trainingData, .n = nExamples};
+    ExampleSource test = {.examples = testData, .n = nTestData};
+    trainInMemory(net, &source, config, &test);
+}
+
+/**
+ * @brief Train the network on a contiguous in-memory training set. Same as trainNetwork, but batches
+ * are gathered from two dense blocks instead of from separately allocated examples.
+ *
+ * @param net Pointer to a network
+ * @param set The training set. Its inputs and outputs must match the network's input and output layers
+ * @param config Training hyperparameters and threading options
+ * @param testSet Optional: Examples to test the network against after every epoch, with a single
+ *                output holding the index of the desired highest activation
+ */
+void trainNetworkOnSet(
+    Network *net,
+    const TrainingSet *set,
+    const TrainingConfig *config,
+    const TrainingSet *testSet)
+{
+    assert( net &&
+        config &&
+        set &&
+        set->nInputs == net->sizes[0] &&
+        set->nOutputs == net->sizes[net->nLayers - 1] &&
+        (!testSet || (testSet->nInputs == net->sizes[0] && testSet->nOutputs == 1)));
+    ExampleSource source = {.set = set, .n = set->nExamples};
+    ExampleSource test = {.set = testSet, .n = testSet ? testSet->nExamples : 0};
+    trainInMemory(net, &source, config, &test);
+}
+
+/*
+ * Sweeps: several networks trained at once on one training set, see trainNetworksOnSet.
+ * Networks with the same batch size and seed visit the examples in the same order, so they form a
+ * cohort whose mini-batches are gathered once for all of them. As they all multiply the same inputs,
+ * the first layer weights of a cohort's networks are moved into one stacked matrix, and the first
+ * layer's product and weight gradient of several networks are one wide GEMM each, split between the
+ * workers by rows. Only the layers above run network by network.
+ *
+ * Every step updates every network, so stepping all of a cohort at once would stream all their
+ * weights through the caches on each batch. The cohort's networks are instead cut into groups whose
+ * parameters fit in about SWEEP_GROUP_BYTES, and a window of batches is gathered and trained on by
+ * one group after the other, which keeps a group's weights cached for the whole window.
+ */
+
+/* About the L2 cache of one core, and examples gathered per window */
+#define SWEEP_GROUP_BYTES (2 << 20)
+#define SWEEP_WINDOW_EXAMPLES 1024
+
+typedef struct Cohort Cohort;
+
+/* One network of a sweep, trained as a single worker TrainingJob */
+typedef struct SweepModel {
+    TrainingJob job;
+    TrainingConfig config;
+    Cohort *cohort;
+    /* The network's own first layer weights, which are kept in the cohort's stack while it trains,
+       and the first row they take there */
+    float *weights;
+    unsigned offset;
+    bool active;
+} SweepModel;
+
+struct Cohort {
+    size_t batchSize;
+    unsigned seed;
+    const TrainingSet *set;
+    ThreadPool *pool;
+    size_t *order;
+    Rng rng;
+    /* The networks still training, in stack order, cut into groups: group g is
+       members[groups[g]] .. members[groups[g + 1] - 1] */
+    SweepModel **members;
+    unsigned nMembers, *groups, nGroups;
+    /* Their first layers: stackRows x nInputs weights and gradients, and the stackRows x bSize
+       products with a batch's inputs and deltas */
+    unsigned stackRows;
+    float *arena, *weights, *gradients, *outputs, *deltas;
+    /* The batches of the current window, each as input rows and as targets with one example per column */
+    size_t windowBatches;
+    float *xRows, *y;
+};
+
+/* Allocate the order, stack and window of a cohort whose members have all joined */
+static void initCohort(Cohort *c) {
+    unsigned nIn = c->set->nInputs, nOut = c->set->nOutputs;
+    c->order = malloc(c->set->nExamples * sizeof(size_t));
+    c->groups = malloc((c->nMembers + 1) * sizeof(unsigned));
+    assert(c->order && c->groups);
+    for (size_t i = 0; i < c->set->nExamples; i++) {
+        c->order[i] = i;
+    }
+    c->windowBatches = c->batchSize < SWEEP_WINDOW_EXAMPLES ? SWEEP_WINDOW_EXAMPLES / c->batchSize : 1;
+    size_t window = c->windowBatches * c->batchSize;
+    /* Each block is rounded up to a multiple of 16 floats to keep every matrix 64 byte aligned */
+    #define BLOCK(n) (((n) + 15) & ~(size_t)15)
+    size_t weights = BLOCK((size_t)c->stackRows * nIn), products = BLOCK((size_t)c->stackRows * c->batchSize);
+    size_t total = 2 * weights + 2 * products + BLOCK(window * nIn) + c->windowBatches * BLOCK(nOut * c->batchSize);
+    c->arena = aligned_alloc(64, total * sizeof(float));
+    assert(c->arena);
+    c->weights = c->arena;
+    c->gradients = c->weights + weights;
+    c->outputs = c->gradients + weights;
+    c->deltas = c->outputs + products;
+    c->xRows = c->deltas + products;
+    c->y = c->xRows + BLOCK(window * nIn);
+    #undef BLOCK
+}
+
+/* Targets of batch s of the window, nOutputs x batchSize */
+static inline float *windowTargets(Cohort *c, size_t s) {
+    return c->y + s * ((c->set->nOutputs * c->batchSize + 15) & ~(size_t)15);
+}
+
+/* Parameters, gradients and optimizer moments of a network */
+static size_t sweepModelBytes(SweepModel *m) {
+    Optimizer *opt = m->job.optimizer;
+    return m->job.nParams * sizeof(float) * (2 + !!opt->m + !!opt->v);
+}
+
+/* Pack the first layers of the cohort's members into its stack, moving them down over those of
+   networks that left, point the networks' first layer weights and gradients at their rows, and group them */
+static void stackCohort(Cohort *c) {
+    unsigned nIn = c->set->nInputs, rows = 0;
+    size_t groupBytes = 0;
+    c->nGroups = 0;
+    for (unsigned k = 0; k < c->nMembers; k++) {
+        SweepModel *m = c->members[k];
+        Matrix *w = &m->job.net->weights[0];
+        float *dst = c->weights + (size_t)rows * nIn;
+        memmove(dst, w->data, len((*w)) * sizeof(float));
+        w->data = dst;
+        m->job.workspaces[0]->dWeights[0].data = c->gradients + (size_t)rows * nIn;
+        m->offset = rows;
+        rows += w->rows;
+        if (k == 0 || groupBytes + sweepModelBytes(m) > SWEEP_GROUP_BYTES) {
+            c->groups[c->nGroups++] = k;
+            groupBytes = 0;
+        }
+        groupBytes += sweepModelBytes(m);
+    }
+    c->groups[c->nGroups] = c->nMembers;
+    c->stackRows = rows;
+}
+
+/* Take a network out of its cohort and give it back its own first layer weights. Restack the cohort afterwards */
+static void leaveCohort(SweepModel *m) {
+    Cohort *c = m->cohort;
+    Matrix *w = &m->job.net->weights[0];
+    memcpy(m->weights, w->data, len((*w)) * sizeof(float));
+    w->data = m->weights;
+    unsigned k = 0;
+    while (c->members[k] != m) {
+        k++;
+    }
+    memmove(c->members + k, c->members + k + 1, (c->nMembers - k - 1) * sizeof(SweepModel*));
+    c->nMembers--;
+    m->active = false;
+}
+
+/* Point a member's first layer products and deltas at its rows of the cohort's, for batches of bSize */
+static void useStackedRows(SweepModel *m, size_t bSize) {
+    Workspace *ws = m->job.workspaces[0];
+    ws->activations[1].data = m->cohort->outputs + m->offset * bSize;
+    ws->deltas[0].data = m->cohort->deltas + m->offset * bSize;
+}
+
+/* Gather examples first .. end - 1 of the cohort's order into its window */
+static void gatherWindow(Cohort *c, size_t first, size_t end) {
+    const TrainingSet *set = c->set;
+    unsigned nIn = set->nInputs, nOut = set->nOutputs;
+    for (size_t start = first, s = 0; start < end; start += c->batchSize, s++) {
+        size_t bSize = min(c->batchSize, end - start);
+        float *y = windowTargets(c, s);
+        for (size_t j = 0; j < bSize; j++) {
+            size_t k = c->order[start + j];
+            memcpy(c->xRows + (start - first + j) * nIn, set->inputs + k * nIn, nIn * sizeof(float));
+            for (unsigned o = 0; o < nOut; o++) {
+                y[o * bSize + j] = set->outputs[k * nOut + o];
+            }
+        }
+    }
+}
+
+/**
+ * @brief One epoch of a cohort. Worker 0 gathers a window of batches, then each group of members
+ * trains on all of them in turn. For every batch the workers multiply the group's stacked first
+ * layers together, and the members are dealt out to them for the layers above and their updates.
+ */
+static void cohortEpoch(void *arg, unsigned worker, unsigned nWorkers) {
+    Cohort *c = arg;
+    unsigned nIn = c->set->nInputs, nOut = c->set->nOutputs;
+    size_t nExamples = c->set->nExamples, window = c->windowBatches * c->batchSize;
+    for (size_t first = 0; first < nExamples; first += window) {
+        size_t end = min(nExamples, first + window);
+        if (worker == 0) {
+            gatherWindow(c, first, end);
+        }
+        threadPoolBarrier(c->pool);
+        for (unsigned g = 0; g < c->nGroups; g++) {
+            SweepModel *last = c->members[c->groups[g + 1] - 1];
+            size_t groupRows = last->offset + last->job.net->sizes[1] - c->members[c->groups[g]]->offset;
+            size_t lo = c->members[c->groups[g]]->offset + groupRows * worker / nWorkers;
+            size_t hi = c->members[c->groups[g]]->offset + groupRows * (worker + 1) / nWorkers;
+            for (size_t start = first, s = 0; start < end; start += c->batchSize, s++) {
+                size_t bSize = min(c->batchSize, end - start);
+                Matrix x = matrixFromData(bSize, nIn, c->xRows + (start - first) * nIn);
+                if (hi > lo) {
+                    /* This worker's rows of the group's first layers times the inputs */
+                    gemmInto(matrixFromData(hi - lo, bSize, c->outputs + lo * bSize),
+                             matrixFromData(hi - lo, nIn, c->weights + lo * nIn), NO_TRANSPOSE, x, TRANSPOSE, 1, 0);
+                }
+                threadPoolBarrier(c->pool);
+                for (unsigned k = c->groups[g] + worker; k < c->groups[g + 1]; k += nWorkers) {
+                    SweepModel *m = c->members[k];
+                    Workspace *ws = m->job.workspaces[0];
+                    useStackedRows(m, bSize);
+                    ws->activations[0] = x;
+                    ws->y = matrixFromData(nOut, c->batchSize, windowTargets(c, s));
+                    backprop(m->job.net, ws, bSize, &m->config, NULL, true);
+                }
+                threadPoolBarrier(c->pool);
+                if (hi > lo) {
+                    /* dW = delta * X for the same rows */
+                    gemmInto(matrixFromData(hi - lo, nIn, c->gradients + lo * nIn),
+                             matrixFromData(hi - lo, bSize, c->deltas + lo * bSize), NO_TRANSPOSE, x, NO_TRANSPOSE, 1, 0);
+                }
+                threadPoolBarrier(c->pool);
+                for (unsigned k = c->groups[g] + worker; k < c->groups[g + 1]; k += nWorkers) {
+                    TrainingJob *job = &c->members[k]->job;
+                    reduceAndUpdate(job, 0, 1, 1.0f / bSize, ++job->optimizer->step);
+                }
+                threadPoolBarrier(c->pool);
+            }
+        }
+    }
+}
+
+typedef struct SweepEvaluation {
+    SweepModel **models;
+    unsigned nModels;
+    ExampleSource test;
+    size_t *nPassed;
+} SweepEvaluation;
+
+static void evaluateSweep(void *arg, unsigned worker, unsigned nWorkers) {
+    SweepEvaluation *s = arg;
+    for (unsigned k = worker; k < s->nModels; k += nWorkers) {
+        SweepModel *m = s->models[k];
+        unsigned nPassed;
+        EvaluationJob evaluation = {&m->job, s->test, &nPassed};
+        useStackedRows(m, m->cohort->batchSize);
+        evaluate(&evaluation, 0, 1);
+        s->nPassed[k] = nPassed;
+    }
+}
+
+/**
+ * @brief Train several networks at once on one training set, for example to compare hyperparameters.
+ * All of them read the examples in place and share one pool of worker threads. Networks with the same
+ * batch size and seed see the same mini-batches, which are gathered once for all of them, and their
+ * first layers are multiplied by the inputs as one stacked matrix; each network still takes the steps
+ * trainNetworkOnSet would take with one thread, up to rounding. After every epoch the networks are
+ * tested on testSet, and those far behind the best can be stopped early, see SweepConfig.
+ *
+ * @param nets The networks. Their input and output layers must match the training set
+ * @param configs Each network's epochs, batchSize, learningRate, af, cost, seed and optimizer. A seed of 0
+ *                is the same clock based seed for all networks. The threads, callbacks, and the background
+ *                testing, checkpointing, Hogwild and distributed options must be left unset
+ * @param nModels Number of networks
+ * @param set The training set
+ * @param testSet Optional: Examples to test the networks against after every epoch, see trainNetworkOnSet
+ * @param sweep Optional: Threads, early stopping and progress callback, NULL for the defaults
+ * @param results Optional: Receives each network's epochs trained and last test result, nModels entries
+ */
+void trainNetworksOnSet(
+    Network **nets,
+    const TrainingConfig *configs,
+    unsigned nModels,
+    const TrainingSet *set,
+    const TrainingSet *testSet,
+    const SweepConfig *sweep,
+    SweepResult *results)
+{
+    assert( nets &&
+        configs &&
+        nModels &&
+        set &&
+        set->nExamples &&
+        (!testSet || (testSet->nInputs == set->nInputs && testSet->nOutputs == 1)));
+    SweepConfig defaults = {0};
+    sweep = sweep ? sweep : &defaults;
+    SweepModel *models = calloc(nModels, sizeof(SweepModel));
+    Cohort *cohorts = calloc(nModels, sizeof(Cohort));
+    SweepModel **trained = malloc(nModels * sizeof(SweepModel*));
+    size_t *nPassed = calloc(nModels, sizeof(size_t));
+    SweepResult *progress = calloc(nModels, sizeof(SweepResult));
+    assert(models && cohorts && trained && nPassed && progress);
+    unsigned nThreads = sweep->nThreads ? sweep->nThreads : defaultThreadCount();
+    ThreadPool *pool = nThreads > 1 ? initThreadPool(nThreads) : NULL;
+    unsigned clockSeed = (unsigned)time(NULL), nCohorts = 0, epochs = 0;
+    ExampleSource none = {0};
+    for (unsigned i = 0; i < nModels; i++) {
+        const TrainingConfig *config = &configs[i];
+        Network *net = nets[i];
+        assert( net &&
+            net->sizes[0] == set->nInputs &&
+            net->sizes[net->nLayers - 1] == set->nOutputs &&
+            config->epochs &&
+            config->batchSize &&
+            config->learningRate &&
+            !config->nThreads &&
+            !config->hogwild &&
+            !config->asyncEvaluation &&
+            !config->evaluateEvery &&
+            !config->checkpointPath &&
+            !config->resume &&
+            !config->communicator &&
+            !config->onEpoch &&
+            !config->onEvaluation);
+        SweepModel *m = &models[i];
+        m->config = *config;
+        m->config.nThreads = 1;
+        m->config.seed = config->seed ? config->seed : clockSeed;
+        initTrainingJob(&m->job, net, &m->config, &none);
+        m->job.stacked = true;
+        m->weights = net->weights[0].data;
+        m->active = true;
+        epochs = config->epochs > epochs ? config->epochs : epochs;
+        Cohort *c = cohorts;
+        while (c < cohorts + nCohorts && (c->batchSize != m->config.batchSize || c->seed != m->config.seed)) {
+            c++;
+        }
+        if (c == cohorts + nCohorts) {
+            *c = (Cohort){
+                .batchSize = m->config.batchSize,
+                .seed = m->config.seed,
+                .set = set,
+                .pool = pool,
+                .members = malloc(nModels * sizeof(SweepModel*))
+            };
+            assert(c->members);
+            seedRng(&c->rng, c->seed);
+            nCohorts++;
+        }
+        c->members[c->nMembers++] = m;
+        c->stackRows += net->sizes[1];
+        m->cohort = c;
+    }
+    for (unsigned k = 0; k < nCohorts; k++) {
+        initCohort(&cohorts[k]);
+        stackCohort(&cohorts[k]);
+    }
+
+    ExampleSource test = {.set = testSet, .n = testSet ? testSet->nExamples : 0};
+    for (unsigned epoch = 0; epoch < epochs; epoch++) {
+        SweepStats stats = {
+            .epoch = epoch,
+            .nModels = nModels,
+            .models = progress,
+            .nTested = test.n
+        };
+        for (unsigned i = 0; i < nModels; i++) {
+            if (models[i].active) {
+                TrainingJob *job = &models[i].job;
+                job->learningRate = scheduledLearningRate(job->optimizer, job->config->learningRate, epoch, job->config->epochs);
+                trained[stats.nTrained++] = &models[i];
+            }
+        }
+        double start = profileClock();
+        for (unsigned k = 0; k < nCohorts; k++) {
+            if (cohorts[k].nMembers) {
+                shuffleIndices(&cohorts[k].rng, cohorts[k].order, set->nExamples);
+                threadPoolRun(pool, cohortEpoch, &cohorts[k]);
+            }
+        }
+        stats.seconds = profileClock() - start;
+        stats.samplesPerSecond = (double)set->nExamples * stats.nTrained / stats.seconds;
+
+        size_t best = 0;
+        if (test.n) {
+            SweepEvaluation evaluation = {trained, stats.nTrained, test, nPassed};
+            threadPoolRun(pool, evaluateSweep, &evaluation);
+            for (unsigned k = 0; k < stats.nTrained; k++) {
+                best = nPassed[k] > best ? nPassed[k] : best;
+            }
+        }
+        bool stopEarly = test.n && sweep->maxAccuracyGap && epoch + 1 >= sweep->minEpochs;
+        for (unsigned k = 0; k < stats.nTrained; k++) {
+            SweepModel *m = trained[k];
+            SweepResult *r = &progress[m - models];
+            r->epochs++;
+            r->nPassed = nPassed[k];
+            r->stopped = stopEarly && r->epochs < m->config.epochs && best - r->nPassed > sweep->maxAccuracyGap * test.n;
+            if (r->stopped || r->epochs == m->config.epochs) {
+                leaveCohort(m);
+            } else {
+                stats.nActive++;
+            }
+        }
+        for (unsigned k = 0; k < nCohorts; k++) {
+            stackCohort(&cohorts[k]);
+        }
+
+        if (sweep->onEpoch) {
+            sweep->onEpoch(&stats, sweep->userData);
+        } else if (test.n) {
+            printf("Epoch %u complete. Best %zu/%zu passing, %u of %u networks still training\n",
+                   epoch + 1, best, test.n, stats.nActive, nModels);
+        } else {
+            printf("Epoch %u complete. %u of %u networks still training\n", epoch + 1, stats.nActive, nModels);
+        }
+    }
+
+    for (unsigned i = 0; i < nModels; i++) {
+        freeTrainingJob(&models[i].job);
+    }
+    for (unsigned k = 0; k < nCohorts; k++) {
+        free(cohorts[k].order);
+        free(cohorts[k].groups);
+        free(cohorts[k].arena);
+        free(cohorts[k].members);
+    }
+    freeThreadPool(pool);
+    if (results) {
+        memcpy(results, progress, nModels * sizeof(SweepResult));
+    }
+    free(models);
+    free(cohorts);
+    free(trained);
+    free(nPassed);
+    free(progress);
+}
+
+/**
+ * @brief Train the network on mini-batches streamed from a dataset file
+ *
+ * Batches are assembled and shuffled by the prefetcher's thread while the previous ones are
+ * being trained on. Shuffling is controlled by the prefetcher, so config->seed is ignored.
+ * Each batch is split between the worker threads as in trainNetwork; Hogwild is not supported.
+ * Checkpoints are only taken at the end of epochs, and the prefetcher's shuffling is not part of
+ * them, so a resumed run continues with the next epoch but not with the same batches.
+ *
+ * @param net Pointer to a network
+ * @param stream Prefetcher over the training set. Its batch size must not exceed config->batchSize
+ * @param config Training hyperparameters and threading options
+ * @param testSet Optional: Examples to test the network against, see trainNetworkOnSet
+ */
+void trainNetworkFromDataset(
+    Network *net,
+    BatchPrefetcher *stream,
+    const TrainingConfig *config,
+    const TrainingSet *testSet)
+{
+    assert( net &&
+        stream &&
+        config &&
+        config->epochs &&
+        config->batchSize &&
+        config->learningRate &&
+        !config->hogwild &&
+        !config->communicator &&
+        (!testSet || (testSet->nInputs == net->sizes[0] && testSet->nOutputs == 1)));
+    TrainingJob job = {
+        .stream = stream
+    };
+    ExampleSource test = {.set = testSet, .n = testSet ? testSet->nExamples : 0};
+    initTrainingJob(&job, net, config, &test);
+    for (unsigned i = resumeTrainingJob(&job); i < config->epochs; i++) {
+        runEpoch(&job, i, streamEpoch, 0, &test);
+    }
+    freeTrainingJob(&job);
+}
+
+/**
+ * @brief Allocate the buffers needed to train a network on mini-batches of up to batchSize examples.
+ * Everything lives in one aligned arena, so a training run performs no further heap allocations.
+ *
+ * @param net Pointer to a network
+ * @param batchSize Maximum number of examples per mini-batch
+ * @return Workspace* The workspace or NULL on failure
+ */
+static Workspace *initWorkspace(Network *net, size_t batchSize) {
+    assert(net && batchSize);
+    unsigned L = net->nLayers - 1;
+    Workspace *ws = calloc(1, sizeof(Workspace));
+    if (!ws) {
+        return NULL;
+    }
+    ws->batchSize = batchSize;
+    ws->activations = calloc(L + 1, sizeof(Matrix));
+    ws->deltas = calloc(L, sizeof(Matrix));
+    ws->dWeights = calloc(L, sizeof(Matrix));
+    ws->dBiases = calloc(L, sizeof(Matrix));
+    ws->profile.layerForward = calloc(2 * L, sizeof(double));
+    ws->profile.layerBackward = ws->profile.layerForward + L;
+    if (!ws->activations || !ws->deltas || !ws->dWeights || !ws->dBiases || !ws->profile.layerForward) {
+        freeWorkspace(ws);
+        return NULL;
+    }
+
+    /* Each block is rounded up to a multiple of 16 floats to keep every matrix 64 byte aligned,
+       except the gradients, which are one block laid out as the parameters */
+    #define BLOCK(n) (((n) + 15) & ~(size_t)15)
+    size_t nParams = layoutParameters(net->sizes, net->nLayers, NULL, NULL, NULL);
+    size_t total = BLOCK(nParams);
+    for (unsigned i = 0; i < L; i++) {
+        total += 2 * BLOCK(net->sizes[i + 1] * batchSize);
+    }
+    total += BLOCK(net->sizes[L] * batchSize);
+    total += BLOCK(net->sizes[0] * batchSize) + BLOCK(net->sizes[L] * batchSize);
+
+    ws->arena = aligned_alloc(64, total * sizeof(float));
+    if (!ws->arena) {
+        freeWorkspace(ws);
+        return NULL;
+    }
+    memset(ws->arena, 0, total * sizeof(float));
+    float *p = ws->arena;
+    ws->gradients = p;
+    layoutParameters(net->sizes, net->nLayers, ws->gradients, ws->dWeights, ws->dBiases);
+    p += BLOCK(nParams);
+    for (unsigned i = 1; i <= L; i++) {
+        ws->activations[i] = matrixFromData(net->sizes[i], batchSize, p);
+        p += BLOCK(net->sizes[i] * batchSize);
+    }
+    for (unsigned i = 0; i < L; i++) {
+        ws->deltas[i] = matrixFromData(net->sizes[i + 1], batchSize, p);
+        p += BLOCK(net->sizes[i + 1] * batchSize);
+    }
+    ws->y = matrixFromData(net->sizes[L], batchSize, p);
+    p += BLOCK(net->sizes[L] * batchSize);
+    ws->xRows = p;
+    ws->activations[0] = matrixFromData(batchSize, net->sizes[0], p);
+    p += BLOCK(net->sizes[0] * batchSize);
+    ws->yRows = p;
+    #undef BLOCK
+    return ws;
+}
+
+/**
+ * @brief Free a workspace created by initWorkspace
+ *
+ * @param ws The workspace to free
+ */
+static void freeWorkspace(Workspace *ws) {
+    if (ws) {
+        free(ws->arena);
+        free(ws->activations);
+        free(ws->deltas);
+        free(ws->dWeights);
+        free(ws->dBiases);
+        free(ws->profile.layerForward);
+        free(ws);
+    }
+}
+
+/**
+ * @brief Point the workspace at examples stored as contiguous rows, as in a Batch. The inputs are
+ * used in place and must stay valid until the batch has been trained on; the targets are transposed.
+ *
+ * @param net Pointer to a network
+ * @param ws Workspace created for net
+ * @param inputs bSize rows with as many elements as the input layer
+ * @param outputs bSize rows with as many elements as the output layer
+ * @param bSize Number of examples, at most ws->batchSize
+ */
+static void packRows(Network *net, Workspace *ws, const float *inputs, const float *outputs, size_t bSize) {
+    assert(net && ws && inputs && outputs && bSize && bSize <= ws->batchSize);
+    unsigned nIn = net->sizes[0], nOut = net->sizes[net->nLayers - 1];
+    ws->activations[0] = matrixFromData(bSize, nIn, (float*)inputs);
+    transposeInto(batchView(ws->y, bSize), matrixFromData(bSize, nOut, (float*)outputs));
+}
+
+/**
+ * @brief Feed the packed batch forward, keeping every layer's activations.
+ * The network's output ends up in ws->activations[nLayers - 1]. Helper for SGD
+ *
+ * @param net Pointer to a network
+ * @param ws Workspace created for net, with the batch's input rows in ws->activations[0]
+ * @param bSize Number of examples in the batch, at most ws->batchSize
+ * @param af The activation function of the layers the network doesn't specify
+ * @param classify Only the index of the highest output is needed, so an output activation that
+ *                 doesn't change it is skipped
+ * @param stacked The first layer's product with the inputs is already in ws->activations[1], see cohortEpoch
+ */
+static void forwardBatch(Network *net, Workspace *ws, size_t bSize, enum EActivationFunction af, bool classify, bool stacked) {
+    assert(net && ws && bSize && bSize <= ws->batchSize);
+    assert(ws->activations[0].rows == bSize);
+    Matrix a = ws->activations[0];
+    double t = PROFILE_NOW();
+    unsigned L = net->nLayers - 1;
+    for (unsigned i = 0; i < L; i++) {
+        Matrix z = batchView(ws->activations[i + 1], bSize);
+        if (i > 0 || !stacked) {
+            gemmInto(z, net->weights[i], NO_TRANSPOSE, a, i == 0 ? TRANSPOSE : NO_TRANSPOSE, 1, 0);
+        }
+        enum EActivationFunction f = layerActivation(net, i, af);
+        addBiasActivate(z, net->biases[i], classify && i + 1 == L && preservesOrder(f) ? FN_LINEAR : f);
+        PROFILE_LAP(ws->profile.layerForward[i], t);
+        a = z;
+    }
+}
+
+/**
+ * @brief Runs the backpropagation algorithm over a whole mini-batch at once. Helper for SGD
+ *
+ * Every layer's activations hold one example per column, so the forward pass, the delta
+ * propagation and the weight gradients are all matrix-matrix products. The transposes of the
+ * weights, activations and input rows are taken by the GEMM itself and never copied.
+ * On return ws->dWeights and ws->dBiases hold the gradients summed over the batch.
+ *
+ * @param net Pointer to a network
+ * @param ws Workspace created for net, with the batch packed by gatherBatch or packRows
+ * @param bSize Number of examples in the batch, at most ws->batchSize
+ * @param config The activation function and cost to train with
+ * @param comm Optional: queue every layer's gradients on it to be summed over the ranks as soon as they are complete
+ * @param stacked The first layer is stacked with other networks': its product with the inputs is already in
+ *                ws->activations[1], and its weight gradient is left to the caller, see cohortEpoch
+ */
+static void backprop(Network *net, Workspace *ws, size_t bSize, const TrainingConfig *config, Communicator *comm, bool stacked) {
+    unsigned L = net->nLayers - 1;
+
+    forwardBatch(net, ws, bSize, config->af, false, stacked);
+    double t = PROFILE_NOW();
+    Matrix delta = batchView(ws->deltas[L - 1], bSize);
+    outputDelta(delta, batchView(ws->activations[L], bSize), batchView(ws->y, bSize),
+                layerActivation(net, L - 1, config->af), config->cost);
+
+    for (unsigned i = L; i-- > 0;) {
+        rowSumsInto(ws->dBiases[i], delta);
+        if (i == 0) {
+            /* dW = delta * X, with the inputs X stored as rows */
+            if (!stacked) {
+                gemmInto(ws->dWeights[0], delta, NO_TRANSPOSE, ws->activations[0], NO_TRANSPOSE, 1, 0);
+            }
+            if (comm) {
+                reduceLayerAsync(comm, ws, 0);
+            }
+            PROFILE_ADD(ws->profile.layerBackward[i], t);
+            break;
+        }
+        Matrix a = batchView(ws->activations[i], bSize);
+        Matrix newDelta = batchView(ws->deltas[i - 1], bSize);
+        gemmInto(ws->dWeights[i], delta, NO_TRANSPOSE, a, TRANSPOSE, 1, 0);
+        /* The layer's gradients are complete: sum them over the ranks while the next layer's are computed */
+        if (comm) {
+            reduceLayerAsync(comm, ws, i);
+        }
+        gemmInto(newDelta, net->weights[i], TRANSPOSE, delta, NO_TRANSPOSE, 1, 0);
+        mulActivationPrime(newDelta, a, layerActivation(net, i - 1, config->af));
+        PROFILE_LAP(ws->profile.layerBackward[i], t);
+        delta = newDelta;
+    }
+}
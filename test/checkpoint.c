@@ -0,0 +1,162 @@
+/**
+ * @brief Checks that resuming from a checkpoint gives the same weights, bit for bit, as an
+ * uninterrupted run: after a finished run, after a process killed part way through an epoch, and
+ * that a truncated or corrupted checkpoint is ignored in favour of training from scratch.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../src/checkpoint.h"
+#include "../src/dataset.h"
+#include "../src/network.h"
+#include "helpers.h"
+
+#define N_EXAMPLES 1000
+#define N_INPUTS 20
+#define N_OUTPUTS 4
+
+static unsigned sizes[] = {N_INPUTS, 16, N_OUTPUTS};
+static char path[64];
+
+/* Stands in for the process being killed: exits once the background tests reach the second epoch */
+static void killAfterFirstEpoch(const EvaluationStats *stats, void *userData) {
+    (void)userData;
+    if (stats->epoch >= 1) {
+        _exit(0);
+    }
+}
+
+/* Train a copy of initial and return it */
+static Network *train(const Network *initial, const TrainingSet *set, unsigned epochs, const char *checkpointPath,
+                      size_t checkpointEvery, bool resume) {
+    TrainingConfig config = {
+        .epochs = epochs,
+        .batchSize = 8,
+        .learningRate = 0.01f,
+        .af = FN_SIGMOID,
+        .nThreads = 2,
+        .seed = 7,
+        .optimizer = {.type = OPT_ADAM},
+        .checkpointPath = checkpointPath,
+        .checkpointEvery = checkpointEvery,
+        .resume = resume,
+        .onEpoch = quietEpoch
+    };
+    Network *net = copyNetwork(initial);
+    trainNetworkOnSet(net, set, &config, NULL);
+    return net;
+}
+
+static void checkSame(const Network *a, Network *b, const char *what) {
+    if (memcmp(a->parameters, b->parameters, a->nParameters * sizeof(float)) != 0) {
+        fprintf(stderr, "checkpoint: %s differs from the uninterrupted run\n", what);
+        exit(1);
+    }
+    freeNetwork(b);
+}
+
+/* Read the checkpoint at path as a resumed run would, returning loadCheckpoint's result */
+static int readCheckpoint(const Network *initial, TrainingState *state) {
+    static size_t order[N_EXAMPLES];
+    OptimizerConfig oc = {.type = OPT_ADAM};
+    Optimizer *opt = initOptimizer(&oc, initial->nParameters);
+    Network *net = copyNetwork(initial);
+    assert(opt);
+    *state = (TrainingState){.order = order, .nExamples = N_EXAMPLES};
+    int err = loadCheckpoint(path, net, opt, state);
+    freeOptimizer(opt);
+    freeNetwork(net);
+    return err;
+}
+
+/* Ways of damaging a checkpoint: a bit flipped in the step count, the PRNG state or the data, or half of it lost */
+enum Damage { DAMAGE_STEP, DAMAGE_RNG, DAMAGE_DATA, DAMAGE_CUT };
+static const char *damageNames[] = {"a flipped step count", "a flipped PRNG state", "flipped data", "a truncated file"};
+
+static void corruptCheckpoint(enum Damage damage) {
+    FILE *fp = fopen(path, "r+b");
+    assert(fp);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    if (damage == DAMAGE_CUT) {
+        fclose(fp);
+        assert(truncate(path, size / 2) == 0);
+        return;
+    }
+    /* CheckpointHeader.step and rng, see src/checkpoint.c */
+    long offset = damage == DAMAGE_STEP ? 24 : damage == DAMAGE_RNG ? 56 : size / 2;
+    fseek(fp, offset, SEEK_SET);
+    int c = fgetc(fp);
+    fseek(fp, offset, SEEK_SET);
+    fputc(c ^ 0x10, fp);
+    fclose(fp);
+}
+
+int main() {
+    snprintf(path, sizeof(path), "/tmp/pecann-check-%d.ckpt", (int)getpid());
+    TrainingSet *set = syntheticSet(N_EXAMPLES, N_INPUTS, N_OUTPUTS, false, 3);
+    Network *initial = initNetwork(sizes, 3);
+    assert(initial);
+    Network *reference = train(initial, set, 4, NULL, 0, false);
+
+    /* Checkpointing, every epoch and every 37 steps, doesn't change the run */
+    checkSame(reference, train(initial, set, 4, path, 37, false), "a checkpointed run");
+
+    /* 2 epochs, then resumed for the other 2 */
+    remove(path);
+    freeNetwork(train(initial, set, 2, path, 0, false));
+    checkSame(reference, train(initial, set, 4, path, 0, true), "a run resumed at an epoch end");
+
+    /* Killed during the second epoch, checkpointing every 37 steps, then resumed */
+    remove(path);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        TrainingSet *testSet = syntheticSet(100, N_INPUTS, N_OUTPUTS, true, 5);
+        TrainingConfig config = {
+            .epochs = 4,
+            .batchSize = 8,
+            .learningRate = 0.01f,
+            .af = FN_SIGMOID,
+            .nThreads = 2,
+            .seed = 7,
+            .optimizer = {.type = OPT_ADAM},
+            .asyncEvaluation = true,
+            .evaluateEvery = 10,
+            .checkpointPath = path,
+            .checkpointEvery = 37,
+            .onEpoch = quietEpoch,
+            .onEvaluation = killAfterFirstEpoch
+        };
+        Network *net = copyNetwork(initial);
+        trainNetworkOnSet(net, set, &config, testSet);
+        _exit(1);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    TrainingState state;
+    assert(readCheckpoint(initial, &state) == 0 && state.epoch < 4 && state.step > 0);
+    checkSame(reference, train(initial, set, 4, path, 37, true), "a run resumed after being killed");
+    printf("checkpoint: resumed at epoch %u, example %zu of %d\n", state.epoch, state.position, N_EXAMPLES);
+
+    /* A damaged checkpoint is ignored: the run starts over and ends as the uninterrupted one */
+    for (enum Damage damage = DAMAGE_STEP; damage <= DAMAGE_CUT; damage++) {
+        char what[96];
+        snprintf(what, sizeof(what), "a run resumed from a checkpoint with %s", damageNames[damage]);
+        freeNetwork(train(initial, set, 2, path, 0, false));
+        corruptCheckpoint(damage);
+        assert(readCheckpoint(initial, &state) != 0);
+        checkSame(reference, train(initial, set, 4, path, 0, true), what);
+    }
+
+    remove(path);
+    freeNetwork(reference);
+    freeNetwork(initial);
+    freeTrainingSet(set);
+    printf("checkpoint: OK\n");
+    return 0;
+}
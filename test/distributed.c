@@ -0,0 +1,169 @@
+/**
+ * @brief Checks src/distributed.h with 2 and 3 ranks forked on this host, over Unix sockets, TCP
+ * and shared memory: ring all-reduces of buffers that don't split evenly over the ranks and span
+ * several COMM_PIECE pieces give the exact sums, bit-identical on every rank, and so do the
+ * weights of a network trained with the communicator.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../src/dataset.h"
+#include "../src/distributed.h"
+#include "../src/network.h"
+#include "helpers.h"
+
+#define MAX_RANKS 3
+#define N_INPUTS 12
+#define N_OUTPUTS 3
+
+enum Transport { UNIX, TCP, SHM };
+static const char *transportNames[] = {"unix", "tcp", "shm"};
+
+/* None divisible by 2 or 3; the larger ones are several 16384 float pieces, with a remainder */
+static const size_t lengths[] = {1, 7, 32771, 100001};
+
+/* Small integers, so the sum is exact whatever order the ring adds them in */
+static float term(unsigned rank, size_t i) {
+    return (float)((i * 7 + rank * 13) % 1000) - 250 * rank;
+}
+
+static void checkSums(Communicator *comm, unsigned rank, unsigned nRanks, size_t n, bool async) {
+    float *data = malloc(n * sizeof(float));
+    assert(data);
+    for (size_t i = 0; i < n; i++) {
+        data[i] = term(rank, i);
+    }
+    if (async) {
+        allReduceAsync(comm, data, n);
+        assert(allReduceWait(comm) == 0);
+    } else {
+        assert(allReduce(comm, data, n) == 0);
+    }
+    for (size_t i = 0; i < n; i++) {
+        float sum = 0;
+        for (unsigned r = 0; r < nRanks; r++) {
+            sum += term(r, i);
+        }
+        if (data[i] != sum) {
+            fprintf(stderr, "distributed: rank %u of %u, n %zu: element %zu is %g, not %g\n", rank, nRanks, n, i,
+                    data[i], sum);
+            exit(1);
+        }
+    }
+    free(data);
+}
+
+/* Every rank must hold the same n floats */
+static void checkIdentical(Communicator *comm, const float *data, size_t n, unsigned nRanks) {
+    float *all = malloc(n * nRanks * sizeof(float));
+    assert(all && allGather(comm, data, n * sizeof(float), all) == 0);
+    for (unsigned r = 0; r < nRanks; r++) {
+        assert(memcmp(all + r * n, data, n * sizeof(float)) == 0);
+    }
+    free(all);
+}
+
+/* Train on this rank's shard of a synthetic set; every rank must end with the same weights */
+static void checkTraining(Communicator *comm, unsigned rank, unsigned nRanks) {
+    TrainingSet *shard = syntheticSet(203 + rank, N_INPUTS, N_OUTPUTS, false, rank + 1);
+    unsigned sizes[] = {N_INPUTS, 9, N_OUTPUTS};
+    Network *net = initNetwork(sizes, 3);
+    assert(net);
+    TrainingConfig config = {
+        .epochs = 2,
+        .batchSize = 8,
+        .learningRate = 0.5f,
+        .af = FN_SIGMOID,
+        .seed = rank + 1,
+        .optimizer = {.type = OPT_MOMENTUM},
+        .communicator = comm,
+        .onEpoch = quietEpoch
+    };
+    trainNetworkOnSet(net, shard, &config, NULL);
+    assert(!communicatorFailed(comm));
+    checkIdentical(comm, net->parameters, net->nParameters, nRanks);
+    freeNetwork(net);
+    freeTrainingSet(shard);
+}
+
+static int runRank(enum Transport t, unsigned rank, unsigned nRanks, int id) {
+    char addressBuf[MAX_RANKS][128];
+    const char *addresses[MAX_RANKS];
+    for (unsigned r = 0; r < nRanks; r++) {
+        if (t == TCP) {
+            unsigned port = 20000 + (unsigned)id % 10000 * MAX_RANKS + r;
+            snprintf(addressBuf[r], sizeof(addressBuf[r]), "tcp:127.0.0.1:%u", port);
+        } else {
+            snprintf(addressBuf[r], sizeof(addressBuf[r]), "unix:/tmp/pecann-check.%d.%u", id, r);
+        }
+        addresses[r] = addressBuf[r];
+    }
+    char shmName[64];
+    snprintf(shmName, sizeof(shmName), "/pecann-check.%d", id);
+    DistributedConfig dc = {.rank = rank, .nRanks = nRanks, .addresses = addresses,
+                            .sharedMemory = t == SHM ? shmName : NULL, .timeout = 20};
+    Communicator *comm = initCommunicator(&dc);
+    assert(comm && communicatorRank(comm) == rank && communicatorSize(comm) == nRanks);
+    for (unsigned i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        checkSums(comm, rank, nRanks, lengths[i], i % 2);
+    }
+    /* Sums of arbitrary floats depend on the order they're added in, but must agree across the ranks */
+    size_t n = 40009;
+    float *data = malloc(n * sizeof(float));
+    assert(data);
+    unsigned seed = rank + 1;
+    for (size_t i = 0; i < n; i++) {
+        data[i] = (float)rand_r(&seed) / RAND_MAX - 0.5f;
+    }
+    assert(allReduce(comm, data, n) == 0);
+    checkIdentical(comm, data, n, nRanks);
+    free(data);
+    checkTraining(comm, rank, nRanks);
+    freeCommunicator(comm);
+    return 0;
+}
+
+static int runRanks(enum Transport t, unsigned nRanks) {
+    /* Distinct addresses for every run, so a run doesn't connect to a previous one's sockets */
+    int id = (int)getpid() * 8 + t * MAX_RANKS + nRanks;
+    fflush(stdout);
+    for (unsigned r = 0; r < nRanks; r++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            _exit(runRank(t, r, nRanks, id));
+        }
+    }
+    int failed = 0;
+    for (unsigned r = 0; r < nRanks; r++) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "distributed: %u ranks over %s failed\n", nRanks, transportNames[t]);
+    }
+    return failed;
+}
+
+int main() {
+    /* A rank stuck waiting for another fails the test rather than hanging it */
+    alarm(300);
+    int failed = 0;
+    for (enum Transport t = UNIX; t <= SHM; t++) {
+        for (unsigned nRanks = 2; nRanks <= MAX_RANKS; nRanks++) {
+            failed |= runRanks(t, nRanks);
+        }
+    }
+    if (failed) {
+        return 1;
+    }
+    printf("distributed: OK\n");
+    return 0;
+}
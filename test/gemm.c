@@ -0,0 +1,195 @@
+/**
+ * @brief Checks src/gemm.h against a double precision reference with every kernel set the CPU has
+ * (AVX-512, AVX2 and scalar, forced with PECANN_ISA): sgemm with every pair of transpose flags and
+ * sgemv both ways, on random shapes with ragged edges, leading dimensions wider than the rows and
+ * blocks larger than the cache blocking. Elements of C outside the m x n result must be left alone,
+ * and beta = 0 must overwrite C even where it holds NaN.
+ */
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../src/gemm.h"
+
+#define N_SHAPES 400
+/* Every tenth shape is large enough to span several KC and MC blocks */
+#define SMALL_DIM 70
+#define LARGE_DIM 300
+
+static const char *isas[] = {"avx512", "avx2", "scalar"};
+static const float alphas[] = {1, -0.5f, 2};
+static const float betas[] = {0, 1, 0.75f};
+
+static unsigned seed = 1;
+
+static float randomFloat(void) {
+    return (float)rand_r(&seed) / RAND_MAX * 2 - 1;
+}
+
+static size_t randomDim(size_t max) {
+    return 1 + rand_r(&seed) % max;
+}
+
+/* From its bits, as -ffast-math lets the compiler assume NaN doesn't occur */
+static float floatBits(uint32_t bits) {
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static bool sameBits(float a, float b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static float *randomMatrix(size_t n) {
+    float *x = malloc((n ? n : 1) * sizeof(float));
+    assert(x);
+    for (size_t i = 0; i < n; i++) {
+        x[i] = randomFloat();
+    }
+    return x;
+}
+
+/* got must be finite and within the rounding error of a float sum of terms whose magnitudes add up to scale */
+static bool withinRounding(float got, double expected, double scale, size_t terms) {
+    uint32_t bits;
+    memcpy(&bits, &got, sizeof(bits));
+    return (bits & 0x7f800000u) != 0x7f800000u && fabs(got - expected) <= (terms + 2) * FLT_EPSILON * scale + 1e-30;
+}
+
+static int checkSgemm(bool transA, bool transB, size_t m, size_t n, size_t k, float alpha, float beta) {
+    size_t lda = (transA ? m : k) + rand_r(&seed) % 5, ldb = (transB ? k : n) + rand_r(&seed) % 5;
+    size_t ldc = n + rand_r(&seed) % 5;
+    float *a = randomMatrix((transA ? k : m) * lda), *b = randomMatrix((transB ? n : k) * ldb);
+    float *c = randomMatrix(m * ldc), *original = malloc(m * ldc * sizeof(float));
+    assert(original);
+    if (beta == 0) {
+        for (size_t i = 0; i < m * ldc; i++) {
+            c[i] = floatBits(0x7fc00000);
+        }
+    }
+    memcpy(original, c, m * ldc * sizeof(float));
+    sgemm(transA, transB, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+    int failed = 0;
+    for (size_t i = 0; i < m && !failed; i++) {
+        for (size_t j = 0; j < ldc && !failed; j++) {
+            if (j >= n) {
+                failed = !sameBits(c[i * ldc + j], original[i * ldc + j]);
+                continue;
+            }
+            double sum = 0, scale = 0;
+            for (size_t p = 0; p < k; p++) {
+                double product = (double)(transA ? a[p * lda + i] : a[i * lda + p]) *
+                                 (transB ? b[j * ldb + p] : b[p * ldb + j]);
+                sum += product;
+                scale += fabs(product);
+            }
+            double expected = alpha * sum + (beta == 0 ? 0 : (double)beta * original[i * ldc + j]);
+            scale = fabs(alpha) * scale + (beta == 0 ? 0 : fabs(beta * original[i * ldc + j]));
+            failed = !withinRounding(c[i * ldc + j], expected, scale, k);
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "gemm: %s sgemm%s%s m %zu n %zu k %zu alpha %g beta %g lda %zu ldb %zu ldc %zu is wrong\n",
+                gemmKernelName(), transA ? " A^T" : "", transB ? " B^T" : "", m, n, k, alpha, beta, lda, ldb, ldc);
+    }
+    free(a);
+    free(b);
+    free(c);
+    free(original);
+    return failed;
+}
+
+static int checkSgemv(bool transA, size_t m, size_t n, float alpha, float beta) {
+    size_t lda = n + rand_r(&seed) % 5, xLen = transA ? m : n, yLen = transA ? n : m;
+    float *a = randomMatrix(m * lda), *x = randomMatrix(xLen), *y = randomMatrix(yLen);
+    float *original = malloc(yLen * sizeof(float));
+    assert(original);
+    if (beta == 0) {
+        for (size_t i = 0; i < yLen; i++) {
+            y[i] = floatBits(0x7fc00000);
+        }
+    }
+    memcpy(original, y, yLen * sizeof(float));
+    sgemv(transA, m, n, alpha, a, lda, x, beta, y);
+    int failed = 0;
+    for (size_t i = 0; i < yLen && !failed; i++) {
+        double sum = 0, scale = 0;
+        for (size_t p = 0; p < xLen; p++) {
+            double product = (double)(transA ? a[p * lda + i] : a[i * lda + p]) * x[p];
+            sum += product;
+            scale += fabs(product);
+        }
+        double expected = alpha * sum + (beta == 0 ? 0 : (double)beta * original[i]);
+        scale = fabs(alpha) * scale + (beta == 0 ? 0 : fabs(beta * original[i]));
+        failed = !withinRounding(y[i], expected, scale, xLen);
+    }
+    if (failed) {
+        fprintf(stderr, "gemm: %s sgemv%s m %zu n %zu alpha %g beta %g lda %zu is wrong\n", gemmKernelName(),
+                transA ? " A^T" : "", m, n, alpha, beta, lda);
+    }
+    free(a);
+    free(x);
+    free(y);
+    free(original);
+    return failed;
+}
+
+static int checkKernels(void) {
+    int failed = 0;
+    for (unsigned s = 0; s < N_SHAPES && !failed; s++) {
+        size_t max = s % 10 == 9 ? LARGE_DIM : SMALL_DIM;
+        size_t m = randomDim(max), n = randomDim(max), k = randomDim(max);
+        float alpha = alphas[rand_r(&seed) % 3], beta = betas[rand_r(&seed) % 3];
+        failed |= checkSgemm(s & 1, s & 2, m, n, k, alpha, beta);
+        failed |= checkSgemv(s & 1, m, k, alpha, beta);
+    }
+    /* Wider than an NC panel */
+    failed |= checkSgemm(false, false, 7, 1100, 33, 1, 0);
+    failed |= checkSgemm(true, true, 13, 1030, 5, 1, 1);
+    return failed;
+}
+
+/* Run this test again with the kernel set forced to isa; returns 0 if it passed or the CPU lacks isa */
+static int runWith(const char *self, const char *isa) {
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        setenv("PECANN_ISA", isa, 1);
+        execl(self, self, isa, (char*)NULL);
+        _exit(1);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "gemm: the %s run failed\n", isa);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 1) {
+        int failed = 0;
+        for (unsigned i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+            failed |= runWith(argv[0], isas[i]);
+        }
+        return failed;
+    }
+    /* PECANN_ISA only caps the choice, so a CPU without the kernels runs a lower set */
+    if (strcmp(gemmKernelName(), argv[1]) != 0) {
+        printf("gemm: %s skipped, the CPU doesn't have it\n", argv[1]);
+        return 0;
+    }
+    if (checkKernels() != 0) {
+        return 1;
+    }
+    printf("gemm: OK (%s)\n", gemmKernelName());
+    return 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+/*
+ * Fixtures shared by the self-checking tests run by make check.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/dataset.h"
+#include "../src/network.h"
+
+/**
+ * @brief A classification set of noisy copies of one random prototype input per class. The
+ * prototypes are the same for every call with the same shape, so sets made with different seeds
+ * are samples of the same problem.
+ *
+ * @param n Number of examples
+ * @param nInputs Inputs per example
+ * @param nClasses Number of classes
+ * @param labels Store the class index as the single target, as test sets do, instead of a one-hot row
+ * @param seed Seed of the examples' classes and noise
+ */
+static inline TrainingSet *syntheticSet(size_t n, unsigned nInputs, unsigned nClasses, bool labels, unsigned seed) {
+    TrainingSet *set = initTrainingSet(n, nInputs, labels ? 1 : nClasses);
+    float *prototypes = malloc((size_t)nClasses * nInputs * sizeof(float));
+    assert(set && prototypes);
+    unsigned prototypeSeed = 1;
+    for (size_t i = 0; i < (size_t)nClasses * nInputs; i++) {
+        prototypes[i] = (float)rand_r(&prototypeSeed) / RAND_MAX;
+    }
+    for (size_t i = 0; i < n; i++) {
+        unsigned c = rand_r(&seed) % nClasses;
+        for (unsigned j = 0; j < nInputs; j++) {
+            set->inputs[i * nInputs + j] = prototypes[c * nInputs + j] + 0.3f * ((float)rand_r(&seed) / RAND_MAX - 0.5f);
+        }
+        if (labels) {
+            set->outputs[i] = c;
+        } else {
+            for (unsigned k = 0; k < nClasses; k++) {
+                set->outputs[i * nClasses + k] = k == c;
+            }
+        }
+    }
+    free(prototypes);
+    return set;
+}
+
+/* TrainingConfig.onEpoch that keeps the progress off stdout */
+static inline void quietEpoch(const TrainingStats *stats, void *userData) {
+    (void)stats;
+    (void)userData;
+}
+
+/* A new network with the same shape and parameters as net */
+static inline Network *copyNetwork(const Network *net) {
+    Network *copy = initNetwork(net->sizes, net->nLayers);
+    assert(copy);
+    memcpy(copy->parameters, net->parameters, net->nParameters * sizeof(float));
+    return copy;
+}
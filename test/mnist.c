@@ -3,43 +3,34 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../src/dataset.h"
 #include "../src/network.h"
 
 int main() {
-    TrainingExample trainingData[50000];
-    TrainingExample testData[10000];
-    FILE *trainingFile = fopen("training.data","r");
-    FILE *testFile = fopen("test.data","r");
+    DatasetFile *trainingFile = openDataset("training.data");
+    DatasetFile *testFile = openDataset("test.data");
     assert(trainingFile && testFile);
-    float f;
-    for (int i = 0; i < 50000; i++){
-        float *inputs = malloc(784 * sizeof(float));
-        float *outputs = malloc(10 * sizeof(float));
-        for (int j = 0; j < 784; j++) {
-            fscanf(trainingFile, "%f", &f);
-            inputs[j] = f;
-        }
-        for (int j = 0; j < 10; j++) {
-            fscanf(trainingFile, "%f", &f);
-            outputs[j] = f;
-        }
-        trainingData[i] = createTrainingExample(inputs,outputs,784,10);
-    }
-    for (int i = 0; i < 10000; i++) {
-        float *inputs = malloc(784 * sizeof(float));
-        float *outputs = malloc(sizeof(float));
-        for (int j = 0; j < 784; j++) {
-            fscanf(testFile, "%f", &f);
-            inputs[j] = f;
-        }
-        fscanf(testFile, "%f", &f);
-        outputs[0] = f;
-        testData[i] = createTrainingExample(inputs, outputs, 784, 1);
-    }
+    assert(datasetInputs(trainingFile) == 784 && datasetOutputs(trainingFile) == 10);
+    assert(datasetInputs(testFile) == 784 && datasetOutputs(testFile) == 1);
+    TrainingSet *testSet = trainingSetFromDataset(testFile);
+    assert(testSet);
     unsigned sizes[] = {784, 100, 10};
     Network *net = initNetwork(sizes, 3);
+    TrainingConfig config = {
+        .epochs = 30,
+        .batchSize = 10,
+        .learningRate = 1,
+        .af = FN_SIGMOID,
+        .nThreads = 1
+    };
+    BatchPrefetcher *batches = initBatchPrefetcher(trainingFile, config.batchSize, 4, 0, 0);
+    assert(batches);
     printf("Starting SGD\n");
-    stochasticGradientDescent(net, trainingData, 50000, 30, 10, 1, FN_SIGMOID, testData, 10000);
+    trainNetworkFromDataset(net, batches, &config, testSet);
     saveNetworkToFile("mnist.nn", net);
+    freeBatchPrefetcher(batches);
+    closeDataset(trainingFile);
+    closeDataset(testFile);
+    freeTrainingSet(testSet);
     freeNetwork(net);
 }
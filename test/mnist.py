@@ -2,6 +2,7 @@
 # Source: http://neuralnetworksanddeeplearning.com
 
 import pickle
+import struct
 import gzip
 import numpy as np
 
@@ -11,23 +12,23 @@ def load_data():
     f.close()
     return (training_data, validation_data, test_data)
 
-def vectorized_result(j):
-    e = np.zeros((10, 1))
-    e[j] = 1.0
-    return e
+def save_dataset(filename, inputs, targets):
+    """Write a pecann dataset file with uint8 inputs, see src/dataset.c"""
+    inputs = np.round(np.clip(inputs, 0, 1) * 255).astype(np.uint8)
+    targets = np.asarray(targets, dtype=np.float32)
+    n, n_inputs = inputs.shape
+    input_bytes = inputs.size
+    output_offset = 64 + (input_bytes + 63) // 64 * 64
+    header = struct.pack('<8sIIQIIfIQQ8x', b'PECANND\n', 1, 1, n, n_inputs,
+                         targets.shape[1], 1 / 255, 0, 64, output_offset)
+    with open(filename, "wb") as f:
+        f.write(header)
+        f.write(inputs.tobytes())
+        f.write(b'\0' * (output_offset - 64 - input_bytes))
+        f.write(targets.tobytes())
 
 tr_d, va_d, te_d = load_data()
-training_inputs = [np.reshape(x, (784, 1)) for x in tr_d[0]]
-training_results = [vectorized_result(y) for y in tr_d[1]]
-test_inputs = [np.reshape(x, (784, 1)) for x in te_d[0]]
-with open("training.data","w") as f:
-    for i in range(50000):
-        for x in training_inputs[i]:
-            f.write(str(x[0]) + '\n')
-        for x in training_results[i]:
-            f.write(str(x[0]) + '\n')
-with open("test.data","w") as f:
-    for i in range(10000):
-        for x in test_inputs[i]:
-            f.write(str(x[0]) + '\n')
-        f.write(str(te_d[1][i]) + '\n')
+training_targets = np.zeros((len(tr_d[1]), 10))
+training_targets[np.arange(len(tr_d[1])), tr_d[1]] = 1.0
+save_dataset("training.data", tr_d[0], training_targets)
+save_dataset("test.data", te_d[0], np.reshape(te_d[1], (-1, 1)))
@@ -0,0 +1,305 @@
+/**
+ * @brief Round trips of src/model.c: networks saved with every dtype (f32, bf16, f16, csr and
+ * int8), read back and mapped where the format allows, must give the same outputs as before
+ * saving, as must version 1 and 2 and text files. Files with a flipped or missing byte, or a
+ * pair of flipped bits, must be refused, wherever it is.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../src/checksum.h"
+#include "../src/network.h"
+#include "../src/quant.h"
+#include "../src/sparse.h"
+#include "helpers.h"
+
+#define N_INPUTS 24
+#define N_OUTPUTS 5
+#define N_SAMPLES 16
+
+/* ModelHeader.dtype values, see src/model.c */
+enum { DTYPE_F32, DTYPE_I8, DTYPE_BF16, DTYPE_F16, DTYPE_CSR };
+
+static unsigned sizes[] = {N_INPUTS, 40, 17, N_OUTPUTS};
+static float inputs[N_SAMPLES * N_INPUTS];
+static char path[64];
+
+static void outputsOf(Network *net, float *outputs) {
+    for (unsigned s = 0; s < N_SAMPLES; s++) {
+        Matrix out = feedForward(net, inputs + s * N_INPUTS, FN_SIGMOID);
+        memcpy(outputs + s * N_OUTPUTS, out.data, N_OUTPUTS * sizeof(float));
+        freeMatrix(out);
+    }
+}
+
+static void checkOutputs(Network *net, Network *loaded, const char *what) {
+    float expected[N_SAMPLES * N_OUTPUTS], got[N_SAMPLES * N_OUTPUTS];
+    if (!loaded) {
+        fprintf(stderr, "model: %s failed\n", what);
+        exit(1);
+    }
+    outputsOf(net, expected);
+    outputsOf(loaded, got);
+    if (memcmp(expected, got, sizeof(expected)) != 0) {
+        fprintf(stderr, "model: %s gives different outputs\n", what);
+        exit(1);
+    }
+    freeNetwork(loaded);
+}
+
+static uint32_t storedDtype(void) {
+    FILE *fp = fopen(path, "rb");
+    uint32_t header[5];
+    assert(fp && fread(header, sizeof(header), 1, fp) == 1);
+    fclose(fp);
+    return header[4];
+}
+
+/* Save, read and, unless it's CSR, map the network; every copy must match it */
+static void roundTrip(Network *net, uint32_t dtype, const char *name) {
+    char what[64];
+    assert(saveNetworkToFile(path, net) == 0);
+    assert(storedDtype() == dtype);
+    snprintf(what, sizeof(what), "reading %s", name);
+    checkOutputs(net, readNetworkFromFile(path), what);
+    if (dtype == DTYPE_CSR) {
+        assert(!mapNetworkFromFile(path, true));
+        return;
+    }
+    snprintf(what, sizeof(what), "mapping %s", name);
+    checkOutputs(net, mapNetworkFromFile(path, true), what);
+    checkOutputs(net, mapNetworkFromFile(path, false), what);
+}
+
+static void flipBits(long offset, int bits) {
+    FILE *fp = fopen(path, "r+b");
+    assert(fp);
+    fseek(fp, offset, offset < 0 ? SEEK_END : SEEK_SET);
+    int c = fgetc(fp);
+    fseek(fp, -1, SEEK_CUR);
+    fputc(c ^ bits, fp);
+    fclose(fp);
+}
+
+static void flipByte(long offset) {
+    flipBits(offset, 0x01);
+}
+
+static long fileSize(void) {
+    FILE *fp = fopen(path, "rb");
+    assert(fp);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static void checkRefused(void) {
+    assert(!readNetworkFromFile(path));
+    assert(!mapNetworkFromFile(path, true));
+}
+
+/*
+ * A flipped byte anywhere in the file, or a truncated file, must be refused. That includes the
+ * layer sizes, which a CSR file can't otherwise tell from a layer whose last columns are empty,
+ * and the activations, which are valid whichever one is stored
+ */
+static void checkDamaged(Network *net) {
+    /* The version, the dtype, the checksum, the input count, the first activation and the data */
+    static const long offsets[] = {0, 8, 16, 40, 64, 64 + 4 * 4, 130, -1};
+    for (unsigned i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        assert(saveNetworkToFile(path, net) == 0);
+        flipByte(offsets[i]);
+        checkRefused();
+    }
+    /* A changed activation that is still a valid one */
+    if (net->activations) {
+        assert(net->activations[0] == FN_RELU && saveNetworkToFile(path, net) == 0);
+        flipBits(64 + 4 * 4, FN_RELU ^ FN_TANH);
+        checkRefused();
+    }
+    /* The sign bits of two weights, which cancel in any sum of words */
+    assert(saveNetworkToFile(path, net) == 0);
+    long data = 128;
+    flipBits(data + 1 * sizeof(float) + 3, 0x80);
+    flipBits(data + 3 * sizeof(float) + 3, 0x80);
+    checkRefused();
+    assert(saveNetworkToFile(path, net) == 0);
+    assert(truncate(path, fileSize() - 64) == 0);
+    assert(!readNetworkFromFile(path));
+    assert(!mapNetworkFromFile(path, false));
+}
+
+/*
+ * Layer sizes whose block sizes add up to 2^64, which wraps to an empty data section, must be
+ * refused even when the checksum isn't verified, rather than mapped past the end of the file
+ */
+static void checkOversized(void) {
+    unsigned small[] = {2, 3, 4};
+    uint32_t huge[] = {1u << 31, 1u << 31, UINT32_MAX - 2};
+    uint64_t dataSize = 0;
+    Network *net = initNetwork(small, 3);
+    assert(net && saveNetworkToFile(path, net) == 0);
+    freeNetwork(net);
+    FILE *fp = fopen(path, "r+b");
+    assert(fp && fseek(fp, 32, SEEK_SET) == 0 && fwrite(&dataSize, sizeof(dataSize), 1, fp) == 1);
+    assert(fseek(fp, 64, SEEK_SET) == 0 && fwrite(huge, sizeof(huge), 1, fp) == 1);
+    fclose(fp);
+    assert(!mapNetworkFromFile(path, false));
+    assert(!readNetworkFromFile(path));
+}
+
+/* The checksum of version 1 and 2 files: FNV-1a over the 8 byte words of the data section */
+static uint64_t legacyChecksum(const unsigned char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash ^= word;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Rewrite the saved file as the given older version, whose data sections are the same */
+static void downgrade(uint32_t version) {
+    FILE *fp = fopen(path, "r+b");
+    uint64_t header[8];
+    assert(fp && fread(header, sizeof(header), 1, fp) == 1);
+    unsigned char *data = malloc(header[4]);
+    assert(data && fseek(fp, header[3], SEEK_SET) == 0 && fread(data, header[4], 1, fp) == 1);
+    uint64_t checksum = legacyChecksum(data, header[4]);
+    free(data);
+    assert(fseek(fp, 8, SEEK_SET) == 0 && fwrite(&version, sizeof(version), 1, fp) == 1);
+    assert(fseek(fp, 40, SEEK_SET) == 0 && fwrite(&checksum, sizeof(checksum), 1, fp) == 1);
+    if (version == 1) {
+        /* 4 layer sizes fill the same 64 byte block as the sizes and activations of later versions */
+        uint32_t unset[sizeof(sizes) / sizeof(sizes[0]) - 1];
+        memset(unset, 0, sizeof(unset));
+        assert(fseek(fp, 64 + sizeof(sizes), SEEK_SET) == 0 && fwrite(unset, sizeof(unset), 1, fp) == 1);
+    }
+    fclose(fp);
+}
+
+/* The same network saved as version 1, which has no activations, as version 2, and in the old text format */
+static void checkOldFormats(Network *net) {
+    assert(saveNetworkToFile(path, net) == 0);
+    downgrade(1);
+    checkOutputs(net, readNetworkFromFile(path), "reading version 1");
+    assert(saveNetworkToFile(path, net) == 0);
+    downgrade(2);
+    checkOutputs(net, readNetworkFromFile(path), "reading version 2");
+    flipByte(130);
+    assert(!readNetworkFromFile(path));
+
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    assert(fp);
+    fprintf(fp, "%u ", net->nLayers);
+    for (unsigned i = 0; i < net->nLayers; i++) {
+        fprintf(fp, "%u ", net->sizes[i]);
+    }
+    for (unsigned i = 0; i < net->nLayers - 1; i++) {
+        saveMatrixToFile(fp, net->weights[i]);
+        saveMatrixToFile(fp, net->biases[i]);
+    }
+    fclose(fp);
+    checkOutputs(net, readNetworkFromFile(path), "importing text");
+}
+
+static void quantizedOutputs(QuantizedNetwork *qnet, float *outputs) {
+    size_t bytes = (quantizedScratchSize(qnet, N_SAMPLES) * sizeof(float) + 63) / 64 * 64;
+    void *scratch = aligned_alloc(64, bytes);
+    assert(scratch);
+    quantizedForward(qnet, inputs, N_SAMPLES, scratch, outputs, NULL);
+    free(scratch);
+}
+
+static void checkQuantized(Network *net) {
+    QuantizedNetwork *qnet = quantizeNetwork(net, FN_SIGMOID, inputs, N_SAMPLES);
+    assert(qnet && saveQuantizedNetwork(path, qnet) == 0);
+    assert(storedDtype() == DTYPE_I8);
+    QuantizedNetwork *loaded = readQuantizedNetwork(path);
+    float expected[N_SAMPLES * N_OUTPUTS], got[N_SAMPLES * N_OUTPUTS];
+    if (!loaded) {
+        fprintf(stderr, "model: reading int8 failed\n");
+        exit(1);
+    }
+    quantizedOutputs(qnet, expected);
+    quantizedOutputs(loaded, got);
+    if (memcmp(expected, got, sizeof(expected)) != 0) {
+        fprintf(stderr, "model: reading int8 gives different outputs\n");
+        exit(1);
+    }
+    freeQuantizedNetwork(loaded);
+    /* An int8 file isn't a float network, and a damaged one is refused */
+    assert(!readNetworkFromFile(path));
+    flipByte(-1);
+    assert(!readQuantizedNetwork(path));
+    freeQuantizedNetwork(qnet);
+}
+
+int main(int argc, char **argv) {
+    /* The standard check value of CRC-32C */
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+    /* Run again with the table kernel, unless this is that run or the CPU has no SSE4.2 anyway */
+    if (argc == 1 && strcmp(crc32cKernelName(), "table") != 0) {
+        fflush(stdout);
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            setenv("PECANN_ISA", "scalar", 1);
+            execl(argv[0], argv[0], "table", (char*)NULL);
+            _exit(1);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "model: the table CRC-32C run failed\n");
+            return 1;
+        }
+    }
+    snprintf(path, sizeof(path), "/tmp/pecann-check-%d.nn", (int)getpid());
+    unsigned seed = 1;
+    for (unsigned i = 0; i < N_SAMPLES * N_INPUTS; i++) {
+        inputs[i] = (float)rand_r(&seed) / RAND_MAX;
+    }
+    Network *net = initNetwork(sizes, 4);
+    assert(net);
+
+    roundTrip(net, DTYPE_F32, "f32");
+    checkDamaged(net);
+    checkOldFormats(net);
+    checkOversized();
+    checkQuantized(net);
+
+    Network *withActivations = copyNetwork(net);
+    enum EActivationFunction afs[] = {FN_RELU, FN_TANH, FN_SOFTMAX};
+    assert(setLayerActivations(withActivations, afs) == 0);
+    roundTrip(withActivations, DTYPE_F32, "f32 with activations");
+    checkDamaged(withActivations);
+    freeNetwork(withActivations);
+
+    Network *bf16 = copyNetwork(net), *f16 = copyNetwork(net);
+    assert(setWeightType(bf16, WEIGHTS_BF16) == 0 && setWeightType(f16, WEIGHTS_F16) == 0);
+    roundTrip(bf16, DTYPE_BF16, "bf16");
+    roundTrip(f16, DTYPE_F16, "f16");
+    freeNetwork(bf16);
+    freeNetwork(f16);
+
+    Network *pruned = copyNetwork(net);
+    assert(pruneNetwork(pruned, 0.9f) == 0);
+    roundTrip(pruned, DTYPE_CSR, "csr");
+    checkDamaged(pruned);
+    freeNetwork(pruned);
+
+    remove(path);
+    freeNetwork(net);
+    printf("model: OK (crc32c %s)\n", crc32cKernelName());
+    return 0;
+}
@@ -0,0 +1,149 @@
+/**
+ * @brief Checks that the int8 kernels of src/quant.c agree: a quantized network with ragged layer
+ * sizes runs the same batches under every kernel the CPU has (AVX-512 VNNI, AVX-VNNI, AVX2 and
+ * scalar, forced with PECANN_ISA), and every output must match the scalar kernel's within one
+ * quantum of its row, the row's weight scale times the layer's input scale.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../src/network.h"
+#include "../src/quant.h"
+
+#define N_INPUTS 75
+#define N_OUTPUTS 7
+#define N_SAMPLES 41
+
+/* PECANN_ISA values and the int8 kernel each one selects on a CPU that has it, scalar last */
+static const char *isas[] = {"avx512", "avx-vnni", "avx2", "scalar"};
+static const char *kernelNames[] = {"avx512-vnni", "avx-vnni", "avx2", "scalar"};
+#define N_ISAS (sizeof(isas) / sizeof(isas[0]))
+
+/* Neither the layer sizes nor the batches are multiples of the kernels' blocks */
+static unsigned sizes[] = {N_INPUTS, 130, 33, N_OUTPUTS};
+static const size_t batches[] = {1, 6, 34};
+
+static char modelPath[64];
+static float inputs[N_SAMPLES * N_INPUTS];
+
+static void outputPath(char *path, size_t size, unsigned isa) {
+    snprintf(path, size, "%s.%s", modelPath, isas[isa]);
+}
+
+/* Run the saved network on all the inputs, in batches of different sizes, and save the outputs */
+static int runKernel(unsigned isa) {
+    if (strcmp(quantKernelName(), kernelNames[isa]) != 0) {
+        printf("quant: %s skipped, the CPU doesn't have it\n", kernelNames[isa]);
+        return 0;
+    }
+    QuantizedNetwork *qnet = readQuantizedNetwork(modelPath);
+    assert(qnet);
+    void *scratch = aligned_alloc(64, (quantizedScratchSize(qnet, N_SAMPLES) * sizeof(float) + 63) / 64 * 64);
+    float outputs[N_SAMPLES * N_OUTPUTS];
+    assert(scratch);
+    for (size_t done = 0, b = 0; done < N_SAMPLES; b++) {
+        size_t n = batches[b % 3] < N_SAMPLES - done ? batches[b % 3] : N_SAMPLES - done;
+        quantizedForward(qnet, inputs + done * N_INPUTS, n, scratch, outputs + done * N_OUTPUTS, NULL);
+        done += n;
+    }
+    char path[80];
+    outputPath(path, sizeof(path), isa);
+    FILE *fp = fopen(path, "wb");
+    assert(fp && fwrite(outputs, sizeof(outputs), 1, fp) == 1);
+    fclose(fp);
+    free(scratch);
+    freeQuantizedNetwork(qnet);
+    return 0;
+}
+
+static int readOutputs(unsigned isa, float *outputs) {
+    char path[80];
+    outputPath(path, sizeof(path), isa);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+    int err = fread(outputs, N_SAMPLES * N_OUTPUTS * sizeof(float), 1, fp) != 1;
+    fclose(fp);
+    remove(path);
+    return err ? -1 : 0;
+}
+
+static int runWith(const char *self, unsigned isa) {
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        char arg[16];
+        snprintf(arg, sizeof(arg), "%u", isa);
+        setenv("PECANN_ISA", isas[isa], 1);
+        execl(self, self, modelPath, arg, (char*)NULL);
+        _exit(1);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "quant: the %s run failed\n", kernelNames[isa]);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned seed = 1;
+    for (unsigned i = 0; i < N_SAMPLES * N_INPUTS; i++) {
+        inputs[i] = (float)rand_r(&seed) / RAND_MAX;
+    }
+    if (argc == 3) {
+        snprintf(modelPath, sizeof(modelPath), "%s", argv[1]);
+        return runKernel((unsigned)atoi(argv[2]));
+    }
+
+    /* Quantized once, as calibration runs on the float kernels, which PECANN_ISA changes too */
+    snprintf(modelPath, sizeof(modelPath), "/tmp/pecann-check-%d.nn", (int)getpid());
+    Network *net = initNetwork(sizes, 4);
+    assert(net);
+    for (size_t i = 0; i < net->nParameters; i++) {
+        net->parameters[i] = (float)rand_r(&seed) / RAND_MAX - 0.5f;
+    }
+    QuantizedNetwork *qnet = quantizeNetwork(net, FN_SIGMOID, inputs, N_SAMPLES);
+    assert(qnet && saveQuantizedNetwork(modelPath, qnet) == 0);
+
+    int failed = 0;
+    for (unsigned i = 0; i < N_ISAS; i++) {
+        failed |= runWith(argv[0], i);
+    }
+    float expected[N_SAMPLES * N_OUTPUTS], got[N_SAMPLES * N_OUTPUTS];
+    const QuantizedLayer *last = &qnet->layers[qnet->nLayers - 2];
+    failed |= readOutputs(N_ISAS - 1, expected);
+    for (unsigned i = 0; i + 1 < N_ISAS && !failed; i++) {
+        if (readOutputs(i, got) != 0) {
+            continue;
+        }
+        for (unsigned s = 0; s < N_SAMPLES; s++) {
+            for (unsigned r = 0; r < N_OUTPUTS; r++) {
+                float tolerance = last->scales[r] * last->inScale;
+                if (fabsf(got[s * N_OUTPUTS + r] - expected[s * N_OUTPUTS + r]) > tolerance) {
+                    fprintf(stderr, "quant: %s output %u of example %u is %g, scalar gives %g\n", kernelNames[i], r, s,
+                            got[s * N_OUTPUTS + r], expected[s * N_OUTPUTS + r]);
+                    failed = 1;
+                }
+            }
+        }
+        if (!failed) {
+            printf("quant: %s agrees with scalar\n", kernelNames[i]);
+        }
+    }
+    remove(modelPath);
+    freeQuantizedNetwork(qnet);
+    freeNetwork(net);
+    if (failed) {
+        return 1;
+    }
+    printf("quant: OK\n");
+    return 0;
+}
@@ -0,0 +1,248 @@
+/**
+ * @brief Checks src/server.h over a Unix socket: clients pipelining requests at once get the
+ * outputs of feedForwardBatch, a request with a bad magic is answered with SERVER_BAD_REQUEST and
+ * its connection closed, a network published while clients stream requests is picked up by the
+ * next batches, and stopping a server with requests in flight fails them instead of hanging.
+ */
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/network.h"
+#include "../src/server.h"
+#include "../src/swap.h"
+
+#define N_INPUTS 20
+#define N_OUTPUTS 6
+#define N_SAMPLES 500
+#define N_CLIENTS 4
+
+static unsigned sizes[] = {N_INPUTS, 48, N_OUTPUTS};
+static float inputs[N_SAMPLES * N_INPUTS];
+static char address[108];
+
+/* Client threads stop streaming once set */
+static volatile int done = 0;
+
+typedef struct ClientRun {
+    pthread_t thread;
+    float outputs[N_SAMPLES * N_OUTPUTS];
+    /* Outputs of the networks the answers may come from, the second NULL if there is only one */
+    const float *expected[2];
+    unsigned rounds;
+    int result;
+} ClientRun;
+
+static Network *randomNetwork(unsigned seed) {
+    Network *net = initNetwork(sizes, 3);
+    assert(net);
+    for (size_t i = 0; i < net->nParameters; i++) {
+        net->parameters[i] = (float)rand_r(&seed) / RAND_MAX - 0.5f;
+    }
+    return net;
+}
+
+/* The outputs of feedForwardBatch for all the inputs, N_SAMPLES * N_OUTPUTS floats */
+static float *expectedOutputs(Network *net) {
+    float *outputs = malloc(N_SAMPLES * N_OUTPUTS * sizeof(float));
+    InferenceContext *ctx = initInferenceContext(net, N_SAMPLES, 1);
+    assert(outputs && ctx);
+    feedForwardBatch(ctx, inputs, N_SAMPLES, FN_SIGMOID, outputs);
+    freeInferenceContext(ctx);
+    return outputs;
+}
+
+/* Batches of different sizes may add the products in a different order */
+static bool sameRow(const float *a, const float *b) {
+    for (unsigned j = 0; j < N_OUTPUTS; j++) {
+        if (fabsf(a[j] - b[j]) > 1e-5f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Every answer of a round must match one of the expected outputs */
+static int checkRound(const ClientRun *run) {
+    for (unsigned s = 0; s < N_SAMPLES; s++) {
+        const float *row = run->outputs + s * N_OUTPUTS;
+        if (!sameRow(row, run->expected[0] + s * N_OUTPUTS) &&
+            !(run->expected[1] && sameRow(row, run->expected[1] + s * N_OUTPUTS))) {
+            fprintf(stderr, "server: output %u matches no published network\n", s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Stream all the inputs until done is set, at least once, checking every round */
+static void *runClient(void *arg) {
+    ClientRun *run = arg;
+    InferenceClient *c = connectInferenceServer(address);
+    run->result = c ? 0 : -1;
+    while (c && run->result == 0 && (!run->rounds || !__atomic_load_n(&done, __ATOMIC_SEQ_CST))) {
+        run->result = remoteFeedForward(c, inputs, N_SAMPLES, run->outputs);
+        if (run->result == 0) {
+            run->result = checkRound(run);
+            run->rounds++;
+        }
+    }
+    closeInferenceClient(c);
+    return NULL;
+}
+
+static InferenceServer *startServer(ModelHandle *h, size_t maxBatch, unsigned maxWaitUs) {
+    ServerConfig config = {.address = address, .maxBatch = maxBatch, .maxWaitUs = maxWaitUs, .nThreads = 2,
+                           .af = FN_SIGMOID};
+    InferenceServer *s = startInferenceServer(h, &config);
+    assert(s);
+    return s;
+}
+
+/* Several clients at once, then a network published while they stream */
+static void checkClients(void) {
+    Network *first = randomNetwork(1), *second = randomNetwork(2);
+    float *expected[2] = {expectedOutputs(first), expectedOutputs(second)};
+    ModelHandle *h = initModelHandle(first);
+    assert(h);
+    InferenceServer *s = startServer(h, 32, 200);
+
+    ClientRun *runs = calloc(N_CLIENTS, sizeof(ClientRun));
+    assert(runs);
+    __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < N_CLIENTS; i++) {
+        runs[i].expected[0] = expected[0];
+        assert(pthread_create(&runs[i].thread, NULL, runClient, &runs[i]) == 0);
+    }
+    for (unsigned i = 0; i < N_CLIENTS; i++) {
+        pthread_join(runs[i].thread, NULL);
+        if (runs[i].result != 0) {
+            fprintf(stderr, "server: client %u failed\n", i);
+            exit(1);
+        }
+    }
+
+    /* Every answer comes from one network or the other, and once publishModel returns only from the second */
+    __atomic_store_n(&done, 0, __ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < N_CLIENTS; i++) {
+        runs[i] = (ClientRun){.expected = {expected[0], expected[1]}};
+        assert(pthread_create(&runs[i].thread, NULL, runClient, &runs[i]) == 0);
+    }
+    struct timespec pause = {0, 20 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+    assert(publishModel(h, second) == 0);
+    nanosleep(&pause, NULL);
+    __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < N_CLIENTS; i++) {
+        pthread_join(runs[i].thread, NULL);
+        if (runs[i].result != 0) {
+            fprintf(stderr, "server: client %u failed while publishing\n", i);
+            exit(1);
+        }
+    }
+    ClientRun *after = calloc(1, sizeof(ClientRun));
+    assert(after);
+    after->expected[0] = expected[1];
+    runClient(after);
+    assert(after->result == 0 && after->rounds == 1);
+    free(after);
+
+    ServerStats stats;
+    inferenceServerStats(s, &stats);
+    assert(stats.nInputs == N_INPUTS && stats.nOutputs == N_OUTPUTS && stats.modelVersion == 2);
+    assert(stats.badRequests == 0 && stats.requests >= (2 * N_CLIENTS + 1) * N_SAMPLES);
+    stopInferenceServer(s);
+    freeModelHandle(h);
+    free(runs);
+    free(expected[0]);
+    free(expected[1]);
+}
+
+static int connectRaw(void) {
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    strcpy(sa.sun_path, address + strlen("unix:"));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0 && connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0);
+    return fd;
+}
+
+/* A bad magic gets SERVER_BAD_REQUEST under the request's id, then the server closes the connection */
+static void checkBadMagic(void) {
+    Network *net = randomNetwork(1);
+    float *expected = expectedOutputs(net);
+    ModelHandle *h = initModelHandle(net);
+    assert(h);
+    InferenceServer *s = startServer(h, 32, 200);
+    int fd = connectRaw();
+    ServerMessage m = {SERVER_MAGIC ^ 1, SERVER_INFER, 7, 0};
+    assert(send(fd, &m, sizeof(m), MSG_NOSIGNAL) == sizeof(m));
+    ServerMessage reply;
+    char extra;
+    assert(recv(fd, &reply, sizeof(reply), MSG_WAITALL) == sizeof(reply));
+    assert(reply.magic == SERVER_MAGIC && reply.code == SERVER_BAD_REQUEST && reply.id == 7 && reply.size == 0);
+    assert(recv(fd, &extra, 1, 0) == 0);
+    close(fd);
+
+    ServerStats stats;
+    inferenceServerStats(s, &stats);
+    assert(stats.badRequests == 1 && stats.requests == 0);
+    /* Other connections are unaffected */
+    ClientRun *run = calloc(1, sizeof(ClientRun));
+    assert(run);
+    run->expected[0] = expected;
+    __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+    runClient(run);
+    assert(run->result == 0);
+    stopInferenceServer(s);
+    freeModelHandle(h);
+    free(expected);
+    free(run);
+}
+
+/* With batches held back for seconds, stopping the server fails the client's requests rather than leaving it waiting */
+static void checkStopInFlight(void) {
+    Network *net = randomNetwork(1);
+    float *expected = expectedOutputs(net);
+    ModelHandle *h = initModelHandle(net);
+    assert(h);
+    InferenceServer *s = startServer(h, N_SAMPLES, 5 * 1000 * 1000);
+    ClientRun *run = calloc(1, sizeof(ClientRun));
+    assert(run);
+    run->expected[0] = expected;
+    __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+    assert(pthread_create(&run->thread, NULL, runClient, run) == 0);
+    ServerStats stats = {0};
+    struct timespec pause = {0, 1000 * 1000};
+    while (stats.queueDepth == 0) {
+        nanosleep(&pause, NULL);
+        inferenceServerStats(s, &stats);
+    }
+    stopInferenceServer(s);
+    pthread_join(run->thread, NULL);
+    assert(run->result == -1 && run->rounds == 0);
+    freeModelHandle(h);
+    free(expected);
+    free(run);
+}
+
+int main() {
+    /* A server or client stuck waiting fails the test rather than hanging it */
+    alarm(120);
+    snprintf(address, sizeof(address), "unix:/tmp/pecann-check-server.%d", (int)getpid());
+    unsigned seed = 3;
+    for (unsigned i = 0; i < N_SAMPLES * N_INPUTS; i++) {
+        inputs[i] = (float)rand_r(&seed) / RAND_MAX;
+    }
+    checkClients();
+    checkBadMagic();
+    checkStopInFlight();
+    printf("server: OK\n");
+    return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @brief Stress test of src/swap.h: reader threads enter and leave the model, and others register
+ * and unregister, while networks are published over and over. Every parameter of the network
+ * published as version v is v, so a reader seeing anything else saw a network being freed.
+ * Networks with an inf or NaN parameter, in float or reduced precision, must be rejected.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/network.h"
+#include "../src/swap.h"
+
+#define N_READERS 4
+#define N_PUBLISHES 300
+
+static unsigned sizes[] = {16, 32, 4};
+static volatile int done = 0;
+
+static Network *versionedNetwork(uint64_t version) {
+    Network *net = initNetwork(sizes, 3);
+    assert(net);
+    for (size_t i = 0; i < net->nParameters; i++) {
+        net->parameters[i] = version;
+    }
+    return net;
+}
+
+static void checkNetwork(const Network *net, uint64_t version) {
+    for (size_t i = 0; i < net->nParameters; i++) {
+        assert(net->parameters[i] == version);
+    }
+}
+
+static void *runReader(void *arg) {
+    ModelHandle *h = arg;
+    ModelReader *r = initModelReader(h);
+    assert(r);
+    uint64_t last = 0, version;
+    float input[16] = {0};
+    while (!__atomic_load_n(&done, __ATOMIC_SEQ_CST)) {
+        Network *net = enterModel(r, &version);
+        assert(version >= last);
+        last = version;
+        checkNetwork(net, version);
+        freeMatrix(feedForward(net, input, FN_RELU));
+        checkNetwork(net, version);
+        leaveModel(r);
+    }
+    freeModelReader(r);
+    return NULL;
+}
+
+/* Registers a new reader for every entry, so registration runs alongside the writers' grace periods */
+static void *runRegistering(void *arg) {
+    ModelHandle *h = arg;
+    uint64_t version;
+    while (!__atomic_load_n(&done, __ATOMIC_SEQ_CST)) {
+        ModelReader *r = initModelReader(h);
+        assert(r);
+        Network *net = enterModel(r, &version);
+        checkNetwork(net, version);
+        leaveModel(r);
+        freeModelReader(r);
+    }
+    return NULL;
+}
+
+typedef struct Publish {
+    ModelHandle *h;
+    uint64_t version;
+    int published;
+} Publish;
+
+static void *runPublish(void *arg) {
+    Publish *p = arg;
+    assert(publishModel(p->h, versionedNetwork(p->version)) == 0);
+    __atomic_store_n(&p->published, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/* A reader registers and unregisters while a publish waits for a reader inside the old network */
+static void testRegisterDuringGracePeriod(void) {
+    ModelHandle *h = initModelHandle(versionedNetwork(1));
+    assert(h);
+    ModelReader *inside = initModelReader(h);
+    assert(inside);
+    uint64_t version;
+    Network *net = enterModel(inside, &version);
+    Publish p = {.h = h, .version = 2};
+    pthread_t publisher;
+    assert(pthread_create(&publisher, NULL, runPublish, &p) == 0);
+    /* The new version is in once the publisher has swapped it, it then waits for inside to leave */
+    struct timespec pause = {0, 1000000};
+    while (modelVersion(h) != 2) {
+        nanosleep(&pause, NULL);
+    }
+    ModelReader *r = initModelReader(h);
+    assert(r);
+    assert(enterModel(r, &version) && version == 2);
+    leaveModel(r);
+    freeModelReader(r);
+    assert(!__atomic_load_n(&p.published, __ATOMIC_SEQ_CST));
+    checkNetwork(net, 1);
+    leaveModel(inside);
+    pthread_join(publisher, NULL);
+    assert(p.published && modelVersion(h) == 2);
+    freeModelReader(inside);
+    freeModelHandle(h);
+}
+
+static void testConcurrentPublish(void) {
+    ModelHandle *h = initModelHandle(versionedNetwork(1));
+    assert(h);
+    pthread_t readers[N_READERS], registering;
+    for (unsigned i = 0; i < N_READERS; i++) {
+        assert(pthread_create(&readers[i], NULL, runReader, h) == 0);
+    }
+    assert(pthread_create(&registering, NULL, runRegistering, h) == 0);
+    for (uint64_t v = 2; v <= N_PUBLISHES + 1; v++) {
+        assert(publishModel(h, versionedNetwork(v)) == 0);
+        assert(modelVersion(h) == v);
+    }
+    /* Rejected: a different number of inputs */
+    unsigned other[] = {8, 4};
+    Network *wrong = initNetwork(other, 2);
+    assert(publishModel(h, wrong) == -1);
+    freeNetwork(wrong);
+    __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < N_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    pthread_join(registering, NULL);
+    assert(modelVersion(h) == N_PUBLISHES + 1);
+    freeModelHandle(h);
+}
+
+/* From its bits, as -ffast-math lets the compiler assume inf and NaN don't occur */
+static float floatBits(uint32_t bits) {
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static void testRejectNonFinite(void) {
+    ModelHandle *h = initModelHandle(versionedNetwork(1));
+    assert(h);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/pecann-check-swap-%d.nn", (int)getpid());
+    Network *rejected[4];
+    /* An inf bias; a NaN float master of bf16 weights; a finite master that is inf in f16 */
+    rejected[0] = versionedNetwork(2);
+    rejected[0]->biases[1].data[0] = floatBits(0x7f800000);
+    rejected[1] = versionedNetwork(2);
+    rejected[1]->weights[0].data[3] = floatBits(0x7fc00000);
+    assert(setWeightType(rejected[1], WEIGHTS_BF16) == 0);
+    rejected[2] = versionedNetwork(2);
+    rejected[2]->weights[1].data[0] = 1e6f;
+    assert(setWeightType(rejected[2], WEIGHTS_F16) == 0);
+    /* bf16 weights mapped from a file, which have no float masters, read back through reloadModel too */
+    assert(saveNetworkToFile(path, rejected[1]) == 0);
+    assert(reloadModel(h, path) == -1);
+    rejected[3] = mapNetworkFromFile(path, true);
+    assert(rejected[3] && !rejected[3]->weights[0].data);
+    for (unsigned i = 0; i < sizeof(rejected) / sizeof(rejected[0]); i++) {
+        assert(publishModel(h, rejected[i]) == -1);
+        freeNetwork(rejected[i]);
+    }
+    assert(modelVersion(h) == 1);
+    /* Finite reduced precision networks are published, mapped or not */
+    Network *bf16 = versionedNetwork(2);
+    assert(setWeightType(bf16, WEIGHTS_BF16) == 0 && saveNetworkToFile(path, bf16) == 0);
+    assert(publishModel(h, bf16) == 0 && modelVersion(h) == 2);
+    Network *mapped = mapNetworkFromFile(path, true);
+    assert(mapped && publishModel(h, mapped) == 0 && modelVersion(h) == 3);
+    remove(path);
+    freeModelHandle(h);
+}
+
+int main() {
+    /* A deadlock fails the test rather than hanging it */
+    alarm(60);
+    testRegisterDuringGracePeriod();
+    testConcurrentPublish();
+    testRejectNonFinite();
+    printf("swap: OK\n");
+    return 0;
+}
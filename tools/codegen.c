@@ -0,0 +1,65 @@
+/**
+ * @brief Generates fixed-topology C inference code for a saved network, see src/codegen.h.
+ *
+ *   ./tools/codegen model.nn name [--af sigmoid|tanh|relu|softmax|linear] [--out dir]
+ *
+ * writes dir/name.h and dir/name.c (dir defaults to the current directory). --af is the
+ * activation of the layers the saved network doesn't specify itself, sigmoid by default.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/codegen.h"
+#include "../src/network.h"
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s MODEL NAME [--af sigmoid|tanh|relu|softmax|linear] [--out DIR]\n", name);
+    exit(2);
+}
+
+static int parseActivation(const char *s, enum EActivationFunction *af) {
+    static const char *names[] = {"sigmoid", "tanh", "relu", "softmax", "linear"};
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(s, names[i]) == 0) {
+            *af = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+    }
+    const char *model = argv[1], *name = argv[2], *dir = ".";
+    enum EActivationFunction af = FN_SIGMOID;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--af") == 0 && i + 1 < argc) {
+            if (parseActivation(argv[++i], &af) != 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    Network *net = readNetworkFromFile(model);
+    if (!net) {
+        fprintf(stderr, "%s: cannot read %s\n", argv[0], model);
+        return 1;
+    }
+    size_t size = strlen(dir) + strlen(name) + 4;
+    char header[size], source[size];
+    snprintf(header, size, "%s/%s.h", dir, name);
+    snprintf(source, size, "%s/%s.c", dir, name);
+    if (generateInferenceCode(net, af, name, header, source) != 0) {
+        fprintf(stderr, "%s: cannot write %s and %s\n", argv[0], header, source);
+        freeNetwork(net);
+        return 1;
+    }
+    freeNetwork(net);
+    return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * @brief Runs a distributed training job as several local processes, see src/distributed.h.
+ *
+ *   ./tools/dtrain NPROCS TRAIN [TEST] [--unix DIR | --tcp PORT] [--shm] [--epochs N] [--batch N] [--hidden N]
+ *
+ * forks NPROCS ranks that each train a one hidden layer sigmoid network on their shard of the
+ * dataset file TRAIN, connected over Unix sockets in DIR (default /tmp) or over TCP on localhost
+ * ports PORT, PORT + 1, ..., and optionally moving the data through shared memory. Rank 0 tests on
+ * TEST after every epoch and saves the network to dtrain.nn. Every rank prints a checksum of its
+ * final weights, which must all be equal.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../src/dataset.h"
+#include "../src/distributed.h"
+#include "../src/network.h"
+
+typedef struct Options {
+    unsigned nRanks, epochs, hidden, port;
+    size_t batchSize;
+    const char *train, *test, *dir;
+    bool shm;
+} Options;
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s NPROCS TRAIN [TEST] [--unix DIR | --tcp PORT] [--shm] [--epochs N] [--batch N] "
+                    "[--hidden N]\n", name);
+    exit(2);
+}
+
+static double weightChecksum(const Network *net) {
+    double sum = 0;
+    for (unsigned l = 0; l < net->nLayers - 1; l++) {
+        for (size_t i = 0; i < len(net->weights[l]); i++) {
+            sum += net->weights[l].data[i] * (i % 7 + 1);
+        }
+    }
+    return sum;
+}
+
+static int runRank(const Options *o, unsigned rank) {
+    char addressBuf[o->nRanks][128];
+    const char *addresses[o->nRanks];
+    for (unsigned r = 0; r < o->nRanks; r++) {
+        if (o->port) {
+            snprintf(addressBuf[r], sizeof(addressBuf[r]), "tcp:127.0.0.1:%u", o->port + r);
+        } else {
+            snprintf(addressBuf[r], sizeof(addressBuf[r]), "unix:%s/dtrain.%d.%u", o->dir, (int)getppid(), r);
+        }
+        addresses[r] = addressBuf[r];
+    }
+    char shmName[64];
+    snprintf(shmName, sizeof(shmName), "/dtrain.%d", (int)getppid());
+    DistributedConfig dc = {.rank = rank, .nRanks = o->nRanks, .addresses = addresses,
+                            .sharedMemory = o->shm ? shmName : NULL};
+    Communicator *comm = initCommunicator(&dc);
+    DatasetFile *ds = openDataset(o->train);
+    if (!comm || !ds) {
+        fprintf(stderr, "rank %u: cannot %s\n", rank, comm ? "open the training set" : "connect to the other ranks");
+        return 1;
+    }
+    size_t n = datasetSize(ds), first = n * rank / o->nRanks, count = n * (rank + 1) / o->nRanks - first;
+    TrainingSet *shard = initTrainingSet(count, datasetInputs(ds), datasetOutputs(ds));
+    TrainingSet *testSet = NULL;
+    if (rank == 0 && o->test) {
+        DatasetFile *testFile = openDataset(o->test);
+        testSet = testFile ? trainingSetFromDataset(testFile) : NULL;
+        closeDataset(testFile);
+    }
+    if (!shard || (rank == 0 && o->test && !testSet)) {
+        fprintf(stderr, "rank %u: cannot read the datasets\n", rank);
+        return 1;
+    }
+    readDatasetExamples(ds, first, count, shard->inputs, shard->outputs);
+    unsigned sizes[] = {datasetInputs(ds), o->hidden, datasetOutputs(ds)};
+    Network *net = initNetwork(sizes, 3);
+    TrainingConfig config = {
+        .epochs = o->epochs,
+        .batchSize = o->batchSize,
+        .learningRate = 1,
+        .af = FN_SIGMOID,
+        .seed = rank + 1,
+        .communicator = comm
+    };
+    trainNetworkOnSet(net, shard, &config, testSet);
+    int failed = communicatorFailed(comm);
+    printf("rank %u: %zu examples, weight checksum %.6f\n", rank, count, weightChecksum(net));
+    if (rank == 0 && !failed && saveNetworkToFile("dtrain.nn", net) != 0) {
+        fprintf(stderr, "rank 0: cannot save dtrain.nn\n");
+        failed = 1;
+    }
+    freeNetwork(net);
+    freeTrainingSet(shard);
+    freeTrainingSet(testSet);
+    closeDataset(ds);
+    freeCommunicator(comm);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+    }
+    Options o = {.nRanks = atoi(argv[1]), .epochs = 10, .hidden = 100, .batchSize = 10, .train = argv[2], .dir = "/tmp"};
+    int i = 3;
+    if (i < argc && argv[i][0] != '-') {
+        o.test = argv[i++];
+    }
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            o.dir = argv[++i];
+        } else if (strcmp(argv[i], "--tcp") == 0 && i + 1 < argc) {
+            o.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            o.shm = true;
+        } else if (strcmp(argv[i], "--epochs") == 0 && i + 1 < argc) {
+            o.epochs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            o.batchSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hidden") == 0 && i + 1 < argc) {
+            o.hidden = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (o.nRanks == 0 || o.epochs == 0 || o.batchSize == 0 || o.hidden == 0) {
+        usage(argv[0]);
+    }
+    fflush(stdout);
+    for (unsigned r = 0; r < o.nRanks; r++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            exit(runRank(&o, r));
+        }
+    }
+    int failed = 0;
+    for (unsigned r = 0; r < o.nRanks; r++) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,238 @@
+/**
+ * @brief Serves a saved network to other processes with dynamic batching, see src/server.h.
+ *
+ *   ./tools/serve MODEL [--unix PATH | --tcp PORT] [--af NAME] [--max-batch N] [--max-wait-us N]
+ *                 [--threads N] [--stats-every S]
+ *
+ * listens on the Unix socket PATH (default /tmp/pecann.sock) or on localhost port PORT until
+ * interrupted, printing the queue depth, batch sizes and latency percentiles every S seconds
+ * (default 10, 0 for only on exit). On SIGHUP it reads MODEL again and swaps it in without
+ * stopping, keeping the running network if the file can't be read or doesn't fit.
+ *
+ *   ./tools/serve --load ADDRESS [--clients N] [--requests N]
+ *
+ * generates load instead: N client threads (default 4) each send N random inputs (default 10000)
+ * to the server at ADDRESS, e.g. unix:/tmp/pecann.sock, then the server's statistics are printed.
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/network.h"
+#include "../src/server.h"
+#include "../src/swap.h"
+
+static volatile sig_atomic_t interrupted = 0, reload = 0;
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s MODEL [--unix PATH | --tcp PORT] [--af NAME] [--max-batch N] [--max-wait-us N] "
+                    "[--threads N] [--stats-every S]\n"
+                    "       %s --load ADDRESS [--clients N] [--requests N]\n", name, name);
+    exit(2);
+}
+
+static int parseActivation(const char *s, enum EActivationFunction *af) {
+    static const char *names[] = {"sigmoid", "tanh", "relu", "softmax", "linear"};
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(s, names[i]) == 0) {
+            *af = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void onSignal(int sig) {
+    if (sig == SIGHUP) {
+        reload = 1;
+    } else {
+        interrupted = 1;
+    }
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void printStats(const ServerStats *st) {
+    printf("model version %llu, %llu requests in %llu batches (mean %.1f, p50 %.0f, p99 %.0f), %llu bad, "
+           "%llu connections\n", (unsigned long long)st->modelVersion, (unsigned long long)st->requests, (unsigned long long)st->batches,
+           st->batches ? (double)st->requests / st->batches : 0.0,
+           histogramPercentile(st->batchSizes, 0.5), histogramPercentile(st->batchSizes, 0.99),
+           (unsigned long long)st->badRequests, (unsigned long long)st->connections);
+    printf("queue depth %llu (max %llu, p50 %.0f, p99 %.0f), latency p50 %.0fus p99 %.0fus, "
+           "queueing p50 %.0fus p99 %.0fus\n",
+           (unsigned long long)st->queueDepth, (unsigned long long)st->maxQueueDepth,
+           histogramPercentile(st->queueDepths, 0.5), histogramPercentile(st->queueDepths, 0.99),
+           histogramPercentile(st->latencyUs, 0.5), histogramPercentile(st->latencyUs, 0.99),
+           histogramPercentile(st->queueUs, 0.5), histogramPercentile(st->queueUs, 0.99));
+    fflush(stdout);
+}
+
+typedef struct LoadClient {
+    const char *address;
+    size_t nRequests;
+    unsigned seed;
+    int failed;
+    pthread_t thread;
+} LoadClient;
+
+static void *runLoadClient(void *arg) {
+    LoadClient *lc = arg;
+    InferenceClient *c = connectInferenceServer(lc->address);
+    ServerStats st;
+    if (!c || remoteServerStats(c, &st) != 0) {
+        closeInferenceClient(c);
+        lc->failed = 1;
+        return NULL;
+    }
+    /* Send the requests in chunks, as a client answering its own callers would */
+    size_t chunk = 256;
+    float *inputs = malloc(chunk * st.nInputs * sizeof(float));
+    float *outputs = malloc(chunk * st.nOutputs * sizeof(float));
+    for (size_t i = 0; inputs && i < chunk * st.nInputs; i++) {
+        inputs[i] = (float)rand_r(&lc->seed) / RAND_MAX;
+    }
+    for (size_t sent = 0; inputs && outputs && sent < lc->nRequests && !lc->failed; sent += chunk) {
+        size_t n = lc->nRequests - sent < chunk ? lc->nRequests - sent : chunk;
+        lc->failed = remoteFeedForward(c, inputs, n, outputs) != 0;
+    }
+    lc->failed = lc->failed || !inputs || !outputs;
+    free(inputs);
+    free(outputs);
+    closeInferenceClient(c);
+    return NULL;
+}
+
+static int runLoad(const char *name, const char *address, unsigned nClients, size_t nRequests) {
+    LoadClient clients[nClients];
+    double start = seconds();
+    for (unsigned i = 0; i < nClients; i++) {
+        clients[i] = (LoadClient){.address = address, .nRequests = nRequests, .seed = i + 1};
+        if (pthread_create(&clients[i].thread, NULL, runLoadClient, &clients[i]) != 0) {
+            fprintf(stderr, "%s: cannot start the clients\n", name);
+            return 1;
+        }
+    }
+    int failed = 0;
+    for (unsigned i = 0; i < nClients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        failed |= clients[i].failed;
+    }
+    double elapsed = seconds() - start;
+    InferenceClient *c = connectInferenceServer(address);
+    ServerStats st;
+    if (failed || !c || remoteServerStats(c, &st) != 0) {
+        fprintf(stderr, "%s: requests to %s failed\n", name, address);
+        closeInferenceClient(c);
+        return 1;
+    }
+    closeInferenceClient(c);
+    printf("%zu requests from %u clients in %.3fs, %.0f requests/s\n", nRequests * nClients, nClients, elapsed,
+           nRequests * nClients / elapsed);
+    printStats(&st);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || (strcmp(argv[1], "--load") == 0 && argc < 3)) {
+        usage(argv[0]);
+    }
+    if (strcmp(argv[1], "--load") == 0) {
+        unsigned nClients = 4;
+        size_t nRequests = 10000;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+                nClients = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+                nRequests = atol(argv[++i]);
+            } else {
+                usage(argv[0]);
+            }
+        }
+        if (nClients == 0 || nRequests == 0) {
+            usage(argv[0]);
+        }
+        return runLoad(argv[0], argv[2], nClients, nRequests);
+    }
+
+    char address[128] = "unix:/tmp/pecann.sock";
+    ServerConfig config = {0};
+    unsigned statsEvery = 10;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            snprintf(address, sizeof(address), "unix:%s", argv[++i]);
+        } else if (strcmp(argv[i], "--tcp") == 0 && i + 1 < argc) {
+            snprintf(address, sizeof(address), "tcp:127.0.0.1:%s", argv[++i]);
+        } else if (strcmp(argv[i], "--af") == 0 && i + 1 < argc) {
+            if (parseActivation(argv[++i], &config.af) != 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--max-batch") == 0 && i + 1 < argc) {
+            config.maxBatch = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-wait-us") == 0 && i + 1 < argc) {
+            config.maxWaitUs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            config.nThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-every") == 0 && i + 1 < argc) {
+            statsEvery = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    Network *net = readNetworkFromFile(argv[1]);
+    if (!net) {
+        fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    ModelHandle *model = initModelHandle(net);
+    if (!model) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        freeNetwork(net);
+        return 1;
+    }
+    config.address = address;
+    InferenceServer *s = startInferenceServer(model, &config);
+    if (!s) {
+        fprintf(stderr, "%s: cannot listen on %s\n", argv[0], address);
+        freeModelHandle(model);
+        return 1;
+    }
+    struct sigaction sa = {.sa_handler = onSignal};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    printf("serving %s on %s\n", argv[1], address);
+    fflush(stdout);
+    double lastStats = seconds();
+    ServerStats st;
+    while (!interrupted) {
+        usleep(100000);
+        if (reload) {
+            reload = 0;
+            if (reloadModel(model, argv[1]) == 0) {
+                printf("reloaded %s, model version %llu\n", argv[1], (unsigned long long)modelVersion(model));
+            } else {
+                fprintf(stderr, "%s: cannot reload %s, still serving version %llu\n", argv[0], argv[1],
+                        (unsigned long long)modelVersion(model));
+            }
+            fflush(stdout);
+        }
+        if (statsEvery && seconds() - lastStats >= statsEvery) {
+            lastStats = seconds();
+            inferenceServerStats(s, &st);
+            printStats(&st);
+        }
+    }
+    inferenceServerStats(s, &st);
+    stopInferenceServer(s);
+    printStats(&st);
+    freeModelHandle(model);
+    return 0;
+}